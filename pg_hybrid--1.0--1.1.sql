@@ -0,0 +1,374 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_hybrid UPDATE TO '1.1'" to load this file. \quit
+
+-- pg_hybrid extension SQL script
+-- 从 1.0 升级到 1.1: 距离范围运算符、标量列操作符类、BM25 索引、混合检索、
+-- hvector_chunk 和批量检索。新安装执行 1.0 脚本后再执行本脚本
+
+-- hvector 距离范围运算符: emb <<->> hvector_range(q, r) 即 emb <-> q < r，
+-- 可以用 pg_hybrid_ivfflat 索引，只探测可能有半径内条目的列表
+
+CREATE TYPE hvector_range AS (query hvector, radius float8);
+
+CREATE FUNCTION hvector_range(hvector, float8) RETURNS hvector_range
+	AS 'SELECT ROW($1, $2)::hvector_range'
+	LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_l2_within(hvector, hvector_range) RETURNS bool
+	AS 'MODULE_PATHNAME', 'hvector_l2_within'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_negative_inner_product_within(hvector, hvector_range) RETURNS bool
+	AS 'MODULE_PATHNAME', 'hvector_negative_inner_product_within'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_cosine_within(hvector, hvector_range) RETURNS bool
+	AS 'MODULE_PATHNAME', 'hvector_cosine_within'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <<->> (
+	LEFTARG = hvector,
+	RIGHTARG = hvector_range,
+	PROCEDURE = hvector_l2_within,
+	RESTRICT = contsel, JOIN = contjoinsel
+);
+
+COMMENT ON OPERATOR <<->>(hvector, hvector_range) IS
+	'L2 distance to the query is less than the radius';
+
+CREATE OPERATOR <<#>> (
+	LEFTARG = hvector,
+	RIGHTARG = hvector_range,
+	PROCEDURE = hvector_negative_inner_product_within,
+	RESTRICT = contsel, JOIN = contjoinsel
+);
+
+CREATE OPERATOR <<=>> (
+	LEFTARG = hvector,
+	RIGHTARG = hvector_range,
+	PROCEDURE = hvector_cosine_within,
+	RESTRICT = contsel, JOIN = contjoinsel
+);
+
+-- 已有的向量操作符类加入范围运算符（策略 2）
+ALTER OPERATOR FAMILY hvector_l2_ops USING pg_hybrid_ivfflat ADD
+	OPERATOR 2 <<->> (hvector, hvector_range);
+
+ALTER OPERATOR FAMILY hvector_ip_ops USING pg_hybrid_ivfflat ADD
+	OPERATOR 2 <<#>> (hvector, hvector_range);
+
+ALTER OPERATOR FAMILY hvector_cosine_ops USING pg_hybrid_ivfflat ADD
+	OPERATOR 2 <<=>> (hvector, hvector_range);
+
+-- ============================================================================
+-- 多列索引的标量列操作符类
+-- 第一列之后的列在索引内按等值/范围条件过滤，不满足的条目不计算距离
+-- 例: CREATE INDEX ON items USING pg_hybrid_ivfflat (embedding, category);
+-- ============================================================================
+
+CREATE OPERATOR FAMILY ivfflat_integer_ops USING pg_hybrid_ivfflat;
+
+CREATE OPERATOR CLASS int2_ops
+	DEFAULT FOR TYPE int2 USING pg_hybrid_ivfflat FAMILY ivfflat_integer_ops AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS int4_ops
+	DEFAULT FOR TYPE int4 USING pg_hybrid_ivfflat FAMILY ivfflat_integer_ops AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS int8_ops
+	DEFAULT FOR TYPE int8 USING pg_hybrid_ivfflat FAMILY ivfflat_integer_ops AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+-- 跨类型比较, 例如 int8 列和 int4 常量
+ALTER OPERATOR FAMILY ivfflat_integer_ops USING pg_hybrid_ivfflat ADD
+	OPERATOR 1 < (int2, int4),
+	OPERATOR 2 <= (int2, int4),
+	OPERATOR 3 = (int2, int4),
+	OPERATOR 4 >= (int2, int4),
+	OPERATOR 5 > (int2, int4),
+	OPERATOR 1 < (int2, int8),
+	OPERATOR 2 <= (int2, int8),
+	OPERATOR 3 = (int2, int8),
+	OPERATOR 4 >= (int2, int8),
+	OPERATOR 5 > (int2, int8),
+	OPERATOR 1 < (int4, int2),
+	OPERATOR 2 <= (int4, int2),
+	OPERATOR 3 = (int4, int2),
+	OPERATOR 4 >= (int4, int2),
+	OPERATOR 5 > (int4, int2),
+	OPERATOR 1 < (int4, int8),
+	OPERATOR 2 <= (int4, int8),
+	OPERATOR 3 = (int4, int8),
+	OPERATOR 4 >= (int4, int8),
+	OPERATOR 5 > (int4, int8),
+	OPERATOR 1 < (int8, int2),
+	OPERATOR 2 <= (int8, int2),
+	OPERATOR 3 = (int8, int2),
+	OPERATOR 4 >= (int8, int2),
+	OPERATOR 5 > (int8, int2),
+	OPERATOR 1 < (int8, int4),
+	OPERATOR 2 <= (int8, int4),
+	OPERATOR 3 = (int8, int4),
+	OPERATOR 4 >= (int8, int4),
+	OPERATOR 5 > (int8, int4);
+
+CREATE OPERATOR FAMILY ivfflat_float_ops USING pg_hybrid_ivfflat;
+
+CREATE OPERATOR CLASS float4_ops
+	DEFAULT FOR TYPE float4 USING pg_hybrid_ivfflat FAMILY ivfflat_float_ops AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS float8_ops
+	DEFAULT FOR TYPE float8 USING pg_hybrid_ivfflat FAMILY ivfflat_float_ops AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+ALTER OPERATOR FAMILY ivfflat_float_ops USING pg_hybrid_ivfflat ADD
+	OPERATOR 1 < (float4, float8),
+	OPERATOR 2 <= (float4, float8),
+	OPERATOR 3 = (float4, float8),
+	OPERATOR 4 >= (float4, float8),
+	OPERATOR 5 > (float4, float8),
+	OPERATOR 1 < (float8, float4),
+	OPERATOR 2 <= (float8, float4),
+	OPERATOR 3 = (float8, float4),
+	OPERATOR 4 >= (float8, float4),
+	OPERATOR 5 > (float8, float4);
+
+CREATE OPERATOR CLASS numeric_ops
+	DEFAULT FOR TYPE numeric USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS text_ops
+	DEFAULT FOR TYPE text USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS bool_ops
+	DEFAULT FOR TYPE bool USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS date_ops
+	DEFAULT FOR TYPE date USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS timestamp_ops
+	DEFAULT FOR TYPE timestamp USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+CREATE OPERATOR CLASS timestamptz_ops
+	DEFAULT FOR TYPE timestamptz USING pg_hybrid_ivfflat AS
+	OPERATOR 1 < ,
+	OPERATOR 2 <= ,
+	OPERATOR 3 = ,
+	OPERATOR 4 >= ,
+	OPERATOR 5 > ;
+
+-- ============================================================================
+-- BM25 全文检索
+-- ============================================================================
+
+-- 查询: 索引和 tsquery。分数用的文档数、平均长度和词频来自该索引
+CREATE TYPE bm25query AS (index regclass, query tsquery);
+
+CREATE FUNCTION to_bm25query(regclass, tsquery) RETURNS bm25query
+	AS 'SELECT ROW($1, $2)::bm25query'
+	LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION bm25_score(tsvector, bm25query) RETURNS float8
+	AS 'MODULE_PATHNAME', 'bm25_score'
+	LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+COMMENT ON FUNCTION bm25_score(tsvector, bm25query) IS
+	'negated BM25 score of the document, lower is better';
+
+CREATE OPERATOR <&> (
+	LEFTARG = tsvector,
+	RIGHTARG = bm25query,
+	PROCEDURE = bm25_score
+);
+
+CREATE FUNCTION pg_hybrid_bm25_handler(internal) RETURNS index_am_handler
+	AS 'MODULE_PATHNAME', 'pg_hybrid_bm25_handler'
+	LANGUAGE C STRICT;
+
+CREATE ACCESS METHOD pg_hybrid_bm25
+	TYPE INDEX
+	HANDLER pg_hybrid_bm25_handler;
+
+COMMENT ON ACCESS METHOD pg_hybrid_bm25 IS
+	'BM25 ranked full text index with block-max WAND top-k scans';
+
+CREATE OPERATOR CLASS tsvector_bm25_ops
+	DEFAULT FOR TYPE tsvector USING pg_hybrid_bm25 AS
+	OPERATOR 1 <&> (tsvector, bm25query) FOR ORDER BY float_ops,
+	OPERATOR 2 @@ (tsvector, tsquery);
+
+-- ============================================================================
+-- 混合检索
+-- ============================================================================
+
+-- 全文检索 top-k 与向量 top-k 在一次调用中执行，用 RRF 融合
+CREATE FUNCTION hybrid_search(
+	rel regclass,
+	text_column name,
+	vector_column name,
+	query tsquery,
+	embedding hvector,
+	k integer,
+	distance_op text DEFAULT '<->',
+	rrf_k integer DEFAULT 60,
+	text_weight float8 DEFAULT 1.0,
+	vector_weight float8 DEFAULT 1.0)
+	RETURNS TABLE(ctid tid, score float8, text_rank integer, vector_rank integer)
+	AS 'MODULE_PATHNAME', 'hybrid_search'
+	LANGUAGE C STABLE STRICT;
+
+COMMENT ON FUNCTION hybrid_search(regclass, name, name, tsquery, hvector, integer, text, integer, float8, float8) IS
+	'fuse a full text top-k and a vector top-k with reciprocal rank fusion';
+
+-- ============================================================================
+-- hvector_chunk 向量块
+-- ============================================================================
+
+-- 多行同维向量连续存放，精确 KNN 和分析查询顺序扫描
+CREATE TYPE hvector_chunk;
+
+CREATE FUNCTION hvector_chunk_in(cstring, oid, integer) RETURNS hvector_chunk
+	AS 'MODULE_PATHNAME', 'hvector_chunk_in'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_out(hvector_chunk) RETURNS cstring
+	AS 'MODULE_PATHNAME', 'hvector_chunk_out'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_recv(internal, oid, integer) RETURNS hvector_chunk
+	AS 'MODULE_PATHNAME', 'hvector_chunk_recv'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_send(hvector_chunk) RETURNS bytea
+	AS 'MODULE_PATHNAME', 'hvector_chunk_send'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- float 数据几乎压缩不了，external 省去压缩的尝试
+CREATE TYPE hvector_chunk (
+	INPUT     = hvector_chunk_in,
+	OUTPUT    = hvector_chunk_out,
+	RECEIVE   = hvector_chunk_recv,
+	SEND      = hvector_chunk_send,
+	STORAGE   = external
+);
+
+CREATE FUNCTION hvector_chunk_accum(internal, hvector) RETURNS internal
+	AS 'MODULE_PATHNAME', 'hvector_chunk_accum'
+	LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_final(internal) RETURNS hvector_chunk
+	AS 'MODULE_PATHNAME', 'hvector_chunk_final'
+	LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE hvector_chunk_agg(hvector) (
+	SFUNC = hvector_chunk_accum,
+	STYPE = internal,
+	FINALFUNC = hvector_chunk_final
+);
+
+CREATE FUNCTION hvector_chunk_count(hvector_chunk) RETURNS integer
+	AS 'MODULE_PATHNAME', 'hvector_chunk_count'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_dims(hvector_chunk) RETURNS integer
+	AS 'MODULE_PATHNAME', 'hvector_chunk_dims'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_get(hvector_chunk, integer) RETURNS hvector
+	AS 'MODULE_PATHNAME', 'hvector_chunk_get'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_unnest(chunk hvector_chunk)
+	RETURNS TABLE(ordinal integer, vector hvector)
+	AS 'MODULE_PATHNAME', 'hvector_chunk_unnest'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION hvector_chunk_knn(
+	chunk hvector_chunk,
+	query hvector,
+	k integer,
+	distance_op text DEFAULT '<->')
+	RETURNS TABLE(ordinal integer, distance float8)
+	AS 'MODULE_PATHNAME', 'hvector_chunk_knn'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+COMMENT ON FUNCTION hvector_chunk_knn(hvector_chunk, hvector, integer, text) IS
+	'exact k nearest vectors of a chunk, scanned with the batch distance kernels';
+
+-- ============================================================================
+-- 批量检索
+-- ============================================================================
+
+-- 一次检索多个查询向量，探测同一列表的查询共享列表页的读取
+CREATE FUNCTION pg_hybrid_ivfflat_search_batch(
+	index regclass,
+	queries hvector[],
+	k integer,
+	probes integer)
+	RETURNS TABLE(query_no integer, rank integer, ctid tid, distance float8)
+	AS 'MODULE_PATHNAME', 'pg_hybrid_ivfflat_search_batch'
+	LANGUAGE C STABLE STRICT;
+
+COMMENT ON FUNCTION pg_hybrid_ivfflat_search_batch(regclass, hvector[], integer, integer) IS
+	'k nearest rows of many query vectors, reading each probed list once';
+
+-- 带过滤的检索: 只返回 allowed 中的行。堆页上没有允许行的条目不计算距离，
+-- 结果不足 k 行时继续探测更远的列表；允许的行少时直接从表中读取并精确计算
+CREATE FUNCTION pg_hybrid_ivfflat_search_filtered(
+	index regclass,
+	query hvector,
+	allowed tid[],
+	k integer,
+	probes integer)
+	RETURNS TABLE(rank integer, ctid tid, distance float8)
+	AS 'MODULE_PATHNAME', 'pg_hybrid_ivfflat_search_filtered'
+	LANGUAGE C STABLE STRICT;
+
+COMMENT ON FUNCTION pg_hybrid_ivfflat_search_filtered(regclass, hvector, tid[], integer, integer) IS
+	'k nearest rows of a query vector among the allowed heap tids';
@@ -0,0 +1,417 @@
+#include "bm25.h"
+#include "bm25_page.h"
+#include "access/genam.h"
+#include "access/relation.h"
+#include "catalog/pg_class.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "utils/float.h"
+#include "utils/selfuncs.h"
+#include "utils/spccache.h"
+#include "tsearch/ts_utils.h"
+#include <math.h>
+
+static relopt_kind bm25_relopt_kind;
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pg_hybrid_bm25_handler);
+Datum
+pg_hybrid_bm25_handler(PG_FUNCTION_ARGS)
+{
+    IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+    //0 自定义操作符号，只有排序操作符 <&>
+    amroutine->amstrategies = 0;
+    //没有支持函数
+    amroutine->amsupport = 0;
+    amroutine->amcanorder = false;
+    //按 BM25 分数排序
+    amroutine->amcanorderbyop = true;
+    amroutine->amcanunique = false;
+    //单列 tsvector
+    amroutine->amcanmulticol = false;
+    //必须有 @@ 条件：索引只能找到含查询词的行，返回该条件匹配的全部行
+    amroutine->amoptionalkey = false;
+    amroutine->amcaninclude = false;
+    //构建时用 maintenance_work_mem 排序 (词项, tid)
+    amroutine->amusemaintenanceworkmem = true;
+    amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+
+    amroutine->ambuild = bm25_build;
+    amroutine->ambuildempty = bm25_buildempty;
+    amroutine->aminsert = bm25_insert;
+
+    amroutine->ambulkdelete = bm25_bulkdelete;
+    amroutine->amvacuumcleanup = bm25_vacuumcleanup;
+    amroutine->amcostestimate = bm25_costestimate;
+
+    amroutine->amoptions = bm25_options;
+    amroutine->amvalidate = bm25_validate;
+
+    amroutine->ambeginscan = bm25_beginscan;
+    amroutine->amrescan = bm25_rescan;
+    amroutine->amgettuple = bm25_gettuple;
+    amroutine->amendscan = bm25_endscan;
+
+    PG_RETURN_POINTER(amroutine);
+}
+
+void
+bm25_init_options(void){
+    bm25_relopt_kind = add_reloption_kind();
+
+    add_real_reloption(
+        bm25_relopt_kind,
+        "k1",
+        "BM25 term frequency saturation",
+        BM25_DEFAULT_K1,
+        0.0,
+        10.0,
+        AccessExclusiveLock
+    );
+
+    add_real_reloption(
+        bm25_relopt_kind,
+        "b",
+        "BM25 length normalization",
+        BM25_DEFAULT_B,
+        0.0,
+        1.0,
+        AccessExclusiveLock
+    );
+}
+
+bytea *
+bm25_options(Datum reloptions, bool validate){
+    static const relopt_parse_elt tab[] = {
+        {
+            "k1",
+             RELOPT_TYPE_REAL,
+              offsetof(Bm25Options, k1)},
+        {
+            "b",
+             RELOPT_TYPE_REAL,
+              offsetof(Bm25Options, b)},
+    };
+
+    return (bytea *) build_reloptions(
+        reloptions,
+        validate,
+        bm25_relopt_kind,
+        sizeof(Bm25Options),
+        tab,
+        lengthof(tab));
+}
+
+bool
+bm25_validate(Oid opclassoid)
+{
+    return true;
+}
+
+void
+bm25_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+    Cost *indexStartupCost, Cost *indexTotalCost,
+    Selectivity *indexSelectivity, double *indexCorrelation,
+    double *indexPages){
+    GenericCosts costs;
+    double spc_seq_page_cost;
+    bool has_filter = false;
+    ListCell *lc;
+
+    //the scan returns the rows of one @@ qual that holds a lexeme of it,
+    //a constant query that also matches rows without one cannot be used
+    foreach(lc, path->indexclauses){
+        IndexClause *iclause = lfirst_node(IndexClause, lc);
+        Expr *clause = iclause->rinfo->clause;
+        Node *arg;
+
+        if(!IsA(clause, OpExpr) || list_length(((OpExpr *) clause)->args) != 2){
+            continue;
+        }
+        arg = (Node *) lsecond(((OpExpr *) clause)->args);
+        if(IsA(arg, Const)){
+            Const *value = (Const *) arg;
+
+            if(value->constisnull ||
+                DatumGetTSQuery(value->constvalue)->size == 0 ||
+                tsquery_requires_match(GETQUERY(DatumGetTSQuery(value->constvalue)))){
+                has_filter = true;
+            }
+        }else{
+            has_filter = true;
+        }
+    }
+
+    //a bm25query naming another index on the column cannot be scanned here
+    foreach(lc, path->indexorderbys){
+        Node *arg = (Node *) lfirst(lc);
+        Oid indexoid;
+
+        if(IsA(arg, OpExpr) && list_length(((OpExpr *) arg)->args) == 2){
+            arg = (Node *) lsecond(((OpExpr *) arg)->args);
+        }
+        if(IsA(arg, Const) && !((Const *) arg)->constisnull){
+            bm25_get_query(((Const *) arg)->constvalue, &indexoid);
+            if(indexoid != path->indexinfo->indexoid){
+                has_filter = false;
+            }
+        }
+    }
+
+    if(path->indexorderbys == NIL || !has_filter){//no order by, no usable @@, or another index
+        *indexStartupCost = get_float8_infinity();
+        *indexTotalCost = get_float8_infinity();
+        *indexSelectivity = 0;
+        *indexCorrelation = 0;
+        *indexPages = 0;
+        return;
+    }
+    MemSet(&costs, 0, sizeof(costs));
+    genericcostestimate(root, path, loop_count, &costs);
+
+    //the posting lists are read in order
+    get_tablespace_page_costs(
+        path->indexinfo->reltablespace,
+        NULL,
+        &spc_seq_page_cost);
+    costs.indexTotalCost -=
+        costs.numIndexPages * (costs.spc_random_page_cost - spc_seq_page_cost);
+
+    //the first batch is ranked before the first row is returned
+    *indexStartupCost = costs.indexTotalCost;
+    *indexTotalCost = costs.indexTotalCost;
+    *indexSelectivity = costs.indexSelectivity;
+    *indexCorrelation = costs.indexCorrelation;
+    *indexPages = costs.numIndexPages;
+}
+
+bool
+bm25_is_index(Relation index){
+    return index->rd_rel->relkind == RELKIND_INDEX &&
+        index->rd_indam != NULL &&
+        index->rd_indam->amgettuple == bm25_gettuple;
+}
+
+//bm25query is (index regclass, query tsquery)
+TSQuery
+bm25_get_query(Datum bm25query, Oid *indexoid){
+    HeapTupleHeader tuple = DatumGetHeapTupleHeader(bm25query);
+    Datum value;
+    bool isnull;
+
+    value = GetAttributeByNum(tuple, 1, &isnull);
+    if(isnull){
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("bm25query has no index")));
+    }
+    *indexoid = DatumGetObjectId(value);
+    value = GetAttributeByNum(tuple, 2, &isnull);
+    if(isnull){
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("bm25query has no query")));
+    }
+    return DatumGetTSQuery(value);
+}
+
+static void
+bm25_add_query_term(Bm25Query result, char *lexeme, int length){
+    Bm25QueryTerm term;
+
+    for(int i = 0; i < result->term_count; i++){
+        if(bm25_compare_lexemes(result->terms[i].lexeme, result->terms[i].length,
+                                lexeme, length) == 0){
+            return;
+        }
+    }
+    term = &result->terms[result->term_count++];
+    memset(term, 0, sizeof(Bm25QueryTermData));
+    term->lexeme = lexeme;
+    term->length = length;
+    term->start_page = InvalidBlockNumber;
+}
+
+//the lexemes of the query, except negated ones unless all is set. the
+//operators only decide which lexemes count, a row matching any of them
+//is scored
+static void
+bm25_collect_query_terms(TSQuery query, QueryItem *item, bool negated, bool all, Bm25Query result){
+    check_stack_depth();
+
+    if(item->type == QI_VAL){
+        if(!negated || all){
+            bm25_add_query_term(
+                result,
+                GETOPERAND(query) + item->qoperand.distance,
+                item->qoperand.length);
+        }
+        return;
+    }
+    if(item->qoperator.oper == OP_NOT){
+        bm25_collect_query_terms(query, item + 1, !negated, all, result);
+        return;
+    }
+    bm25_collect_query_terms(query, item + 1, negated, all, result);
+    bm25_collect_query_terms(query, item + item->qoperator.left, negated, all, result);
+}
+
+static Bm25Query
+bm25_prepare_terms(Relation index, TSQuery query, bool all, Bm25PendingMatch *matches, int *match_count){
+    Bm25Query result = palloc0(sizeof(Bm25QueryData));
+    Bm25Options *opts = (Bm25Options *) index->rd_options;
+    Bm25MetaPageData meta;
+
+    result->terms = palloc0(Max(query->size, 1) * sizeof(Bm25QueryTermData));
+    if(query->size > 0){
+        bm25_collect_query_terms(query, GETQUERY(query), false, all, result);
+    }
+    result->k1 = opts != NULL ? opts->k1 : BM25_DEFAULT_K1;
+    result->b = opts != NULL ? opts->b : BM25_DEFAULT_B;
+
+    bm25_get_meta(index, &meta);
+    for(int i = 0; i < result->term_count; i++){
+        bm25_find_term(index, &meta, &result->terms[i]);
+    }
+    bm25_scan_pending(index, &meta, result, matches, match_count);
+
+    result->doc_count = (double) meta.doc_count;
+    result->avg_length = meta.doc_count > 0 ?
+        (double) meta.total_length / meta.doc_count : 1.0;
+    if(result->avg_length <= 0){
+        result->avg_length = 1.0;
+    }
+    for(int i = 0; i < result->term_count; i++){
+        Bm25QueryTerm term = &result->terms[i];
+        double df = (double) term->doc_freq + term->pending_freq;
+        double n = Max(result->doc_count, df);
+
+        term->idf = log(1.0 + (n - df + 0.5) / (df + 0.5));
+    }
+    return result;
+}
+
+/*
+ * look the query lexemes up in the dictionary and the pending list and
+ * compute their idf. when matches is set, the pending entries of the
+ * lexemes are returned too.
+ */
+Bm25Query
+bm25_prepare_query(Relation index, TSQuery query, Bm25PendingMatch *matches, int *match_count){
+    return bm25_prepare_terms(index, query, false, matches, match_count);
+}
+
+//all the lexemes of an @@ qual, negated ones too: a row it matches holds
+//at least one of them when tsquery_requires_match() is true
+Bm25Query
+bm25_prepare_filter(Relation index, TSQuery query, Bm25PendingMatch *matches, int *match_count){
+    return bm25_prepare_terms(index, query, true, matches, match_count);
+}
+
+double
+bm25_term_score(Bm25Query query, double idf, double tf, double length){
+    double norm = query->k1 * (1.0 - query->b + query->b * length / query->avg_length);
+
+    return idf * tf * (query->k1 + 1.0) / (tf + norm);
+}
+
+//a lexeme counts once per position, or once when positions are stripped
+static inline uint32
+bm25_entry_tf(TSVector vector, WordEntry *entry){
+    return entry->haspos ? POSDATALEN(vector, entry) : 1;
+}
+
+uint32
+bm25_document_length(TSVector vector){
+    WordEntry *entries = ARRPTR(vector);
+    uint32 length = 0;
+
+    for(int i = 0; i < vector->size; i++){
+        length += bm25_entry_tf(vector, &entries[i]);
+    }
+    return length;
+}
+
+//the score of a row, summed in query term order like the index scan
+double
+bm25_document_score(Bm25Query query, TSVector vector){
+    WordEntry *entries = ARRPTR(vector);
+    char *lexemes = STRPTR(vector);
+    double length = bm25_document_length(vector);
+    double score = 0;
+
+    for(int i = 0; i < query->term_count; i++){
+        Bm25QueryTerm term = &query->terms[i];
+        int low = 0;
+        int high = vector->size - 1;
+
+        //lexemes of a tsvector are sorted the same way as the dictionary
+        while(low <= high){
+            int mid = low + (high - low) / 2;
+            int cmp = bm25_compare_lexemes(
+                term->lexeme, term->length,
+                lexemes + entries[mid].pos, entries[mid].len);
+
+            if(cmp == 0){
+                score += bm25_term_score(query, term->idf,
+                                         bm25_entry_tf(vector, &entries[mid]), length);
+                break;
+            }
+            if(cmp < 0){
+                high = mid - 1;
+            }else{
+                low = mid + 1;
+            }
+        }
+    }
+    return score;
+}
+
+typedef struct Bm25ScoreCacheData {
+    Oid indexoid;
+    TSQuery query;
+    Bm25Query prepared;
+} Bm25ScoreCacheData;
+
+typedef Bm25ScoreCacheData * Bm25ScoreCache;
+
+/*
+ * tsvector <&> bm25query: the negated bm25 score, so that ascending order
+ * puts the best rows first like the distance operators. the statistics
+ * come from the index named in the query and are read once per query.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(bm25_score);
+Datum
+bm25_score(PG_FUNCTION_ARGS){
+    TSVector vector = PG_GETARG_TSVECTOR(0);
+    Bm25ScoreCache cache = (Bm25ScoreCache) fcinfo->flinfo->fn_extra;
+    Oid indexoid;
+    TSQuery query = bm25_get_query(PG_GETARG_DATUM(1), &indexoid);
+
+    if(cache == NULL ||
+        cache->indexoid != indexoid ||
+        VARSIZE(cache->query) != VARSIZE(query) ||
+        memcmp(cache->query, query, VARSIZE(query)) != 0){
+        MemoryContext old_ctx = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+        Relation index;
+
+        if(cache == NULL){
+            cache = palloc0(sizeof(Bm25ScoreCacheData));
+            fcinfo->flinfo->fn_extra = cache;
+        }
+        index = index_open(indexoid, AccessShareLock);
+        if(!bm25_is_index(index)){
+            ereport(ERROR,
+                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                     errmsg("\"%s\" is not a pg_hybrid_bm25 index",
+                            RelationGetRelationName(index))));
+        }
+        cache->indexoid = indexoid;
+        cache->query = (TSQuery) palloc(VARSIZE(query));
+        memcpy(cache->query, query, VARSIZE(query));
+        cache->prepared = bm25_prepare_query(index, cache->query, NULL, NULL);
+        index_close(index, AccessShareLock);
+        MemoryContextSwitchTo(old_ctx);
+    }
+
+    PG_RETURN_FLOAT8(-bm25_document_score(cache->prepared, vector));
+}
@@ -0,0 +1,146 @@
+#ifndef BM25_H
+#define BM25_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "access/amapi.h"
+#include "access/reloptions.h"
+#include "commands/vacuum.h"
+#include "nodes/execnodes.h"
+#include "nodes/pathnodes.h"
+#include "tsearch/ts_type.h"
+#include "utils/relcache.h"
+
+#define BM25_VERSION 1
+#define BM25_PAGE_ID 0xFF85
+
+#define BM25_DEFAULT_K1 1.2
+#define BM25_DEFAULT_B 0.75
+
+//postings per compressed block, each block keeps its own score bound
+#define BM25_BLOCK_SIZE 128
+
+//rows the first top-k pass of a scan returns, doubled by every later pass
+#define BM25_INITIAL_BATCH 100
+
+//scores are summed in different orders by the bounds and by the scoring
+#define BM25_SCORE_SLACK 1e-6
+
+typedef struct Bm25Options {
+    int32 vl_len_;
+    double k1;
+    double b;
+} Bm25Options;
+
+//a lexeme of the query and its statistics in the index
+typedef struct Bm25QueryTermData {
+    char *lexeme;
+    int length;
+    //dictionary entry, doc_freq 0 when the lexeme is not in it
+    uint32 doc_freq;
+    uint32 max_tf;
+    uint32 min_length;
+    BlockNumber start_page;
+    OffsetNumber start_offset;
+    uint32 block_count;
+    //entries of the lexeme in the pending list
+    uint32 pending_freq;
+    double idf;
+} Bm25QueryTermData;
+
+typedef Bm25QueryTermData * Bm25QueryTerm;
+
+typedef struct Bm25QueryData {
+    int term_count;
+    Bm25QueryTerm terms;
+    double k1;
+    double b;
+    double doc_count;
+    double avg_length;
+} Bm25QueryData;
+
+typedef Bm25QueryData * Bm25Query;
+
+//an entry of the pending list that matches a query term
+typedef struct Bm25PendingMatchData {
+    ItemPointerData tid;
+    int term;
+    uint32 tf;
+    uint32 length;
+} Bm25PendingMatchData;
+
+typedef Bm25PendingMatchData * Bm25PendingMatch;
+
+void
+bm25_init_options(void);
+
+bytea *
+bm25_options(Datum reloptions, bool validate);
+
+IndexBuildResult *
+bm25_build(Relation heap, Relation index, IndexInfo *indexInfo);
+
+void
+bm25_buildempty(Relation index);
+
+bool
+bm25_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+    Relation heap, IndexUniqueCheck checkUnique
+    ,bool indexUnchanged
+    ,IndexInfo *indexInfo
+);
+
+IndexBulkDeleteResult *
+bm25_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+                IndexBulkDeleteCallback callback, void *callback_state);
+
+IndexBulkDeleteResult *
+bm25_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
+
+void
+bm25_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+    Cost *indexStartupCost, Cost *indexTotalCost,
+    Selectivity *indexSelectivity, double *indexCorrelation,
+    double *indexPages);
+
+bool
+bm25_validate(Oid opclassoid);
+
+IndexScanDesc
+bm25_beginscan(Relation index, int nkeys, int norderbys);
+
+void
+bm25_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
+
+bool
+bm25_gettuple(IndexScanDesc scan, ScanDirection dir);
+
+void
+bm25_endscan(IndexScanDesc scan);
+
+bool
+bm25_is_index(Relation index);
+
+TSQuery
+bm25_get_query(Datum bm25query, Oid *indexoid);
+
+Bm25Query
+bm25_prepare_query(Relation index, TSQuery query, Bm25PendingMatch *matches, int *match_count);
+
+Bm25Query
+bm25_prepare_filter(Relation index, TSQuery query, Bm25PendingMatch *matches, int *match_count);
+
+double
+bm25_term_score(Bm25Query query, double idf, double tf, double length);
+
+double
+bm25_document_score(Bm25Query query, TSVector vector);
+
+uint32
+bm25_document_length(TSVector vector);
+
+PGDLLEXPORT Datum pg_hybrid_bm25_handler(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum bm25_score(PG_FUNCTION_ARGS);
+
+#endif
@@ -0,0 +1,621 @@
+#include "bm25_build.h"
+#include "ivfflat_page.h"
+#include "access/tableam.h"
+#include "access/xloginsert.h"
+#include "catalog/index.h"
+#include "catalog/pg_collation_d.h"
+#include "catalog/pg_operator_d.h"
+#include "catalog/pg_type_d.h"
+#include "miscadmin.h"
+#include "storage/indexfsm.h"
+#include "storage/lmgr.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/typcache.h"
+#include "varatt.h"
+
+IndexBuildResult *
+bm25_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+    IndexBuildResult *result;
+    Bm25BuildCtx ctx;
+
+    if(RelationGetNumberOfBlocks(index) != 0){
+        elog(ERROR, "index \"%s\" already contains data", RelationGetRelationName(index));
+    }
+    ctx = bm25_build_init_ctx(heap, index, indexInfo, MAIN_FORKNUM);
+    bm25_build_index(ctx);
+
+    result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+    result->heap_tuples = ctx->rel_tuple_count;
+    result->index_tuples = (double) ctx->doc_count;
+
+    bm25_build_destroy_ctx(ctx);
+    return result;
+}
+
+void
+bm25_buildempty(Relation index)
+{
+    Bm25BuildCtx ctx = bm25_build_init_ctx(NULL, index, BuildIndexInfo(index), INIT_FORKNUM);
+
+    bm25_build_index(ctx);
+    bm25_build_destroy_ctx(ctx);
+}
+
+Bm25BuildCtx
+bm25_build_init_ctx(Relation heap, Relation index, IndexInfo *index_info, ForkNumber fork_num){
+    Bm25BuildCtx ctx = palloc0(sizeof(Bm25BuildCtxData));
+
+    ctx->heap = heap;
+    ctx->index = index;
+    ctx->index_info = index_info;
+    ctx->fork_num = fork_num;
+    ctx->buf = InvalidBuffer;
+    ctx->posting_start_page = InvalidBlockNumber;
+
+    ctx->sort_desc = CreateTemplateTupleDesc(4);
+    TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 1, "lexeme", TEXTOID, -1, 0);
+    TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
+    TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 3, "tf", INT4OID, -1, 0);
+    TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 4, "length", INT4OID, -1, 0);
+    ctx->sort_slot = MakeSingleTupleTableSlot(ctx->sort_desc, &TTSOpsVirtual);
+
+    ctx->postings = palloc(BM25_BLOCK_SIZE * sizeof(Bm25PostingData));
+    ctx->block = palloc(BM25_MAX_BLOCK_SIZE);
+    ctx->term_capacity = 1024;
+    ctx->terms = palloc(ctx->term_capacity * sizeof(Bm25Term));
+
+    ctx->term_ctx = AllocSetContextCreate(
+        CurrentMemoryContext,
+        "bm25 build terms",
+        ALLOCSET_DEFAULT_SIZES);
+    ctx->tmp_ctx = AllocSetContextCreate(
+        CurrentMemoryContext,
+        "bm25 build temporary context",
+        ALLOCSET_DEFAULT_SIZES);
+    return ctx;
+}
+
+void
+bm25_build_destroy_ctx(Bm25BuildCtx ctx){
+    ExecDropSingleTupleTableSlot(ctx->sort_slot);
+    pfree(ctx->postings);
+    pfree(ctx->block);
+    pfree(ctx->terms);
+    MemoryContextDelete(ctx->term_ctx);
+    MemoryContextDelete(ctx->tmp_ctx);
+    pfree(ctx);
+}
+
+//sort (lexeme, tid), lexemes in the order of the dictionary
+static void
+bm25_build_begin_sort(Bm25BuildCtx ctx){
+    AttrNumber attNums[] = {1, 2};
+    Oid sortOperators[] = {
+        lookup_type_cache(TEXTOID, TYPECACHE_LT_OPR)->lt_opr,
+        TIDLessOperator};
+    Oid sortCollations[] = {C_COLLATION_OID, InvalidOid};
+    bool nullsFirstFlags[] = {false, false};
+
+    ctx->sort_state = tuplesort_begin_heap(
+        ctx->sort_desc,
+        2,
+        attNums,
+        sortOperators,
+        sortCollations,
+        nullsFirstFlags,
+        maintenance_work_mem,
+        NULL,
+        false);
+}
+
+static void
+bm25_build_put(Bm25BuildCtx ctx, const char *lexeme, int length, ItemPointer tid, uint32 tf, uint32 row_length){
+    TupleTableSlot *slot = ctx->sort_slot;
+
+    ExecClearTuple(slot);
+    slot->tts_values[0] = PointerGetDatum(cstring_to_text_with_len(lexeme, length));
+    slot->tts_values[1] = ItemPointerGetDatum(tid);
+    slot->tts_values[2] = Int32GetDatum((int32) tf);
+    slot->tts_values[3] = Int32GetDatum((int32) row_length);
+    memset(slot->tts_isnull, 0, 4 * sizeof(bool));
+    ExecStoreVirtualTuple(slot);
+    tuplesort_puttupleslot(ctx->sort_state, slot);
+}
+
+void
+bm25_build_index(Bm25BuildCtx ctx){
+    Buffer meta_buf;
+    Page page;
+    Bm25MetaPage meta;
+    BlockNumber dict_start_page;
+    BlockNumber dict_page_count;
+
+    //step 1. the meta page, filled in at the end
+    meta_buf = ivfflat_new_buffer(ctx->index, ctx->fork_num);
+    Assert(BufferGetBlockNumber(meta_buf) == BM25_METAPAGE_BLKNO);
+    bm25_init_page(meta_buf, BufferGetPage(meta_buf), BM25_PAGE_META);
+    MarkBufferDirty(meta_buf);
+    UnlockReleaseBuffer(meta_buf);
+
+    //step 2. sort (lexeme, tid) of every row
+    bm25_build_begin_sort(ctx);
+    if(ctx->heap != NULL){
+        ctx->rel_tuple_count = table_index_build_scan(
+            ctx->heap,
+            ctx->index,
+            ctx->index_info,
+            true,
+            true,
+            bm25_build_callback,
+            (void *) ctx,
+            NULL);
+    }
+    tuplesort_performsort(ctx->sort_state);
+
+    //step 3. the posting lists, then the dictionary
+    bm25_write_postings(ctx);
+    tuplesort_end(ctx->sort_state);
+    bm25_write_dictionary(ctx, &dict_start_page, &dict_page_count);
+
+    meta_buf = ReadBufferExtended(ctx->index, ctx->fork_num, BM25_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    page = BufferGetPage(meta_buf);
+    meta = Bm25PageGetMeta(page);
+    meta->version = BM25_VERSION;
+    meta->term_count = ctx->term_count;
+    meta->doc_count = ctx->doc_count;
+    meta->total_length = ctx->total_length;
+    meta->posting_start_page = ctx->posting_start_page;
+    meta->dict_start_page = dict_start_page;
+    meta->dict_page_count = dict_page_count;
+    meta->pending_start_page = InvalidBlockNumber;
+    meta->pending_insert_page = InvalidBlockNumber;
+    meta->merge_xid = InvalidFullTransactionId;
+    ((PageHeader) page)->pd_lower = ((char *) meta + sizeof(Bm25MetaPageData)) - (char *) page;
+    MarkBufferDirty(meta_buf);
+    UnlockReleaseBuffer(meta_buf);
+
+    //the pages were written without wal
+    if(ctx->fork_num == INIT_FORKNUM || RelationNeedsWAL(ctx->index)){
+        log_newpage_range(
+            ctx->index,
+            ctx->fork_num,
+            0,
+            RelationGetNumberOfBlocksInFork(ctx->index, ctx->fork_num),
+            true);
+    }
+}
+
+void
+bm25_build_callback(
+    Relation index,
+    ItemPointer tid,
+    Datum *values,
+    bool *isnull,
+    bool tupleIsAlive,
+    void *state){
+    Bm25BuildCtx ctx = (Bm25BuildCtx) state;
+    MemoryContext old_ctx;
+    TSVector vector;
+    WordEntry *entries;
+    uint32 length;
+
+    if(isnull[0]){
+        return;
+    }
+    old_ctx = MemoryContextSwitchTo(ctx->tmp_ctx);
+
+    vector = DatumGetTSVector(values[0]);
+    entries = ARRPTR(vector);
+    length = bm25_document_length(vector);
+    for(int i = 0; i < vector->size; i++){
+        bm25_build_put(
+            ctx,
+            STRPTR(vector) + entries[i].pos,
+            entries[i].len,
+            tid,
+            entries[i].haspos ? POSDATALEN(vector, &entries[i]) : 1,
+            length);
+    }
+    if(vector->size > 0){
+        ctx->doc_count++;
+        ctx->total_length += length;
+    }
+
+    MemoryContextSwitchTo(old_ctx);
+    MemoryContextReset(ctx->tmp_ctx);
+}
+
+//a merge puts its posting pages on the free pages first and logs each
+//page, the build logs all of them at the end. the merge holds the
+//extension lock while it writes the dictionary
+static Buffer
+bm25_build_get_buffer(Bm25BuildCtx ctx, uint16 page_type){
+    if(ctx->merge && page_type == BM25_PAGE_POSTING){
+        BlockNumber blkno = GetFreeIndexPage(ctx->index);
+        Buffer buf;
+
+        if(!BlockNumberIsValid(blkno)){
+            return bm25_new_buffer(ctx->index);
+        }
+        buf = ReadBuffer(ctx->index, blkno);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        return buf;
+    }
+    return ivfflat_new_buffer(ctx->index, ctx->fork_num);
+}
+
+static void
+bm25_build_write_page(Bm25BuildCtx ctx){
+    MarkBufferDirty(ctx->buf);
+    if(ctx->merge && RelationNeedsWAL(ctx->index)){
+        log_newpage_buffer(ctx->buf, true);
+    }
+    UnlockReleaseBuffer(ctx->buf);
+}
+
+static void
+bm25_build_new_page(Bm25BuildCtx ctx, uint16 page_type){
+    Buffer buf = bm25_build_get_buffer(ctx, page_type);
+    Page page = BufferGetPage(buf);
+
+    bm25_init_page(buf, page, page_type);
+    if(BufferIsValid(ctx->buf)){
+        Bm25PageGetOpaque(ctx->page)->nextblkno = BufferGetBlockNumber(buf);
+        bm25_build_write_page(ctx);
+    }
+    if(page_type == BM25_PAGE_POSTING && !BlockNumberIsValid(ctx->posting_start_page)){
+        ctx->posting_start_page = BufferGetBlockNumber(buf);
+    }
+    ctx->buf = buf;
+    ctx->page = page;
+}
+
+static void
+bm25_build_release_page(Bm25BuildCtx ctx){
+    if(BufferIsValid(ctx->buf)){
+        bm25_build_write_page(ctx);
+        ctx->buf = InvalidBuffer;
+        ctx->page = NULL;
+    }
+}
+
+static void
+bm25_build_add_item(Bm25BuildCtx ctx, Item item, Size size, uint16 page_type, OffsetNumber *offset){
+    if(!BufferIsValid(ctx->buf) || PageGetFreeSpace(ctx->page) < MAXALIGN(size)){
+        bm25_build_new_page(ctx, page_type);
+    }
+    *offset = PageAddItem(ctx->page, item, size, InvalidOffsetNumber, false, false);
+    if(*offset == InvalidOffsetNumber){
+        elog(ERROR, "failed to add item to \"%s\"", RelationGetRelationName(ctx->index));
+    }
+}
+
+//write the postings of the current block after those of the lexeme
+static void
+bm25_build_flush_block(Bm25BuildCtx ctx){
+    Bm25Term term = ctx->term;
+    OffsetNumber offset;
+    int size;
+
+    if(ctx->posting_count == 0){
+        return;
+    }
+    size = bm25_encode_block(ctx->postings, ctx->posting_count, ctx->block);
+    bm25_build_add_item(ctx, (Item) ctx->block, size, BM25_PAGE_POSTING, &offset);
+    if(term->block_count == 0){
+        term->start_page = BufferGetBlockNumber(ctx->buf);
+        term->start_offset = offset;
+    }
+    term->block_count++;
+    term->max_tf = Max(term->max_tf, ctx->block->max_tf);
+    term->min_length = Min(term->min_length, ctx->block->min_length);
+    ctx->posting_count = 0;
+}
+
+static void
+bm25_build_finish_term(Bm25BuildCtx ctx){
+    if(ctx->term == NULL){
+        return;
+    }
+    bm25_build_flush_block(ctx);
+    if(ctx->term_count == ctx->term_capacity){
+        ctx->term_capacity *= 2;
+        ctx->terms = repalloc_huge(ctx->terms, ctx->term_capacity * sizeof(Bm25Term));
+    }
+    ctx->terms[ctx->term_count++] = ctx->term;
+    ctx->term = NULL;
+}
+
+static void
+bm25_build_start_term(Bm25BuildCtx ctx, const char *lexeme, int length){
+    Bm25Term term = MemoryContextAllocZero(ctx->term_ctx, BM25_TERM_SIZE(length));
+
+    term->min_length = PG_UINT32_MAX;
+    term->start_page = InvalidBlockNumber;
+    term->length = length;
+    memcpy(term->lexeme, lexeme, length);
+    ctx->term = term;
+}
+
+//the sorted (lexeme, tid) go to the posting pages, a block at a time
+void
+bm25_write_postings(Bm25BuildCtx ctx){
+    TupleTableSlot *slot = MakeSingleTupleTableSlot(ctx->sort_desc, &TTSOpsMinimalTuple);
+    bool isnull;
+
+    while(tuplesort_gettupleslot(ctx->sort_state, true, false, slot, NULL)){
+        text *lexeme = DatumGetTextPP(slot_getattr(slot, 1, &isnull));
+        ItemPointer tid = DatumGetItemPointer(slot_getattr(slot, 2, &isnull));
+        Bm25Posting posting;
+
+        CHECK_FOR_INTERRUPTS();
+        if(ctx->term == NULL ||
+            bm25_compare_lexemes(ctx->term->lexeme, ctx->term->length,
+                                 VARDATA_ANY(lexeme), VARSIZE_ANY_EXHDR(lexeme)) != 0){
+            bm25_build_finish_term(ctx);
+            bm25_build_start_term(ctx, VARDATA_ANY(lexeme), VARSIZE_ANY_EXHDR(lexeme));
+        }
+        posting = &ctx->postings[ctx->posting_count++];
+        posting->tid = *tid;
+        posting->tf = (uint32) DatumGetInt32(slot_getattr(slot, 3, &isnull));
+        posting->length = (uint32) DatumGetInt32(slot_getattr(slot, 4, &isnull));
+        ctx->term->doc_freq++;
+        if(ctx->posting_count == BM25_BLOCK_SIZE){
+            bm25_build_flush_block(ctx);
+        }
+    }
+    bm25_build_finish_term(ctx);
+    bm25_build_release_page(ctx);
+    ExecDropSingleTupleTableSlot(slot);
+}
+
+//the dictionary pages follow the posting pages, contiguous and sorted
+void
+bm25_write_dictionary(Bm25BuildCtx ctx, BlockNumber *start_page, BlockNumber *page_count){
+    OffsetNumber offset;
+
+    *start_page = InvalidBlockNumber;
+    *page_count = 0;
+    for(int i = 0; i < ctx->term_count; i++){
+        Bm25Term term = ctx->terms[i];
+        bool new_page = !BufferIsValid(ctx->buf) ||
+            PageGetFreeSpace(ctx->page) < MAXALIGN(BM25_TERM_SIZE(term->length));
+
+        bm25_build_add_item(ctx, (Item) term, BM25_TERM_SIZE(term->length), BM25_PAGE_DICT, &offset);
+        if(new_page){
+            if(*page_count == 0){
+                *start_page = BufferGetBlockNumber(ctx->buf);
+            }
+            (*page_count)++;
+        }
+    }
+    bm25_build_release_page(ctx);
+}
+
+static void
+bm25_merge_mark_chain(Relation index, BlockNumber blkno, bool *live, BlockNumber nblocks){
+    while(BlockNumberIsValid(blkno) && blkno < nblocks){
+        Buffer buf;
+
+        live[blkno] = true;
+        buf = ReadBuffer(index, blkno);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        blkno = Bm25PageGetOpaque(BufferGetPage(buf))->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+/*
+ * give the pages the meta page no longer leads to back to the free space
+ * map, once no scan that started before the last merge is left. only the
+ * merge takes pages from the map, inserts extend the index.
+ */
+void
+bm25_recycle_pages(Relation index, Relation heap, IndexBulkDeleteResult *stats){
+    Buffer meta_buf;
+    Bm25MetaPageData meta;
+    BlockNumber nblocks;
+    bool *live;
+
+    //inserts link their new pages while holding the meta page
+    meta_buf = ReadBuffer(index, BM25_METAPAGE_BLKNO);
+    LockBuffer(meta_buf, BUFFER_LOCK_SHARE);
+    memcpy(&meta, Bm25PageGetMeta(BufferGetPage(meta_buf)), sizeof(Bm25MetaPageData));
+    nblocks = RelationGetNumberOfBlocks(index);
+    UnlockReleaseBuffer(meta_buf);
+
+    if(!FullTransactionIdIsValid(meta.merge_xid) ||
+        !GlobalVisCheckRemovableFullXid(heap, meta.merge_xid)){
+        return;
+    }
+    live = palloc0(nblocks * sizeof(bool));
+    live[BM25_METAPAGE_BLKNO] = true;
+    bm25_merge_mark_chain(index, meta.posting_start_page, live, nblocks);
+    bm25_merge_mark_chain(index, meta.pending_start_page, live, nblocks);
+    for(BlockNumber i = 0; i < meta.dict_page_count; i++){
+        live[meta.dict_start_page + i] = true;
+    }
+    for(BlockNumber blkno = 0; blkno < nblocks; blkno++){
+        if(!live[blkno]){
+            RecordFreeIndexPage(index, blkno);
+            stats->pages_free++;
+        }
+    }
+    IndexFreeSpaceMapVacuum(index);
+    pfree(live);
+}
+
+//the postings of a dictionary entry
+static void
+bm25_merge_put_term(Bm25BuildCtx ctx, Bm25Term term, BufferAccessStrategy strategy){
+    BlockNumber blkno = term->start_page;
+    OffsetNumber offset = term->start_offset;
+    uint32 left = term->block_count;
+
+    while(left > 0 && BlockNumberIsValid(blkno)){
+        Buffer buf;
+        Page page;
+        OffsetNumber max_offset;
+
+        vacuum_delay_point();
+        buf = ReadBufferExtended(ctx->index, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(; offset <= max_offset && left > 0; offset = OffsetNumberNext(offset), left--){
+            Bm25Block block = (Bm25Block) PageGetItem(page, PageGetItemId(page, offset));
+            int count = bm25_decode_block(block, ctx->postings);
+            MemoryContext old_ctx = MemoryContextSwitchTo(ctx->tmp_ctx);
+
+            for(int i = 0; i < count; i++){
+                Bm25Posting posting = &ctx->postings[i];
+
+                bm25_build_put(ctx, term->lexeme, term->length, &posting->tid, posting->tf, posting->length);
+            }
+            MemoryContextSwitchTo(old_ctx);
+            MemoryContextReset(ctx->tmp_ctx);
+        }
+        blkno = Bm25PageGetOpaque(page)->nextblkno;
+        offset = FirstOffsetNumber;
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+static void
+bm25_merge_put_dictionary(Bm25BuildCtx ctx, Bm25MetaPage meta, BufferAccessStrategy strategy){
+    Page copy = palloc(BLCKSZ);
+
+    for(BlockNumber i = 0; i < meta->dict_page_count; i++){
+        Buffer buf;
+        OffsetNumber max_offset;
+
+        //the posting pages are locked one at a time, from a copy
+        buf = ReadBufferExtended(ctx->index, MAIN_FORKNUM, meta->dict_start_page + i, RBM_NORMAL, strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        memcpy(copy, BufferGetPage(buf), BLCKSZ);
+        UnlockReleaseBuffer(buf);
+
+        max_offset = PageGetMaxOffsetNumber(copy);
+        for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset++){
+            bm25_merge_put_term(ctx, (Bm25Term) PageGetItem(copy, PageGetItemId(copy, offset)), strategy);
+        }
+    }
+    pfree(copy);
+}
+
+//the entries of the pending pages from start_page up to last_page
+static void
+bm25_merge_put_pending(Bm25BuildCtx ctx, BlockNumber start_page, BlockNumber last_page, BufferAccessStrategy strategy){
+    BlockNumber blkno = start_page;
+
+    while(BlockNumberIsValid(blkno)){
+        Buffer buf;
+        Page page;
+        OffsetNumber max_offset;
+        MemoryContext old_ctx;
+
+        vacuum_delay_point();
+        buf = ReadBufferExtended(ctx->index, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        old_ctx = MemoryContextSwitchTo(ctx->tmp_ctx);
+        for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset++){
+            Bm25Pending entry = (Bm25Pending) PageGetItem(page, PageGetItemId(page, offset));
+
+            bm25_build_put(ctx, entry->lexeme, entry->lexeme_length, &entry->tid, entry->tf, entry->length);
+        }
+        MemoryContextSwitchTo(old_ctx);
+        MemoryContextReset(ctx->tmp_ctx);
+        blkno = blkno == last_page ? InvalidBlockNumber : Bm25PageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+/*
+ * merge the pending list into the postings, like ginInsertCleanup. the
+ * list is cut at its tail first: rows inserted meanwhile go to a new page
+ * and stay pending. the postings and the dictionary are written again,
+ * then the meta page switches to them and to the rest of the list in one
+ * record. scans that read the old meta page keep reading the old pages,
+ * bm25_recycle_pages frees them later.
+ */
+void
+bm25_merge_pending(Relation index, BufferAccessStrategy strategy){
+    Bm25BuildCtx ctx;
+    Bm25MetaPageData old_meta;
+    Bm25MetaPage meta;
+    GenericXLogState *state;
+    Buffer meta_buf;
+    Buffer buf;
+    Buffer new_buf;
+    Page page;
+    Page new_page;
+    BlockNumber next_start_page;
+    BlockNumber dict_start_page;
+    BlockNumber dict_page_count;
+
+    //step 1. cut the list after its last page
+    meta_buf = ReadBuffer(index, BM25_METAPAGE_BLKNO);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    memcpy(&old_meta, Bm25PageGetMeta(BufferGetPage(meta_buf)), sizeof(Bm25MetaPageData));
+    if(!BlockNumberIsValid(old_meta.pending_start_page)){
+        UnlockReleaseBuffer(meta_buf);
+        return;
+    }
+    buf = ReadBuffer(index, old_meta.pending_insert_page);
+    LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    if(old_meta.pending_start_page == old_meta.pending_insert_page && PageIsEmpty(BufferGetPage(buf))){
+        UnlockReleaseBuffer(buf);
+        UnlockReleaseBuffer(meta_buf);
+        return;
+    }
+    new_buf = bm25_new_buffer(index);
+    state = GenericXLogStart(index);
+    meta = Bm25PageGetMeta(GenericXLogRegisterBuffer(state, meta_buf, 0));
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    new_page = GenericXLogRegisterBuffer(state, new_buf, GENERIC_XLOG_FULL_IMAGE);
+    bm25_init_page(new_buf, new_page, BM25_PAGE_PENDING);
+    next_start_page = BufferGetBlockNumber(new_buf);
+    Bm25PageGetOpaque(page)->nextblkno = next_start_page;
+    meta->pending_insert_page = next_start_page;
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(new_buf);
+    UnlockReleaseBuffer(buf);
+    UnlockReleaseBuffer(meta_buf);
+
+    //step 2. sort the postings with the entries before the cut
+    ctx = bm25_build_init_ctx(NULL, index, NULL, MAIN_FORKNUM);
+    ctx->merge = true;
+    bm25_build_begin_sort(ctx);
+    bm25_merge_put_dictionary(ctx, &old_meta, strategy);
+    bm25_merge_put_pending(ctx, old_meta.pending_start_page, old_meta.pending_insert_page, strategy);
+    tuplesort_performsort(ctx->sort_state);
+
+    //step 3. the new postings and dictionary, the dictionary contiguous
+    bm25_write_postings(ctx);
+    tuplesort_end(ctx->sort_state);
+    LockRelationForExtension(index, ExclusiveLock);
+    bm25_write_dictionary(ctx, &dict_start_page, &dict_page_count);
+    UnlockRelationForExtension(index, ExclusiveLock);
+
+    //step 4. switch, the statistics already count the pending rows
+    meta_buf = ReadBuffer(index, BM25_METAPAGE_BLKNO);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    state = GenericXLogStart(index);
+    meta = Bm25PageGetMeta(GenericXLogRegisterBuffer(state, meta_buf, 0));
+    meta->term_count = ctx->term_count;
+    meta->posting_start_page = ctx->posting_start_page;
+    meta->dict_start_page = dict_start_page;
+    meta->dict_page_count = dict_page_count;
+    meta->pending_start_page = next_start_page;
+    meta->merge_xid = ReadNextFullTransactionId();
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(meta_buf);
+
+    bm25_build_destroy_ctx(ctx);
+}
@@ -0,0 +1,77 @@
+#ifndef BM25_BUILD_H
+#define BM25_BUILD_H
+
+#include "bm25.h"
+#include "bm25_page.h"
+#include "executor/tuptable.h"
+#include "utils/tuplesort.h"
+
+typedef struct Bm25BuildCtxData {
+    Relation heap;
+    Relation index;
+    IndexInfo *index_info;
+    ForkNumber fork_num;
+    //merging the pending list of a built index
+    bool merge;
+
+    double rel_tuple_count;
+    uint64 doc_count;
+    uint64 total_length;
+
+    //sort desc  1: lexeme, 2: tid, 3: tf, 4: row length
+    TupleDesc sort_desc;
+    Tuplesortstate *sort_state;
+    TupleTableSlot *sort_slot;
+
+    //posting page being filled, written without wal until the end
+    Buffer buf;
+    Page page;
+    BlockNumber posting_start_page;
+    //postings of the current block and the dictionary entry they go to
+    Bm25Posting postings;
+    int posting_count;
+    Bm25Block block;
+    Bm25Term term;
+    //dictionary entries, in lexeme order
+    Bm25Term *terms;
+    int term_count;
+    int term_capacity;
+
+    MemoryContext term_ctx;
+    //reset after each heap row
+    MemoryContext tmp_ctx;
+} Bm25BuildCtxData;
+
+typedef Bm25BuildCtxData * Bm25BuildCtx;
+
+Bm25BuildCtx
+bm25_build_init_ctx(Relation heap, Relation index, IndexInfo *index_info, ForkNumber fork_num);
+
+void
+bm25_build_destroy_ctx(Bm25BuildCtx ctx);
+
+void
+bm25_build_index(Bm25BuildCtx ctx);
+
+void
+bm25_build_callback(
+    Relation index,
+    ItemPointer tid,
+    Datum *values,
+    bool *isnull,
+    bool tupleIsAlive,
+    void *state);
+
+void
+bm25_write_postings(Bm25BuildCtx ctx);
+
+void
+bm25_write_dictionary(Bm25BuildCtx ctx, BlockNumber *start_page, BlockNumber *page_count);
+
+void
+bm25_recycle_pages(Relation index, Relation heap, IndexBulkDeleteResult *stats);
+
+void
+bm25_merge_pending(Relation index, BufferAccessStrategy strategy);
+
+#endif
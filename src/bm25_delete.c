@@ -0,0 +1,273 @@
+#include "bm25.h"
+#include "bm25_build.h"
+#include "access/generic_xlog.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+//a removed row, counted once however many lexemes it had
+typedef struct Bm25DeletedData {
+    ItemPointerData tid;
+    uint32 length;
+} Bm25DeletedData;
+
+typedef Bm25DeletedData * Bm25Deleted;
+
+typedef struct Bm25VacuumStateData {
+    IndexVacuumInfo *info;
+    IndexBulkDeleteCallback callback;
+    void *callback_state;
+    HTAB *deleted;
+    Bm25Posting postings;
+    Bm25Block block;
+} Bm25VacuumStateData;
+
+typedef Bm25VacuumStateData * Bm25VacuumState;
+
+static void
+bm25_vacuum_deleted(Bm25VacuumState vacuum_state, ItemPointer tid, uint32 length){
+    Bm25Deleted deleted;
+    bool found;
+
+    deleted = (Bm25Deleted) hash_search(vacuum_state->deleted, tid, HASH_ENTER, &found);
+    deleted->length = length;
+}
+
+//remove the dead rows from the blocks of one lexeme, in place. the block
+//bounds are recomputed from the remaining rows. returns the removed rows
+static uint32
+bm25_vacuum_term(Bm25VacuumState vacuum_state, Bm25Term term){
+    Relation index = vacuum_state->info->index;
+    BlockNumber blkno = term->start_page;
+    OffsetNumber offset = term->start_offset;
+    uint32 left = term->block_count;
+    uint32 removed = 0;
+
+    while(left > 0 && BlockNumberIsValid(blkno)){
+        Buffer buf;
+        Page page;
+        GenericXLogState *state = NULL;
+        OffsetNumber max_offset;
+
+        vacuum_delay_point();
+        buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuum_state->info->strategy);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(; offset <= max_offset && left > 0; offset = OffsetNumberNext(offset), left--){
+            Bm25Block block = (Bm25Block) PageGetItem(page, PageGetItemId(page, offset));
+            int count = bm25_decode_block(block, vacuum_state->postings);
+            int nkeep = 0;
+            Size size;
+
+            for(int i = 0; i < count; i++){
+                Bm25Posting posting = &vacuum_state->postings[i];
+
+                if(vacuum_state->callback(&posting->tid, vacuum_state->callback_state)){
+                    bm25_vacuum_deleted(vacuum_state, &posting->tid, posting->length);
+                    continue;
+                }
+                vacuum_state->postings[nkeep++] = *posting;
+            }
+            if(nkeep == count){
+                continue;
+            }
+            removed += count - nkeep;
+
+            if(state == NULL){
+                state = GenericXLogStart(index);
+                page = GenericXLogRegisterBuffer(state, buf, 0);
+                block = (Bm25Block) PageGetItem(page, PageGetItemId(page, offset));
+            }
+            //an empty block stays, so that the dictionary offsets hold
+            if(nkeep > 0){
+                size = bm25_encode_block(vacuum_state->postings, nkeep, vacuum_state->block);
+            }else{
+                memcpy(vacuum_state->block, block, BM25_BLOCK_HEADER_SIZE);
+                vacuum_state->block->count = 0;
+                vacuum_state->block->data_size = 0;
+                size = BM25_BLOCK_HEADER_SIZE;
+            }
+            if(!PageIndexTupleOverwrite(page, offset, (Item) vacuum_state->block, size)){
+                elog(ERROR, "failed to overwrite block in \"%s\"", RelationGetRelationName(index));
+            }
+        }
+        if(state != NULL){
+            GenericXLogFinish(state);
+            page = BufferGetPage(buf);
+        }
+        blkno = Bm25PageGetOpaque(page)->nextblkno;
+        offset = FirstOffsetNumber;
+        UnlockReleaseBuffer(buf);
+    }
+    return removed;
+}
+
+static void
+bm25_vacuum_dictionary(Bm25VacuumState vacuum_state, Bm25MetaPage meta){
+    Relation index = vacuum_state->info->index;
+
+    for(BlockNumber i = 0; i < meta->dict_page_count; i++){
+        BlockNumber blkno = meta->dict_start_page + i;
+        Buffer buf;
+        Page page;
+        OffsetNumber max_offset;
+        Bm25Term terms;
+        uint32 *removed;
+        bool changed = false;
+
+        //copy the entries, the posting pages are locked one at a time
+        buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuum_state->info->strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        terms = palloc(max_offset * sizeof(Bm25TermData));
+        removed = palloc0(max_offset * sizeof(uint32));
+        for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset++){
+            memcpy(&terms[offset - 1], PageGetItem(page, PageGetItemId(page, offset)),
+                   offsetof(Bm25TermData, lexeme));
+        }
+        UnlockReleaseBuffer(buf);
+
+        for(int j = 0; j < max_offset; j++){
+            removed[j] = bm25_vacuum_term(vacuum_state, &terms[j]);
+            changed |= removed[j] > 0;
+        }
+
+        if(changed){
+            GenericXLogState *state;
+
+            buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuum_state->info->strategy);
+            LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+            state = GenericXLogStart(index);
+            page = GenericXLogRegisterBuffer(state, buf, 0);
+            for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset++){
+                Bm25Term term = (Bm25Term) PageGetItem(page, PageGetItemId(page, offset));
+
+                term->doc_freq -= Min(term->doc_freq, removed[offset - 1]);
+            }
+            GenericXLogFinish(state);
+            UnlockReleaseBuffer(buf);
+        }
+        pfree(terms);
+        pfree(removed);
+    }
+}
+
+static void
+bm25_vacuum_pending(Bm25VacuumState vacuum_state, Bm25MetaPage meta){
+    Relation index = vacuum_state->info->index;
+    BlockNumber blkno = meta->pending_start_page;
+    OffsetNumber deletable[MaxOffsetNumber];
+
+    while(BlockNumberIsValid(blkno)){
+        Buffer buf;
+        Page page;
+        OffsetNumber max_offset;
+        int ndeletable = 0;
+
+        vacuum_delay_point();
+        buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuum_state->info->strategy);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset++){
+            Bm25Pending entry = (Bm25Pending) PageGetItem(page, PageGetItemId(page, offset));
+
+            if(vacuum_state->callback(&entry->tid, vacuum_state->callback_state)){
+                bm25_vacuum_deleted(vacuum_state, &entry->tid, entry->length);
+                deletable[ndeletable++] = offset;
+            }
+        }
+        if(ndeletable > 0){
+            GenericXLogState *state = GenericXLogStart(index);
+
+            page = GenericXLogRegisterBuffer(state, buf, 0);
+            PageIndexMultiDelete(page, deletable, ndeletable);
+            GenericXLogFinish(state);
+            page = BufferGetPage(buf);
+        }
+        blkno = Bm25PageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+IndexBulkDeleteResult *
+bm25_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+                IndexBulkDeleteCallback callback, void *callback_state){
+    Relation index = info->index;
+    Bm25VacuumStateData vacuum_state;
+    Bm25MetaPageData meta;
+    HASHCTL ctl;
+    HASH_SEQ_STATUS status;
+    Bm25Deleted deleted;
+    uint64 removed_count = 0;
+    uint64 removed_length = 0;
+
+    if(stats == NULL){
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+    }
+    bm25_get_meta(index, &meta);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(ItemPointerData);
+    ctl.entrysize = sizeof(Bm25DeletedData);
+    ctl.hcxt = CurrentMemoryContext;
+    vacuum_state.info = info;
+    vacuum_state.callback = callback;
+    vacuum_state.callback_state = callback_state;
+    vacuum_state.deleted = hash_create("bm25 deleted rows", 1024, &ctl,
+                                       HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    vacuum_state.postings = palloc(BM25_BLOCK_SIZE * sizeof(Bm25PostingData));
+    vacuum_state.block = palloc(BM25_MAX_BLOCK_SIZE);
+
+    bm25_vacuum_dictionary(&vacuum_state, &meta);
+    bm25_vacuum_pending(&vacuum_state, &meta);
+
+    hash_seq_init(&status, vacuum_state.deleted);
+    while((deleted = (Bm25Deleted) hash_seq_search(&status)) != NULL){
+        removed_count++;
+        removed_length += deleted->length;
+    }
+    //the removed rows leave the statistics
+    if(removed_count > 0){
+        Buffer buf = ReadBufferExtended(index, MAIN_FORKNUM, BM25_METAPAGE_BLKNO, RBM_NORMAL, info->strategy);
+        GenericXLogState *state;
+        Bm25MetaPage meta_page;
+
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        state = GenericXLogStart(index);
+        meta_page = Bm25PageGetMeta(GenericXLogRegisterBuffer(state, buf, 0));
+        meta_page->doc_count -= Min(meta_page->doc_count, removed_count);
+        meta_page->total_length -= Min(meta_page->total_length, removed_length);
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(buf);
+    }
+    stats->tuples_removed += removed_count;
+
+    hash_destroy(vacuum_state.deleted);
+    pfree(vacuum_state.postings);
+    pfree(vacuum_state.block);
+    return stats;
+}
+
+IndexBulkDeleteResult *
+bm25_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats){
+    Bm25MetaPageData meta;
+
+    if(info->analyze_only){
+        return stats;
+    }
+    if(stats == NULL){
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+    }
+    //the pages the last merge replaced first, this merge can reuse them
+    bm25_recycle_pages(info->index, info->heaprel, stats);
+    bm25_merge_pending(info->index, info->strategy);
+
+    bm25_get_meta(info->index, &meta);
+    stats->num_pages = RelationGetNumberOfBlocks(info->index);
+    stats->num_index_tuples = (double) meta.doc_count;
+    return stats;
+}
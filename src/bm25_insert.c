@@ -0,0 +1,117 @@
+#include "bm25.h"
+#include "bm25_page.h"
+#include "utils/memutils.h"
+
+//start a wal record with the meta page and the pending page
+static void
+bm25_register_pending(
+    Relation index,
+    GenericXLogState **state,
+    Buffer meta_buf,
+    Page *meta_page,
+    Buffer buf,
+    Page *page,
+    bool new_page){
+    *state = GenericXLogStart(index);
+    *meta_page = GenericXLogRegisterBuffer(*state, meta_buf, 0);
+    *page = GenericXLogRegisterBuffer(*state, buf, new_page ? GENERIC_XLOG_FULL_IMAGE : 0);
+    if(new_page){
+        bm25_init_page(buf, *page, BM25_PAGE_PENDING);
+    }
+}
+
+/*
+ * rows inserted after the build go to the pending list, one entry per
+ * lexeme, and count in the statistics right away. the meta page lock
+ * serializes the inserts, VACUUM merges the list into the postings.
+ */
+bool
+bm25_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+    Relation heap, IndexUniqueCheck checkUnique
+    ,bool indexUnchanged
+    ,IndexInfo *indexInfo
+){
+    MemoryContext insert_ctx;
+    MemoryContext old_ctx;
+    TSVector vector;
+    WordEntry *entries;
+    uint32 length;
+    Bm25MetaPage meta;
+    GenericXLogState *state;
+    Buffer meta_buf;
+    Page meta_page;
+    Buffer buf;
+    Page page;
+    bool new_page;
+
+    if(isnull[0]){
+        return false;
+    }
+    insert_ctx = AllocSetContextCreate(
+        CurrentMemoryContext,
+        "bm25 insert temporary context",
+        ALLOCSET_DEFAULT_SIZES);
+    old_ctx = MemoryContextSwitchTo(insert_ctx);
+
+    vector = DatumGetTSVector(values[0]);
+    if(vector->size == 0){
+        MemoryContextSwitchTo(old_ctx);
+        MemoryContextDelete(insert_ctx);
+        return false;
+    }
+    entries = ARRPTR(vector);
+    length = bm25_document_length(vector);
+
+    meta_buf = ReadBuffer(index, BM25_METAPAGE_BLKNO);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+    meta = Bm25PageGetMeta(BufferGetPage(meta_buf));
+    new_page = !BlockNumberIsValid(meta->pending_insert_page);
+    if(new_page){
+        buf = bm25_new_buffer(index);
+    }else{
+        buf = ReadBuffer(index, meta->pending_insert_page);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    }
+    bm25_register_pending(index, &state, meta_buf, &meta_page, buf, &page, new_page);
+    meta = Bm25PageGetMeta(meta_page);
+    if(new_page){
+        meta->pending_start_page = BufferGetBlockNumber(buf);
+        meta->pending_insert_page = BufferGetBlockNumber(buf);
+    }
+
+    for(int i = 0; i < vector->size; i++){
+        Size size = BM25_PENDING_SIZE(entries[i].len);
+        Bm25Pending entry = palloc(size);
+
+        entry->tid = *heap_tid;
+        entry->tf = entries[i].haspos ? POSDATALEN(vector, &entries[i]) : 1;
+        entry->length = length;
+        entry->lexeme_length = entries[i].len;
+        memcpy(entry->lexeme, STRPTR(vector) + entries[i].pos, entries[i].len);
+
+        if(PageGetFreeSpace(page) < MAXALIGN(size)){
+            Buffer new_buf = bm25_new_buffer(index);
+
+            Bm25PageGetOpaque(page)->nextblkno = BufferGetBlockNumber(new_buf);
+            meta->pending_insert_page = BufferGetBlockNumber(new_buf);
+            GenericXLogFinish(state);
+            UnlockReleaseBuffer(buf);
+
+            buf = new_buf;
+            bm25_register_pending(index, &state, meta_buf, &meta_page, buf, &page, true);
+            meta = Bm25PageGetMeta(meta_page);
+        }
+        if(PageAddItem(page, (Item) entry, size, InvalidOffsetNumber, false, false) == InvalidOffsetNumber){
+            elog(ERROR, "failed to add item to \"%s\"", RelationGetRelationName(index));
+        }
+    }
+    meta->doc_count++;
+    meta->total_length += length;
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(buf);
+    UnlockReleaseBuffer(meta_buf);
+
+    MemoryContextSwitchTo(old_ctx);
+    MemoryContextDelete(insert_ctx);
+    return false;
+}
@@ -0,0 +1,288 @@
+#include "bm25_page.h"
+#include "ivfflat_page.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "storage/off.h"
+
+void
+bm25_init_page(Buffer buf, Page page, uint16 page_type){
+    PageInit(
+        page,
+        BufferGetPageSize(buf),
+        sizeof(Bm25PageOpaqueData));
+    Bm25PageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+    Bm25PageGetOpaque(page)->page_type = page_type;
+    Bm25PageGetOpaque(page)->page_id = BM25_PAGE_ID;
+}
+
+//like ivfflat_append_page: link a new page of the same type and continue there
+void
+bm25_append_page(
+    Relation index,
+    Buffer *buf,
+    Page *page,
+    GenericXLogState **state,
+    ForkNumber fork_num){
+    Buffer new_buf;
+    Page new_page;
+
+    new_buf = ivfflat_new_buffer(index, fork_num);
+    new_page = GenericXLogRegisterBuffer(*state, new_buf, GENERIC_XLOG_FULL_IMAGE);
+    Bm25PageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(new_buf);
+    bm25_init_page(new_buf, new_page, Bm25PageGetOpaque(*page)->page_type);
+
+    ivfflat_commit_xlog(*buf, *state);
+
+    *state = GenericXLogStart(index);
+    *page = GenericXLogRegisterBuffer(*state, new_buf, GENERIC_XLOG_FULL_IMAGE);
+    *buf = new_buf;
+}
+
+//a new page at the end of the index. the extension lock keeps the
+//dictionary that a merge writes contiguous
+Buffer
+bm25_new_buffer(Relation index){
+    Buffer buf;
+
+    LockRelationForExtension(index, ExclusiveLock);
+    buf = ivfflat_new_buffer(index, MAIN_FORKNUM);
+    UnlockRelationForExtension(index, ExclusiveLock);
+    return buf;
+}
+
+void
+bm25_get_meta(Relation index, Bm25MetaPage meta){
+    Buffer buf;
+    Page page;
+
+    buf = ReadBuffer(index, BM25_METAPAGE_BLKNO);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    memcpy(meta, Bm25PageGetMeta(page), sizeof(Bm25MetaPageData));
+    UnlockReleaseBuffer(buf);
+
+    if(meta->version != BM25_VERSION){
+        ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("bm25 index \"%s\" has version %u, expected %u",
+                RelationGetRelationName(index), meta->version, BM25_VERSION),
+             errhint("REINDEX the index.")));
+    }
+}
+
+//the order of the dictionary: bytes, then the shorter lexeme first. the
+//same as text in the "C" collation, which sorts the build
+int
+bm25_compare_lexemes(const char *a, int alen, const char *b, int blen){
+    int cmp = memcmp(a, b, Min(alen, blen));
+
+    if(cmp != 0){
+        return cmp;
+    }
+    return alen - blen;
+}
+
+static char *
+bm25_encode_varbyte(char *ptr, uint64 value){
+    while(value >= 0x80){
+        *ptr++ = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *ptr++ = (char) value;
+    return ptr;
+}
+
+static const char *
+bm25_decode_varbyte(const char *ptr, uint64 *value){
+    uint64 result = 0;
+    int shift = 0;
+    uint8 byte;
+
+    do{
+        byte = (uint8) *ptr++;
+        result |= ((uint64) (byte & 0x7F)) << shift;
+        shift += 7;
+    }while(byte & 0x80);
+    *value = result;
+    return ptr;
+}
+
+static inline uint64
+bm25_tid_key(ItemPointer tid){
+    return ((uint64) ItemPointerGetBlockNumberNoCheck(tid) << 16) |
+        ItemPointerGetOffsetNumberNoCheck(tid);
+}
+
+//encode the postings, sorted by tid, into block. returns the block size
+int
+bm25_encode_block(Bm25Posting postings, int count, Bm25Block block){
+    char *ptr = block->data;
+    uint64 prev = 0;
+
+    Assert(count > 0 && count <= BM25_BLOCK_SIZE);
+    block->count = count;
+    block->max_tf = 0;
+    block->min_length = PG_UINT32_MAX;
+    for(int i = 0; i < count; i++){
+        uint64 key = bm25_tid_key(&postings[i].tid);
+
+        ptr = bm25_encode_varbyte(ptr, key - prev);
+        ptr = bm25_encode_varbyte(ptr, postings[i].tf);
+        ptr = bm25_encode_varbyte(ptr, postings[i].length);
+        prev = key;
+        block->max_tf = Max(block->max_tf, postings[i].tf);
+        block->min_length = Min(block->min_length, postings[i].length);
+    }
+    block->last_tid = postings[count - 1].tid;
+    block->data_size = ptr - block->data;
+    return BM25_BLOCK_HEADER_SIZE + block->data_size;
+}
+
+int
+bm25_decode_block(Bm25Block block, Bm25Posting postings){
+    const char *ptr = block->data;
+    uint64 key = 0;
+    uint64 value;
+
+    for(int i = 0; i < block->count; i++){
+        ptr = bm25_decode_varbyte(ptr, &value);
+        key += value;
+        ItemPointerSet(&postings[i].tid, (BlockNumber) (key >> 16), (OffsetNumber) (key & 0xFFFF));
+        ptr = bm25_decode_varbyte(ptr, &value);
+        postings[i].tf = (uint32) value;
+        ptr = bm25_decode_varbyte(ptr, &value);
+        postings[i].length = (uint32) value;
+    }
+    return block->count;
+}
+
+static int
+bm25_compare_term(Bm25QueryTerm term, Page page, OffsetNumber offset){
+    Bm25Term entry = (Bm25Term) PageGetItem(page, PageGetItemId(page, offset));
+
+    return bm25_compare_lexemes(term->lexeme, term->length, entry->lexeme, entry->length);
+}
+
+//binary search the dictionary pages for the lexeme of term and fill in
+//its statistics. returns false when the lexeme is not in the dictionary
+bool
+bm25_find_term(Relation index, Bm25MetaPage meta, Bm25QueryTerm term){
+    int low = 0;
+    int high = (int) meta->dict_page_count - 1;
+    int found_page = -1;
+    Buffer buf;
+    Page page;
+    bool found = false;
+
+    term->doc_freq = 0;
+    //the last page whose first lexeme is not after the searched one
+    while(low <= high){
+        int mid = low + (high - low) / 2;
+        int cmp;
+
+        buf = ReadBuffer(index, meta->dict_start_page + mid);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        cmp = bm25_compare_term(term, page, FirstOffsetNumber);
+        UnlockReleaseBuffer(buf);
+        if(cmp < 0){
+            high = mid - 1;
+        }else{
+            found_page = mid;
+            low = mid + 1;
+        }
+    }
+    if(found_page < 0){
+        return false;
+    }
+
+    buf = ReadBuffer(index, meta->dict_start_page + found_page);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    low = FirstOffsetNumber;
+    high = PageGetMaxOffsetNumber(page);
+    while(low <= high){
+        int mid = low + (high - low) / 2;
+        int cmp = bm25_compare_term(term, page, (OffsetNumber) mid);
+
+        if(cmp == 0){
+            Bm25Term entry = (Bm25Term) PageGetItem(page, PageGetItemId(page, (OffsetNumber) mid));
+
+            term->doc_freq = entry->doc_freq;
+            term->max_tf = entry->max_tf;
+            term->min_length = entry->min_length;
+            term->block_count = entry->block_count;
+            term->start_page = entry->start_page;
+            term->start_offset = entry->start_offset;
+            found = true;
+            break;
+        }
+        if(cmp < 0){
+            high = mid - 1;
+        }else{
+            low = mid + 1;
+        }
+    }
+    UnlockReleaseBuffer(buf);
+    return found;
+}
+
+//count the pending entries of the query lexemes. when matches is set, also
+//collect the entries, so that the rows in the pending list can be scored
+void
+bm25_scan_pending(
+    Relation index,
+    Bm25MetaPage meta,
+    Bm25Query query,
+    Bm25PendingMatch *matches,
+    int *match_count){
+    BlockNumber blkno = meta->pending_start_page;
+    int capacity = 0;
+
+    if(matches != NULL){
+        *matches = NULL;
+        *match_count = 0;
+    }
+    while(BlockNumberIsValid(blkno)){
+        Buffer buf = ReadBuffer(index, blkno);
+        Page page;
+        OffsetNumber max_offset;
+
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(OffsetNumber offset = FirstOffsetNumber;
+            offset <= max_offset;
+            offset = OffsetNumberNext(offset)){
+            Bm25Pending entry = (Bm25Pending) PageGetItem(page, PageGetItemId(page, offset));
+
+            for(int i = 0; i < query->term_count; i++){
+                Bm25QueryTerm term = &query->terms[i];
+                Bm25PendingMatch match;
+
+                if(bm25_compare_lexemes(term->lexeme, term->length,
+                                        entry->lexeme, entry->lexeme_length) != 0){
+                    continue;
+                }
+                term->pending_freq++;
+                if(matches == NULL){
+                    break;
+                }
+                if(*match_count == capacity){
+                    capacity = Max(capacity * 2, 64);
+                    *matches = *matches == NULL ?
+                        palloc(capacity * sizeof(Bm25PendingMatchData)) :
+                        repalloc(*matches, capacity * sizeof(Bm25PendingMatchData));
+                }
+                match = &(*matches)[(*match_count)++];
+                match->tid = entry->tid;
+                match->term = i;
+                match->tf = entry->tf;
+                match->length = entry->length;
+                break;
+            }
+        }
+        blkno = Bm25PageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef BM25_PAGE_H
+#define BM25_PAGE_H
+
+#include "postgres.h"
+#include "bm25.h"
+#include "access/generic_xlog.h"
+#include "access/transam.h"
+#include "storage/block.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "storage/itemptr.h"
+#include "utils/rel.h"
+
+#define BM25_METAPAGE_BLKNO 0
+
+/*
+ * layout: the meta page, the posting pages, then the dictionary pages.
+ * the build writes the dictionary last so that its pages are contiguous
+ * and sorted, lookups binary search them. rows inserted after the build
+ * go to the pending list until VACUUM merges it: the merge writes the
+ * postings and the dictionary again and switches the meta page to them.
+ * the old pages are reused once no scan can still read them.
+ */
+typedef struct Bm25MetaPageData {
+    uint32 version;
+    uint32 term_count;
+    //rows with at least one lexeme and the sum of their lengths
+    uint64 doc_count;
+    uint64 total_length;
+    BlockNumber posting_start_page;
+    BlockNumber dict_start_page;
+    BlockNumber dict_page_count;
+    //pending list, created on first insert
+    BlockNumber pending_start_page;
+    BlockNumber pending_insert_page;
+    //next xid at the last merge, the pages it replaced are free after it
+    FullTransactionId merge_xid;
+} Bm25MetaPageData;
+
+typedef Bm25MetaPageData * Bm25MetaPage;
+
+#define BM25_PAGE_META    0
+#define BM25_PAGE_POSTING 1
+#define BM25_PAGE_DICT    2
+#define BM25_PAGE_PENDING 3
+
+//same layout as IvfflatPageOpaqueData
+typedef struct Bm25PageOpaqueData {
+    BlockNumber nextblkno;
+    uint16 page_type;
+    uint16 page_id;
+} Bm25PageOpaqueData;
+
+typedef Bm25PageOpaqueData * Bm25PageOpaque;
+
+#define Bm25PageGetMeta(page)   ((Bm25MetaPage) PageGetContents(page))
+#define Bm25PageGetOpaque(page) ((Bm25PageOpaque) PageGetSpecialPointer(page))
+
+/*
+ * dictionary entry. the blocks of a lexeme are block_count consecutive
+ * items from (start_page, start_offset), following nextblkno. max_tf and
+ * min_length bound the score of the lexeme in any row.
+ */
+typedef struct Bm25TermData {
+    uint32 doc_freq;
+    uint32 max_tf;
+    uint32 min_length;
+    uint32 block_count;
+    BlockNumber start_page;
+    OffsetNumber start_offset;
+    uint16 length;
+    char lexeme[FLEXIBLE_ARRAY_MEMBER];
+} Bm25TermData;
+
+typedef Bm25TermData * Bm25Term;
+
+#define BM25_TERM_SIZE(length) (offsetof(Bm25TermData, lexeme) + (length))
+
+/*
+ * posting block: up to BM25_BLOCK_SIZE rows sorted by heap tid. data holds
+ * per row the varbyte delta of the tid, the term frequency and the row
+ * length. vacuum removes rows in place and keeps the bounds.
+ */
+typedef struct Bm25BlockData {
+    ItemPointerData last_tid;
+    uint16 count;
+    uint16 data_size;
+    uint32 max_tf;
+    uint32 min_length;
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} Bm25BlockData;
+
+typedef Bm25BlockData * Bm25Block;
+
+#define BM25_BLOCK_HEADER_SIZE offsetof(Bm25BlockData, data)
+//a 48 bit tid delta takes at most 7 bytes, tf and length 5 each
+#define BM25_MAX_BLOCK_SIZE (BM25_BLOCK_HEADER_SIZE + BM25_BLOCK_SIZE * 17)
+
+typedef struct Bm25PostingData {
+    ItemPointerData tid;
+    uint32 tf;
+    uint32 length;
+} Bm25PostingData;
+
+typedef Bm25PostingData * Bm25Posting;
+
+//pending list entry, one per lexeme of an inserted row
+typedef struct Bm25PendingData {
+    ItemPointerData tid;
+    uint32 tf;
+    uint32 length;
+    uint16 lexeme_length;
+    char lexeme[FLEXIBLE_ARRAY_MEMBER];
+} Bm25PendingData;
+
+typedef Bm25PendingData * Bm25Pending;
+
+#define BM25_PENDING_SIZE(length) (offsetof(Bm25PendingData, lexeme) + (length))
+
+void
+bm25_init_page(Buffer buf, Page page, uint16 page_type);
+
+void
+bm25_append_page(
+    Relation index,
+    Buffer *buf,
+    Page *page,
+    GenericXLogState **state,
+    ForkNumber fork_num);
+
+Buffer
+bm25_new_buffer(Relation index);
+
+void
+bm25_get_meta(Relation index, Bm25MetaPage meta);
+
+int
+bm25_compare_lexemes(const char *a, int alen, const char *b, int blen);
+
+int
+bm25_encode_block(Bm25Posting postings, int count, Bm25Block block);
+
+int
+bm25_decode_block(Bm25Block block, Bm25Posting postings);
+
+bool
+bm25_find_term(Relation index, Bm25MetaPage meta, Bm25QueryTerm term);
+
+void
+bm25_scan_pending(
+    Relation index,
+    Bm25MetaPage meta,
+    Bm25Query query,
+    Bm25PendingMatch *matches,
+    int *match_count);
+
+#endif
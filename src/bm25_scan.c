@@ -0,0 +1,663 @@
+#include "bm25_scan.h"
+#include "access/genam.h"
+#include "access/relscan.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+#include "tsearch/ts_utils.h"
+#include <float.h>
+
+IndexScanDesc
+bm25_beginscan(Relation index, int nkeys, int norderbys){
+    IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
+    Bm25ScanOpaque scan_opaque = palloc0(sizeof(Bm25ScanOpaqueData));
+
+    scan_opaque->first = true;
+    scan_opaque->scan_ctx = AllocSetContextCreate(
+        CurrentMemoryContext,
+        "bm25 scan context",
+        ALLOCSET_DEFAULT_SIZES);
+    scan->xs_orderbyvals = palloc0(sizeof(Datum) * Max(norderbys, 1));
+    scan->xs_orderbynulls = palloc(sizeof(bool) * Max(norderbys, 1));
+    memset(scan->xs_orderbynulls, true, sizeof(bool) * Max(norderbys, 1));
+    scan->opaque = scan_opaque;
+    return scan;
+}
+
+void
+bm25_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+
+    if(keys && scan->numberOfKeys > 0){
+        memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+    }
+    if(orderbys && scan->numberOfOrderBys > 0){
+        memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+    }
+    MemoryContextReset(scan_opaque->scan_ctx);
+    scan_opaque->first = true;
+}
+
+void
+bm25_endscan(IndexScanDesc scan){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+
+    MemoryContextDelete(scan_opaque->scan_ctx);
+    pfree(scan_opaque);
+    scan->opaque = NULL;
+}
+
+static inline bool
+bm25_result_better(Bm25Result a, Bm25Result b){
+    if(a->score != b->score){
+        return a->score > b->score;
+    }
+    return ItemPointerCompare(&a->tid, &b->tid) < 0;
+}
+
+static int
+bm25_compare_results(const void *a, const void *b){
+    if(bm25_result_better((Bm25Result) a, (Bm25Result) b)){
+        return -1;
+    }
+    if(bm25_result_better((Bm25Result) b, (Bm25Result) a)){
+        return 1;
+    }
+    return 0;
+}
+
+//keep the batch_size best rows, the worst of them on top of the heap
+void
+bm25_offer_result(Bm25ScanOpaque scan_opaque, ItemPointer tid, double score){
+    Bm25Result heap = scan_opaque->heap;
+    Bm25ResultData result;
+    int i;
+
+    result.tid = *tid;
+    result.score = score;
+    if(scan_opaque->heap_count < scan_opaque->batch_size){
+        i = scan_opaque->heap_count++;
+        while(i > 0){
+            int parent = (i - 1) / 2;
+
+            if(!bm25_result_better(&heap[parent], &result)){
+                break;
+            }
+            heap[i] = heap[parent];
+            i = parent;
+        }
+        heap[i] = result;
+        return;
+    }
+    if(!bm25_result_better(&result, &heap[0])){
+        return;
+    }
+    i = 0;
+    for(;;){
+        int child = 2 * i + 1;
+
+        if(child >= scan_opaque->heap_count){
+            break;
+        }
+        if(child + 1 < scan_opaque->heap_count &&
+            bm25_result_better(&heap[child], &heap[child + 1])){
+            child++;
+        }
+        if(!bm25_result_better(&result, &heap[child])){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = result;
+}
+
+//score of the worst row kept, rows that cannot reach it are skipped
+static inline double
+bm25_threshold(Bm25ScanOpaque scan_opaque){
+    if(scan_opaque->heap_count < scan_opaque->batch_size){
+        return -DBL_MAX;
+    }
+    return scan_opaque->heap[0].score;
+}
+
+//copy the next block of the lexeme, without decoding it
+static bool
+bm25_cursor_read_block(Relation index, Bm25Query query, Bm25Cursor cursor){
+    while(cursor->blocks_left > 0 && BlockNumberIsValid(cursor->page)){
+        Buffer buf = ReadBuffer(index, cursor->page);
+        Page page;
+        ItemId itemid;
+
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        if(cursor->offset > PageGetMaxOffsetNumber(page)){
+            cursor->page = Bm25PageGetOpaque(page)->nextblkno;
+            cursor->offset = FirstOffsetNumber;
+            UnlockReleaseBuffer(buf);
+            continue;
+        }
+        itemid = PageGetItemId(page, cursor->offset);
+        memcpy(cursor->block, PageGetItem(page, itemid), ItemIdGetLength(itemid));
+        UnlockReleaseBuffer(buf);
+
+        cursor->offset = OffsetNumberNext(cursor->offset);
+        cursor->blocks_left--;
+        cursor->has_block = true;
+        cursor->decoded = false;
+        cursor->block_max = bm25_term_score(
+            query,
+            cursor->term->idf,
+            cursor->block->max_tf,
+            cursor->block->min_length);
+        return true;
+    }
+    cursor->has_block = false;
+    cursor->exhausted = true;
+    return false;
+}
+
+void
+bm25_init_cursor(Relation index, Bm25Query query, int term_no, Bm25Cursor cursor){
+    Bm25QueryTerm term = &query->terms[term_no];
+
+    cursor->term = term;
+    cursor->term_no = term_no;
+    cursor->max_score = bm25_term_score(query, term->idf, term->max_tf, term->min_length);
+    cursor->page = term->start_page;
+    cursor->offset = term->start_offset;
+    cursor->blocks_left = term->block_count;
+    cursor->has_block = false;
+    cursor->exhausted = false;
+    ItemPointerSet(&cursor->doc, 0, FirstOffsetNumber);
+    if(bm25_cursor_read_block(index, query, cursor)){
+        bm25_cursor_next_geq(index, query, cursor, &cursor->doc);
+    }
+}
+
+//move to the first block that may hold target, without decoding
+void
+bm25_cursor_shallow(Relation index, Bm25Query query, Bm25Cursor cursor, ItemPointer target){
+    while(cursor->has_block &&
+        (cursor->block->count == 0 || ItemPointerCompare(&cursor->block->last_tid, target) < 0)){
+        bm25_cursor_read_block(index, query, cursor);
+    }
+}
+
+//move to the first row at or after target
+void
+bm25_cursor_next_geq(Relation index, Bm25Query query, Bm25Cursor cursor, ItemPointer target){
+    ItemPointerData goal = *target;
+
+    for(;;){
+        bm25_cursor_shallow(index, query, cursor, &goal);
+        if(!cursor->has_block){
+            return;
+        }
+        if(!cursor->decoded){
+            cursor->count = bm25_decode_block(cursor->block, cursor->postings);
+            cursor->pos = 0;
+            cursor->decoded = true;
+        }
+        while(cursor->pos < cursor->count &&
+            ItemPointerCompare(&cursor->postings[cursor->pos].tid, &goal) < 0){
+            cursor->pos++;
+        }
+        if(cursor->pos < cursor->count){
+            cursor->doc = cursor->postings[cursor->pos].tid;
+            return;
+        }
+        if(!bm25_cursor_read_block(index, query, cursor)){
+            return;
+        }
+    }
+}
+
+static void
+bm25_tid_successor(ItemPointer tid, ItemPointer next){
+    ItemPointerSet(next,
+                   ItemPointerGetBlockNumberNoCheck(tid),
+                   ItemPointerGetOffsetNumberNoCheck(tid) + 1);
+}
+
+static int
+bm25_compare_matches(const void *a, const void *b){
+    Bm25PendingMatch ma = (Bm25PendingMatch) a;
+    Bm25PendingMatch mb = (Bm25PendingMatch) b;
+    int cmp = ItemPointerCompare(&ma->tid, &mb->tid);
+
+    if(cmp != 0){
+        return cmp;
+    }
+    return ma->term - mb->term;
+}
+
+//sum the scores of a row in query term order, as bm25_document_score does
+static double
+bm25_sum_term_scores(Bm25ScanOpaque scan_opaque){
+    double score = 0;
+
+    for(int i = 0; i < scan_opaque->query->term_count; i++){
+        score += scan_opaque->term_scores[i];
+    }
+    return score;
+}
+
+//the rows in the pending list are few, they are all scored
+void
+bm25_score_pending(Bm25ScanOpaque scan_opaque){
+    Bm25Query query = scan_opaque->query;
+    int i = 0;
+
+    while(i < scan_opaque->match_count){
+        ItemPointerData tid = scan_opaque->matches[i].tid;
+
+        memset(scan_opaque->term_scores, 0, query->term_count * sizeof(double));
+        for(; i < scan_opaque->match_count &&
+              ItemPointerEquals(&scan_opaque->matches[i].tid, &tid); i++){
+            Bm25PendingMatch match = &scan_opaque->matches[i];
+
+            scan_opaque->term_scores[match->term] = bm25_term_score(
+                query,
+                query->terms[match->term].idf,
+                match->tf,
+                match->length);
+        }
+        bm25_offer_result(scan_opaque, &tid, bm25_sum_term_scores(scan_opaque));
+    }
+}
+
+static void
+bm25_sort_cursors(Bm25Cursor *cursors, int count){
+    for(int i = 1; i < count; i++){
+        Bm25Cursor cursor = cursors[i];
+        int j = i - 1;
+
+        while(j >= 0 && (cursors[j]->exhausted ||
+            (!cursor->exhausted && ItemPointerCompare(&cursors[j]->doc, &cursor->doc) > 0))){
+            cursors[j + 1] = cursors[j];
+            j--;
+        }
+        cursors[j + 1] = cursor;
+    }
+}
+
+/*
+ * one pass of block-max wand. the cursors are ordered by their current
+ * row, the pivot is the first cursor where the lexeme bounds reach the
+ * threshold: no earlier row can make it into the heap. the block bounds
+ * of the cursors up to the pivot then decide whether the pivot row is
+ * scored, or all of them skip to the end of the nearest block.
+ */
+void
+bm25_rank(IndexScanDesc scan){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+    Relation index = scan->indexRelation;
+    Bm25Query query = scan_opaque->query;
+    Bm25Cursor *cursors;
+    int count = 0;
+
+    scan_opaque->heap_count = 0;
+    bm25_score_pending(scan_opaque);
+
+    cursors = palloc(Max(query->term_count, 1) * sizeof(Bm25Cursor));
+    for(int i = 0; i < query->term_count; i++){
+        if(query->terms[i].doc_freq == 0 || query->terms[i].block_count == 0){
+            continue;
+        }
+        bm25_init_cursor(index, query, i, &scan_opaque->cursors[count]);
+        cursors[count] = &scan_opaque->cursors[count];
+        count++;
+    }
+
+    for(;;){
+        double threshold = bm25_threshold(scan_opaque);
+        double bound = 0;
+        int pivot = -1;
+        ItemPointerData doc;
+
+        CHECK_FOR_INTERRUPTS();
+        bm25_sort_cursors(cursors, count);
+        for(int i = 0; i < count && !cursors[i]->exhausted; i++){
+            bound += cursors[i]->max_score;
+            if(bound + BM25_SCORE_SLACK >= threshold){
+                pivot = i;
+                break;
+            }
+        }
+        if(pivot < 0){
+            break;
+        }
+        doc = cursors[pivot]->doc;
+        while(pivot + 1 < count && !cursors[pivot + 1]->exhausted &&
+            ItemPointerEquals(&cursors[pivot + 1]->doc, &doc)){
+            pivot++;
+        }
+
+        bound = 0;
+        for(int i = 0; i <= pivot; i++){
+            bm25_cursor_shallow(index, query, cursors[i], &doc);
+            if(cursors[i]->has_block){
+                bound += cursors[i]->block_max;
+            }
+        }
+
+        if(bound + BM25_SCORE_SLACK >= threshold){
+            if(ItemPointerEquals(&cursors[0]->doc, &doc)){
+                ItemPointerData next;
+                double length = 0;
+
+                memset(scan_opaque->term_scores, 0, query->term_count * sizeof(double));
+                for(int i = 0; i <= pivot; i++){
+                    Bm25Posting posting = &cursors[i]->postings[cursors[i]->pos];
+
+                    length = posting->length;
+                    scan_opaque->term_scores[cursors[i]->term_no] = bm25_term_score(
+                        query, cursors[i]->term->idf, posting->tf, length);
+                }
+                bm25_offer_result(scan_opaque, &doc, bm25_sum_term_scores(scan_opaque));
+
+                bm25_tid_successor(&doc, &next);
+                for(int i = 0; i <= pivot; i++){
+                    bm25_cursor_next_geq(index, query, cursors[i], &next);
+                }
+            }else{
+                for(int i = 0; i < pivot; i++){
+                    if(!cursors[i]->exhausted && ItemPointerCompare(&cursors[i]->doc, &doc) < 0){
+                        bm25_cursor_next_geq(index, query, cursors[i], &doc);
+                    }
+                }
+            }
+        }else{
+            //no row up to the end of the nearest block can make it
+            ItemPointerData next;
+            bool has_next = false;
+
+            for(int i = 0; i <= pivot; i++){
+                ItemPointerData block_next;
+
+                if(!cursors[i]->has_block){
+                    continue;
+                }
+                bm25_tid_successor(&cursors[i]->block->last_tid, &block_next);
+                if(!has_next || ItemPointerCompare(&block_next, &next) < 0){
+                    next = block_next;
+                    has_next = true;
+                }
+            }
+            if(pivot + 1 < count && !cursors[pivot + 1]->exhausted &&
+                (!has_next || ItemPointerCompare(&cursors[pivot + 1]->doc, &next) < 0)){
+                next = cursors[pivot + 1]->doc;
+                has_next = true;
+            }
+            for(int i = 0; i <= pivot; i++){
+                if(!has_next){
+                    cursors[i]->exhausted = true;
+                }else if(!cursors[i]->exhausted && ItemPointerCompare(&cursors[i]->doc, &next) < 0){
+                    bm25_cursor_next_geq(index, query, cursors[i], &next);
+                }
+            }
+        }
+    }
+    pfree(cursors);
+
+    //best first
+    memcpy(scan_opaque->results, scan_opaque->heap, scan_opaque->heap_count * sizeof(Bm25ResultData));
+    scan_opaque->result_count = scan_opaque->heap_count;
+    qsort(scan_opaque->results, scan_opaque->result_count, sizeof(Bm25ResultData), bm25_compare_results);
+    scan_opaque->done = scan_opaque->result_count < scan_opaque->batch_size;
+}
+
+static void
+bm25_begin_batch(IndexScanDesc scan, int batch_size){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+
+    if(scan_opaque->heap != NULL){
+        pfree(scan_opaque->heap);
+        pfree(scan_opaque->results);
+    }
+    scan_opaque->batch_size = batch_size;
+    scan_opaque->heap = palloc(batch_size * sizeof(Bm25ResultData));
+    scan_opaque->results = palloc(batch_size * sizeof(Bm25ResultData));
+    bm25_rank(scan);
+    //rows returned by the previous passes come first
+    scan_opaque->result_index = scan_opaque->returned;
+}
+
+static int
+bm25_compare_result_tids(const void *a, const void *b){
+    return ItemPointerCompare(&((Bm25Result) a)->tid, &((Bm25Result) b)->tid);
+}
+
+//the @@ qual whose rows all hold one of its lexemes. false when a qual
+//is null or empty, no row matches then
+static bool
+bm25_choose_filter(IndexScanDesc scan){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+
+    for(int i = 0; i < scan->numberOfKeys; i++){
+        ScanKey key = &scan->keyData[i];
+        TSQuery query;
+
+        if(key->sk_flags & SK_ISNULL){
+            return false;
+        }
+        query = DatumGetTSQuery(key->sk_argument);
+        if(query->size == 0){
+            return false;
+        }
+        if(scan_opaque->filter_query == NULL && tsquery_requires_match(GETQUERY(query))){
+            scan_opaque->filter_query = query;
+        }
+    }
+    if(scan_opaque->filter_query == NULL){
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pg_hybrid_bm25 needs a tsquery that only matches rows with one of its lexemes")));
+    }
+    return true;
+}
+
+//after the ranked rows: cursors over all the lexemes of the @@ qual
+static void
+bm25_begin_filter(IndexScanDesc scan){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+    Relation index = scan->indexRelation;
+    Bm25Query filter;
+    int count = 0;
+
+    scan_opaque->filtering = true;
+    scan_opaque->scored_count = scan_opaque->result_count;
+    scan_opaque->scored = palloc(Max(scan_opaque->result_count, 1) * sizeof(Bm25ResultData));
+    if(scan_opaque->result_count > 0){
+        memcpy(scan_opaque->scored, scan_opaque->results,
+               scan_opaque->result_count * sizeof(Bm25ResultData));
+        qsort(scan_opaque->scored, scan_opaque->scored_count,
+              sizeof(Bm25ResultData), bm25_compare_result_tids);
+    }
+
+    filter = bm25_prepare_filter(
+        index,
+        scan_opaque->filter_query,
+        &scan_opaque->filter_matches,
+        &scan_opaque->filter_match_count);
+    if(scan_opaque->filter_match_count > 1){
+        qsort(scan_opaque->filter_matches, scan_opaque->filter_match_count,
+              sizeof(Bm25PendingMatchData), bm25_compare_matches);
+    }
+    scan_opaque->filter = filter;
+    scan_opaque->filter_match_index = 0;
+    scan_opaque->filter_cursors = palloc0(Max(filter->term_count, 1) * sizeof(Bm25CursorData));
+    for(int i = 0; i < filter->term_count; i++){
+        Bm25Cursor cursor = &scan_opaque->filter_cursors[count];
+
+        if(filter->terms[i].doc_freq == 0 || filter->terms[i].block_count == 0){
+            continue;
+        }
+        cursor->block = palloc(BM25_MAX_BLOCK_SIZE);
+        cursor->postings = palloc(BM25_BLOCK_SIZE * sizeof(Bm25PostingData));
+        bm25_init_cursor(index, filter, i, cursor);
+        count++;
+    }
+    scan_opaque->filter_cursor_count = count;
+}
+
+//the next row of the @@ qual lexemes, in heap tid order, that was not ranked
+static bool
+bm25_next_filtered(IndexScanDesc scan, ItemPointer tid){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+    Relation index = scan->indexRelation;
+
+    for(;;){
+        ItemPointerData doc;
+        ItemPointerData next;
+        bool has_doc = false;
+
+        CHECK_FOR_INTERRUPTS();
+        for(int i = 0; i < scan_opaque->filter_cursor_count; i++){
+            Bm25Cursor cursor = &scan_opaque->filter_cursors[i];
+
+            if(!cursor->exhausted && (!has_doc || ItemPointerCompare(&cursor->doc, &doc) < 0)){
+                doc = cursor->doc;
+                has_doc = true;
+            }
+        }
+        if(scan_opaque->filter_match_index < scan_opaque->filter_match_count){
+            Bm25PendingMatch match = &scan_opaque->filter_matches[scan_opaque->filter_match_index];
+
+            if(!has_doc || ItemPointerCompare(&match->tid, &doc) < 0){
+                doc = match->tid;
+                has_doc = true;
+            }
+        }
+        if(!has_doc){
+            return false;
+        }
+
+        bm25_tid_successor(&doc, &next);
+        for(int i = 0; i < scan_opaque->filter_cursor_count; i++){
+            Bm25Cursor cursor = &scan_opaque->filter_cursors[i];
+
+            if(!cursor->exhausted && ItemPointerEquals(&cursor->doc, &doc)){
+                bm25_cursor_next_geq(index, scan_opaque->filter, cursor, &next);
+            }
+        }
+        while(scan_opaque->filter_match_index < scan_opaque->filter_match_count &&
+            ItemPointerEquals(&scan_opaque->filter_matches[scan_opaque->filter_match_index].tid, &doc)){
+            scan_opaque->filter_match_index++;
+        }
+
+        if(scan_opaque->scored_count > 0){
+            Bm25ResultData key;
+
+            key.tid = doc;
+            if(bsearch(&key, scan_opaque->scored, scan_opaque->scored_count,
+                       sizeof(Bm25ResultData), bm25_compare_result_tids) != NULL){
+                continue;
+            }
+        }
+        *tid = doc;
+        return true;
+    }
+}
+
+static void
+bm25_begin_scan(IndexScanDesc scan){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+    Relation index = scan->indexRelation;
+    Oid indexoid;
+    TSQuery query;
+
+    scan_opaque->heap = NULL;
+    scan_opaque->results = NULL;
+    scan_opaque->returned = 0;
+    scan_opaque->result_count = 0;
+    scan_opaque->result_index = 0;
+    scan_opaque->done = true;
+    scan_opaque->filter_query = NULL;
+    scan_opaque->filtering = false;
+    scan_opaque->scored_count = 0;
+    if(!bm25_choose_filter(scan)){
+        scan_opaque->filter_query = NULL;
+        return;
+    }
+    //a null bm25query scores every row null, they all follow unranked
+    if(scan->numberOfOrderBys == 0 || (scan->orderByData[0].sk_flags & SK_ISNULL)){
+        return;
+    }
+    query = bm25_get_query(scan->orderByData[0].sk_argument, &indexoid);
+    if(indexoid != RelationGetRelid(index)){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("bm25query names another index than \"%s\"",
+                        RelationGetRelationName(index))));
+    }
+
+    scan_opaque->query = bm25_prepare_query(
+        index,
+        query,
+        &scan_opaque->matches,
+        &scan_opaque->match_count);
+    if(scan_opaque->match_count > 1){
+        qsort(scan_opaque->matches, scan_opaque->match_count,
+              sizeof(Bm25PendingMatchData), bm25_compare_matches);
+    }
+    scan_opaque->term_scores = palloc0(Max(scan_opaque->query->term_count, 1) * sizeof(double));
+    scan_opaque->cursors = palloc0(Max(scan_opaque->query->term_count, 1) * sizeof(Bm25CursorData));
+    for(int i = 0; i < scan_opaque->query->term_count; i++){
+        scan_opaque->cursors[i].block = palloc(BM25_MAX_BLOCK_SIZE);
+        scan_opaque->cursors[i].postings = palloc(BM25_BLOCK_SIZE * sizeof(Bm25PostingData));
+    }
+    bm25_begin_batch(scan, BM25_INITIAL_BATCH);
+}
+
+bool
+bm25_gettuple(IndexScanDesc scan, ScanDirection dir){
+    Bm25ScanOpaque scan_opaque = (Bm25ScanOpaque) scan->opaque;
+    MemoryContext old_ctx;
+
+    Assert(ScanDirectionIsForward(dir));
+    old_ctx = MemoryContextSwitchTo(scan_opaque->scan_ctx);
+    if(scan_opaque->first){
+        bm25_begin_scan(scan);
+        scan_opaque->first = false;
+    }
+    for(;;){
+        if(scan_opaque->result_index < scan_opaque->result_count){
+            Bm25Result result = &scan_opaque->results[scan_opaque->result_index++];
+
+            scan_opaque->returned++;
+            scan->xs_heaptid = result->tid;
+            scan->xs_recheck = true;
+            scan->xs_recheckorderby = false;
+            scan->xs_orderbyvals[0] = Float8GetDatum(-result->score);
+            scan->xs_orderbynulls[0] = false;
+            MemoryContextSwitchTo(old_ctx);
+            return true;
+        }
+        if(scan_opaque->done){
+            ItemPointerData tid;
+
+            if(scan_opaque->filter_query == NULL){
+                break;
+            }
+            if(!scan_opaque->filtering){
+                bm25_begin_filter(scan);
+            }
+            if(!bm25_next_filtered(scan, &tid)){
+                break;
+            }
+            scan->xs_heaptid = tid;
+            scan->xs_recheck = true;
+            scan->xs_recheckorderby = false;
+            scan->xs_orderbyvals[0] = Float8GetDatum(-0.0);
+            scan->xs_orderbynulls[0] = scan->numberOfOrderBys == 0 ||
+                (scan->orderByData[0].sk_flags & SK_ISNULL) != 0;
+            MemoryContextSwitchTo(old_ctx);
+            return true;
+        }
+        bm25_begin_batch(scan, scan_opaque->batch_size * 2);
+    }
+    MemoryContextSwitchTo(old_ctx);
+    return false;
+}
@@ -0,0 +1,111 @@
+#ifndef BM25_SCAN_H
+#define BM25_SCAN_H
+
+#include "bm25.h"
+#include "bm25_page.h"
+#include "access/relscan.h"
+
+//position of a scan in the posting list of one query lexeme
+typedef struct Bm25CursorData {
+    Bm25QueryTerm term;
+    int term_no;
+    //bound of the lexeme in any row, and in the rows of the current block
+    double max_score;
+    double block_max;
+    //next block to read
+    BlockNumber page;
+    OffsetNumber offset;
+    uint32 blocks_left;
+    //current block, decoded on demand
+    Bm25Block block;
+    bool has_block;
+    bool decoded;
+    Bm25Posting postings;
+    int count;
+    int pos;
+    //current row, valid unless exhausted
+    ItemPointerData doc;
+    bool exhausted;
+} Bm25CursorData;
+
+typedef Bm25CursorData * Bm25Cursor;
+
+typedef struct Bm25ResultData {
+    ItemPointerData tid;
+    double score;
+} Bm25ResultData;
+
+typedef Bm25ResultData * Bm25Result;
+
+/*
+ * the am does not know the limit of the query. each pass ranks the best
+ * batch_size rows with block-max wand, and a scan that needs more rows
+ * runs the next pass with twice the batch size. rows are ordered by
+ * score, then by heap tid, so every pass starts with the rows of the
+ * previous one, which are skipped.
+ */
+typedef struct Bm25ScanOpaqueData {
+    bool first;
+    Bm25Query query;
+    Bm25PendingMatch matches;
+    int match_count;
+    Bm25Cursor cursors;
+    int cursor_count;
+    //score of each query lexeme in the row being scored
+    double *term_scores;
+
+    int batch_size;
+    //min-heap of the pass, the worst row on top
+    Bm25Result heap;
+    int heap_count;
+    //rows of the last pass, best first
+    Bm25Result results;
+    int result_count;
+    int result_index;
+    //rows returned by earlier passes
+    int returned;
+    bool done;
+
+    /*
+     * the scan needs an @@ qual, the executor rechecks it. the ranked
+     * rows hold a lexeme of the order by query; the rows the qual
+     * matches without one follow with score 0, so the index returns
+     * the same rows as a sequential scan and a sort
+     */
+    TSQuery filter_query;
+    bool filtering;
+    Bm25Query filter;
+    Bm25PendingMatch filter_matches;
+    int filter_match_count;
+    int filter_match_index;
+    Bm25Cursor filter_cursors;
+    int filter_cursor_count;
+    //the ranked rows, by heap tid
+    Bm25Result scored;
+    int scored_count;
+
+    //reset by rescan
+    MemoryContext scan_ctx;
+} Bm25ScanOpaqueData;
+
+typedef Bm25ScanOpaqueData * Bm25ScanOpaque;
+
+void
+bm25_init_cursor(Relation index, Bm25Query query, int term_no, Bm25Cursor cursor);
+
+void
+bm25_cursor_next_geq(Relation index, Bm25Query query, Bm25Cursor cursor, ItemPointer target);
+
+void
+bm25_cursor_shallow(Relation index, Bm25Query query, Bm25Cursor cursor, ItemPointer target);
+
+void
+bm25_offer_result(Bm25ScanOpaque scan_opaque, ItemPointer tid, double score);
+
+void
+bm25_score_pending(Bm25ScanOpaque scan_opaque);
+
+void
+bm25_rank(IndexScanDesc scan);
+
+#endif
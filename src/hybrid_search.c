@@ -0,0 +1,263 @@
+#include "hybrid_search.h"
+#include "bm25.h"
+#include "access/genam.h"
+#include "access/table.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+
+#define HYBRID_SEARCH_TEXT   0
+#define HYBRID_SEARCH_VECTOR 1
+
+//the distance operators of hvector that can order an ivfflat scan
+static const char *hybrid_search_operators[] = {"<->", "<#>", "<=>", "<+>"};
+
+//the table name to put in the queries. the ctid of a partitioned table
+//does not identify a row, so only plain tables are accepted
+static char *
+hybrid_search_relation_name(Oid relid){
+    char relkind = get_rel_relkind(relid);
+    char *nspname;
+
+    if(relkind != RELKIND_RELATION && relkind != RELKIND_MATVIEW){
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("hybrid_search needs a table or a materialized view")));
+    }
+    nspname = get_namespace_name(get_rel_namespace(relid));
+    return quote_qualified_identifier(nspname, get_rel_name(relid));
+}
+
+//a pg_hybrid_bm25 index on the column, InvalidOid when there is none
+static Oid
+hybrid_search_bm25_index(Oid relid, const char *column){
+    AttrNumber attnum = get_attnum(relid, column);
+    Relation rel;
+    List *indexes;
+    ListCell *lc;
+    Oid result = InvalidOid;
+
+    if(attnum == InvalidAttrNumber){
+        return InvalidOid;
+    }
+    rel = table_open(relid, AccessShareLock);
+    indexes = RelationGetIndexList(rel);
+    foreach(lc, indexes){
+        Relation index = index_open(lfirst_oid(lc), AccessShareLock);
+
+        if(bm25_is_index(index) &&
+            index->rd_index->indkey.values[0] == attnum &&
+            RelationGetIndexPredicate(index) == NIL){
+            result = RelationGetRelid(index);
+        }
+        index_close(index, AccessShareLock);
+        if(OidIsValid(result)){
+            break;
+        }
+    }
+    list_free(indexes);
+    table_close(rel, AccessShareLock);
+    return result;
+}
+
+static const char *
+hybrid_search_operator(text *distance_op){
+    char *op = text_to_cstring(distance_op);
+
+    for(int i = 0; i < (int) lengthof(hybrid_search_operators); i++){
+        if(strcmp(op, hybrid_search_operators[i]) == 0){
+            return hybrid_search_operators[i];
+        }
+    }
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unsupported distance operator \"%s\"", op),
+             errhint("Use <->, <#>, <=> or <+>.")));
+    return NULL;
+}
+
+//run the top-k query of one side and add the rrf score of its rows.
+//the query returns only the ctid, by rank, and at most k rows
+static void
+hybrid_search_rank(
+    const char *sql,
+    Oid query_type,
+    Datum query,
+    int64 k,
+    int side,
+    double weight,
+    int rrf_k,
+    HTAB *entries){
+    Oid argtypes[2] = {query_type, INT8OID};
+    Datum values[2] = {query, Int64GetDatum(k)};
+    int ret;
+
+    ret = SPI_execute_with_args(sql, 2, argtypes, values, NULL, true, 0);
+    if(ret != SPI_OK_SELECT){
+        elog(ERROR, "hybrid_search: query failed: %s", SPI_result_code_string(ret));
+    }
+
+    for(uint64 i = 0; i < SPI_processed; i++){
+        HybridSearchEntry entry;
+        ItemPointer tid;
+        bool isnull;
+        bool found;
+        int rank = (int) i + 1;
+
+        tid = DatumGetItemPointer(
+            SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
+        if(isnull){
+            continue;
+        }
+        entry = (HybridSearchEntry) hash_search(entries, tid, HASH_ENTER, &found);
+        if(!found){
+            entry->text_rank = 0;
+            entry->vector_rank = 0;
+            entry->score = 0;
+        }
+        if(side == HYBRID_SEARCH_TEXT){
+            entry->text_rank = rank;
+        }else{
+            entry->vector_rank = rank;
+        }
+        entry->score += weight / (rrf_k + rank);
+    }
+    SPI_freetuptable(SPI_tuptable);
+}
+
+//higher score first, then by ctid so that the order is stable
+static int
+hybrid_search_compare(const void *a, const void *b){
+    HybridSearchEntry ea = *(HybridSearchEntry *) a;
+    HybridSearchEntry eb = *(HybridSearchEntry *) b;
+
+    if(ea->score > eb->score){
+        return -1;
+    }
+    if(ea->score < eb->score){
+        return 1;
+    }
+    return ItemPointerCompare(&ea->tid, &eb->tid);
+}
+
+/*
+ * hybrid_search(rel, text_column, vector_column, query, embedding, k,
+ *               distance_op, rrf_k, text_weight, vector_weight)
+ *
+ * runs a full text top-k (bm25 when the tsvector column has a
+ * pg_hybrid_bm25 index, ts_rank_cd otherwise) and a vector
+ * top-k (ordered by the distance operator, so an ivfflat index can serve
+ * it) in one call, and fuses them with reciprocal rank fusion:
+ *   score = text_weight / (rrf_k + text_rank) + vector_weight / (rrf_k + vector_rank)
+ * each side fetches only k rows. returns the k best rows by score, with
+ * the ctid to join back to the table.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hybrid_search);
+Datum
+hybrid_search(PG_FUNCTION_ARGS){
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid relid = PG_GETARG_OID(0);
+    Name text_column = PG_GETARG_NAME(1);
+    Name vector_column = PG_GETARG_NAME(2);
+    Datum query = PG_GETARG_DATUM(3);
+    Datum embedding = PG_GETARG_DATUM(4);
+    int32 k = PG_GETARG_INT32(5);
+    const char *distance_op = hybrid_search_operator(PG_GETARG_TEXT_PP(6));
+    int32 rrf_k = PG_GETARG_INT32(7);
+    double text_weight = PG_GETARG_FLOAT8(8);
+    double vector_weight = PG_GETARG_FLOAT8(9);
+    const char *relname;
+    const char *text_name;
+    const char *nspname;
+    Oid bm25_index;
+    StringInfoData sql;
+    HASHCTL ctl;
+    HTAB *entries;
+    HASH_SEQ_STATUS status;
+    HybridSearchEntry entry;
+    HybridSearchEntry *sorted;
+    long count = 0;
+
+    if(k < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("k must be at least 1")));
+    }
+    if(rrf_k < 0){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("rrf_k must not be negative")));
+    }
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    relname = hybrid_search_relation_name(relid);
+    text_name = quote_identifier(NameStr(*text_column));
+    nspname = quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+    bm25_index = hybrid_search_bm25_index(relid, NameStr(*text_column));
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(ItemPointerData);
+    ctl.entrysize = sizeof(HybridSearchEntryData);
+    ctl.hcxt = CurrentMemoryContext;
+    entries = hash_create("hybrid_search", 2 * (long) k, &ctl,
+                          HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    if(SPI_connect() != SPI_OK_CONNECT){
+        elog(ERROR, "hybrid_search: SPI_connect failed");
+    }
+
+    initStringInfo(&sql);
+    if(OidIsValid(bm25_index)){
+        //the index needs the @@ qual, both branches rank the same rows
+        appendStringInfo(&sql,
+                         "SELECT ctid FROM %s WHERE %s @@ $1 ORDER BY %s OPERATOR(%s.<&>) %s.to_bm25query(%u::oid::regclass, $1) LIMIT $2",
+                         relname, text_name, text_name, nspname, nspname, bm25_index);
+    }else{
+        appendStringInfo(&sql,
+                         "SELECT ctid FROM %s WHERE %s @@ $1 ORDER BY ts_rank_cd(%s, $1) DESC LIMIT $2",
+                         relname, text_name, text_name);
+    }
+    hybrid_search_rank(sql.data, get_fn_expr_argtype(fcinfo->flinfo, 3), query, k,
+                       HYBRID_SEARCH_TEXT, text_weight, rrf_k, entries);
+
+    resetStringInfo(&sql);
+    appendStringInfo(&sql,
+                     "SELECT ctid FROM %s ORDER BY %s OPERATOR(%s.%s) $1 LIMIT $2",
+                     relname, quote_identifier(NameStr(*vector_column)),
+                     nspname, distance_op);
+    hybrid_search_rank(sql.data, get_fn_expr_argtype(fcinfo->flinfo, 4), embedding, k,
+                       HYBRID_SEARCH_VECTOR, vector_weight, rrf_k, entries);
+
+    SPI_finish();
+
+    sorted = palloc(Max(hash_get_num_entries(entries), 1) * sizeof(HybridSearchEntry));
+    hash_seq_init(&status, entries);
+    while((entry = (HybridSearchEntry) hash_seq_search(&status)) != NULL){
+        sorted[count++] = entry;
+    }
+    qsort(sorted, count, sizeof(HybridSearchEntry), hybrid_search_compare);
+
+    for(long i = 0; i < count && i < k; i++){
+        Datum values[4];
+        bool nulls[4] = {false, false, false, false};
+
+        entry = sorted[i];
+        values[0] = ItemPointerGetDatum(&entry->tid);
+        values[1] = Float8GetDatum(entry->score);
+        values[2] = Int32GetDatum(entry->text_rank);
+        values[3] = Int32GetDatum(entry->vector_rank);
+        nulls[2] = entry->text_rank == 0;
+        nulls[3] = entry->vector_rank == 0;
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
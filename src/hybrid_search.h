@@ -0,0 +1,20 @@
+#ifndef HYBRID_SEARCH_H
+#define HYBRID_SEARCH_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "storage/itemptr.h"
+
+//a row found by either side. rank 0 means not found by that side
+typedef struct HybridSearchEntryData {
+    ItemPointerData tid;
+    int text_rank;
+    int vector_rank;
+    double score;
+} HybridSearchEntryData;
+
+typedef HybridSearchEntryData * HybridSearchEntry;
+
+PGDLLEXPORT Datum hybrid_search(PG_FUNCTION_ARGS);
+
+#endif
@@ -1,11 +1,13 @@
 #include "ivffat.h"
+#include "access/genam.h"
+#include "vector.h"
 
 PGDLLEXPORT PG_FUNCTION_INFO_V1(pg_hybrid_ivfflat_handler);
 Datum
 pg_hybrid_ivfflat_handler(PG_FUNCTION_ARGS)
 {
 	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
-    //0 自定义操作符号
+    //0 自定义操作符号. 标量列的过滤操作符沿用 btree 的编号 1-5
     amroutine->amstrategies = 0;
     //PROC的最大编号 - 支持5个支持函数（距离、归一化、K-means距离、K-means归一化、向量类型）
     amroutine->amsupport = 5;
@@ -15,8 +17,19 @@ pg_hybrid_ivfflat_handler(PG_FUNCTION_ARGS)
 	amroutine->amcanorderbyop = true;
     //支持唯一索引
     amroutine->amcanunique = false;
-    //支持多列索引
-	amroutine->amcanmulticol = false;
+    //支持多列索引: 第一列是向量，其余列是在索引内过滤的标量列
+	amroutine->amcanmulticol = true;
+    //没有过滤条件时只按距离排序扫描
+    amroutine->amoptionalkey = true;
+    //INCLUDE 列只存储，用于仅索引扫描
+    amroutine->amcaninclude = true;
+    //并行扫描: 参与者按下界顺序领取列表，由 Gather Merge 合并
+    amroutine->amcanparallel = true;
+    //不使用maintenance_work_mem
+    amroutine->amusemaintenanceworkmem = false;
+    //并行vacuum: bulkdelete可在worker中执行; cleanup只在未执行bulkdelete时并行
+    amroutine->amparallelvacuumoptions =
+        VACUUM_OPTION_PARALLEL_BULKDEL | VACUUM_OPTION_PARALLEL_COND_CLEANUP;
 
 	amroutine->ambuild = ivfflat_build;
 	amroutine->ambuildempty = ivfflat_buildempty;
@@ -29,11 +42,15 @@ pg_hybrid_ivfflat_handler(PG_FUNCTION_ARGS)
     amroutine->amoptions = ivfflat_options;
     amroutine->ambuildphasename = ivfflat_buildphasename;
     amroutine->amvalidate = ivfflat_validate;
+    amroutine->amcanreturn = ivfflat_canreturn;
     
     amroutine->ambeginscan = ivfflat_beginscan;
 	amroutine->amrescan = ivfflat_rescan;
 	amroutine->amgettuple = ivfflat_gettuple;
 	amroutine->amendscan = ivfflat_endscan;
+    amroutine->amestimateparallelscan = ivfflat_estimateparallelscan;
+    amroutine->aminitparallelscan = ivfflat_initparallelscan;
+    amroutine->amparallelrescan = ivfflat_parallelrescan;
 
     PG_RETURN_POINTER(amroutine);
 }
@@ -49,3 +66,13 @@ ivfflat_validate(Oid opclassoid)
 {
 	return true;
 }
+
+//归一化的 opclass（cosine）存的是单位向量，不能返回原值
+bool
+ivfflat_canreturn(Relation index, int attno)
+{
+    if(attno == 1){
+        return !OidIsValid(index_getprocid(index, 1, IVFFALT_VECTOR_NORMALIZATION_PROC));
+    }
+    return true;
+}
@@ -12,7 +12,7 @@
 #include "nodes/pathnodes.h"
 #include "common/pg_prng.h"
 
-#define IVFFLAT_VERSION 1
+#define IVFFLAT_VERSION 3
 #define IVFFLAT_PAGE_ID          0xFF84
 
 #define RandomDouble() pg_prng_double(&pg_global_prng_state)
@@ -54,6 +54,9 @@ ivfflat_buildphasename(int64 phasenum);
 bool
 ivfflat_validate(Oid opclassoid);
 
+bool
+ivfflat_canreturn(Relation index, int attno);
+
 IndexScanDesc
 ivfflat_beginscan(Relation index, int nkeys, int norderbys);
 
@@ -64,6 +67,15 @@ ivfflat_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, in
 bool
 ivfflat_gettuple(IndexScanDesc scan, ScanDirection dir);
 
+Size
+ivfflat_estimateparallelscan(void);
+
+void
+ivfflat_initparallelscan(void *target);
+
+void
+ivfflat_parallelrescan(IndexScanDesc scan);
+
 void
 ivfflat_endscan(IndexScanDesc scan);
 
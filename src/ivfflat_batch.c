@@ -0,0 +1,945 @@
+#include "ivfflat_batch.h"
+#include "ivffat.h"
+#include "ivfflat_page.h"
+#include "access/genam.h"
+#include "access/relscan.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/index.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+#include <math.h>
+
+typedef struct IvfflatBatchStateData {
+    Relation heap;
+    Relation index;
+    TupleDesc tup_desc;
+    BufferAccessStrategy strategy;
+    Snapshot snapshot;
+    IndexFetchTableData *fetch;
+    TupleTableSlot *slot;
+    HTAB *visible;
+
+    FmgrInfo *distance_proc;
+    Oid collation;
+    //the pages are scored against each query in one call when the
+    //distance function has a batch version
+    HvectorBatchDistance batch_distance;
+    HvectorMetric metric;
+    bool normalized;
+    IvfflatVectorType vector_type;
+
+    IvfflatBatchQuery queries;
+    int query_count;
+    int k;
+    int probes;
+    int dimensions;
+    int list_count;
+    //the allowed rows of a filtered search, NULL otherwise
+    IvfflatBatchFilter filter;
+
+    //the vectors of the page being scored
+    const float **vectors;
+    Datum *values;
+    OffsetNumber *offsets;
+    double *distances;
+    IvfflatBatchCandidate candidates;
+    int candidate_count;
+    int max_candidates;
+    MemoryContext page_ctx;
+} IvfflatBatchStateData;
+
+typedef IvfflatBatchStateData * IvfflatBatchState;
+
+static int
+ivfflat_batch_compare_results(IvfflatBatchResult a, IvfflatBatchResult b){
+    if(a->distance != b->distance){
+        return a->distance < b->distance ? -1 : 1;
+    }
+    return ItemPointerCompare(&a->tid, &b->tid);
+}
+
+static int
+ivfflat_batch_sort_results(const void *a, const void *b){
+    return ivfflat_batch_compare_results((IvfflatBatchResult) a, (IvfflatBatchResult) b);
+}
+
+//keep the probes nearest lists of the query
+static void
+ivfflat_batch_offer_list(IvfflatBatchQuery query, int probes, int list_no, double distance){
+    IvfflatBatchList lists = query->lists;
+    int i;
+
+    if(query->list_count == probes){
+        if(distance >= lists[0].distance){
+            return;
+        }
+        //replace the farthest and sift it down
+        i = 0;
+        for(;;){
+            int farthest = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+
+            if(left < probes && lists[left].distance > (farthest == i ? distance : lists[farthest].distance)){
+                farthest = left;
+            }
+            if(right < probes && lists[right].distance > (farthest == i ? distance : lists[farthest].distance)){
+                farthest = right;
+            }
+            if(farthest == i){
+                break;
+            }
+            lists[i] = lists[farthest];
+            i = farthest;
+        }
+    }else{
+        i = query->list_count++;
+        while(i > 0 && lists[(i - 1) / 2].distance < distance){
+            lists[i] = lists[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    lists[i].distance = distance;
+    lists[i].list_no = list_no;
+}
+
+static void
+ivfflat_batch_offer_result(IvfflatBatchQuery query, int k, double distance, ItemPointer tid){
+    IvfflatBatchResult results = query->results;
+    IvfflatBatchResultData item;
+    int i;
+
+    item.distance = distance;
+    item.tid = *tid;
+    if(query->result_count == k){
+        if(ivfflat_batch_compare_results(&item, &results[0]) >= 0){
+            return;
+        }
+        i = 0;
+        for(;;){
+            IvfflatBatchResult farthest = &item;
+            int next = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+
+            if(left < k && ivfflat_batch_compare_results(&results[left], farthest) > 0){
+                farthest = &results[left];
+                next = left;
+            }
+            if(right < k && ivfflat_batch_compare_results(&results[right], farthest) > 0){
+                farthest = &results[right];
+                next = right;
+            }
+            if(next == i){
+                break;
+            }
+            results[i] = results[next];
+            i = next;
+        }
+    }else{
+        i = query->result_count++;
+        while(i > 0 && ivfflat_batch_compare_results(&results[(i - 1) / 2], &item) < 0){
+            results[i] = results[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    results[i] = item;
+}
+
+//whether an entry at this distance may still enter the results
+static inline bool
+ivfflat_batch_may_enter(IvfflatBatchQuery query, int k, double distance){
+    return query->result_count < k || distance <= query->results[0].distance;
+}
+
+static int
+ivfflat_batch_compare_blocks(const void *a, const void *b){
+    BlockNumber ba = *((const BlockNumber *) a);
+    BlockNumber bb = *((const BlockNumber *) b);
+
+    if(ba != bb){
+        return ba < bb ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+ivfflat_batch_compare_tids(const void *a, const void *b){
+    return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+static inline bool
+ivfflat_batch_filter_has_block(IvfflatBatchFilter filter, BlockNumber blkno){
+    return bsearch(&blkno, filter->blocks, filter->block_count,
+                   sizeof(BlockNumber), ivfflat_batch_compare_blocks) != NULL;
+}
+
+static inline bool
+ivfflat_batch_filter_has_tid(IvfflatBatchFilter filter, ItemPointer tid){
+    return bsearch(tid, filter->tids, filter->tid_count,
+                   sizeof(ItemPointerData), ivfflat_batch_compare_tids) != NULL;
+}
+
+//whether the heap tid is visible to the snapshot, and the tid of the
+//visible row of its hot chain. each tid is fetched once for the batch
+static bool
+ivfflat_batch_visible(IvfflatBatchState state, ItemPointer tid, ItemPointer visible_tid){
+    IvfflatBatchVisible entry;
+    bool found;
+
+    entry = (IvfflatBatchVisible) hash_search(state->visible, tid, HASH_ENTER, &found);
+    if(!found){
+        bool call_again = false;
+        bool all_dead = false;
+
+        entry->visible = table_index_fetch_tuple(
+            state->fetch,
+            tid,
+            state->snapshot,
+            state->slot,
+            &call_again,
+            &all_dead);
+        if(entry->visible){
+            entry->visible_tid = state->slot->tts_tid;
+        }
+        ExecClearTuple(state->slot);
+    }
+    if(entry->visible){
+        *visible_tid = entry->visible_tid;
+    }
+    return entry->visible;
+}
+
+static void
+ivfflat_batch_add_candidate(IvfflatBatchState state, int query_no, double distance, ItemPointer tid){
+    IvfflatBatchCandidate candidate;
+
+    if(state->candidate_count == state->max_candidates){
+        state->max_candidates *= 2;
+        state->candidates = repalloc(state->candidates, state->max_candidates * sizeof(IvfflatBatchCandidateData));
+    }
+    candidate = &state->candidates[state->candidate_count++];
+    candidate->query_no = query_no;
+    candidate->distance = distance;
+    candidate->tid = *tid;
+}
+
+//the candidates of a page, checked against the heap without the index
+//page locked
+static void
+ivfflat_batch_check_candidates(IvfflatBatchState state){
+    for(int i = 0; i < state->candidate_count; i++){
+        IvfflatBatchCandidate candidate = &state->candidates[i];
+        IvfflatBatchQuery query = &state->queries[candidate->query_no];
+        ItemPointerData visible_tid;
+        bool duplicate = false;
+
+        if(!ivfflat_batch_may_enter(query, state->k, candidate->distance) ||
+            !ivfflat_batch_visible(state, &candidate->tid, &visible_tid)){
+            continue;
+        }
+        //the entry points at the root of a hot chain, the allowed rows may
+        //be any of its members
+        if(state->filter != NULL &&
+            !ivfflat_batch_filter_has_tid(state->filter, &visible_tid) &&
+            !ivfflat_batch_filter_has_tid(state->filter, &candidate->tid)){
+            continue;
+        }
+        //an entry being merged is in both the insert buffer and its list
+        for(int j = 0; j < query->result_count; j++){
+            if(ItemPointerEquals(&query->results[j].tid, &visible_tid)){
+                duplicate = true;
+                break;
+            }
+        }
+        if(!duplicate){
+            ivfflat_batch_offer_result(query, state->k, candidate->distance, &visible_tid);
+        }
+    }
+    state->candidate_count = 0;
+}
+
+//distances from the query to the vectors of the page
+static void
+ivfflat_batch_distances(IvfflatBatchState state, IvfflatBatchQuery query, int count){
+    if(state->batch_distance != NULL){
+        state->batch_distance(
+            state->dimensions,
+            query->value->data,
+            state->vectors,
+            count,
+            state->distances);
+        return;
+    }
+    for(int i = 0; i < count; i++){
+        state->distances[i] = DatumGetFloat8(FunctionCall2Coll(
+            state->distance_proc,
+            state->collation,
+            state->values[i],
+            PointerGetDatum(query->value)));
+    }
+}
+
+//score the centers of one center page against every query
+static BlockNumber
+ivfflat_batch_score_centers(
+    IvfflatBatchState state,
+    BlockNumber blkno,
+    BlockNumber *start_pages,
+    int max_lists,
+    int *list_count){
+    Buffer buf;
+    Page page;
+    OffsetNumber max_offset;
+    BlockNumber next_page;
+    int first_list_no = *list_count;
+    int count = 0;
+
+    buf = ReadBuffer(state->index, blkno);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    max_offset = PageGetMaxOffsetNumber(page);
+    for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset = OffsetNumberNext(offset)){
+        IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offset));
+
+        if(first_list_no + count >= max_lists){
+            elog(ERROR, "ivfflat index \"%s\" has more lists than its meta page",
+                RelationGetRelationName(state->index));
+        }
+        start_pages[first_list_no + count] = list->start_page;
+        state->vectors[count] = list->center.data;
+        state->values[count] = PointerGetDatum(&list->center);
+        count++;
+    }
+    for(int q = 0; q < state->query_count; q++){
+        IvfflatBatchQuery query = &state->queries[q];
+
+        if(query->value == NULL){
+            continue;
+        }
+        ivfflat_batch_distances(state, query, count);
+        for(int i = 0; i < count; i++){
+            ivfflat_batch_offer_list(query, state->probes, first_list_no + i, state->distances[i]);
+        }
+    }
+    next_page = IvfflatPageGetOpaque(page)->nextblkno;
+    UnlockReleaseBuffer(buf);
+    *list_count += count;
+    return next_page;
+}
+
+//score one entry page against the queries that probe its list. returns
+//the next page of the chain
+static BlockNumber
+ivfflat_batch_score_page(IvfflatBatchState state, BlockNumber blkno, const int *query_nos, int query_count){
+    Buffer buf;
+    Page page;
+    OffsetNumber max_offset;
+    BlockNumber next_page;
+    MemoryContext old_ctx;
+    int count = 0;
+
+    buf = ReadBufferExtended(state->index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->strategy);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    max_offset = PageGetMaxOffsetNumber(page);
+
+    old_ctx = MemoryContextSwitchTo(state->page_ctx);
+    for(OffsetNumber offset = FirstOffsetNumber; offset <= max_offset; offset = OffsetNumberNext(offset)){
+        ItemId itemid = PageGetItemId(page, offset);
+        IndexTuple itup;
+        Vector vec;
+        bool isnull;
+
+        //known dead to every transaction
+        if(ItemIdIsDead(itemid)){
+            continue;
+        }
+        itup = (IndexTuple) PageGetItem(page, itemid);
+        if(state->filter != NULL){
+            ItemPointer tids = ivfflat_tuple_tids(itup, state->tup_desc);
+            int ntids = ivfflat_tuple_tid_count(itup, state->tup_desc);
+            bool allowed = false;
+
+            for(int j = 0; j < ntids && !allowed; j++){
+                allowed = ivfflat_batch_filter_has_block(state->filter, ItemPointerGetBlockNumber(&tids[j]));
+            }
+            if(!allowed){
+                continue;
+            }
+        }
+        //short varlena headers are copied to an aligned vector
+        vec = DatumGetVectorP(index_getattr(itup, 1, state->tup_desc, &isnull));
+        if(vec->dim != state->dimensions){
+            ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("different vector dimensions %d and %d", vec->dim, state->dimensions)));
+        }
+        state->vectors[count] = vec->data;
+        state->values[count] = PointerGetDatum(vec);
+        state->offsets[count] = offset;
+        count++;
+    }
+
+    //the page stays in cache while every query is scored against it
+    for(int q = 0; q < query_count; q++){
+        IvfflatBatchQuery query = &state->queries[query_nos[q]];
+
+        ivfflat_batch_distances(state, query, count);
+        for(int i = 0; i < count; i++){
+            IndexTuple itup;
+            ItemPointer tids;
+            int ntids;
+
+            if(!ivfflat_batch_may_enter(query, state->k, state->distances[i])){
+                continue;
+            }
+            itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, state->offsets[i]));
+            tids = ivfflat_tuple_tids(itup, state->tup_desc);
+            ntids = ivfflat_tuple_tid_count(itup, state->tup_desc);
+            for(int j = 0; j < ntids; j++){
+                if(state->filter != NULL &&
+                    !ivfflat_batch_filter_has_block(state->filter, ItemPointerGetBlockNumber(&tids[j]))){
+                    continue;
+                }
+                ivfflat_batch_add_candidate(state, query_nos[q], state->distances[i], &tids[j]);
+            }
+        }
+    }
+    MemoryContextSwitchTo(old_ctx);
+    next_page = IvfflatPageGetOpaque(page)->nextblkno;
+    UnlockReleaseBuffer(buf);
+    MemoryContextReset(state->page_ctx);
+
+    ivfflat_batch_check_candidates(state);
+    return next_page;
+}
+
+static int
+ivfflat_batch_compare_lists(const void *a, const void *b, void *arg){
+    BlockNumber *start_pages = (BlockNumber *) arg;
+    BlockNumber pa = start_pages[*((const int *) a)];
+    BlockNumber pb = start_pages[*((const int *) b)];
+
+    if(pa != pb){
+        return pa < pb ? -1 : 1;
+    }
+    return 0;
+}
+
+//the distance of the ORDER BY operator. the l2 opclass orders by the
+//squared distance, the cosine one by the negative inner product of the
+//normalized vectors
+static double
+ivfflat_batch_operator_distance(IvfflatBatchState state, double distance){
+    if(state->metric == HVECTOR_METRIC_L2_SQUARED){
+        return sqrt(Max(distance, 0.0));
+    }
+    if(state->normalized){
+        distance += 1.0;
+        if(distance < 0.0){
+            distance = 0.0;
+        }else if(distance > 2.0){
+            distance = 2.0;
+        }
+    }
+    return distance;
+}
+
+static Relation
+ivfflat_batch_open(Oid indexoid, Relation *heap){
+    Oid heapoid;
+    AclResult aclresult;
+    Relation index;
+
+    if(get_rel_relkind(indexoid) != RELKIND_INDEX){
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not an index", get_rel_name(indexoid))));
+    }
+    heapoid = IndexGetRelation(indexoid, false);
+    aclresult = pg_class_aclcheck(heapoid, GetUserId(), ACL_SELECT);
+    if(aclresult != ACLCHECK_OK){
+        aclcheck_error(aclresult, get_relkind_objtype(get_rel_relkind(heapoid)), get_rel_name(heapoid));
+    }
+    //the rows are read past the executor, so policies would not apply
+    if(check_enable_rls(heapoid, InvalidOid, false) == RLS_ENABLED){
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot search \"%s\" with row-level security enabled", get_rel_name(heapoid)),
+                 errhint("Query the table with ORDER BY and the distance operator instead.")));
+    }
+
+    *heap = table_open(heapoid, AccessShareLock);
+    index = index_open(indexoid, AccessShareLock);
+    if(index->rd_indam == NULL || index->rd_indam->amgettuple != ivfflat_gettuple){
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a pg_hybrid_ivfflat index", RelationGetRelationName(index))));
+    }
+    if(!index->rd_index->indisvalid){
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("index \"%s\" is not valid", RelationGetRelationName(index))));
+    }
+    return index;
+}
+
+//open the index and set up the state shared by the search functions
+static void
+ivfflat_batch_begin(IvfflatBatchState state, Oid indexoid, int k){
+    FmgrInfo *normalize_proc;
+    HASHCTL ctl;
+
+    memset(state, 0, sizeof(IvfflatBatchStateData));
+    state->index = ivfflat_batch_open(indexoid, &state->heap);
+    state->tup_desc = RelationGetDescr(state->index);
+    state->strategy = GetAccessStrategy(BAS_BULKREAD);
+    state->snapshot = GetActiveSnapshot();
+    state->distance_proc = index_getprocinfo(state->index, 1, IVFFALT_VECTOR_DISTANCE_PROC);
+    state->collation = state->index->rd_indcollation[0];
+    state->batch_distance = hvector_get_batch_distance(state->distance_proc);
+    state->metric = hvector_get_metric(state->distance_proc);
+    normalize_proc = ivfflat_get_proc_info(state->index, IVFFALT_VECTOR_NORMALIZATION_PROC);
+    state->normalized = normalize_proc != NULL;
+    state->vector_type = ivfflat_get_vector_type(state->index);
+    ivfflat_get_meta_page(state->index, &state->list_count, &state->dimensions);
+    state->k = k;
+
+    state->vectors = palloc(MaxOffsetNumber * sizeof(float *));
+    state->values = palloc(MaxOffsetNumber * sizeof(Datum));
+    state->offsets = palloc(MaxOffsetNumber * sizeof(OffsetNumber));
+    state->distances = palloc(MaxOffsetNumber * sizeof(double));
+    state->max_candidates = 1024;
+    state->candidates = palloc(state->max_candidates * sizeof(IvfflatBatchCandidateData));
+    state->page_ctx = AllocSetContextCreate(CurrentMemoryContext,
+        "Ivfflat batch search page context",
+        ALLOCSET_DEFAULT_SIZES);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(ItemPointerData);
+    ctl.entrysize = sizeof(IvfflatBatchVisibleData);
+    ctl.hcxt = CurrentMemoryContext;
+    state->visible = hash_create("ivfflat batch visible tids", 1024, &ctl,
+                                 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    state->fetch = table_index_fetch_begin(state->heap);
+    state->slot = table_slot_create(state->heap, NULL);
+}
+
+static void
+ivfflat_batch_end(IvfflatBatchState state){
+    ExecDropSingleTupleTableSlot(state->slot);
+    table_index_fetch_end(state->fetch);
+    hash_destroy(state->visible);
+    MemoryContextDelete(state->page_ctx);
+    FreeAccessStrategy(state->strategy);
+    index_close(state->index, AccessShareLock);
+    table_close(state->heap, AccessShareLock);
+}
+
+//the query, normalized like a scan key, with room for max_lists
+//probed lists and k results
+static void
+ivfflat_batch_init_query(IvfflatBatchState state, IvfflatBatchQuery query, Datum value, int max_lists){
+    if(state->normalized){
+        value = ivfflat_normalize_value(state->vector_type, state->collation, value);
+    }
+    query->value = DatumGetVectorP(value);
+    if(query->value->dim != state->dimensions){
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("different vector dimensions %d and %d", query->value->dim, state->dimensions)));
+    }
+    query->lists = palloc(Max(max_lists, 1) * sizeof(IvfflatBatchListData));
+    query->results = palloc(state->k * sizeof(IvfflatBatchResultData));
+}
+
+//score every center page. returns the lists read, their start pages
+//are left in start_pages
+static int
+ivfflat_batch_score_all_centers(IvfflatBatchState state, BlockNumber *start_pages){
+    BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
+    int loaded = 0;
+
+    while(BlockNumberIsValid(blkno) && state->list_count > 0){
+        CHECK_FOR_INTERRUPTS();
+        blkno = ivfflat_batch_score_centers(state, blkno, start_pages, state->list_count, &loaded);
+    }
+    return Min(state->list_count, loaded);
+}
+
+//the insert buffer first, as in a scan, so an entry moved by a
+//concurrent merge is seen at least once
+static void
+ivfflat_batch_score_buffer(IvfflatBatchState state, const int *query_nos, int query_count){
+    BlockNumber blkno;
+
+    ivfflat_get_buffer_pages(state->index, &blkno, NULL);
+    while(BlockNumberIsValid(blkno) && query_count > 0){
+        CHECK_FOR_INTERRUPTS();
+        blkno = ivfflat_batch_score_page(state, blkno, query_nos, query_count);
+    }
+}
+
+static void
+ivfflat_batch_sort_query_results(IvfflatBatchQuery query){
+    qsort(query->results, query->result_count, sizeof(IvfflatBatchResultData), ivfflat_batch_sort_results);
+}
+
+/*
+ * pg_hybrid_ivfflat_search_batch(index, queries, k, probes)
+ *
+ * the k nearest visible rows of each query, like one ivfflat scan per
+ * query with ivfflat.probes = probes. the queries are grouped by the
+ * lists they probe: each list is read once, and each page is scored
+ * against all the queries that probe it while it is in cache. an entry
+ * is checked against the heap only when it may enter the results of a
+ * query, and each heap tid once for the whole batch.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pg_hybrid_ivfflat_search_batch);
+Datum
+pg_hybrid_ivfflat_search_batch(PG_FUNCTION_ARGS){
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid indexoid = PG_GETARG_OID(0);
+    ArrayType *array = PG_GETARG_ARRAYTYPE_P(1);
+    int32 k = PG_GETARG_INT32(2);
+    int32 probes = PG_GETARG_INT32(3);
+    IvfflatBatchStateData state;
+    Datum *elems;
+    bool *nulls;
+    int list_count;
+    BlockNumber *start_pages;
+    BlockNumber blkno;
+    int *list_offsets;
+    int *list_query_nos;
+    int *list_order;
+    int *all_query_nos;
+    int order_count = 0;
+
+    if(k < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("k must be at least 1")));
+    }
+    if(probes < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("probes must be at least 1")));
+    }
+    InitMaterializedSRF(fcinfo, 0);
+
+    ivfflat_batch_begin(&state, indexoid, k);
+    state.probes = Min(probes, Max(state.list_count, 1));
+
+    //the queries, normalized like scan keys
+    deconstruct_array(array, ARR_ELEMTYPE(array), -1, false, TYPALIGN_INT,
+                      &elems, &nulls, &state.query_count);
+    state.queries = palloc0(Max(state.query_count, 1) * sizeof(IvfflatBatchQueryData));
+    for(int q = 0; q < state.query_count; q++){
+        if(nulls[q]){
+            continue;
+        }
+        ivfflat_batch_init_query(&state, &state.queries[q], elems[q], state.probes);
+    }
+
+    //the probed lists of every query, from one pass over the centers
+    start_pages = palloc(Max(state.list_count, 1) * sizeof(BlockNumber));
+    list_count = ivfflat_batch_score_all_centers(&state, start_pages);
+
+    //the queries of each list
+    list_offsets = palloc0((list_count + 1) * sizeof(int));
+    for(int q = 0; q < state.query_count; q++){
+        for(int i = 0; i < state.queries[q].list_count; i++){
+            list_offsets[state.queries[q].lists[i].list_no + 1]++;
+        }
+    }
+    for(int l = 0; l < list_count; l++){
+        list_offsets[l + 1] += list_offsets[l];
+    }
+    list_query_nos = palloc(Max(list_offsets[list_count], 1) * sizeof(int));
+    list_order = palloc(Max(list_count, 1) * sizeof(int));
+    {
+        int *next = palloc(Max(list_count, 1) * sizeof(int));
+
+        memcpy(next, list_offsets, list_count * sizeof(int));
+        for(int q = 0; q < state.query_count; q++){
+            for(int i = 0; i < state.queries[q].list_count; i++){
+                list_query_nos[next[state.queries[q].lists[i].list_no]++] = q;
+            }
+        }
+        pfree(next);
+    }
+
+    all_query_nos = palloc(Max(state.query_count, 1) * sizeof(int));
+    {
+        int count = 0;
+
+        for(int q = 0; q < state.query_count; q++){
+            if(state.queries[q].value != NULL){
+                all_query_nos[count++] = q;
+            }
+        }
+        ivfflat_batch_score_buffer(&state, all_query_nos, count);
+    }
+
+    //then each probed list once, in block order
+    for(int l = 0; l < list_count; l++){
+        if(list_offsets[l + 1] > list_offsets[l]){
+            list_order[order_count++] = l;
+        }
+    }
+    qsort_arg(list_order, order_count, sizeof(int), ivfflat_batch_compare_lists, start_pages);
+    for(int i = 0; i < order_count; i++){
+        int l = list_order[i];
+
+        blkno = start_pages[l];
+        while(BlockNumberIsValid(blkno)){
+            CHECK_FOR_INTERRUPTS();
+            blkno = ivfflat_batch_score_page(
+                &state,
+                blkno,
+                &list_query_nos[list_offsets[l]],
+                list_offsets[l + 1] - list_offsets[l]);
+        }
+    }
+
+    for(int q = 0; q < state.query_count; q++){
+        IvfflatBatchQuery query = &state.queries[q];
+
+        ivfflat_batch_sort_query_results(query);
+        for(int i = 0; i < query->result_count; i++){
+            Datum values[4];
+            bool isnull[4] = {false, false, false, false};
+
+            values[0] = Int32GetDatum(q + 1);
+            values[1] = Int32GetDatum(i + 1);
+            values[2] = ItemPointerGetDatum(&query->results[i].tid);
+            values[3] = Float8GetDatum(ivfflat_batch_operator_distance(&state, query->results[i].distance));
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, isnull);
+        }
+    }
+
+    ivfflat_batch_end(&state);
+    return (Datum) 0;
+}
+
+//the allowed tids, sorted and distinct, and their heap pages
+static void
+ivfflat_batch_init_filter(IvfflatBatchFilter filter, ArrayType *array){
+    Datum *elems;
+    bool *nulls;
+    int count;
+
+    deconstruct_array(array, TIDOID, sizeof(ItemPointerData), false, TYPALIGN_SHORT,
+                      &elems, &nulls, &count);
+    filter->tids = palloc(Max(count, 1) * sizeof(ItemPointerData));
+    filter->tid_count = 0;
+    for(int i = 0; i < count; i++){
+        if(!nulls[i]){
+            filter->tids[filter->tid_count++] = *DatumGetItemPointer(elems[i]);
+        }
+    }
+    qsort(filter->tids, filter->tid_count, sizeof(ItemPointerData), ivfflat_batch_compare_tids);
+    count = 0;
+    for(int i = 0; i < filter->tid_count; i++){
+        if(count == 0 || !ItemPointerEquals(&filter->tids[count - 1], &filter->tids[i])){
+            filter->tids[count++] = filter->tids[i];
+        }
+    }
+    filter->tid_count = count;
+
+    filter->blocks = palloc(Max(count, 1) * sizeof(BlockNumber));
+    filter->block_count = 0;
+    for(int i = 0; i < count; i++){
+        BlockNumber blkno = ItemPointerGetBlockNumber(&filter->tids[i]);
+        if(filter->block_count == 0 || filter->blocks[filter->block_count - 1] != blkno){
+            filter->blocks[filter->block_count++] = blkno;
+        }
+    }
+}
+
+//score the allowed rows from the heap, without reading the index
+static void
+ivfflat_batch_score_allowed(IvfflatBatchState state, IvfflatBatchQuery query, AttrNumber attnum){
+    IvfflatBatchFilter filter = state->filter;
+
+    for(int i = 0; i < filter->tid_count; i++){
+        ItemPointerData tid = filter->tids[i];
+        bool call_again = false;
+        bool all_dead = false;
+        bool isnull;
+        Datum value;
+
+        CHECK_FOR_INTERRUPTS();
+        if(!table_index_fetch_tuple(state->fetch, &tid, state->snapshot, state->slot,
+                                    &call_again, &all_dead)){
+            continue;
+        }
+        value = slot_getattr(state->slot, attnum, &isnull);
+        if(!isnull){
+            ItemPointerData visible_tid = state->slot->tts_tid;
+            MemoryContext old_ctx = MemoryContextSwitchTo(state->page_ctx);
+            bool duplicate = false;
+            Vector vec;
+            double distance;
+
+            if(state->normalized){
+                value = ivfflat_normalize_value(state->vector_type, state->collation, value);
+            }
+            vec = DatumGetVectorP(value);
+            if(vec->dim != state->dimensions){
+                ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("different vector dimensions %d and %d", vec->dim, state->dimensions)));
+            }
+            distance = DatumGetFloat8(FunctionCall2Coll(
+                state->distance_proc,
+                state->collation,
+                PointerGetDatum(vec),
+                PointerGetDatum(query->value)));
+            MemoryContextSwitchTo(old_ctx);
+
+            //two allowed tids of one hot chain
+            for(int j = 0; j < query->result_count; j++){
+                if(ItemPointerEquals(&query->results[j].tid, &visible_tid)){
+                    duplicate = true;
+                    break;
+                }
+            }
+            if(!duplicate){
+                ivfflat_batch_offer_result(query, state->k, distance, &visible_tid);
+            }
+        }
+        ExecClearTuple(state->slot);
+        MemoryContextReset(state->page_ctx);
+    }
+}
+
+static int
+ivfflat_batch_sort_lists(const void *a, const void *b){
+    IvfflatBatchList la = (IvfflatBatchList) a;
+    IvfflatBatchList lb = (IvfflatBatchList) b;
+
+    if(la->distance != lb->distance){
+        return la->distance < lb->distance ? -1 : 1;
+    }
+    return la->list_no - lb->list_no;
+}
+
+/*
+ * pg_hybrid_ivfflat_search_filtered(index, query, allowed, k, probes)
+ *
+ * the k nearest visible rows among the allowed heap tids. entries whose
+ * heap page holds no allowed row are skipped before they are scored.
+ * the lists are probed nearest first, and past probes lists until k
+ * rows are found, so a selective filter does not leave the results
+ * short. when the allowed rows are fewer than the entries of the probed
+ * lists, they are scored from the heap instead, which is exact.
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(pg_hybrid_ivfflat_search_filtered);
+Datum
+pg_hybrid_ivfflat_search_filtered(PG_FUNCTION_ARGS){
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid indexoid = PG_GETARG_OID(0);
+    Datum value = PG_GETARG_DATUM(1);
+    ArrayType *allowed = PG_GETARG_ARRAYTYPE_P(2);
+    int32 k = PG_GETARG_INT32(3);
+    int32 probes = PG_GETARG_INT32(4);
+    IvfflatBatchStateData state;
+    IvfflatBatchFilterData filter;
+    IvfflatBatchQuery query;
+    AttrNumber attnum;
+    double list_entries;
+    int query_no = 0;
+
+    if(k < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("k must be at least 1")));
+    }
+    if(probes < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("probes must be at least 1")));
+    }
+    InitMaterializedSRF(fcinfo, 0);
+
+    ivfflat_batch_begin(&state, indexoid, k);
+    ivfflat_batch_init_filter(&filter, allowed);
+    state.filter = &filter;
+    state.probes = Max(state.list_count, 1);
+    state.query_count = 1;
+    state.queries = palloc0(sizeof(IvfflatBatchQueryData));
+    query = &state.queries[0];
+    ivfflat_batch_init_query(&state, query, value, state.probes);
+
+    //the entries of the probed lists, from the statistics of the index
+    list_entries = state.index->rd_rel->reltuples;
+    if(list_entries > 0 && state.list_count > 0){
+        list_entries = list_entries * Min(probes, state.list_count) / state.list_count;
+    }else{
+        list_entries = 0;
+    }
+    //an expression index has no heap column to score, and the rows of
+    //the heap are not all in a partial index
+    attnum = state.index->rd_index->indkey.values[0];
+    if(RelationGetIndexPredicate(state.index) != NIL){
+        attnum = InvalidAttrNumber;
+    }
+
+    if(filter.tid_count == 0){
+        //nothing is allowed
+    }else if(attnum != InvalidAttrNumber && filter.tid_count <= Max(list_entries, (double) k)){
+        ivfflat_batch_score_allowed(&state, query, attnum);
+    }else{
+        BlockNumber *start_pages = palloc(Max(state.list_count, 1) * sizeof(BlockNumber));
+        int list_count = ivfflat_batch_score_all_centers(&state, start_pages);
+
+        ivfflat_batch_score_buffer(&state, &query_no, 1);
+        qsort(query->lists, query->list_count, sizeof(IvfflatBatchListData), ivfflat_batch_sort_lists);
+        for(int i = 0; i < query->list_count; i++){
+            BlockNumber blkno;
+
+            if(i >= probes && query->result_count == k){
+                break;
+            }
+            if(query->lists[i].list_no >= list_count){
+                continue;
+            }
+            blkno = start_pages[query->lists[i].list_no];
+            while(BlockNumberIsValid(blkno)){
+                CHECK_FOR_INTERRUPTS();
+                blkno = ivfflat_batch_score_page(&state, blkno, &query_no, 1);
+            }
+        }
+    }
+
+    ivfflat_batch_sort_query_results(query);
+    for(int i = 0; i < query->result_count; i++){
+        Datum values[3];
+        bool isnull[3] = {false, false, false};
+
+        values[0] = Int32GetDatum(i + 1);
+        values[1] = ItemPointerGetDatum(&query->results[i].tid);
+        values[2] = Float8GetDatum(ivfflat_batch_operator_distance(&state, query->results[i].distance));
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, isnull);
+    }
+
+    ivfflat_batch_end(&state);
+    return (Datum) 0;
+}
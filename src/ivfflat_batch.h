@@ -0,0 +1,72 @@
+#ifndef IVFFLAT_BATCH_H
+#define IVFFLAT_BATCH_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "storage/itemptr.h"
+#include "vector.h"
+
+typedef struct IvfflatBatchListData {
+    double distance;
+    int list_no;
+} IvfflatBatchListData;
+
+typedef IvfflatBatchListData * IvfflatBatchList;
+
+typedef struct IvfflatBatchResultData {
+    double distance;
+    ItemPointerData tid;
+} IvfflatBatchResultData;
+
+typedef IvfflatBatchResultData * IvfflatBatchResult;
+
+//one query of the batch. both heaps keep the farthest on top
+typedef struct IvfflatBatchQueryData {
+    //normalized like a scan key, NULL for a null array element
+    Vector value;
+    IvfflatBatchList lists;
+    int list_count;
+    //nearest visible rows
+    IvfflatBatchResult results;
+    int result_count;
+} IvfflatBatchQueryData;
+
+typedef IvfflatBatchQueryData * IvfflatBatchQuery;
+
+//an entry of a page that may enter the results of a query, checked
+//against the heap once the page is unlocked
+typedef struct IvfflatBatchCandidateData {
+    int query_no;
+    double distance;
+    ItemPointerData tid;
+} IvfflatBatchCandidateData;
+
+typedef IvfflatBatchCandidateData * IvfflatBatchCandidate;
+
+//heap tids already checked, shared by the queries
+typedef struct IvfflatBatchVisibleData {
+    ItemPointerData tid;
+    bool visible;
+    //the visible row of the hot chain
+    ItemPointerData visible_tid;
+} IvfflatBatchVisibleData;
+
+typedef IvfflatBatchVisibleData * IvfflatBatchVisible;
+
+//the heap rows a filtered search may return. the rows of a hot chain
+//share a heap page, so an entry is skipped before it is scored when no
+//allowed row is on the page of its heap tid
+typedef struct IvfflatBatchFilterData {
+    //sorted and distinct
+    ItemPointer tids;
+    int tid_count;
+    BlockNumber *blocks;
+    int block_count;
+} IvfflatBatchFilterData;
+
+typedef IvfflatBatchFilterData * IvfflatBatchFilter;
+
+PGDLLEXPORT Datum pg_hybrid_ivfflat_search_batch(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_hybrid_ivfflat_search_filtered(PG_FUNCTION_ARGS);
+
+#endif
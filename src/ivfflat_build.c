@@ -22,6 +22,11 @@
 #include "utils/palloc.h"
 #include "utils/sampling.h"
 #include "varatt.h"
+#include "access/xloginsert.h"
+#include "storage/smgr.h"
+#include "ivfflat_xlog.h"
+#include "ivfflat_options.h"
+#include "utils/typcache.h"
 
 IndexBuildResult *
 ivfflat_build(Relation heap, Relation index, IndexInfo *indexInfo)
@@ -98,12 +103,33 @@ ivfflat_build_init_ctx(
              errmsg("dimensions must be greater than one for this opclass")));
     }
 
-    ctx->sort_desc = CreateTemplateTupleDesc(3);
+    //the key columns after the vector are filters, they must not be
+    //vectors. INCLUDE columns have no opclass
+    for(int i = 1; i < IndexRelationGetNumberOfKeyAttributes(index); i++){
+        if(OidIsValid(index_getprocid(index, i + 1, IVFFALT_VECTOR_DISTANCE_PROC))){
+            ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("only the first column of an ivfflat index can be a vector")));
+        }
+    }
+
+    //sort desc  1: list, 2: tid, 3: vector, 4..: the other columns
+    ctx->sort_desc = CreateTemplateTupleDesc(2 + ctx->tupdesc->natts);
     TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 1, "list", INT4OID, -1, 0);
     TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
     TupleDescInitEntry(ctx->sort_desc, (AttrNumber) 3, "vector", TupleDescAttr(ctx->tupdesc, 0)->atttypid, -1, 0);
+    for(int i = 1; i < ctx->tupdesc->natts; i++){
+        Form_pg_attribute att = TupleDescAttr(ctx->tupdesc, i);
+        TupleDescInitEntry(ctx->sort_desc, (AttrNumber) (3 + i), NameStr(att->attname), att->atttypid, att->atttypmod, 0);
+    }
 
     ctx->sort_slot = MakeSingleTupleTableSlot(ctx->sort_desc, &TTSOpsVirtual);
+    //the btree opclass of the vector type, when there is one
+    ctx->vector_lt_opr = lookup_type_cache(
+        TupleDescAttr(ctx->tupdesc, 0)->atttypid,
+        TYPECACHE_LT_OPR)->lt_opr;
+    ctx->next_itup = NULL;
+    ctx->next_list_no = -1;
     ctx->centers = array_create(
         ctx->list_count,
          ctx->dimensions, 
@@ -112,6 +138,14 @@ ivfflat_build_init_ctx(
         ctx->list_count,
         1,
         sizeof(ListInfoData));
+    ctx->metric = hvector_get_metric(ctx->vector_distance_proc);
+    ctx->radii = (float *) palloc0(ctx->list_count * sizeof(float));
+    ctx->summarized = ivfflat_get_summary_proc(index, &ctx->summary_lt, CurrentMemoryContext);
+    ctx->summary_collation = ctx->summarized ? index->rd_indcollation[1] : InvalidOid;
+    ctx->summaries = (IvfflatListSummary) palloc(ctx->list_count * sizeof(IvfflatListSummaryData));
+    for(int i = 0; i < ctx->list_count; i++){
+        ivfflat_init_summary(&ctx->summaries[i], ctx->summarized);
+    }
     ctx->tmp_ctx = AllocSetContextCreate(
         CurrentMemoryContext,
         "ivfflat temp ctx",
@@ -124,6 +158,8 @@ ivfflat_build_destroy_ctx(IvfflatBuildCtx ctx)
 {
     array_destroy(ctx->centers);
     array_destroy(ctx->list_infos);
+    pfree(ctx->radii);
+    pfree(ctx->summaries);
     MemoryContextDelete(ctx->tmp_ctx);
     pfree(ctx);
 }
@@ -132,6 +168,11 @@ void
 ivfflat_build_index(IvfflatBuildCtx ctx,ForkNumber fork_num){
     //step 1. calculate the centers
     ivfflat_calculate_centers(ctx);
+    //the main fork is written directly to the storage
+    if(fork_num == MAIN_FORKNUM){
+        ivfflat_bulk_build(ctx);
+        return;
+    }
     //step 2. create the meta page
     ivfflat_create_meta_page(
         ctx->index,
@@ -145,7 +186,8 @@ ivfflat_build_index(IvfflatBuildCtx ctx,ForkNumber fork_num){
         ctx->dimensions,
         ctx->list_count,
         fork_num,
-        ctx->list_infos);
+        ctx->list_infos,
+        ctx->summarized);
     //step 4. create the entry pages
     ivfflat_create_entry_pages(ctx,fork_num);
     if(fork_num == INIT_FORKNUM){
@@ -366,6 +408,159 @@ ivfflat_normalize_centers(
     }
 }
 
+//bytes of the matrices, the dot products take the larger of one
+//column of samples and one strip of center rows
+Size
+ivfflat_kmeans_matrix_size(Array samples, Array centers){
+    Size dimensions = (Size) samples->dimensions;
+    Size dot_count = Max((Size) samples->length,
+        (Size) IVFFLAT_KMEANS_STRIP_ROWS * (Size) centers->max_length);
+
+    return sizeof(IvfflatKmeansMatrixData) +
+        (sizeof(float) * dimensions + sizeof(double)) * (Size) samples->length +
+        (sizeof(float) * dimensions + sizeof(double)) * (Size) centers->max_length +
+        sizeof(double) * dot_count +
+        sizeof(float) * dimensions *
+            (IVFFLAT_KMEANS_BLOCK_ROWS + IVFFLAT_KMEANS_STRIP_ROWS) +
+        4 * PG_CACHE_LINE_SIZE;
+}
+
+//copy the samples into a matrix. NULL when the kmeans distance is not
+//one the matrices can compute
+IvfflatKmeansMatrix
+ivfflat_kmeans_matrix_create(FmgrInfo *distance_proc, Array samples, Array centers){
+    IvfflatKmeansMatrix matrix;
+    int dimensions = samples->dimensions;
+
+    if(distance_proc->fn_addr != hvector_l2_distance &&
+        distance_proc->fn_addr != hvector_spherical_distance){
+        return NULL;
+    }
+
+    matrix = palloc(sizeof(IvfflatKmeansMatrixData));
+    matrix->spherical = distance_proc->fn_addr == hvector_spherical_distance;
+    matrix->dimensions = dimensions;
+    matrix->samples = palloc_aligned(
+        sizeof(float) * (Size) dimensions * (Size) samples->length,
+        PG_CACHE_LINE_SIZE,
+        MCXT_ALLOC_HUGE);
+    matrix->sample_norms = palloc_extended(
+        sizeof(double) * (Size) samples->length,
+        MCXT_ALLOC_HUGE);
+    matrix->centers = palloc_aligned(
+        sizeof(float) * (Size) dimensions * (Size) centers->max_length,
+        PG_CACHE_LINE_SIZE,
+        MCXT_ALLOC_HUGE);
+    matrix->center_norms = palloc_extended(
+        sizeof(double) * (Size) centers->max_length,
+        MCXT_ALLOC_HUGE);
+    matrix->dots = palloc_extended(
+        sizeof(double) * Max((Size) samples->length,
+            (Size) IVFFLAT_KMEANS_STRIP_ROWS * (Size) centers->max_length),
+        MCXT_ALLOC_HUGE);
+    matrix->x_rows = palloc_aligned(
+        sizeof(float) * (Size) dimensions * IVFFLAT_KMEANS_BLOCK_ROWS,
+        PG_CACHE_LINE_SIZE,
+        0);
+    matrix->y_rows = palloc_aligned(
+        sizeof(float) * (Size) dimensions * IVFFLAT_KMEANS_STRIP_ROWS,
+        PG_CACHE_LINE_SIZE,
+        0);
+
+    for(int j = 0; j < samples->length; j++){
+        Vector vec = (Vector) array_get(samples, j);
+        float *row = matrix->samples + (Size) j * dimensions;
+        double norm = 0.0;
+
+        memcpy(row, vec->data, sizeof(float) * dimensions);
+        for(int k = 0; k < dimensions; k++){
+            norm += (double) row[k] * row[k];
+        }
+        matrix->sample_norms[j] = norm;
+    }
+    return matrix;
+}
+
+//copy the chosen centers into the matrix
+void
+ivfflat_kmeans_matrix_load_centers(IvfflatKmeansMatrix matrix, Array centers){
+    int dimensions = matrix->dimensions;
+
+    for(int i = 0; i < centers->length; i++){
+        Vector vec = (Vector) array_get(centers, i);
+        float *row = matrix->centers + (Size) i * dimensions;
+        double norm = 0.0;
+
+        memcpy(row, vec->data, sizeof(float) * dimensions);
+        for(int k = 0; k < dimensions; k++){
+            norm += (double) row[k] * row[k];
+        }
+        matrix->center_norms[i] = norm;
+    }
+}
+
+//the kmeans distance from a dot product and the squared norms
+static inline double
+ivfflat_kmeans_matrix_distance(IvfflatKmeansMatrix matrix, double dot, double x_norm, double c_norm){
+    double d;
+
+    if(matrix->spherical){
+        if(dot > 1.0){
+            dot = 1.0;
+        }else if(dot < -1.0){
+            dot = -1.0;
+        }
+        return acos(dot) / M_PI;
+    }
+    d = x_norm + c_norm - 2.0 * dot;
+    return d > 0.0 ? sqrt(d) : 0.0;
+}
+
+//the kmeans distance of one pair, without the cancellation of the norm form
+static double
+ivfflat_kmeans_pair_distance(IvfflatKmeansMatrix matrix, const float *a, const float *b){
+    double sum = 0.0;
+
+    if(matrix->spherical){
+        for(int k = 0; k < matrix->dimensions; k++){
+            sum += (double) a[k] * b[k];
+        }
+        return ivfflat_kmeans_matrix_distance(matrix, sum, 1.0, 1.0);
+    }
+    for(int k = 0; k < matrix->dimensions; k++){
+        double diff = (double) a[k] - b[k];
+        sum += diff * diff;
+    }
+    return sqrt(sum);
+}
+
+//distance of sample_j to centers[i]
+static double
+ivfflat_kmeans_sample_distance(
+    IvfflatKmeansMatrix matrix,
+    FmgrInfo *distance_proc,
+    Oid collation,
+    Array samples,
+    Array centers,
+    int j,
+    int i
+){
+    if(matrix != NULL){
+        return ivfflat_kmeans_pair_distance(
+            matrix,
+            matrix->samples + (Size) j * matrix->dimensions,
+            matrix->centers + (Size) i * matrix->dimensions);
+    }
+    return DatumGetFloat8(
+        FunctionCall2Coll(
+            distance_proc,
+            collation,
+            PointerGetDatum(array_get(samples, j)),
+            PointerGetDatum(array_get(centers, i))
+        )
+    );
+}
+
 /*
 choose centers from samples using kmeans++ seeding technique:
 
@@ -380,11 +575,13 @@ ivfflat_kmeans_plusplus(
     Relation index,
     Array samples,
     Array centers,
-    float *lower_bounds //x_j distance to centers[i]
+    float *lower_bounds, //x_j distance to centers[i]
+    IvfflatKmeansMatrix matrix //NULL to call the distance function per pair
 ){
     Oid collation;
     int64 i;
     int j;
+    int chosen;//the sample copied to centers[i]
     int num_centers = centers->max_length;
     int num_samples = samples->length;
     float *weight;//D(x) = min_i=1,...,k ||x - c_i||^2
@@ -395,10 +592,11 @@ ivfflat_kmeans_plusplus(
     collation = index->rd_indcollation[0];
 
     //step 1a. Choose an initial center c1 uniformly at random from X .
+    chosen = RandomInt() % samples->length;
     array_copy(
         centers, 
         0, 
-        array_get(samples, RandomInt() % samples->length));
+        array_get(samples, chosen));
     centers->length++;
 
     for(i = 0; i < num_samples; i++){
@@ -413,20 +611,39 @@ ivfflat_kmeans_plusplus(
 
 		sum = 0.0;
 
+        //dot products of all samples with centers[i] in one pass
+        if(matrix != NULL){
+            hvector_dot_matrix(
+                matrix->dimensions,
+                matrix->samples,
+                num_samples,
+                matrix->samples + (Size) chosen * matrix->dimensions,
+                1,
+                matrix->dots,
+                1);
+        }
+
         for(j=0; j<num_samples; j++){
             //evaluate D(x) -- the shortest distance from a data point x 
             // to the closest center we have already chosen.
-            Datum vec = PointerGetDatum(
-                array_get(samples,j));//sample_j
-            double distance = DatumGetFloat8(
-                FunctionCall2Coll(
-                    distance_proc,
-                    collation,
-                    vec,//sample_j
-                    PointerGetDatum(
-                        array_get(centers,i))//centers[i]
-                )
-            );
+            double distance;
+
+            if(matrix != NULL){
+                distance = ivfflat_kmeans_matrix_distance(
+                    matrix,
+                    matrix->dots[j],
+                    matrix->sample_norms[j],
+                    matrix->sample_norms[chosen]);
+            }else{
+                distance = DatumGetFloat8(
+                    FunctionCall2Coll(
+                        distance_proc,
+                        collation,
+                        PointerGetDatum(array_get(samples,j)),//sample_j
+                        PointerGetDatum(array_get(centers,i))//centers[i]
+                    )
+                );
+            }
             lower_bounds[j * num_centers + i] = distance;
 
             //evaluate the shortest squared distance
@@ -451,6 +668,7 @@ ivfflat_kmeans_plusplus(
             }
         }
         //must be a center been chosen
+        chosen = j;
         array_copy(
             centers,
             i + 1,//next centers[i+1]
@@ -462,6 +680,325 @@ ivfflat_kmeans_plusplus(
     pfree(weight);
 }
 
+//distances between samples, out[a * y_count + b] = d(x_a, y_b). the rows
+//are gathered into the matrix buffers, so there are at most
+//IVFFLAT_KMEANS_BLOCK_ROWS x rows and IVFFLAT_KMEANS_STRIP_ROWS y rows
+static void
+ivfflat_kmeans_distance_block(
+    IvfflatKmeansMatrix matrix,
+    FmgrInfo *distance_proc,
+    Oid collation,
+    Array samples,
+    const int *x,
+    int x_count,
+    const int *y,
+    int y_count,
+    double *out
+){
+    int dimensions;
+
+    if(matrix == NULL){
+        for(int a = 0; a < x_count; a++){
+            Datum x_a = PointerGetDatum(array_get(samples, x[a]));
+            for(int b = 0; b < y_count; b++){
+                out[a * y_count + b] = DatumGetFloat8(
+                    FunctionCall2Coll(
+                        distance_proc,
+                        collation,
+                        x_a,
+                        PointerGetDatum(array_get(samples, y[b]))
+                    )
+                );
+            }
+        }
+        return;
+    }
+
+    dimensions = matrix->dimensions;
+    for(int a = 0; a < x_count; a++){
+        memcpy(matrix->x_rows + (Size) a * dimensions,
+            matrix->samples + (Size) x[a] * dimensions,
+            sizeof(float) * dimensions);
+    }
+    for(int b = 0; b < y_count; b++){
+        memcpy(matrix->y_rows + (Size) b * dimensions,
+            matrix->samples + (Size) y[b] * dimensions,
+            sizeof(float) * dimensions);
+    }
+    hvector_dot_matrix(
+        dimensions,
+        matrix->x_rows,
+        x_count,
+        matrix->y_rows,
+        y_count,
+        out,
+        y_count);
+    for(int a = 0; a < x_count; a++){
+        for(int b = 0; b < y_count; b++){
+            out[a * y_count + b] = ivfflat_kmeans_matrix_distance(
+                matrix,
+                out[a * y_count + b],
+                matrix->sample_norms[x[a]],
+                matrix->sample_norms[y[b]]);
+        }
+    }
+}
+
+//lower the squared distance of each point to its closest center by the
+//centers[first..count). closest, when not NULL, gets the center number
+static void
+ivfflat_kmeans_update_closest(
+    IvfflatKmeansMatrix matrix,
+    FmgrInfo *distance_proc,
+    Oid collation,
+    Array samples,
+    const int *points,
+    int point_count,
+    const int *centers,
+    int first,
+    int count,
+    double *min_distances,
+    int *closest,
+    double *out
+){
+    for(int p = 0; p < point_count; p += IVFFLAT_KMEANS_BLOCK_ROWS){
+        int rows = Min(IVFFLAT_KMEANS_BLOCK_ROWS, point_count - p);
+
+        CHECK_FOR_INTERRUPTS();
+
+        for(int c = first; c < count; c += IVFFLAT_KMEANS_STRIP_ROWS){
+            int cols = Min(IVFFLAT_KMEANS_STRIP_ROWS, count - c);
+
+            ivfflat_kmeans_distance_block(
+                matrix,
+                distance_proc,
+                collation,
+                samples,
+                points + p,
+                rows,
+                centers + c,
+                cols,
+                out);
+            for(int a = 0; a < rows; a++){
+                for(int b = 0; b < cols; b++){
+                    double d = out[a * cols + b];
+                    d *= d;
+                    if(d < min_distances[p + a]){
+                        min_distances[p + a] = d;
+                        if(closest != NULL){
+                            closest[p + a] = c + b;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+choose centers from samples using k-means|| (scalable k-means++):
+
+1. Choose an initial candidate uniformly at random from X.
+2. In each of a few rounds, add every x to the candidates independently
+   with probability l * D(x)^2 / Sigma(D(x)^2), l = 2k.
+3. Weight each candidate by the count of samples closest to it.
+4. Recluster the weighted candidates into k centers with kmeans++.
+
+a round scores all samples against all new candidates at once, so the
+seeding takes a few blocked passes instead of k passes over the samples
+*/
+void
+ivfflat_kmeans_parallel(
+    Relation index,
+    Array samples,
+    Array centers,
+    float *lower_bounds, //x_j distance to centers[i]
+    IvfflatKmeansMatrix matrix //NULL to call the distance function per pair
+){
+    Oid collation;
+    int num_centers = centers->max_length;
+    int num_samples = samples->length;
+    double oversampling = (double) IVFFLAT_KMEANS_OVERSAMPLING * num_centers;
+    int *sample_numbers;//0..num_samples-1
+    double *min_distances;//D(x)^2
+    int *closest;//the candidate closest to x
+    int *candidates;//sample numbers
+    int candidate_count;
+    int candidate_max;
+    int scored;
+    double *weights;
+    double *candidate_distances;
+    int *center_samples;
+    double *out;
+    FmgrInfo *distance_proc = ivfflat_get_proc_info(
+        index,
+        IVFFALT_KMEANS_DISTANCE_PROC);
+    collation = index->rd_indcollation[0];
+
+    sample_numbers = palloc_extended(sizeof(int) * (Size) num_samples, MCXT_ALLOC_HUGE);
+    min_distances = palloc_extended(sizeof(double) * (Size) num_samples, MCXT_ALLOC_HUGE);
+    closest = palloc_extended(sizeof(int) * (Size) num_samples, MCXT_ALLOC_HUGE);
+    out = palloc(sizeof(double) * IVFFLAT_KMEANS_BLOCK_ROWS * IVFFLAT_KMEANS_STRIP_ROWS);
+    for(int j = 0; j < num_samples; j++){
+        sample_numbers[j] = j;
+        min_distances[j] = DBL_MAX;
+        closest[j] = 0;
+    }
+
+    //step 1. the first candidate
+    candidate_max = Min(num_samples, Max(num_centers, 64));
+    candidates = palloc(sizeof(int) * candidate_max);
+    candidates[0] = RandomInt() % num_samples;
+    min_distances[candidates[0]] = 0.0;
+    candidate_count = 1;
+    scored = 0;
+
+    //step 2. oversample in rounds
+    for(int round = 0; ; round++){
+        double cost = 0.0;
+
+        ivfflat_kmeans_update_closest(
+            matrix,
+            distance_proc,
+            collation,
+            samples,
+            sample_numbers,
+            num_samples,
+            candidates,
+            scored,
+            candidate_count,
+            min_distances,
+            closest,
+            out);
+        scored = candidate_count;
+
+        for(int j = 0; j < num_samples; j++){
+            cost += min_distances[j];
+        }
+        if(round == IVFFLAT_KMEANS_PARALLEL_ROUNDS || cost <= 0.0){
+            break;
+        }
+
+        //a candidate has D(x) = 0 and is not chosen again
+        for(int j = 0; j < num_samples; j++){
+            if(RandomDouble() * cost >= oversampling * min_distances[j]){
+                continue;
+            }
+            if(candidate_count == candidate_max){
+                candidate_max = Min(num_samples, candidate_max * 2);
+                candidates = repalloc_huge(candidates, sizeof(int) * (Size) candidate_max);
+            }
+            min_distances[j] = 0.0;
+            closest[j] = candidate_count;
+            candidates[candidate_count++] = j;
+        }
+    }
+
+    //step 3. weight the candidates
+    weights = palloc0(sizeof(double) * candidate_count);
+    for(int j = 0; j < num_samples; j++){
+        weights[closest[j]] += 1.0;
+    }
+
+    //step 4. weighted kmeans++ over the candidates
+    center_samples = palloc(sizeof(int) * num_centers);
+    if(candidate_count <= num_centers){
+        //too few distinct samples, the rest are random samples
+        for(int i = 0; i < num_centers; i++){
+            center_samples[i] = i < candidate_count ?
+                candidates[i] : (int) (RandomInt() % num_samples);
+        }
+    }else{
+        double choice = RandomDouble() * num_samples;
+        int c;
+
+        for(c = 0; c < candidate_count - 1; c++){
+            choice -= weights[c];
+            if(choice <= 0.0){
+                break;
+            }
+        }
+        center_samples[0] = candidates[c];
+
+        candidate_distances = palloc(sizeof(double) * candidate_count);
+        for(c = 0; c < candidate_count; c++){
+            candidate_distances[c] = DBL_MAX;
+        }
+
+        for(int i = 0; i < num_centers - 1; i++){
+            double sum = 0.0;
+
+            ivfflat_kmeans_update_closest(
+                matrix,
+                distance_proc,
+                collation,
+                samples,
+                candidates,
+                candidate_count,
+                center_samples,
+                i,
+                i + 1,
+                candidate_distances,
+                NULL,
+                out);
+
+            for(c = 0; c < candidate_count; c++){
+                sum += weights[c] * candidate_distances[c];
+            }
+            choice = RandomDouble() * sum;
+            for(c = 0; c < candidate_count - 1; c++){
+                choice -= weights[c] * candidate_distances[c];
+                if(choice <= 0.0){
+                    break;
+                }
+            }
+            center_samples[i + 1] = candidates[c];
+        }
+        pfree(candidate_distances);
+    }
+
+    for(int i = 0; i < num_centers; i++){
+        array_copy(centers, i, array_get(samples, center_samples[i]));
+    }
+    centers->length = num_centers;
+
+    //the distances of all samples to all centers, as kmeans++ leaves them
+    for(int p = 0; p < num_samples; p += IVFFLAT_KMEANS_BLOCK_ROWS){
+        int rows = Min(IVFFLAT_KMEANS_BLOCK_ROWS, num_samples - p);
+
+        CHECK_FOR_INTERRUPTS();
+
+        for(int c = 0; c < num_centers; c += IVFFLAT_KMEANS_STRIP_ROWS){
+            int cols = Min(IVFFLAT_KMEANS_STRIP_ROWS, num_centers - c);
+
+            ivfflat_kmeans_distance_block(
+                matrix,
+                distance_proc,
+                collation,
+                samples,
+                sample_numbers + p,
+                rows,
+                center_samples + c,
+                cols,
+                out);
+            for(int a = 0; a < rows; a++){
+                for(int b = 0; b < cols; b++){
+                    lower_bounds[(int64) (p + a) * num_centers + c + b] =
+                        out[a * cols + b];
+                }
+            }
+        }
+    }
+
+    pfree(sample_numbers);
+    pfree(min_distances);
+    pfree(closest);
+    pfree(candidates);
+    pfree(weights);
+    pfree(center_samples);
+    pfree(out);
+}
+
 /*
 Triangle Inequality algorithm avoids unnecessary distance calculations 
 by applying the triangle inequality in two different ways, 
@@ -488,6 +1025,7 @@ ivfflat_elkan_kmeans(
     int iteration;
     float *new_d;//d(c,mean(c))
     int num_centers = centers->max_length;
+    IvfflatKmeansMatrix matrix;
 
     Size sample_size;
     Size centers_size;
@@ -544,6 +1082,14 @@ ivfflat_elkan_kmeans(
         index, IVFFALT_KMEANS_NORMALIZATION_PROC);
     collation = index->rd_indcollation[0];
 
+    //the matrices copy the samples once more, so fall back to the
+    //distance function when they do not fit as well
+    matrix = NULL;
+    if(t_size + ivfflat_kmeans_matrix_size(samples, centers) <=
+        (Size)maintenance_work_mem * 1024L){
+        matrix = ivfflat_kmeans_matrix_create(distance_proc, samples, centers);
+    }
+
     agg = palloc(agg_size);
     center_counts = palloc(center_counts_size);
     closest_centers = palloc(closest_centers_size);
@@ -562,12 +1108,26 @@ ivfflat_elkan_kmeans(
     
     //step 1. Init
     //step 1.1 choose init centers
-    ivfflat_kmeans_plusplus(
-        index,
-        samples,
-        centers,
-        lower_bounds
-    );
+    if(ivfflat_get_seeding(index) == IVFFLAT_SEEDING_KMEANS_PARALLEL){
+        ivfflat_kmeans_parallel(
+            index,
+            samples,
+            centers,
+            lower_bounds,
+            matrix
+        );
+    }else{
+        ivfflat_kmeans_plusplus(
+            index,
+            samples,
+            centers,
+            lower_bounds,
+            matrix
+        );
+    }
+    if(matrix != NULL){
+        ivfflat_kmeans_matrix_load_centers(matrix, centers);
+    }
 
     //step 1.2 assign sample_j to its closest center[i]
     for(int j = 0; j < samples->length; j++){
@@ -595,22 +1155,53 @@ ivfflat_elkan_kmeans(
 
         //algorithm step1.
         //step 2.1 evaluate distance between all centers
-        for(int i = 0; i < num_centers; i++){
-            //center[i]
-            Datum center = PointerGetDatum(array_get(centers, i));
-            for(int j = i+1; j < num_centers; j++){
-                float distance = DatumGetFloat8(
-                    FunctionCall2Coll(
-                        distance_proc,
-                        collation,
-                        center,//center i
-                        PointerGetDatum(
-                            array_get(centers, j)//center j
+        if(matrix != NULL){
+            //a strip of center rows against the centers from the
+            //strip on, the other half is symmetric
+            for(int first = 0; first < num_centers; first += IVFFLAT_KMEANS_STRIP_ROWS){
+                int rows = Min(IVFFLAT_KMEANS_STRIP_ROWS, num_centers - first);
+                int cols = num_centers - first;
+                float *strip = matrix->centers + (Size) first * matrix->dimensions;
+
+                hvector_dot_matrix(
+                    matrix->dimensions,
+                    strip,
+                    rows,
+                    strip,
+                    cols,
+                    matrix->dots,
+                    cols);
+                for(int i = first; i < first + rows; i++){
+                    double *dots = matrix->dots + (Size) (i - first) * cols;
+                    for(int j = i+1; j < num_centers; j++){
+                        float distance = ivfflat_kmeans_matrix_distance(
+                            matrix,
+                            dots[j - first],
+                            matrix->center_norms[i],
+                            matrix->center_norms[j])/2;
+                        half_distances[i * num_centers + j] = distance;
+                        half_distances[j * num_centers + i] = distance;
+                    }
+                }
+            }
+        }else{
+            for(int i = 0; i < num_centers; i++){
+                //center[i]
+                Datum center = PointerGetDatum(array_get(centers, i));
+                for(int j = i+1; j < num_centers; j++){
+                    float distance = DatumGetFloat8(
+                        FunctionCall2Coll(
+                            distance_proc,
+                            collation,
+                            center,//center i
+                            PointerGetDatum(
+                                array_get(centers, j)//center j
+                            )
                         )
-                    )
-                )/2;
-                half_distances[i * num_centers + j] = distance;
-                half_distances[j * num_centers + i] = distance;
+                    )/2;
+                    half_distances[i * num_centers + j] = distance;
+                    half_distances[j * num_centers + i] = distance;
+                }
             }
         }
 
@@ -644,7 +1235,6 @@ ivfflat_elkan_kmeans(
 
             //
             for(int i = 0; i < num_centers; i++){
-                Datum sample_j;
                 float d;
 
                 /*
@@ -664,18 +1254,15 @@ ivfflat_elkan_kmeans(
                 }
 
                 //algorithm step3a.
-                sample_j = PointerGetDatum(array_get(samples, j));
                 if(jreset){
-                    d = DatumGetFloat8(
-                        FunctionCall2Coll(
-                            distance_proc, 
-                            collation, 
-                            sample_j, 
-                            PointerGetDatum(
-                                array_get(centers, 
-                                    closest_centers[j]))
-                            )
-                        );
+                    d = ivfflat_kmeans_sample_distance(
+                        matrix,
+                        distance_proc,
+                        collation,
+                        samples,
+                        centers,
+                        j,
+                        closest_centers[j]);
                     lower_bounds[j * num_centers + closest_centers[j]] = d;
                     upper_bounds[j] = d;
                     jreset = false;
@@ -686,15 +1273,14 @@ ivfflat_elkan_kmeans(
                 //algorithm step3b.
                 if(d > lower_bounds[j * num_centers + i] ||
                     d > half_distances[closest_centers[j] * num_centers + i]){
-                    float d2 = DatumGetFloat8(
-                        FunctionCall2Coll(
-                            distance_proc, 
-                            collation, 
-                            sample_j, 
-                            PointerGetDatum(
-                                array_get(centers, i))
-                            )
-                        );
+                    float d2 = ivfflat_kmeans_sample_distance(
+                        matrix,
+                        distance_proc,
+                        collation,
+                        samples,
+                        centers,
+                        j,
+                        i);
                     lower_bounds[j * num_centers + i] = d2;
                     if(d2 < d){
                         closest_centers[j] = i;
@@ -723,13 +1309,20 @@ ivfflat_elkan_kmeans(
         for(int i = 0; i < num_centers; i++){
             Datum center = PointerGetDatum(array_get(centers, i));
             Datum new_center = PointerGetDatum(array_get(new_centers, i));
-            new_d[i] = DatumGetFloat8(
-                FunctionCall2Coll(
-                    distance_proc,
-                    collation,
-                    center,
-                    new_center
-            ));
+            if(matrix != NULL){
+                new_d[i] = ivfflat_kmeans_pair_distance(
+                    matrix,
+                    matrix->centers + (Size) i * matrix->dimensions,
+                    ((Vector) DatumGetPointer(new_center))->data);
+            }else{
+                new_d[i] = DatumGetFloat8(
+                    FunctionCall2Coll(
+                        distance_proc,
+                        collation,
+                        center,
+                        new_center
+                ));
+            }
         }
 
         for(int j = 0; j < samples->length; j++){
@@ -755,6 +1348,9 @@ ivfflat_elkan_kmeans(
                 array_get(new_centers, i)
             );
         }
+        if(matrix != NULL){
+            ivfflat_kmeans_matrix_load_centers(matrix, centers);
+        }
         if(changes == 0 && iteration != 0){
             break;
         }
@@ -871,16 +1467,23 @@ ivfflat_create_meta_page(
     Buffer buf ;
     Page page;
     GenericXLogState *state;
-    IvfflatMetaPage meta;
     buf= ivfflat_new_buffer(index, forkNum);
     ivfflat_start_xlog(index, &buf, &page, &state);
-    meta = IvfflatPageGetMeta(page);
+    ivfflat_fill_meta_page(page, dimensions, list_count);
+    ivfflat_commit_xlog(buf, state);
+}
+
+void
+ivfflat_fill_meta_page(Page page, int dimensions, int list_count){
+    IvfflatMetaPage meta = IvfflatPageGetMeta(page);
     meta->version = IVFFLAT_VERSION;
     meta->dimensions = dimensions;
     meta->list_count = list_count;
+    meta->buffer_start_page = InvalidBlockNumber;
+    meta->buffer_insert_page = InvalidBlockNumber;
+    meta->buffer_merge_page = InvalidBlockNumber;
     ((PageHeader) page)->pd_lower =
         ((char *) meta + sizeof(IvfflatMetaPageData)) - (char *) page;
-    ivfflat_commit_xlog(buf, state);
 }
 
 void
@@ -890,7 +1493,8 @@ ivfflat_create_list_pages(
     int dimensions,
     int list_count,
     ForkNumber fork_num,
-    Array list_infos
+    Array list_infos,
+    bool summarized
 ){
     Size list_size;
     IvfflatList list_entry;
@@ -912,6 +1516,7 @@ ivfflat_create_list_pages(
 
         list_entry->start_page = InvalidBlockNumber;
         list_entry->insert_page = InvalidBlockNumber;
+        ivfflat_init_summary(&list_entry->summary, summarized);
         center = array_get(centers, i);
         memcpy(
             &list_entry->center, 
@@ -947,6 +1552,7 @@ void
 ivfflat_scan_tuples(IvfflatBuildCtx ctx){
     ctx->sort_state = ivfflat_init_sort_state(
         ctx->sort_desc,
+        ctx->vector_lt_opr,
         maintenance_work_mem,
         NULL
     );
@@ -965,15 +1571,20 @@ ivfflat_scan_tuples(IvfflatBuildCtx ctx){
 }
 
 Tuplesortstate *
-ivfflat_init_sort_state(TupleDesc tupdesc,int memory, SortCoordinate coordinate){
-    AttrNumber	attNums[] = {1};
-	Oid			sortOperators[] = {Int4LessOperator};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
+ivfflat_init_sort_state(
+    TupleDesc tupdesc,
+    Oid vector_lt_opr,
+    int memory,
+    SortCoordinate coordinate){
+    //sort desc  1: list_no, 2: tid, 3: vector
+    AttrNumber	attNums[] = {1, 3, 2};
+	Oid			sortOperators[] = {Int4LessOperator, vector_lt_opr, TIDLessOperator};
+	Oid			sortCollations[] = {InvalidOid, InvalidOid, InvalidOid};
+	bool		nullsFirstFlags[] = {false, false, false};
 
 	return tuplesort_begin_heap(
         tupdesc,
-        1,
+        OidIsValid(vector_lt_opr) ? 3 : 1,
         attNums,
         sortOperators,
         sortCollations,
@@ -1000,7 +1611,7 @@ ivfflat_sort_tuples_callback(
 
     old_ctx = MemoryContextSwitchTo(ctx->tmp_ctx);
 
-    ivfflat_sort_tuples(index, tid, values, ctx);
+    ivfflat_sort_tuples(index, tid, values, isnull, ctx);
 
     MemoryContextSwitchTo(old_ctx);
 	MemoryContextReset(ctx->tmp_ctx);
@@ -1011,6 +1622,7 @@ ivfflat_sort_tuples(
     Relation index,
     ItemPointer tid,
     Datum *values,
+    bool *isnull,
     IvfflatBuildCtx ctx){
     double distance;
     double min_distance = DBL_MAX;
@@ -1039,6 +1651,21 @@ ivfflat_sort_tuples(
             closest_center = i;
         }
     }
+    if(ctx->metric != HVECTOR_METRIC_NONE){
+        float radius = ivfflat_covering_radius(ctx->metric, min_distance);
+        if(radius > ctx->radii[closest_center]){
+            ctx->radii[closest_center] = radius;
+        }
+    }
+    if(ctx->summarized){
+        //by-value datums, they outlive the tuple
+        ivfflat_summary_add(
+            &ctx->summaries[closest_center],
+            &ctx->summary_lt,
+            ctx->summary_collation,
+            values[1],
+            isnull[1]);
+    }
 
     //fill tuple
     ExecClearTuple(ctx->sort_slot);
@@ -1048,6 +1675,10 @@ ivfflat_sort_tuples(
     ctx->sort_slot->tts_isnull[1] = false;
     ctx->sort_slot->tts_values[2] = value;
     ctx->sort_slot->tts_isnull[2] = false;
+    for(int i = 1; i < ctx->tupdesc->natts; i++){
+        ctx->sort_slot->tts_values[2 + i] = values[i];
+        ctx->sort_slot->tts_isnull[2 + i] = isnull[i];
+    }
     ExecStoreVirtualTuple(ctx->sort_slot);
     tuplesort_puttupleslot(ctx->sort_state, ctx->sort_slot);
 
@@ -1057,7 +1688,6 @@ ivfflat_sort_tuples(
 void
 ivfflat_insert_tuples(IvfflatBuildCtx ctx, ForkNumber fork_num){
     TupleTableSlot *slot;
-    TupleDesc tupdesc;
     IndexTuple itup;
     int list_no;
     ListInfo list_info;
@@ -1066,11 +1696,9 @@ ivfflat_insert_tuples(IvfflatBuildCtx ctx, ForkNumber fork_num){
         ctx->sort_desc,
         &TTSOpsMinimalTuple
     );
-    tupdesc = ctx->tupdesc;
 
-    ivfflat_get_next_tuple(
-        ctx->sort_state, 
-        tupdesc,
+    ivfflat_get_next_posting(
+        ctx,
         slot,
         &itup,
         &list_no);
@@ -1087,6 +1715,7 @@ ivfflat_insert_tuples(IvfflatBuildCtx ctx, ForkNumber fork_num){
 
         buf = ivfflat_new_buffer(ctx->index, fork_num);
         ivfflat_start_xlog(ctx->index, &buf, &page, &state);
+        IvfflatPageGetOpaque(page)->list_tag = IvfflatListTag(i);
 
         start_page = BufferGetBlockNumber(buf);
         while(list_no == i){
@@ -1112,9 +1741,8 @@ ivfflat_insert_tuples(IvfflatBuildCtx ctx, ForkNumber fork_num){
 
             pfree(itup);
 
-            ivfflat_get_next_tuple(
-                ctx->sort_state,
-                tupdesc,
+            ivfflat_get_next_posting(
+                ctx,
                 slot,
                 &itup,
                 &list_no);
@@ -1142,13 +1770,12 @@ ivfflat_get_next_tuple(
     int *list_no
 ){
     if(tuplesort_gettupleslot(sort_state, true, false, slot, NULL)){
-        Datum value;
         bool isnull;
 
-        //sort desc  1: list_no, 2: tid, 3: vector(values[0])
+        //sort desc  1: list_no, 2: tid, 3..: the index columns
         *list_no = DatumGetInt32(slot_getattr(slot, 1, &isnull));
-        value = slot_getattr(slot, 3, &isnull);
-        *itup = index_form_tuple(tupdesc, &value, &isnull);
+        slot_getsomeattrs(slot, 2 + tupdesc->natts);
+        *itup = index_form_tuple(tupdesc, &slot->tts_values[2], &slot->tts_isnull[2]);
         (*itup)->t_tid = *((ItemPointer) DatumGetPointer(
             slot_getattr(slot, 2, &isnull)));
     }else{
@@ -1156,6 +1783,61 @@ ivfflat_get_next_tuple(
     }
 }
 
+/*
+ * the next entry of the sorted tuples. heap tids of identical vectors in
+ * the same list are put into one posting tuple
+ */
+void
+ivfflat_get_next_posting(
+    IvfflatBuildCtx ctx,
+    TupleTableSlot *slot,
+    IndexTuple *itup,
+    int *list_no
+){
+    IndexTuple first,next;
+    int first_list_no,next_list_no;
+    int ntids = 1;
+    int max_tids;
+    ItemPointerData tids[BLCKSZ / sizeof(ItemPointerData)];
+
+    //the tuple read ahead by the last call
+    if(ctx->next_itup != NULL){
+        first = ctx->next_itup;
+        first_list_no = ctx->next_list_no;
+        ctx->next_itup = NULL;
+    }else{
+        ivfflat_get_next_tuple(ctx->sort_state, ctx->tupdesc, slot, &first, &first_list_no);
+    }
+    *list_no = first_list_no;
+    if(first_list_no < 0){
+        return;
+    }
+
+    tids[0] = first->t_tid;
+    max_tids = ivfflat_max_posting_tids(first, ctx->tupdesc);
+    while(true){
+        ivfflat_get_next_tuple(ctx->sort_state, ctx->tupdesc, slot, &next, &next_list_no);
+        if(next_list_no != first_list_no ||
+            ntids == max_tids ||
+            !ivfflat_key_equal(first, next, ctx->tupdesc)){
+            break;
+        }
+        tids[ntids++] = next->t_tid;
+        pfree(next);
+    }
+    if(next_list_no >= 0){
+        ctx->next_itup = next;
+        ctx->next_list_no = next_list_no;
+    }
+
+    if(ntids > 1){
+        *itup = ivfflat_form_posting(first, ctx->tupdesc, tids, ntids);
+        pfree(first);
+    }else{
+        *itup = first;
+    }
+}
+
 void
 ivfflat_update_list(
     Relation index,
@@ -1166,10 +1848,6 @@ ivfflat_update_list(
     ForkNumber fork_num
 ){
     Buffer buf;
-    Page page;
-    GenericXLogState *state;
-    IvfflatList list;
-    bool changed = false;
 
     buf = ReadBufferExtended(
     index,
@@ -1178,8 +1856,100 @@ ivfflat_update_list(
     RBM_NORMAL,
     NULL);
     LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-    state = GenericXLogStart(index);
-    page = GenericXLogRegisterBuffer(state, buf, 0);
+    ivfflat_update_list_locked(
+        index,
+        buf,
+        list_info,
+        insert_page,
+        original_insert_page,
+        start_page);
+}
+
+void
+ivfflat_try_update_list(
+    Relation index,
+    ListInfo list_info,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page
+){
+    Buffer buf;
+
+    buf = ReadBuffer(index, list_info->blknum);
+    //the list page is shared by many lists. the insert page is only
+    //a hint, so skip it rather than queue behind other writers
+    if(!ConditionalLockBuffer(buf)){
+        ReleaseBuffer(buf);
+        return;
+    }
+    ivfflat_update_list_locked(
+        index,
+        buf,
+        list_info,
+        insert_page,
+        original_insert_page,
+        InvalidBlockNumber);
+}
+
+//raise the covering radius and widen the summary of the list to cover
+//the given ones, which return what the list has now. unlike the insert
+//page, the bounds must not be skipped
+void
+ivfflat_update_list_bounds(
+    Relation index,
+    ListInfo list_info,
+    float *radius,
+    IvfflatListSummary summary,
+    FmgrInfo *lt_proc,
+    Oid collation
+){
+    Buffer buf;
+    Page page;
+    IvfflatList list;
+    IvfflatListSummaryData new_summary;
+    float new_radius;
+    bool changed = false;
+
+    buf = ReadBuffer(index, list_info->blknum);
+    LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    page = BufferGetPage(buf);
+    list = (IvfflatList) PageGetItem(page,
+        PageGetItemId(page,
+            list_info->offnum));
+
+    new_radius = list->radius;
+    if(*radius > new_radius){
+        new_radius = *radius;
+        changed = true;
+    }
+    new_summary = list->summary;
+    if(summary->flags == IVFFLAT_SUMMARY_RANGE){
+        changed |= ivfflat_summary_add(&new_summary, lt_proc, collation, summary->min, false);
+        changed |= ivfflat_summary_add(&new_summary, lt_proc, collation, summary->max, false);
+    }
+    if(changed){
+        ivfflat_xlog_update_bounds(index, buf, list_info->offnum, new_radius, &new_summary);
+    }
+    UnlockReleaseBuffer(buf);
+
+    *radius = new_radius;
+    *summary = new_summary;
+}
+
+void
+ivfflat_update_list_locked(
+    Relation index,
+    Buffer buf,
+    ListInfo list_info,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page,
+    BlockNumber start_page
+){
+    Page page;
+    IvfflatList list;
+    BlockNumber new_insert_page = InvalidBlockNumber;
+    BlockNumber new_start_page = InvalidBlockNumber;
+
+    page = BufferGetPage(buf);
     list = (IvfflatList) PageGetItem(page, 
         PageGetItemId(page, 
             list_info->offnum));
@@ -1188,19 +1958,237 @@ ivfflat_update_list(
         insert_page != list->insert_page){
         if(!BlockNumberIsValid(original_insert_page) || 
             insert_page >= original_insert_page){
-            list->insert_page = insert_page;
-            changed = true;
+            new_insert_page = insert_page;
         }
     }
 
     if(BlockNumberIsValid(start_page) && start_page != list->start_page){
-        list->start_page = start_page;
-        changed = true;
+        new_start_page = start_page;
     }
 
-    if(changed){
-        ivfflat_commit_xlog(buf, state);
-    }else{
-        ivfflat_abort_xlog(buf, state);
+    if(BlockNumberIsValid(new_insert_page) || BlockNumberIsValid(new_start_page)){
+        ivfflat_xlog_update_list(
+            index,
+            buf,
+            list_info->offnum,
+            new_insert_page,
+            new_start_page);
+    }
+    UnlockReleaseBuffer(buf);
+}
+Page
+ivfflat_bulk_new_page(void){
+    Page page = (Page) palloc_aligned(BLCKSZ, PG_IO_ALIGN_SIZE, 0);
+    PageInit(page, BLCKSZ, sizeof(IvfflatPageOpaqueData));
+    IvfflatPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+    IvfflatPageGetOpaque(page)->list_tag = IVFFLAT_LIST_TAG_NONE;
+    IvfflatPageGetOpaque(page)->page_id = IVFFLAT_PAGE_ID;
+    return page;
+}
+
+void
+ivfflat_bulk_write_page(IvfflatBulkWriter writer, BlockNumber blkno, Page page){
+    writer->blknos[writer->page_count] = blkno;
+    writer->pages[writer->page_count] = page;
+    writer->page_count++;
+    if(writer->page_count == IVFFLAT_BULK_WRITE_PAGES){
+        ivfflat_bulk_flush(writer);
+    }
+}
+
+void
+ivfflat_bulk_flush(IvfflatBulkWriter writer){
+    if(writer->page_count == 0){
+        return;
+    }
+    //one wal record for the whole batch, no full page image per page
+    if(writer->use_wal){
+        log_newpages(
+            &writer->index->rd_locator,
+            MAIN_FORKNUM,
+            writer->page_count,
+            writer->blknos,
+            writer->pages,
+            true);
     }
-}
\ No newline at end of file
+    for(int i = 0; i < writer->page_count; i++){
+        BlockNumber blkno = writer->blknos[i];
+        Page page = writer->pages[i];
+
+        PageSetChecksumInplace(page, blkno);
+        //the meta and list pages were reserved before the entries
+        if(blkno < writer->reserved_blocks){
+            smgrwrite(RelationGetSmgr(writer->index), MAIN_FORKNUM, blkno, page, true);
+        }else{
+            smgrextend(RelationGetSmgr(writer->index), MAIN_FORKNUM, blkno, page, true);
+        }
+        pfree(page);
+    }
+    writer->page_count = 0;
+}
+
+/*
+ * build the main fork without the shared buffers and the generic wal.
+ *
+ * layout is the same as ivfflat_build_index: meta page, list pages, then
+ * the entry pages of each list. the meta and list pages stay in memory
+ * until every list knows its entry pages.
+ */
+void
+ivfflat_bulk_build(IvfflatBuildCtx ctx){
+    IvfflatBulkWriterData writer;
+    Page meta_page;
+    Page *list_pages;
+    int list_page_count = 1;
+    int list_page_size = 16;
+    Size list_size;
+    IvfflatList list_entry;
+    TupleTableSlot *slot;
+    IndexTuple itup;
+    int list_no;
+    ListInfo list_info;
+
+    if(RelationGetNumberOfBlocks(ctx->index) != 0){
+        elog(ERROR, "index \"%s\" already contains data",
+            RelationGetRelationName(ctx->index));
+    }
+
+    writer.index = ctx->index;
+    //unlogged index, or wal_level minimal on a new relfilenode
+    writer.use_wal = RelationNeedsWAL(ctx->index);
+    writer.page_count = 0;
+
+    //step 2. the meta page
+    meta_page = ivfflat_bulk_new_page();
+    ivfflat_fill_meta_page(meta_page, ctx->dimensions, ctx->list_count);
+
+    //step 3. the list pages
+    list_size = MAXALIGN(IVFFLAT_LIST_SIZE(ctx->centers->item_size));
+    list_entry = (IvfflatList) palloc0(list_size);
+    list_pages = (Page *) palloc(list_page_size * sizeof(Page));
+    list_pages[0] = ivfflat_bulk_new_page();
+
+    for(int i = 0; i < ctx->list_count; i++){
+        Page page = list_pages[list_page_count - 1];
+        Pointer center = array_get(ctx->centers, i);
+        OffsetNumber offno;
+
+        MemSet(list_entry, 0, list_size);
+        list_entry->start_page = InvalidBlockNumber;
+        list_entry->insert_page = InvalidBlockNumber;
+        memcpy(
+            &list_entry->center,
+            center,
+            VARSIZE_ANY(center));
+
+        if(PageGetFreeSpace(page) < list_size){
+            if(list_page_count == list_page_size){
+                list_page_size *= 2;
+                list_pages = (Page *) repalloc(list_pages, list_page_size * sizeof(Page));
+            }
+            IvfflatPageGetOpaque(page)->nextblkno = IVFFLAT_HEAD_BLKNO + list_page_count;
+            page = ivfflat_bulk_new_page();
+            list_pages[list_page_count++] = page;
+        }
+
+        offno = PageAddItem(page, (Item) list_entry, list_size, InvalidOffsetNumber, false, false);
+        if (offno == InvalidOffsetNumber){
+            elog(ERROR, "failed to add list entry to page");
+        }
+        list_info = (ListInfo) array_get(ctx->list_infos, i);
+        list_info->blknum = IVFFLAT_HEAD_BLKNO + list_page_count - 1;
+        list_info->offnum = offno;
+    }
+    pfree(list_entry);
+
+    //reserve the meta and list pages. the entry pages follow them
+    writer.reserved_blocks = IVFFLAT_HEAD_BLKNO + list_page_count;
+    smgrzeroextend(
+        RelationGetSmgr(ctx->index),
+        MAIN_FORKNUM,
+        0,
+        writer.reserved_blocks,
+        true);
+    writer.next_blkno = writer.reserved_blocks;
+
+    //step 4. the entry pages
+    ivfflat_scan_tuples(ctx);
+    tuplesort_performsort(ctx->sort_state);
+
+    slot = MakeSingleTupleTableSlot(
+        ctx->sort_desc,
+        &TTSOpsMinimalTuple
+    );
+    ivfflat_get_next_posting(
+        ctx,
+        slot,
+        &itup,
+        &list_no);
+
+    for(int i = 0; i < ctx->centers->length; i++){
+        BlockNumber blkno = writer.next_blkno++;
+        Page page = ivfflat_bulk_new_page();
+        IvfflatList list;
+
+        CHECK_FOR_INTERRUPTS();
+
+        IvfflatPageGetOpaque(page)->list_tag = IvfflatListTag(i);
+        list_info = (ListInfo) array_get(ctx->list_infos, i);
+        list = (IvfflatList) PageGetItem(
+            list_pages[list_info->blknum - IVFFLAT_HEAD_BLKNO],
+            PageGetItemId(
+                list_pages[list_info->blknum - IVFFLAT_HEAD_BLKNO],
+                list_info->offnum));
+        list->start_page = blkno;
+        list->radius = ctx->radii[i];
+        list->summary = ctx->summaries[i];
+
+        while(list_no == i){
+            Size    itemsz = MAXALIGN(IndexTupleSize(itup));
+            if(PageGetFreeSpace(page) < itemsz){
+                Page new_page = ivfflat_bulk_new_page();
+                IvfflatPageGetOpaque(new_page)->list_tag = IvfflatListTag(i);
+                IvfflatPageGetOpaque(page)->nextblkno = writer.next_blkno;
+                ivfflat_bulk_write_page(&writer, blkno, page);
+                blkno = writer.next_blkno++;
+                page = new_page;
+            }
+            if(PageAddItem(
+                page,
+                (Item) itup,
+                itemsz,
+                InvalidOffsetNumber,
+                false,
+                false) == InvalidOffsetNumber){
+                elog(ERROR, "failed to add list entry to page");
+            }
+
+            pfree(itup);
+
+            ivfflat_get_next_posting(
+                ctx,
+                slot,
+                &itup,
+                &list_no);
+        }
+        list->insert_page = blkno;
+        ivfflat_bulk_write_page(&writer, blkno, page);
+    }
+    tuplesort_end(ctx->sort_state);
+    ExecDropSingleTupleTableSlot(slot);
+
+    //the lists know their entry pages now
+    ivfflat_bulk_write_page(&writer, IVFFLAT_METAPAGE_BLKNO, meta_page);
+    for(int i = 0; i < list_page_count; i++){
+        ivfflat_bulk_write_page(&writer, IVFFLAT_HEAD_BLKNO + i, list_pages[i]);
+    }
+    ivfflat_bulk_flush(&writer);
+    pfree(list_pages);
+
+    //the pages did not go through the shared buffers, so the checkpoint
+    //does not flush them. without wal, the commit syncs the new file
+    //(wal_level minimal) or the crash recovery resets it (unlogged)
+    if(writer.use_wal){
+        smgrimmedsync(RelationGetSmgr(ctx->index), MAIN_FORKNUM);
+    }
+}
@@ -4,6 +4,7 @@
 #include "ivffat.h"
 #include "common/relpath.h"
 #include "utils/rel.h"
+#include "storage/bufpage.h"
 #include "vector.h"
 #include "utils/memutils.h"
 #include "utils/sampling.h"
@@ -38,9 +39,21 @@ typedef struct IvfflatBuildCtxData
     TupleDesc sort_desc;
     TupleTableSlot *sort_slot;
     Tuplesortstate *sort_state;
+    //identical vectors sort next to each other and share a posting tuple
+    Oid vector_lt_opr;
+    IndexTuple next_itup;
+    int next_list_no;
 
     Array centers;
     Array list_infos;
+    //covering radius of each list, l2 opclasses only
+    HvectorMetric metric;
+    float *radii;
+    //min/max of the second column of each list, see IvfflatListSummaryData
+    bool summarized;
+    FmgrInfo summary_lt;
+    Oid summary_collation;
+    struct IvfflatListSummaryData *summaries;
 
     Array samples;
     BlockSamplerData block_sampler;
@@ -53,6 +66,54 @@ typedef struct IvfflatBuildCtxData
 
 typedef IvfflatBuildCtxData * IvfflatBuildCtx;
 
+//pages per wal record of the bulk build
+#define IVFFLAT_BULK_WRITE_PAGES 32
+
+typedef struct IvfflatBulkWriterData
+{
+    Relation index;
+    bool use_wal;
+    //meta page and list pages, written in place at the end
+    BlockNumber reserved_blocks;
+    BlockNumber next_blkno;
+
+    int page_count;
+    BlockNumber blknos[IVFFLAT_BULK_WRITE_PAGES];
+    Page pages[IVFFLAT_BULK_WRITE_PAGES];
+} IvfflatBulkWriterData;
+
+typedef IvfflatBulkWriterData * IvfflatBulkWriter;
+
+//samples and centers of k-means as row-major float matrices, so the
+//distances come from norms and blocked dot products instead of one
+//fmgr call per pair. only for the l2 and spherical kmeans distances
+typedef struct IvfflatKmeansMatrixData
+{
+    //acos(x.c)/pi of unit vectors, else sqrt(|x|^2+|c|^2-2x.c)
+    bool spherical;
+    int dimensions;
+    float *samples;
+    double *sample_norms;
+    float *centers;
+    double *center_norms;
+    //dot products of one strip of rows
+    double *dots;
+    //rows gathered for ivfflat_kmeans_parallel
+    float *x_rows;
+    float *y_rows;
+} IvfflatKmeansMatrixData;
+
+typedef IvfflatKmeansMatrixData * IvfflatKmeansMatrix;
+
+//center rows per strip of the center to center distances
+#define IVFFLAT_KMEANS_STRIP_ROWS 64
+//sample rows per block of the k-means|| distances
+#define IVFFLAT_KMEANS_BLOCK_ROWS 256
+
+//k-means|| samples about 2 * lists candidates in each of 5 rounds
+#define IVFFLAT_KMEANS_PARALLEL_ROUNDS 5
+#define IVFFLAT_KMEANS_OVERSAMPLING 2
+
 
 IvfflatBuildCtx
 ivfflat_build_init_ctx(
@@ -97,12 +158,31 @@ ivfflat_normalize_centers(
     Array centers
 );
 
+Size
+ivfflat_kmeans_matrix_size(Array samples, Array centers);
+
+IvfflatKmeansMatrix
+ivfflat_kmeans_matrix_create(FmgrInfo *distance_proc, Array samples, Array centers);
+
+void
+ivfflat_kmeans_matrix_load_centers(IvfflatKmeansMatrix matrix, Array centers);
+
 void 
 ivfflat_kmeans_plusplus(
     Relation index,
     Array samples,
     Array centers,
-    float *lower_bounds
+    float *lower_bounds,
+    IvfflatKmeansMatrix matrix
+);
+
+void
+ivfflat_kmeans_parallel(
+    Relation index,
+    Array samples,
+    Array centers,
+    float *lower_bounds,
+    IvfflatKmeansMatrix matrix
 );
 
 void
@@ -147,6 +227,9 @@ ivfflat_create_meta_page(
     ForkNumber forkNum
 );
 
+void
+ivfflat_fill_meta_page(Page page, int dimensions, int list_count);
+
 void
 ivfflat_create_list_pages(
     Relation index,
@@ -154,7 +237,8 @@ ivfflat_create_list_pages(
     int dimensions,
     int list_count,
     ForkNumber fork_num,
-    Array list_infos
+    Array list_infos,
+    bool summarized
 );
 
 void
@@ -177,6 +261,7 @@ ivfflat_sort_tuples(
     Relation index,
     ItemPointer tid,
     Datum *values,
+    bool *isnull,
     IvfflatBuildCtx ctx);
 
 void
@@ -201,7 +286,59 @@ ivfflat_update_list(
     ForkNumber fork_num
 );
 
+void
+ivfflat_try_update_list(
+    Relation index,
+    ListInfo list_info,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page
+);
+
+void
+ivfflat_update_list_bounds(
+    Relation index,
+    ListInfo list_info,
+    float *radius,
+    struct IvfflatListSummaryData *summary,
+    FmgrInfo *lt_proc,
+    Oid collation
+);
+
+void
+ivfflat_update_list_locked(
+    Relation index,
+    Buffer buf,
+    ListInfo list_info,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page,
+    BlockNumber start_page
+);
+
 Tuplesortstate *
-ivfflat_init_sort_state(TupleDesc tupdesc,int memory, SortCoordinate coordinate);
+ivfflat_init_sort_state(
+    TupleDesc tupdesc,
+    Oid vector_lt_opr,
+    int memory,
+    SortCoordinate coordinate);
+
+void
+ivfflat_get_next_posting(
+    IvfflatBuildCtx ctx,
+    TupleTableSlot *slot,
+    IndexTuple *itup,
+    int *list_no
+);
+
+Page
+ivfflat_bulk_new_page(void);
+
+void
+ivfflat_bulk_write_page(IvfflatBulkWriter writer, BlockNumber blkno, Page page);
+
+void
+ivfflat_bulk_flush(IvfflatBulkWriter writer);
+
+void
+ivfflat_bulk_build(IvfflatBuildCtx ctx);
 
 #endif
\ No newline at end of file
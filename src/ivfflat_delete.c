@@ -1,36 +1,257 @@
 #include "ivfflat_delete.h"
 #include "access/generic_xlog.h"
+#include "access/genam.h"
+#include "access/xlog.h"
+#include "access/itup.h"
+#include "catalog/index.h"
 #include "common/relpath.h"
+#include "ivfflat_insert.h"
 #include "ivfflat_page.h"
+#include "ivfflat_xlog.h"
 #include "storage/block.h"
 #include "storage/bufmgr.h"
 #include "storage/off.h"
 
+void
+ivfflat_page_deletable(
+    Page page,
+    TupleDesc tupdesc,
+    IndexBulkDeleteCallback callback,
+    void *callback_state,
+    IvfflatVacuumPage vacuum_page,
+    bool form_postings
+){
+    OffsetNumber offset;
+    OffsetNumber max_offset = PageGetMaxOffsetNumber(page);
+    IndexTuple index_tup;
+    ItemId itemid;
+    ItemPointer tids;
+    int ntids,nremaining;
+
+    vacuum_page->ndeletable = 0;
+    vacuum_page->nupdatable = 0;
+    vacuum_page->tuples_removed = 0;
+    vacuum_page->tuples_remaining = 0;
+
+    //scan entries on the page
+    for(offset = FirstOffsetNumber;
+        offset <= max_offset;
+        offset = OffsetNumberNext(offset)){
+        itemid = PageGetItemId(page, offset);
+        index_tup = (IndexTuple) PageGetItem(page, itemid);
+        ntids = ivfflat_tuple_tid_count(index_tup, tupdesc);
+        //entries killed by scans go with the rest
+        if(ItemIdIsDead(itemid)){
+            vacuum_page->deletable[vacuum_page->ndeletable++] = offset;
+            vacuum_page->tuples_removed += ntids;
+            continue;
+        }
+
+        //keep the live heap tids of a posting tuple. counting them is
+        //enough to tell whether the page has anything to delete
+        tids = ivfflat_tuple_tids(index_tup, tupdesc);
+        nremaining = 0;
+        for(int i = 0; i < ntids; i++){
+            if(!callback(&tids[i], callback_state)){
+                if(form_postings){
+                    vacuum_page->remaining[nremaining] = tids[i];
+                }
+                nremaining++;
+            }
+        }
+        vacuum_page->tuples_removed += ntids - nremaining;
+        vacuum_page->tuples_remaining += nremaining;
+
+        if(nremaining == 0){
+            vacuum_page->deletable[vacuum_page->ndeletable++] = offset;
+        }else if(nremaining < ntids){
+            vacuum_page->updatable[vacuum_page->nupdatable] = offset;
+            vacuum_page->updated[vacuum_page->nupdatable++] = form_postings ?
+                ivfflat_form_posting(
+                    index_tup,
+                    tupdesc,
+                    vacuum_page->remaining,
+                    nremaining) :
+                NULL;
+        }
+    }
+}
+
+void
+ivfflat_vacuum_page_reset(IvfflatVacuumPage vacuum_page){
+    for(int i = 0; i < vacuum_page->nupdatable; i++){
+        if(vacuum_page->updated[i] != NULL){
+            pfree(vacuum_page->updated[i]);
+        }
+    }
+    vacuum_page->nupdatable = 0;
+    vacuum_page->ndeletable = 0;
+}
+
+/*
+ * remove the entries scans marked LP_DEAD from a full page, so the
+ * insert can stay on it. the caller holds the exclusive lock.
+ * scans do not keep pins on entry pages, so no cleanup lock is needed.
+ */
+int
+ivfflat_prune_page(Relation index, Relation heap_rel, Buffer buf){
+    Page page = BufferGetPage(buf);
+    OffsetNumber max_offset = PageGetMaxOffsetNumber(page);
+    OffsetNumber deletable[MaxOffsetNumber];
+    int ndeletable = 0;
+    TransactionId horizon = InvalidTransactionId;
+
+    for(OffsetNumber offset = FirstOffsetNumber;
+        offset <= max_offset;
+        offset = OffsetNumberNext(offset)){
+        if(ItemIdIsDead(PageGetItemId(page, offset))){
+            deletable[ndeletable++] = offset;
+        }
+    }
+    if(ndeletable == 0){
+        return 0;
+    }
+
+    //hot standby queries must be cancelled before the entries go away.
+    //only the custom wal carries the conflict horizon
+    if(RelationNeedsWAL(index) && XLogStandbyInfoActive()){
+        if(!ivfflat_use_custom_wal() || heap_rel == NULL){
+            return 0;
+        }
+        horizon = index_compute_xid_horizon_for_tuples(
+            index,
+            heap_rel,
+            buf,
+            deletable,
+            ndeletable);
+    }
+
+    ivfflat_xlog_prune_items(index, heap_rel, buf, deletable, ndeletable, horizon);
+    return ndeletable;
+}
+
+BlockNumber
+ivfflat_vacuum_chain(
+    IndexVacuumInfo *info,
+    IndexBulkDeleteResult *stats,
+    IndexBulkDeleteCallback callback,
+    void *callback_state,
+    IvfflatVacuumPage vacuum_page,
+    BlockNumber search_page
+){
+    TupleDesc tupdesc = RelationGetDescr(info->index);
+    Buffer buf;
+    Page page;
+    BlockNumber insert_page = InvalidBlockNumber;
+
+    //scan entries pages
+    while(BlockNumberIsValid(search_page)){
+        vacuum_delay_point();
+        buf = ReadBufferExtended(
+            info->index,
+            MAIN_FORKNUM,
+            search_page,
+            RBM_NORMAL,
+            info->strategy);
+
+        //first pass under the share lock: scans are not blocked
+        //and most pages have nothing to delete
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        ivfflat_page_deletable(
+            page,
+            tupdesc,
+            callback,
+            callback_state,
+            vacuum_page,
+            false);
+
+        if(vacuum_page->ndeletable == 0 && vacuum_page->nupdatable == 0){
+            stats->num_index_tuples += vacuum_page->tuples_remaining;
+            search_page = IvfflatPageGetOpaque(page)->nextblkno;
+            UnlockReleaseBuffer(buf);
+            continue;
+        }
+        ivfflat_vacuum_page_reset(vacuum_page);
+
+        //delete entries from pages may be blocked.
+        //only pages with dead entries wait for the cleanup lock
+        LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        LockBufferForCleanup(buf);
+        page = BufferGetPage(buf);
+
+        //entries may be added while the page was unlocked
+        ivfflat_page_deletable(
+            page,
+            tupdesc,
+            callback,
+            callback_state,
+            vacuum_page,
+            true);
+        stats->tuples_removed += vacuum_page->tuples_removed;
+        stats->num_index_tuples += vacuum_page->tuples_remaining;
+
+        if(!BlockNumberIsValid(insert_page) &&
+            (vacuum_page->ndeletable > 0 || vacuum_page->nupdatable > 0)){
+            insert_page = search_page;
+        }
+
+        search_page = IvfflatPageGetOpaque(page)->nextblkno;
+        //posting tuples only shrink, so they fit in place.
+        //the offsets stay valid for the delete
+        for(int i = 0; i < vacuum_page->nupdatable; i++){
+            ivfflat_xlog_overwrite_item(
+                info->index,
+                buf,
+                vacuum_page->updatable[i],
+                vacuum_page->updated[i]);
+        }
+        if(vacuum_page->ndeletable > 0){
+            ivfflat_xlog_delete_items(
+                info->index,
+                buf,
+                vacuum_page->deletable,
+                vacuum_page->ndeletable);
+        }
+        ivfflat_vacuum_page_reset(vacuum_page);
+
+        UnlockReleaseBuffer(buf);
+    }
+    //the first page with free space
+    return insert_page;
+}
+
 IndexBulkDeleteResult *
 ivfflat_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 				  IndexBulkDeleteCallback callback, void *callback_state)
 {
-    Buffer center_buf,buf;
-    Page center_page,page;
-    OffsetNumber center_offset,offset;
-    OffsetNumber center_max_offset,max_offset,deletable[MaxOffsetNumber];
-    BlockNumber list_pages[MaxOffsetNumber],search_page,insert_page;
+    Buffer center_buf;
+    Page center_page;
+    OffsetNumber center_offset;
+    OffsetNumber center_max_offset;
+    BlockNumber list_pages[MaxOffsetNumber],insert_page,buffer_start;
     ListInfoData list_info_data;
     IvfflatList list;
-    int ndeletable;
-    GenericXLogState *state;
-    IndexTuple index_tup;
-    ItemPointer heap_tup;
+    //scratch space of every chain, too large to allocate per list
+    IvfflatVacuumPage vacuum_page;
 
     BlockNumber start_blkno = IVFFLAT_HEAD_BLKNO;
-    BufferAccessStrategy strategy = GetAccessStrategy(BAS_BULKREAD);
+    //use the ring of the vacuum, which is shared by the
+    //leader and the parallel vacuum workers
+    BufferAccessStrategy strategy = info->strategy;
     if(stats == NULL){
         stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
     }
+    vacuum_page = (IvfflatVacuumPage) palloc(sizeof(IvfflatVacuumPageData));
 
     //scan list pages
     while(BlockNumberIsValid(start_blkno)){
-        center_buf = ReadBuffer(info->index,start_blkno);
+        center_buf = ReadBufferExtended(
+            info->index,
+            MAIN_FORKNUM,
+            start_blkno,
+            RBM_NORMAL,
+            strategy);
         LockBuffer(center_buf,BUFFER_LOCK_SHARE);
         center_page = BufferGetPage(center_buf);
 
@@ -53,58 +274,17 @@ ivfflat_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
         for(center_offset = FirstOffsetNumber;
             center_offset <= center_max_offset;
             center_offset = OffsetNumberNext(center_offset)){
-            search_page = list_pages[center_offset - FirstOffsetNumber];
-            insert_page = InvalidBlockNumber;
+            insert_page = ivfflat_vacuum_chain(
+                info,
+                stats,
+                callback,
+                callback_state,
+                vacuum_page,
+                list_pages[center_offset - FirstOffsetNumber]);
 
-            //scan entries pages
-            while(BlockNumberIsValid(search_page)){
-                vacuum_delay_point();
-                buf = ReadBufferExtended(
-                    info->index,
-                    MAIN_FORKNUM,
-                    search_page,
-                    RBM_NORMAL,
-                    strategy);
-                
-                //delete entries from pages may be blocked
-                LockBufferForCleanup(buf);
-
-                state = GenericXLogStart(info->index);
-                page = GenericXLogRegisterBuffer(state, buf, 0);
-
-                max_offset = PageGetMaxOffsetNumber(page);
-                ndeletable = 0;
-
-                //scan entries on the page
-                for(offset = FirstOffsetNumber; 
-                    offset <= max_offset; 
-                    offset = OffsetNumberNext(offset)){
-                    index_tup = (IndexTuple) PageGetItem(page,
-                         PageGetItemId(page, offset));
-                    heap_tup = &(index_tup->t_tid);
-                    if(callback(heap_tup, callback_state)){
-                        deletable[ndeletable++] = offset;
-                        stats->tuples_removed++;
-                    }else{
-                        stats->num_index_tuples++;
-                    }
-                }
-
-                if(!BlockNumberIsValid(insert_page) && ndeletable > 0){
-                    insert_page = search_page;
-                }
-
-                search_page = IvfflatPageGetOpaque(page)->nextblkno;
-                if(ndeletable > 0){
-                    PageIndexMultiDelete(page, deletable, ndeletable);
-                    GenericXLogFinish(state);
-                }else{
-                    GenericXLogAbort(state);
-                }
-
-                UnlockReleaseBuffer(buf);
-            }
-            
+            //the list entry is only changed under the exclusive lock of its
+            //list page, so it is safe against concurrent inserts
+            //whichever backend (leader or parallel worker) vacuums the index
             if(BlockNumberIsValid(insert_page)){
                 list_info_data.offnum = center_offset;
                 ivfflat_update_list(
@@ -118,10 +298,194 @@ ivfflat_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
             }
         }
     }
-    FreeAccessStrategy(strategy);
+
+    //the insert buffer
+    ivfflat_get_buffer_pages(info->index, &buffer_start, NULL);
+    if(BlockNumberIsValid(buffer_start)){
+        insert_page = ivfflat_vacuum_chain(
+            info,
+            stats,
+            callback,
+            callback_state,
+            vacuum_page,
+            buffer_start);
+        if(BlockNumberIsValid(insert_page)){
+            ivfflat_update_buffer_insert_page(
+                info->index,
+                insert_page,
+                InvalidBlockNumber,
+                true);
+        }
+    }
+    pfree(vacuum_page);
     return stats;
 }
 
+//whether the list starting at start_page has an entry of the heap tid
+static bool
+ivfflat_list_has_tid(
+    IndexVacuumInfo *info,
+    BlockNumber start_page,
+    ItemPointer tid){
+    TupleDesc tupdesc = RelationGetDescr(info->index);
+    BlockNumber blkno = start_page;
+    bool found = false;
+
+    while(BlockNumberIsValid(blkno) && !found){
+        Buffer buf = ReadBufferExtended(info->index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+        Page page;
+        OffsetNumber max_offset;
+
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(OffsetNumber offset = FirstOffsetNumber;
+            offset <= max_offset && !found;
+            offset = OffsetNumberNext(offset)){
+            IndexTuple itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offset));
+            ItemPointer tids = ivfflat_tuple_tids(itup, tupdesc);
+            int count = ivfflat_tuple_tid_count(itup, tupdesc);
+
+            for(int i = 0; i < count && !found; i++){
+                found = ItemPointerEquals(&tids[i], tid);
+            }
+        }
+        blkno = IvfflatPageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+    return found;
+}
+
+/*
+ * move the entries of the insert buffer to their nearest lists.
+ *
+ * an entry is added to its list before it is deleted from the buffer,
+ * and scans read the buffer before the lists, so a concurrent scan sees
+ * the entry at least once. scans drop the duplicate when they see it twice.
+ *
+ * the add and the delete are separate wal records. the meta page names
+ * the buffer page being moved, so after a crash between them the next
+ * merge skips the entries of that page its list already holds.
+ */
+void
+ivfflat_merge_buffer(IndexVacuumInfo *info){
+    Relation index = info->index;
+    TupleDesc tupdesc = RelationGetDescr(index);
+    BlockNumber buffer_start,blkno;
+    IndexInfo *index_info;
+    IvfflatInsertCache cache;
+    MemoryContext old_ctx;
+    Buffer buf;
+    Page page;
+    OffsetNumber max_offset,deletable[MaxOffsetNumber];
+    IndexTuple moved[MaxOffsetNumber];
+    int nmoved,ndeletable;
+    BlockNumber crashed_page;
+    bool marked = false;
+
+    ivfflat_get_buffer_pages(index, &buffer_start, NULL);
+    if(!BlockNumberIsValid(buffer_start)){
+        return;
+    }
+
+    index_info = BuildIndexInfo(index);
+    cache = ivfflat_get_insert_cache(index, index_info);
+    crashed_page = ivfflat_get_buffer_merge_page(index);
+
+    blkno = buffer_start;
+    while(BlockNumberIsValid(blkno)){
+        //a merge of this page was cut short, some entries may be in
+        //their lists already
+        bool retry = blkno == crashed_page;
+
+        vacuum_delay_point();
+        old_ctx = MemoryContextSwitchTo(cache->tmp_ctx);
+
+        //copy the entries out, so no buffer lock is held while adding
+        //them to the lists
+        buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        nmoved = 0;
+        for(OffsetNumber offset = FirstOffsetNumber;
+            offset <= max_offset;
+            offset = OffsetNumberNext(offset)){
+            moved[nmoved++] = CopyIndexTuple(
+                (IndexTuple) PageGetItem(page, PageGetItemId(page, offset)));
+        }
+        LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        if(!retry && nmoved > 0){
+            ivfflat_set_buffer_merge_page(index, blkno);
+            marked = true;
+        }
+
+        for(int i = 0; i < nmoved; i++){
+            IndexTuple itup = moved[i];
+            bool isnull;
+            Datum value = index_getattr(itup, 1, tupdesc, &isnull);
+            Datum summary_value = (Datum) 0;
+            bool summary_isnull = true;
+            double distance;
+            int slot;
+
+            if(cache->summarized){
+                summary_value = index_getattr(itup, 2, tupdesc, &summary_isnull);
+            }
+            //the vector in the buffer is normalized already
+            slot = ivfflat_find_insert_list(cache, value, &distance);
+            if(retry && ivfflat_list_has_tid(info, cache->start_pages[slot], &itup->t_tid)){
+                continue;
+            }
+            ivfflat_cover_entry(
+                index,
+                cache,
+                slot,
+                distance,
+                summary_value,
+                summary_isnull);
+            ivfflat_add_tuple(
+                index,
+                NULL,
+                cache,
+                slot,
+                itup);
+        }
+
+        //delete the moved entries. entries added to the page meanwhile stay
+        //for the next vacuum
+        LockBufferForCleanup(buf);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        ndeletable = 0;
+        for(OffsetNumber offset = FirstOffsetNumber;
+            offset <= max_offset;
+            offset = OffsetNumberNext(offset)){
+            IndexTuple itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offset));
+            for(int i = 0; i < nmoved; i++){
+                if(ItemPointerEquals(&itup->t_tid, &moved[i]->t_tid)){
+                    deletable[ndeletable++] = offset;
+                    break;
+                }
+            }
+        }
+        blkno = IvfflatPageGetOpaque(page)->nextblkno;
+        if(ndeletable > 0){
+            ivfflat_xlog_delete_items(index, buf, deletable, ndeletable);
+        }
+        UnlockReleaseBuffer(buf);
+
+        MemoryContextSwitchTo(old_ctx);
+        MemoryContextReset(cache->tmp_ctx);
+    }
+
+    if(marked || BlockNumberIsValid(crashed_page)){
+        ivfflat_set_buffer_merge_page(index, InvalidBlockNumber);
+    }
+    //inserts refill the buffer from its first page
+    ivfflat_update_buffer_insert_page(index, buffer_start, InvalidBlockNumber, true);
+}
+
 IndexBulkDeleteResult *
 ivfflat_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
@@ -129,6 +493,8 @@ ivfflat_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
     if(info->analyze_only){
         return stats;
     }
+    //also when buffered_insert was turned off, the buffer may be left
+    ivfflat_merge_buffer(info);
     if(stats == NULL){
         return NULL;
     }
@@ -2,5 +2,52 @@
 #define IVFFLAT_DELETE_H
 
 #include "ivffat.h"
+#include "storage/bufpage.h"
+#include "access/itup.h"
+
+//what vacuum does to one entry page
+typedef struct IvfflatVacuumPageData {
+    int ndeletable;
+    OffsetNumber deletable[MaxOffsetNumber];
+    //posting tuples that lose some of their heap tids
+    int nupdatable;
+    OffsetNumber updatable[MaxOffsetNumber];
+    IndexTuple updated[MaxOffsetNumber];
+    double tuples_removed;
+    double tuples_remaining;
+    //scratch space for the live heap tids of one posting tuple
+    ItemPointerData remaining[BLCKSZ / sizeof(ItemPointerData)];
+} IvfflatVacuumPageData;
+
+typedef IvfflatVacuumPageData * IvfflatVacuumPage;
+
+void
+ivfflat_page_deletable(
+    Page page,
+    TupleDesc tupdesc,
+    IndexBulkDeleteCallback callback,
+    void *callback_state,
+    IvfflatVacuumPage vacuum_page,
+    bool form_postings
+);
+
+void
+ivfflat_vacuum_page_reset(IvfflatVacuumPage vacuum_page);
+
+BlockNumber
+ivfflat_vacuum_chain(
+    IndexVacuumInfo *info,
+    IndexBulkDeleteResult *stats,
+    IndexBulkDeleteCallback callback,
+    void *callback_state,
+    IvfflatVacuumPage vacuum_page,
+    BlockNumber search_page
+);
+
+int
+ivfflat_prune_page(Relation index, Relation heap_rel, Buffer buf);
+
+void
+ivfflat_merge_buffer(IndexVacuumInfo *info);
 
 #endif
\ No newline at end of file
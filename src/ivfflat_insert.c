@@ -12,6 +12,13 @@
 #include "utils/rel.h"
 #include "ivfflat_page.h"
 #include "storage/lmgr.h"
+#include "ivfflat_options.h"
+#include "ivfflat_xlog.h"
+#include "ivfflat_delete.h"
+#include "utils/hsearch.h"
+#include <float.h>
+
+static HTAB *ivfflat_session_hints = NULL;
 
 bool
 ivfflat_insert(
@@ -24,22 +31,309 @@ ivfflat_insert(
     bool index_unchanged,
     IndexInfo *index_info
 ){
-    MemoryContext insert_ctx;
+    IvfflatInsertCache cache;
     MemoryContext old_ctx;
     if(isnull[0]){
         return false;
     }
-    insert_ctx = AllocSetContextCreate(
+    cache = ivfflat_get_insert_cache(index, index_info);
+    old_ctx = MemoryContextSwitchTo(cache->tmp_ctx);
+
+    ivfflat_insert_tuple(index, values, isnull, heap_tid, heap, cache);
+
+    MemoryContextSwitchTo(old_ctx);
+    MemoryContextReset(cache->tmp_ctx);
+    return true;
+}
+
+IvfflatInsertCache
+ivfflat_get_insert_cache(Relation index, IndexInfo *index_info){
+    IvfflatInsertCache cache = (IvfflatInsertCache) index_info->ii_AmCache;
+    MemoryContext old_ctx;
+    FmgrInfo *proc;
+    int list_count,dimensions;
+
+    if(cache != NULL){
+        return cache;
+    }
+
+    //lives as long as the IndexInfo, i.e. the whole statement
+    old_ctx = MemoryContextSwitchTo(index_info->ii_Context);
+
+    cache = (IvfflatInsertCache) palloc0(sizeof(IvfflatInsertCacheData));
+    cache->vector_type = ivfflat_get_vector_type(index);
+    cache->collation = index->rd_indcollation[0];
+
+    //copy procs, so that they survive relcache rebuilds
+    proc = index_getprocinfo(index, 1, IVFFALT_VECTOR_DISTANCE_PROC);
+    fmgr_info_copy(&cache->distance_proc, proc, CurrentMemoryContext);
+    proc = ivfflat_get_proc_info(index, IVFFALT_VECTOR_NORMALIZATION_PROC);
+    cache->has_normalize_proc = proc != NULL;
+    if(cache->has_normalize_proc){
+        fmgr_info_copy(&cache->normalize_proc, proc, CurrentMemoryContext);
+    }
+
+    ivfflat_get_meta_page(index, &list_count, &dimensions);
+    //every insert picks one of the lists, list_infos[0] must exist
+    if(list_count <= 0){
+        ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("ivfflat index \"%s\" has no lists", RelationGetRelationName(index)),
+             errhint("REINDEX the index.")));
+    }
+    cache->centers = array_create(
+        list_count,
+        dimensions,
+        cache->vector_type->item_size(dimensions));
+    //one more slot for the insert buffer
+    cache->buffer_slot = list_count;
+    cache->list_infos = (ListInfo) palloc((list_count + 1) * sizeof(ListInfoData));
+    cache->start_pages = (BlockNumber *) palloc((list_count + 1) * sizeof(BlockNumber));
+    cache->shared_insert_pages = (BlockNumber *) palloc((list_count + 1) * sizeof(BlockNumber));
+    cache->metric = hvector_get_metric(&cache->distance_proc);
+    cache->radii = (float *) palloc(list_count * sizeof(float));
+    cache->summarized = ivfflat_get_summary_proc(index, &cache->summary_lt, CurrentMemoryContext);
+    cache->summary_collation = cache->summarized ? index->rd_indcollation[1] : InvalidOid;
+    cache->summaries = (IvfflatListSummary) palloc(list_count * sizeof(IvfflatListSummaryData));
+    ivfflat_load_lists(
+        index,
+        cache->centers,
+        cache->list_infos,
+        cache->start_pages,
+        cache->shared_insert_pages,
+        cache->radii,
+        cache->summaries);
+    if(cache->centers->length == 0){
+        ereport(ERROR,
+            (errcode(ERRCODE_INDEX_CORRUPTED),
+             errmsg("ivfflat index \"%s\" has no list entries", RelationGetRelationName(index))));
+    }
+
+    cache->buffered = ivfflat_get_buffered_insert(index);
+    ivfflat_get_buffer_pages(
+        index,
+        &cache->start_pages[cache->buffer_slot],
+        &cache->shared_insert_pages[cache->buffer_slot]);
+    if(cache->buffered &&
+        !BlockNumberIsValid(cache->shared_insert_pages[cache->buffer_slot])){
+        cache->start_pages[cache->buffer_slot] = ivfflat_create_buffer(index);
+        cache->shared_insert_pages[cache->buffer_slot] = cache->start_pages[cache->buffer_slot];
+    }
+
+    //resolved on the first insert into each list
+    cache->insert_pages = (BlockNumber *) palloc((list_count + 1) * sizeof(BlockNumber));
+    for(int i = 0; i <= list_count; i++){
+        cache->insert_pages[i] = InvalidBlockNumber;
+    }
+    cache->nblocks = RelationGetNumberOfBlocks(index);
+
+    cache->tmp_ctx = AllocSetContextCreate(
         CurrentMemoryContext,
         "insert temporary context",
         ALLOCSET_DEFAULT_SIZES);
-    old_ctx = MemoryContextSwitchTo(insert_ctx);
-
-    ivfflat_insert_tuple(index, values, isnull, heap_tid, heap);
 
     MemoryContextSwitchTo(old_ctx);
-    MemoryContextDelete(insert_ctx);
-    return true;
+    index_info->ii_AmCache = (void *) cache;
+    return cache;
+}
+
+BlockNumber
+ivfflat_get_session_hint(Relation index, int list_no, BlockNumber tail_page){
+    IvfflatSessionHintKey key;
+    IvfflatSessionHint hint;
+
+    if(ivfflat_session_hints == NULL){
+        return InvalidBlockNumber;
+    }
+    MemSet(&key, 0, sizeof(key));
+    key.locator = index->rd_locator;
+    key.list_no = list_no;
+    hint = (IvfflatSessionHint) hash_search(
+        ivfflat_session_hints,
+        &key,
+        HASH_FIND,
+        NULL);
+    if(hint == NULL){
+        return InvalidBlockNumber;
+    }
+    //the tail of the list moved since, by another backend or by vacuum.
+    //the page of this backend may be full or far from the free space
+    if(hint->tail_page != tail_page){
+        hash_search(ivfflat_session_hints, &key, HASH_REMOVE, NULL);
+        return InvalidBlockNumber;
+    }
+    return hint->insert_page;
+}
+
+void
+ivfflat_set_session_hint(
+    Relation index,
+    int list_no,
+    BlockNumber insert_page,
+    BlockNumber tail_page){
+    IvfflatSessionHintKey key;
+    IvfflatSessionHint hint;
+
+    if(ivfflat_session_hints == NULL){
+        HASHCTL ctl;
+        ctl.keysize = sizeof(IvfflatSessionHintKey);
+        ctl.entrysize = sizeof(IvfflatSessionHintData);
+        ctl.hcxt = TopMemoryContext;
+        ivfflat_session_hints = hash_create(
+            "ivfflat insert hints",
+            256,
+            &ctl,
+            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+    MemSet(&key, 0, sizeof(key));
+    key.locator = index->rd_locator;
+    key.list_no = list_no;
+    hint = (IvfflatSessionHint) hash_search(
+        ivfflat_session_hints,
+        &key,
+        HASH_ENTER,
+        NULL);
+    hint->insert_page = insert_page;
+    hint->tail_page = tail_page;
+}
+
+BlockNumber
+ivfflat_get_insert_page(
+    Relation index,
+    IvfflatInsertCache cache,
+    int slot,
+    bool *verify){
+    BlockNumber insert_page = cache->insert_pages[slot];
+
+    *verify = false;
+    if(BlockNumberIsValid(insert_page)){
+        return insert_page;
+    }
+
+    //the page of an earlier statement. it may belong to an older
+    //relation with the same file, so it is verified before use
+    insert_page = ivfflat_get_session_hint(index, slot, cache->shared_insert_pages[slot]);
+    if(BlockNumberIsValid(insert_page) && insert_page < cache->nblocks){
+        *verify = true;
+        return insert_page;
+    }
+    return cache->shared_insert_pages[slot];
+}
+
+uint16
+ivfflat_slot_tag(IvfflatInsertCache cache, int slot){
+    if(slot == cache->buffer_slot){
+        return IVFFLAT_LIST_TAG_BUFFER;
+    }
+    return IvfflatListTag(slot);
+}
+
+bool
+ivfflat_page_in_list(Page page, uint16 list_tag){
+    IvfflatPageOpaque opaque = IvfflatPageGetOpaque(page);
+    return !PageIsNew(page) &&
+        opaque->page_id == IVFFLAT_PAGE_ID &&
+        opaque->list_tag == list_tag;
+}
+
+/*
+ * link a new page right after the locked page buf, and return the new
+ * page exclusively locked. buf is unlocked and released.
+ *
+ * the new page goes after buf rather than at the end of the list, so
+ * backends that find their insert page busy each get a tail of their own.
+ */
+Buffer
+ivfflat_link_new_page(Relation index, Buffer buf, uint16 list_tag){
+    Buffer new_buf;
+    Page page,new_page;
+    GenericXLogState *state;
+
+    LockRelationForExtension(index,ExclusiveLock);
+    new_buf = ivfflat_new_buffer(index,MAIN_FORKNUM);
+    UnlockRelationForExtension(index,ExclusiveLock);
+
+    state = GenericXLogStart(index);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    ivfflat_append_xlog(&new_buf, &new_page, state);
+
+    IvfflatPageGetOpaque(new_page)->nextblkno = IvfflatPageGetOpaque(page)->nextblkno;
+    IvfflatPageGetOpaque(new_page)->list_tag = list_tag;
+    IvfflatPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(new_buf);
+
+    ivfflat_commit_xlog(buf,state);
+    return new_buf;
+}
+
+int
+ivfflat_find_insert_list(IvfflatInsertCache cache, Datum value, double *distance_out){
+    double min_distance = DBL_MAX;
+    double distance;
+    int list_no = 0;
+
+    for(int i = 0; i < cache->centers->length; i++){
+        distance = DatumGetFloat8(
+            FunctionCall2Coll(
+                &cache->distance_proc,
+                cache->collation,
+                value,
+                PointerGetDatum(array_get(cache->centers, i))));
+        if(distance < min_distance){
+            min_distance = distance;
+            list_no = i;
+        }
+    }
+    if(distance_out != NULL){
+        *distance_out = min_distance;
+    }
+    return list_no;
+}
+
+/*
+ * make the radius and the summary of the list cover an entry at the given
+ * distance from its center. called before the entry is added: a scan that
+ * read the bounds before this can not see the entry, either its
+ * transaction is not visible yet or the scan found it in the insert buffer.
+ */
+void
+ivfflat_cover_entry(
+    Relation index,
+    IvfflatInsertCache cache,
+    int slot,
+    double distance,
+    Datum summary_value,
+    bool summary_isnull){
+    float radius = cache->radii[slot];
+    IvfflatListSummaryData summary = cache->summaries[slot];
+    bool changed = false;
+
+    if(cache->metric != HVECTOR_METRIC_NONE){
+        float entry_radius = ivfflat_covering_radius(cache->metric, distance);
+        if(entry_radius > radius){
+            radius = entry_radius;
+            changed = true;
+        }
+    }
+    if(cache->summarized){
+        changed |= ivfflat_summary_add(
+            &summary,
+            &cache->summary_lt,
+            cache->summary_collation,
+            summary_value,
+            summary_isnull);
+    }
+    if(!changed){
+        return;
+    }
+    ivfflat_update_list_bounds(
+        index,
+        &cache->list_infos[slot],
+        &radius,
+        &summary,
+        &cache->summary_lt,
+        cache->summary_collation);
+    cache->radii[slot] = radius;
+    cache->summaries[slot] = summary;
 }
 
 void
@@ -48,97 +342,253 @@ ivfflat_insert_tuple(
     Datum *values, 
     bool *isnull, 
     ItemPointer heap_tid, 
-    Relation heap_rel){
+    Relation heap_rel,
+    IvfflatInsertCache cache){
     Datum value;
-    FmgrInfo *normalize_proc;
-    Oid collation;
-    BlockNumber insert_page = InvalidBlockNumber,original_insert_page;
-    ListInfoData list_info;
+    Datum tuple_values[INDEX_MAX_KEYS];
+    int slot;
+    double distance;
     IndexTuple itup;
-    Size sz;
-    Buffer buf,new_buf;
-    Page page,new_page;
-    GenericXLogState *state;
-    OffsetNumber offno;
-    const IvfflatVectorType vector_type = ivfflat_get_vector_type(index);
 
     value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
-    normalize_proc = ivfflat_get_proc_info(index, IVFFALT_VECTOR_NORMALIZATION_PROC);
-    if(normalize_proc != NULL){
-        collation = index->rd_indcollation[0];
-        if(!ivfflat_norm_non_zero(normalize_proc, collation, value)){
+    if(cache->has_normalize_proc){
+        if(!ivfflat_norm_non_zero(&cache->normalize_proc, cache->collation, value)){
             return;//zero vector
         }
         //normalize non-zero vector
-        value = ivfflat_normalize_value(vector_type, collation, value);
+        value = ivfflat_normalize_value(cache->vector_type, cache->collation, value);
     }
 
-    ivfflat_get_meta_page(index,NULL,NULL);
-    
-    //find the nearest center and the list belong to it
-    ivfflat_find_insert_page(
-        index,
-        &value,
-        &insert_page,
-        &list_info);
-    original_insert_page = insert_page;
+    if(cache->buffered){
+        //vacuum moves it to the nearest list later
+        slot = cache->buffer_slot;
+    }else{
+        //find the nearest center and the list belong to it
+        slot = ivfflat_find_insert_list(cache, value, &distance);
+        ivfflat_cover_entry(
+            index,
+            cache,
+            slot,
+            distance,
+            cache->summarized ? values[1] : (Datum) 0,
+            cache->summarized ? isnull[1] : true);
+    }
 
-    //build index tuple from input
+    //build index tuple from input. the columns after the vector are
+    //stored as they are
+    memcpy(tuple_values, values, RelationGetDescr(index)->natts * sizeof(Datum));
+    tuple_values[0] = value;
     itup = index_form_tuple(
         RelationGetDescr(index),
-        &value,
+        tuple_values,
         isnull
     );
     itup->t_tid = *heap_tid;
 
-    sz = MAXALIGN(IndexTupleSize(itup));
-    Assert(sz <= IvfflatPageMaxSpace);
+    ivfflat_add_tuple(index, heap_rel, cache, slot, itup);
+}
 
-    while(1){
-        buf = ReadBuffer(index, insert_page);
-        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+/*
+ * add the heap tids of itup to the entry with the same vector on the page.
+ * the caller holds the exclusive lock.
+ */
+bool
+ivfflat_add_posting(Relation index, Buffer buf, IndexTuple itup){
+    TupleDesc tupdesc = RelationGetDescr(index);
+    Page page = BufferGetPage(buf);
+    OffsetNumber max_offset = PageGetMaxOffsetNumber(page);
+
+    for(OffsetNumber offset = FirstOffsetNumber;
+        offset <= max_offset;
+        offset = OffsetNumberNext(offset)){
+        ItemId itemid = PageGetItemId(page, offset);
+        IndexTuple old_tup = (IndexTuple) PageGetItem(page, itemid);
+        ItemPointer old_tids,add_tids,tids;
+        int old_count,add_count,ntids;
+        IndexTuple new_tup;
+        bool fits;
 
-        state = GenericXLogStart(index);
-        page = GenericXLogRegisterBuffer(state, buf,0);
-        if(PageGetFreeSpace(page) >= sz){
-            break;
+        if(ItemIdIsDead(itemid) || !ivfflat_key_equal(old_tup, itup, tupdesc)){
+            continue;
         }
-        insert_page = IvfflatPageGetOpaque(page)->nextblkno;
-        if(BlockNumberIsValid(insert_page)){
-            ivfflat_abort_xlog(buf, state);
-        }else{
-            LockRelationForExtension(index,ExclusiveLock);
-            new_buf = ivfflat_new_buffer(index,MAIN_FORKNUM);
-            UnlockRelationForExtension(index,ExclusiveLock);
 
-            ivfflat_append_xlog(&new_buf, &new_page, state);
+        old_tids = ivfflat_tuple_tids(old_tup, tupdesc);
+        old_count = ivfflat_tuple_tid_count(old_tup, tupdesc);
+        add_tids = ivfflat_tuple_tids(itup, tupdesc);
+        add_count = ivfflat_tuple_tid_count(itup, tupdesc);
+        if(old_count + add_count > ivfflat_max_posting_tids(old_tup, tupdesc)){
+            return false;
+        }
+
+        tids = (ItemPointer) palloc((old_count + add_count) * sizeof(ItemPointerData));
+        memcpy(tids, old_tids, old_count * sizeof(ItemPointerData));
+        ntids = old_count;
+        for(int i = 0; i < add_count; i++){
+            bool found = false;
+            //a buffer merge interrupted by a crash adds the tid again
+            for(int j = 0; j < old_count && !found; j++){
+                found = ItemPointerEquals(&tids[j], &add_tids[i]);
+            }
+            if(!found){
+                tids[ntids++] = add_tids[i];
+            }
+        }
+        if(ntids == old_count){
+            pfree(tids);
+            return true;
+        }
+
+        new_tup = ivfflat_form_posting(old_tup, tupdesc, tids, ntids);
+        fits = IndexTupleSize(new_tup) - ItemIdGetLength(itemid) <= PageGetExactFreeSpace(page);
+        if(fits){
+            ivfflat_xlog_overwrite_item(index, buf, offset, new_tup);
+        }
+        pfree(new_tup);
+        pfree(tids);
+        return fits;
+    }
+    return false;
+}
+
+void
+ivfflat_add_tuple(
+    Relation index,
+    Relation heap_rel,
+    IvfflatInsertCache cache,
+    int slot,
+    IndexTuple itup){
+    BlockNumber insert_page,next_page;
+    uint16 list_tag;
+    bool verify,own;
+    bool from_start = false;
+    bool locked = false;
+    bool spliced = false;
+    bool merged = false;
+    bool tagged;
+    Size sz;
+    Buffer buf;
+    Page page;
 
-            insert_page = BufferGetBlockNumber(new_buf);
-            IvfflatPageGetOpaque(page)->nextblkno = insert_page;
+    list_tag = ivfflat_slot_tag(cache, slot);
+    insert_page = ivfflat_get_insert_page(index, cache, slot, &verify);
+    own = insert_page != cache->shared_insert_pages[slot];
 
-            ivfflat_commit_xlog(buf,state);
+    sz = MAXALIGN(IndexTupleSize(itup));
+    Assert(sz <= IvfflatPageMaxSpace);
 
-            state = GenericXLogStart(index);
-            buf = new_buf;
-            page = GenericXLogRegisterBuffer(state,buf,0);
-            break;
+    while(1){
+        if(locked){
+            //locked while walking on from the start page
+            locked = false;
+        }else if(from_start){
+            //the own and the shared page were busy. the start page is
+            //only held this long when it is the tail of a single page list
+            buf = ReadBuffer(index, insert_page);
+            LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        }else{
+            buf = ReadBuffer(index, insert_page);
+            if(!ConditionalLockBuffer(buf)){
+                //never wait for a page another backend is adding to.
+                //the own page is given up for the shared one, a busy
+                //shared page for a free page after the start page
+                ReleaseBuffer(buf);
+                if(own){
+                    insert_page = cache->shared_insert_pages[slot];
+                }else{
+                    insert_page = cache->start_pages[slot];
+                    from_start = true;
+                }
+                verify = own = false;
+                continue;
+            }
         }
+        if(verify && !ivfflat_page_in_list(BufferGetPage(buf), list_tag)){
+            //stale hint of this backend. start over from the list entry
+            UnlockReleaseBuffer(buf);
+            insert_page = cache->shared_insert_pages[slot];
+            verify = own = false;
+            continue;
+        }
+        verify = false;
+
+        page = BufferGetPage(buf);
+        //an identical vector on the page takes the heap tid.
+        //the buffer is drained by vacuum, it keeps plain entries
+        merged = list_tag != IVFFLAT_LIST_TAG_BUFFER &&
+            ivfflat_add_posting(index, buf, itup);
+        //entries killed by scans make room before the list grows
+        if(!merged && PageGetFreeSpace(page) < sz){
+            ivfflat_prune_page(index, heap_rel, buf);
+        }
+        if(!merged && PageGetFreeSpace(page) < sz){
+            next_page = IvfflatPageGetOpaque(page)->nextblkno;
+            if(BlockNumberIsValid(next_page) && !from_start){
+                UnlockReleaseBuffer(buf);
+                insert_page = next_page;
+                own = false;
+                continue;
+            }
+            if(BlockNumberIsValid(next_page)){
+                //from the start page the list is walked for free space,
+                //pages linked by backends that are gone are reused.
+                //the next page is locked before this one is released,
+                //so a new page is still linked after a locked page
+                Buffer next_buf = ReadBuffer(index, next_page);
+                if(ConditionalLockBuffer(next_buf)){
+                    UnlockReleaseBuffer(buf);
+                    buf = next_buf;
+                    insert_page = next_page;
+                    locked = true;
+                    continue;
+                }
+                ReleaseBuffer(next_buf);
+            }
+            //the tail is full, or the walk from the start page reached a
+            //busy page. the new page goes right after this one
+            buf = ivfflat_link_new_page(index, buf, list_tag);
+        }
+        //pages found from the start page are not advertised in the list entry
+        spliced = from_start;
+
+        insert_page = BufferGetBlockNumber(buf);
+        page = BufferGetPage(buf);
+        break;
     }
 
-    offno = PageAddItem(page, (Item) itup, sz, InvalidOffsetNumber, false, false);
-    if(offno == InvalidOffsetNumber){
-        elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+    if(!merged){
+        ivfflat_xlog_add_item(index, buf, itup, sz);
     }
+    tagged = IvfflatPageGetOpaque(page)->list_tag == list_tag;
+    UnlockReleaseBuffer(buf);
 
-    ivfflat_commit_xlog(buf,state);
+    //a page reached from the start page is kept by this backend only.
+    //other pages are advertised in the list entry if it is not busy
+    if(!spliced && insert_page != cache->shared_insert_pages[slot]){
+        if(slot == cache->buffer_slot){
+            ivfflat_update_buffer_insert_page(
+                index,
+                insert_page,
+                cache->shared_insert_pages[slot],
+                false);
+        }else{
+            ivfflat_try_update_list(
+                index, 
+                &cache->list_infos[slot], 
+                insert_page, 
+                cache->shared_insert_pages[slot]);
+        }
+        cache->shared_insert_pages[slot] = insert_page;
+    }
 
-    if(insert_page != original_insert_page){
-        ivfflat_update_list(
-            index, 
-            &list_info, 
-            insert_page, 
-            original_insert_page, 
-            InvalidBlockNumber, 
-            MAIN_FORKNUM);
+    //later rows start from where this one landed
+    if(insert_page != cache->insert_pages[slot]){
+        cache->insert_pages[slot] = insert_page;
+        if(tagged){
+            ivfflat_set_session_hint(
+                index,
+                slot,
+                insert_page,
+                cache->shared_insert_pages[slot]);
+        }
     }
-}
\ No newline at end of file
+}
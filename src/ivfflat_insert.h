@@ -2,6 +2,71 @@
 #define IVFFLAT_INSERT_H
 
 #include "ivffat.h"
+#include "ivfflat_build.h"
+#include "ivfflat_page.h"
+#include "vector.h"
+#include "storage/relfilelocator.h"
+
+/*
+ * per statement insert state, kept in IndexInfo->ii_AmCache.
+ * the centers and the location of the list entries never change
+ * after the index is built. insert pages are only hints: pages are
+ * never removed from a list, and the insert walks forward from the
+ * hint until it finds free space.
+ *
+ * shared_insert_pages are the hints stored in the list entries.
+ * insert_pages are the pages this backend writes to. inserts never wait
+ * for a page: a backend that finds the page busy walks the list from its
+ * start page for free space, links a page of its own only where the walk
+ * meets a busy or full page, and keeps using the page across statements
+ * (see ivfflat_get_session_hint), so that concurrent writers of a list do
+ * not share one tail page. pages left by other backends are found again
+ * by the walk instead of piling up.
+ */
+typedef struct IvfflatInsertCacheData {
+    IvfflatVectorType vector_type;
+    FmgrInfo distance_proc;
+    FmgrInfo normalize_proc;
+    bool has_normalize_proc;
+    Oid collation;
+
+    Array centers;
+    //covering radii and summaries of the lists as last seen
+    HvectorMetric metric;
+    float *radii;
+    bool summarized;
+    FmgrInfo summary_lt;
+    Oid summary_collation;
+    IvfflatListSummary summaries;
+    //slots 0..buffer_slot-1 are the lists, buffer_slot is the insert buffer
+    int buffer_slot;
+    bool buffered;
+    ListInfo list_infos;
+    BlockNumber *start_pages;
+    BlockNumber *shared_insert_pages;
+    BlockNumber *insert_pages;
+    BlockNumber nblocks;
+
+    //reset after each inserted row
+    MemoryContext tmp_ctx;
+} IvfflatInsertCacheData;
+
+typedef IvfflatInsertCacheData * IvfflatInsertCache;
+
+typedef struct IvfflatSessionHintKey {
+    RelFileLocator locator;
+    int list_no;
+} IvfflatSessionHintKey;
+
+//insert page of a list kept by this backend across statements.
+//tail_page is the insert page of the list entry when it was set
+typedef struct IvfflatSessionHintData {
+    IvfflatSessionHintKey key;
+    BlockNumber insert_page;
+    BlockNumber tail_page;
+} IvfflatSessionHintData;
+
+typedef IvfflatSessionHintData * IvfflatSessionHint;
 
 bool
 ivfflat_insert(
@@ -15,12 +80,65 @@ ivfflat_insert(
     IndexInfo *index_info
 );
 
+IvfflatInsertCache
+ivfflat_get_insert_cache(Relation index, IndexInfo *index_info);
+
+BlockNumber
+ivfflat_get_session_hint(Relation index, int list_no, BlockNumber tail_page);
+
+void
+ivfflat_set_session_hint(
+    Relation index,
+    int list_no,
+    BlockNumber insert_page,
+    BlockNumber tail_page);
+
+BlockNumber
+ivfflat_get_insert_page(
+    Relation index,
+    IvfflatInsertCache cache,
+    int slot,
+    bool *verify);
+
+uint16
+ivfflat_slot_tag(IvfflatInsertCache cache, int slot);
+
+bool
+ivfflat_page_in_list(Page page, uint16 list_tag);
+
+Buffer
+ivfflat_link_new_page(Relation index, Buffer buf, uint16 list_tag);
+
+int
+ivfflat_find_insert_list(IvfflatInsertCache cache, Datum value, double *distance);
+
+void
+ivfflat_cover_entry(
+    Relation index,
+    IvfflatInsertCache cache,
+    int slot,
+    double distance,
+    Datum summary_value,
+    bool summary_isnull);
+
 void
 ivfflat_insert_tuple(
     Relation index, 
     Datum *values, 
     bool *isnull, 
     ItemPointer heap_tid, 
-    Relation heap_rel);
+    Relation heap_rel,
+    IvfflatInsertCache cache);
+
+bool
+ivfflat_add_posting(Relation index, Buffer buf, IndexTuple itup);
+
+void
+ivfflat_add_tuple(
+    Relation index,
+    Relation heap_rel,
+    IvfflatInsertCache cache,
+    int slot,
+    IndexTuple itup);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,11 +1,15 @@
 #include "ivffat.h"
 #include "ivfflat_options.h"
+#include "miscadmin.h"
 #include "storage/lockdefs.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/rel.h"
 
 int ivfflat_probes;
 int ivfflat_iterative_scan;
 int ivfflat_max_probes;
+bool ivfflat_custom_wal;
 static relopt_kind ivfflat_relopt_kind;
 
 static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
@@ -14,6 +18,12 @@ static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
 	{NULL, 0, false}
 };
 
+static relopt_enum_elt_def ivfflat_seeding_options[] = {
+    {"kmeans++", IVFFLAT_SEEDING_KMEANS_PLUSPLUS},
+    {"kmeans||", IVFFLAT_SEEDING_KMEANS_PARALLEL},
+    {NULL}
+};
+
 
 void ivfflat_init_options(void){
     ivfflat_relopt_kind = add_reloption_kind();
@@ -28,6 +38,23 @@ void ivfflat_init_options(void){
         AccessExclusiveLock
     );
 
+    add_bool_reloption(
+        ivfflat_relopt_kind,
+        "buffered_insert",
+        "Append inserts to a buffer that vacuum merges into the lists",
+        false,
+        AccessExclusiveLock
+    );
+
+    add_enum_reloption(
+        ivfflat_relopt_kind,
+        "seeding",
+        "Seeding of the k-means centers when the index is built",
+        ivfflat_seeding_options,
+        IVFFLAT_SEEDING_KMEANS_PLUSPLUS,
+        "Valid values are \"kmeans++\" and \"kmeans||\".",
+        AccessExclusiveLock
+    );
 
     DefineCustomIntVariable(
     "pg_hybrid_ivfflat.probes",
@@ -58,6 +85,29 @@ void ivfflat_init_options(void){
     IVFFLAT_MAX_LIST_COUNT, 
     PGC_USERSET, 0, NULL, NULL, NULL);
 
+    //a postmaster variable can only be created while the postmaster
+    //loads shared_preload_libraries. loaded later, custom_wal stays off
+    //and a value set for it only gets a warning
+    if(process_shared_preload_libraries_in_progress){
+        DefineCustomBoolVariable(
+        "pg_hybrid_ivfflat.custom_wal",
+        "Logs index changes with the pg_hybrid_ivfflat WAL resource manager",
+        "Requires pg_hybrid in shared_preload_libraries, on the standbys too.",
+        &ivfflat_custom_wal,
+        false,
+        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    }else{
+        const char *value = GetConfigOption("pg_hybrid_ivfflat.custom_wal", true, false);
+        bool custom_wal;
+
+        ivfflat_custom_wal = false;
+        if(value != NULL && parse_bool(value, &custom_wal) && custom_wal){
+            ereport(WARNING,
+                (errmsg("pg_hybrid_ivfflat.custom_wal requires pg_hybrid in shared_preload_libraries"),
+                 errdetail("Index changes are logged by the generic WAL.")));
+        }
+    }
+
     MarkGUCPrefixReserved("pg_hybrid_ivfflat");
 }
 
@@ -68,6 +118,14 @@ ivfflat_options(Datum reloptions, bool validate){
             "lists",
              RELOPT_TYPE_INT,
               offsetof(IvfflatOptions, list_count)},
+        {
+            "buffered_insert",
+             RELOPT_TYPE_BOOL,
+              offsetof(IvfflatOptions, buffered_insert)},
+        {
+            "seeding",
+             RELOPT_TYPE_ENUM,
+              offsetof(IvfflatOptions, seeding)},
 	};
 
     return (bytea *) build_reloptions(
@@ -77,4 +135,22 @@ ivfflat_options(Datum reloptions, bool validate){
          sizeof(IvfflatOptions),
           tab,
            lengthof(tab));
-}
\ No newline at end of file
+}
+
+bool
+ivfflat_get_buffered_insert(Relation index){
+    IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+    if(opts == NULL){
+        return false;
+    }
+    return opts->buffered_insert;
+}
+
+IvfflatSeeding
+ivfflat_get_seeding(Relation index){
+    IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+    if(opts == NULL){
+        return IVFFLAT_SEEDING_KMEANS_PLUSPLUS;
+    }
+    return (IvfflatSeeding) opts->seeding;
+}
@@ -2,6 +2,7 @@
 #define IVFFLAT_OPTIONS_H
 
 #include "c.h"
+#include "utils/relcache.h"
 
 #define IVFFLAT_DEFAULT_PROBES 1
 #define IVFFLAT_DEFAULT_LIST_COUNT 100
@@ -11,8 +12,17 @@
 typedef struct IvfflatOptions {
     int32 vl_len_;
     int list_count;
+    bool buffered_insert;
+    int seeding;
 } IvfflatOptions;
 
+//how the build chooses the initial k-means centers
+typedef enum IvfflatSeeding
+{
+    IVFFLAT_SEEDING_KMEANS_PLUSPLUS,
+    IVFFLAT_SEEDING_KMEANS_PARALLEL
+}   IvfflatSeeding;
+
 typedef enum IvfflatIterativeScanMode
 {
 	IVFFLAT_ITERATIVE_SCAN_OFF,
@@ -20,4 +30,10 @@ typedef enum IvfflatIterativeScanMode
 }	IvfflatIterativeScanMode;
 
 void ivfflat_init_options(void);
+
+bool
+ivfflat_get_buffered_insert(Relation index);
+
+IvfflatSeeding
+ivfflat_get_seeding(Relation index);
 #endif
\ No newline at end of file
@@ -6,7 +6,13 @@
 #include "storage/bufpage.h"
 #include "storage/off.h"
 #include "utils/relcache.h"
+#include "storage/lmgr.h"
+#include "varatt.h"
+#include "access/tupmacs.h"
+#include "access/stratnum.h"
+#include "utils/lsyscache.h"
 #include <float.h>
+#include <math.h>
 
 Buffer
 ivfflat_new_buffer(Relation rel, ForkNumber forkNum){ 
@@ -44,6 +50,8 @@ ivfflat_append_page(
     new_page = GenericXLogRegisterBuffer(*state, new_buf, GENERIC_XLOG_FULL_IMAGE);
     IvfflatPageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(new_buf);
     ivfflat_init_page(new_buf, new_page);
+    //the new page continues the same list
+    IvfflatPageGetOpaque(new_page)->list_tag = IvfflatPageGetOpaque(*page)->list_tag;
 
     GenericXLogFinish(*state);
     UnlockReleaseBuffer(*buf);
@@ -64,6 +72,14 @@ ivfflat_get_meta_page(Relation index, int *list_count, int *dimensions){
     page = BufferGetPage(buf);
     meta = IvfflatPageGetMeta(page);
 
+    if(meta->version != IVFFLAT_VERSION){
+        UnlockReleaseBuffer(buf);
+        ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("ivfflat index \"%s\" has version %u, expected %u",
+                RelationGetRelationName(index), meta->version, IVFFLAT_VERSION),
+             errhint("REINDEX the index.")));
+    }
     if(list_count != NULL){
         *list_count = meta->list_count;
     }
@@ -75,24 +91,159 @@ ivfflat_get_meta_page(Relation index, int *list_count, int *dimensions){
 }
 
 void
-ivfflat_find_insert_page(
+ivfflat_get_buffer_pages(
     Relation index,
-    Datum *values,
-    BlockNumber *insert_page,
-    ListInfo list_info
+    BlockNumber *start_page,
+    BlockNumber *insert_page){
+    Buffer buf;
+    Page page;
+    IvfflatMetaPage meta;
+
+    buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    meta = IvfflatPageGetMeta(page);
+
+    //block 0 is the meta page itself: meta pages without the buffer fields
+    if(start_page != NULL){
+        *start_page = meta->buffer_start_page == IVFFLAT_METAPAGE_BLKNO ?
+            InvalidBlockNumber : meta->buffer_start_page;
+    }
+    if(insert_page != NULL){
+        *insert_page = meta->buffer_insert_page == IVFFLAT_METAPAGE_BLKNO ?
+            InvalidBlockNumber : meta->buffer_insert_page;
+    }
+
+    UnlockReleaseBuffer(buf);
+}
+
+BlockNumber
+ivfflat_create_buffer(Relation index){
+    Buffer buf,new_buf;
+    Page page,new_page;
+    GenericXLogState *state;
+    IvfflatMetaPage meta;
+    BlockNumber start_page;
+
+    buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+    LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    meta = IvfflatPageGetMeta(BufferGetPage(buf));
+    start_page = meta->buffer_start_page;
+    //created by another backend meanwhile
+    if(BlockNumberIsValid(start_page) && start_page != IVFFLAT_METAPAGE_BLKNO){
+        UnlockReleaseBuffer(buf);
+        return start_page;
+    }
+
+    LockRelationForExtension(index, ExclusiveLock);
+    new_buf = ivfflat_new_buffer(index, MAIN_FORKNUM);
+    UnlockRelationForExtension(index, ExclusiveLock);
+
+    state = GenericXLogStart(index);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    ivfflat_append_xlog(&new_buf, &new_page, state);
+    IvfflatPageGetOpaque(new_page)->list_tag = IVFFLAT_LIST_TAG_BUFFER;
+
+    start_page = BufferGetBlockNumber(new_buf);
+    meta = IvfflatPageGetMeta(page);
+    meta->buffer_start_page = start_page;
+    meta->buffer_insert_page = start_page;
+    meta->buffer_merge_page = InvalidBlockNumber;
+    ((PageHeader) page)->pd_lower =
+        ((char *) meta + sizeof(IvfflatMetaPageData)) - (char *) page;
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(new_buf);
+    UnlockReleaseBuffer(buf);
+    return start_page;
+}
+
+BlockNumber
+ivfflat_get_buffer_merge_page(Relation index){
+    Buffer buf;
+    Page page;
+    BlockNumber merge_page = InvalidBlockNumber;
+
+    buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    //meta pages without the field end before it
+    if(((PageHeader) page)->pd_lower >=
+        ((char *) IvfflatPageGetMeta(page) + sizeof(IvfflatMetaPageData)) - (char *) page){
+        merge_page = IvfflatPageGetMeta(page)->buffer_merge_page;
+    }
+    UnlockReleaseBuffer(buf);
+    return merge_page;
+}
+
+void
+ivfflat_set_buffer_merge_page(Relation index, BlockNumber merge_page){
+    Buffer buf;
+    Page page;
+    GenericXLogState *state;
+    IvfflatMetaPage meta;
+
+    buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+    LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    state = GenericXLogStart(index);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    meta = IvfflatPageGetMeta(page);
+    meta->buffer_merge_page = merge_page;
+    //the field is past the end of older meta pages
+    ((PageHeader) page)->pd_lower =
+        ((char *) meta + sizeof(IvfflatMetaPageData)) - (char *) page;
+    ivfflat_commit_xlog(buf, state);
+}
+
+void
+ivfflat_update_buffer_insert_page(
+    Relation index,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page,
+    bool wait){
+    Buffer buf;
+    Page page;
+    GenericXLogState *state;
+    IvfflatMetaPage meta;
+
+    buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+    if(wait){
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    }else if(!ConditionalLockBuffer(buf)){
+        //only a hint
+        ReleaseBuffer(buf);
+        return;
+    }
+
+    state = GenericXLogStart(index);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    meta = IvfflatPageGetMeta(page);
+    if(insert_page != meta->buffer_insert_page &&
+        (!BlockNumberIsValid(original_insert_page) ||
+            insert_page >= original_insert_page)){
+        meta->buffer_insert_page = insert_page;
+        ivfflat_commit_xlog(buf, state);
+    }else{
+        ivfflat_abort_xlog(buf, state);
+    }
+}
+
+void
+ivfflat_load_lists(
+    Relation index,
+    Array centers,
+    ListInfo list_infos,
+    BlockNumber *start_pages,
+    BlockNumber *insert_pages,
+    float *radii,
+    IvfflatListSummary summaries
 ){
-    double min_distance = DBL_MAX;
     BlockNumber next_blkno = IVFFLAT_HEAD_BLKNO;
-    FmgrInfo *distance_proc;
-    Oid collation;
     Buffer buf;
     Page page;
     OffsetNumber max_offset;
     IvfflatList list;
-    double distance;
-
-    distance_proc = index_getprocinfo(index,1, IVFFALT_VECTOR_DISTANCE_PROC);
-    collation = index->rd_indcollation[0];
+    int list_no;
 
     while(BlockNumberIsValid(next_blkno)){
         buf = ReadBuffer(index, next_blkno);
@@ -105,28 +256,116 @@ ivfflat_find_insert_page(
             offset <= max_offset;
             offset = OffsetNumberNext(offset)
         ){
+            if(centers->length >= centers->max_length){
+                elog(ERROR, "ivfflat index \"%s\" has more lists than its meta page",
+                    RelationGetRelationName(index));
+            }
             list = (IvfflatList) PageGetItem(
                 page,
                 PageGetItemId(page, offset));
-            distance = DatumGetFloat8(
-                FunctionCall2Coll(
-                    distance_proc, 
-                    collation, 
-                    values[0], 
-                    PointerGetDatum(&list->center)));
-            if(distance < min_distance || 
-                !BlockNumberIsValid(*insert_page)){
-                *insert_page = list->insert_page;
-                list_info->blknum = next_blkno;
-                list_info->offnum = offset;
-                min_distance = distance;
-            }
+            list_no = centers->length;
+            array_copy(centers, list_no, (Pointer) &list->center);
+            centers->length++;
+
+            list_infos[list_no].blknum = next_blkno;
+            list_infos[list_no].offnum = offset;
+            start_pages[list_no] = list->start_page;
+            insert_pages[list_no] = list->insert_page;
+            radii[list_no] = list->radius;
+            summaries[list_no] = list->summary;
         }
         next_blkno = IvfflatPageGetOpaque(page)->nextblkno;
         UnlockReleaseBuffer(buf);
     }
 }
 
+//the radius covering an entry at the given distance from the center.
+//rounded up to float, a smaller radius would hide the entry from scans
+float
+ivfflat_covering_radius(HvectorMetric metric, double distance){
+    double radius;
+    float result;
+
+    if(metric == HVECTOR_METRIC_L2_SQUARED){
+        radius = sqrt(Max(distance, 0.0));
+    }else if(metric == HVECTOR_METRIC_L2){
+        radius = distance;
+    }else{
+        return 0;
+    }
+    result = (float) radius;
+    if((double) result < radius){
+        result = nextafterf(result, FLT_MAX);
+    }
+    return result;
+}
+
+//the < operator of the summarized column, false when it is not summarized
+bool
+ivfflat_get_summary_proc(Relation index, FmgrInfo *lt_proc, MemoryContext mcxt){
+    TupleDesc tupdesc = RelationGetDescr(index);
+    Form_pg_attribute att;
+    Oid opno;
+
+    //INCLUDE columns are not summarized
+    if(IndexRelationGetNumberOfKeyAttributes(index) < 2){
+        return false;
+    }
+    //min and max are stored as datums in the list entry
+    att = TupleDescAttr(tupdesc, 1);
+    if(!att->attbyval || att->attlen <= 0){
+        return false;
+    }
+    opno = get_opfamily_member(
+        index->rd_opfamily[1],
+        index->rd_opcintype[1],
+        index->rd_opcintype[1],
+        BTLessStrategyNumber);
+    if(!OidIsValid(opno)){
+        return false;
+    }
+    fmgr_info_cxt(get_opcode(opno), lt_proc, mcxt);
+    return true;
+}
+
+void
+ivfflat_init_summary(IvfflatListSummary summary, bool summarized){
+    summary->flags = summarized ? IVFFLAT_SUMMARY_EMPTY : IVFFLAT_SUMMARY_NONE;
+    summary->min = (Datum) 0;
+    summary->max = (Datum) 0;
+}
+
+//widen the summary to cover the value, returns whether it changed.
+//the quals are strict, nulls never match them
+bool
+ivfflat_summary_add(
+    IvfflatListSummary summary,
+    FmgrInfo *lt_proc,
+    Oid collation,
+    Datum value,
+    bool isnull){
+    bool changed = false;
+
+    if(summary->flags == IVFFLAT_SUMMARY_NONE || isnull){
+        return false;
+    }
+    if(summary->flags == IVFFLAT_SUMMARY_EMPTY){
+        summary->flags = IVFFLAT_SUMMARY_RANGE;
+        summary->min = value;
+        summary->max = value;
+        return true;
+    }
+    if(DatumGetBool(FunctionCall2Coll(lt_proc, collation, value, summary->min))){
+        summary->min = value;
+        changed = true;
+    }
+    if(DatumGetBool(FunctionCall2Coll(lt_proc, collation, summary->max, value))){
+        summary->max = value;
+        changed = true;
+    }
+    return changed;
+}
+
 void
 ivfflat_start_xlog(Relation index,Buffer *buf,Page *page, GenericXLogState **state){
     *state = GenericXLogStart(index);
@@ -164,4 +403,95 @@ void
 ivfflat_abort_xlog(Buffer buf, GenericXLogState *state){
     GenericXLogAbort(state);
     UnlockReleaseBuffer(buf);
-}
\ No newline at end of file
+}
+
+//bytes of the tuple up to the end of its last non-null column: the vector,
+//the scalar key columns and the INCLUDE columns. a posting tuple keeps its
+//tid count and tids after this, so the size must cover every column
+Size
+ivfflat_key_size(IndexTuple itup, TupleDesc tupdesc){
+    //columns are laid out like heap_fill_tuple
+    Size data_offset = IndexInfoFindDataOffset(itup->t_info);
+    char *tp = (char *) itup + data_offset;
+    bits8 *bp = (bits8 *) ((char *) itup + sizeof(IndexTupleData));
+    Size off = 0;
+
+    for(int i = 0; i < tupdesc->natts; i++){
+        Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+        if(IndexTupleHasNulls(itup) && att_isnull(i, bp)){
+            continue;
+        }
+        off = att_align_pointer(off, att->attalign, att->attlen, tp + off);
+        off = att_addlength_pointer(off, att->attlen, tp + off);
+    }
+    return data_offset + off;
+}
+
+bool
+ivfflat_key_equal(IndexTuple a, IndexTuple b, TupleDesc tupdesc){
+    Size key_size = ivfflat_key_size(a, tupdesc);
+    Size offset = sizeof(IndexTupleData);
+
+    //the null bitmap is compared with the columns
+    if(key_size != ivfflat_key_size(b, tupdesc) ||
+        IndexTupleHasNulls(a) != IndexTupleHasNulls(b)){
+        return false;
+    }
+    return memcmp((char *) a + offset, (char *) b + offset, key_size - offset) == 0;
+}
+
+int
+ivfflat_tuple_tid_count(IndexTuple itup, TupleDesc tupdesc){
+    if(!IvfflatTupleIsPosting(itup)){
+        return 1;
+    }
+    return *((uint16 *) ((char *) itup + SHORTALIGN(ivfflat_key_size(itup, tupdesc))));
+}
+
+ItemPointer
+ivfflat_tuple_tids(IndexTuple itup, TupleDesc tupdesc){
+    if(!IvfflatTupleIsPosting(itup)){
+        return &itup->t_tid;
+    }
+    return (ItemPointer) ((char *) itup + SHORTALIGN(ivfflat_key_size(itup, tupdesc)) + sizeof(uint16));
+}
+
+//a posting tuple still fits on an empty page
+int
+ivfflat_max_posting_tids(IndexTuple itup, TupleDesc tupdesc){
+    Size posting_offset = SHORTALIGN(ivfflat_key_size(itup, tupdesc)) + sizeof(uint16);
+    Size max_size = Min(IvfflatPageMaxSpace, INDEX_SIZE_MASK) & ~((Size) (MAXIMUM_ALIGNOF - 1));
+
+    if(posting_offset + sizeof(ItemPointerData) > max_size){
+        return 1;
+    }
+    return Min((max_size - posting_offset) / sizeof(ItemPointerData), PG_UINT16_MAX);
+}
+
+IndexTuple
+ivfflat_form_posting(IndexTuple base, TupleDesc tupdesc, ItemPointer tids, int ntids){
+    Size key_size = ivfflat_key_size(base, tupdesc);
+    Size size;
+    IndexTuple itup;
+
+    Assert(ntids >= 1 && ntids <= ivfflat_max_posting_tids(base, tupdesc));
+    if(ntids == 1){
+        size = MAXALIGN(key_size);
+    }else{
+        size = MAXALIGN(SHORTALIGN(key_size) + sizeof(uint16) + ntids * sizeof(ItemPointerData));
+    }
+
+    itup = (IndexTuple) palloc0(size);
+    memcpy(itup, base, key_size);
+    itup->t_info &= ~(INDEX_SIZE_MASK | INDEX_AM_RESERVED_BIT);
+    itup->t_info |= size;
+    itup->t_tid = tids[0];
+    if(ntids > 1){
+        char *posting = (char *) itup + SHORTALIGN(key_size);
+        itup->t_info |= INDEX_AM_RESERVED_BIT;
+        *((uint16 *) posting) = (uint16) ntids;
+        memcpy(posting + sizeof(uint16), tids, ntids * sizeof(ItemPointerData));
+    }
+    return itup;
+}
@@ -8,6 +8,7 @@
 #include "storage/bufmgr.h"
 #include "access/generic_xlog.h"
 #include "vector.h"
+#include "access/itup.h"
 
 #define IVFFLAT_METAPAGE_BLKNO 0
 #define IVFFLAT_HEAD_BLKNO 1
@@ -16,21 +17,55 @@ typedef struct IvfflatMetaPageData {
     uint32 version;
     uint16 dimensions;
     uint16 list_count;
+    //insert buffer, see buffered_insert. created on first use
+    BlockNumber buffer_start_page;
+    BlockNumber buffer_insert_page;
+    //buffer page whose entries vacuum is adding to the lists
+    BlockNumber buffer_merge_page;
 } IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
 
 typedef struct IvfflatPageOpaqueData {
     BlockNumber nextblkno;
-    uint16 unused;
+    uint16 list_tag;    //list the entry page belongs to. see IvfflatListTag
     uint16 page_id;
 } IvfflatPageOpaqueData;
 
+//meta page, list pages and entry pages of indexes built before tagging
+#define IVFFLAT_LIST_TAG_NONE 0
+#define IVFFLAT_LIST_TAG_BUFFER 0xFFFF
+#define IvfflatListTag(list_no) ((uint16) ((list_no) + 1))
+
 typedef IvfflatPageOpaqueData * IvfflatPageOpaque;
 
+/*
+ * min/max of the first column after the vector, kept when it is a by-value
+ * type. scans skip the lists that cannot satisfy the quals on it.
+ */
+#define IVFFLAT_SUMMARY_NONE  0 //not kept, every list may match
+#define IVFFLAT_SUMMARY_EMPTY 1 //no non-null value yet
+#define IVFFLAT_SUMMARY_RANGE 2
+
+typedef struct IvfflatListSummaryData {
+    uint16 flags;
+    Datum min;
+    Datum max;
+} IvfflatListSummaryData;
+
+typedef IvfflatListSummaryData * IvfflatListSummary;
+
+/*
+ * radius: l2 distance from the center to the farthest entry of the list,
+ * only kept for l2 opclasses. the radius and the summary only grow, so
+ * any value a scan reads still covers the entries the scan can see
+ * (see ivfflat_cover_entry).
+ */
 typedef struct IvfflatListData {
     BlockNumber start_page;
     BlockNumber insert_page;
+    float radius;
+    IvfflatListSummaryData summary;
     VectorData center;
 } IvfflatListData;
 
@@ -44,6 +79,13 @@ typedef IvfflatListData * IvfflatList;
 #define IvfflatPageMaxSpace \
     (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData)) - sizeof(ItemIdData))
 
+/*
+ * posting tuple: heap tids of identical keys (the vector and the other
+ * columns) in one list share one entry. the columns are followed by a
+ * uint16 count and the heap tids, t_tid is the first of them. entries with one heap tid are plain index tuples.
+ */
+#define IvfflatTupleIsPosting(itup) (((itup)->t_info & INDEX_AM_RESERVED_BIT) != 0)
+
 Buffer
 ivfflat_new_buffer(Relation rel, ForkNumber forkNum);
 
@@ -62,13 +104,55 @@ void
 ivfflat_get_meta_page(Relation index, int *list_count, int *dimensions);
 
 void
-ivfflat_find_insert_page(
+ivfflat_get_buffer_pages(
+    Relation index,
+    BlockNumber *start_page,
+    BlockNumber *insert_page);
+
+BlockNumber
+ivfflat_create_buffer(Relation index);
+
+BlockNumber
+ivfflat_get_buffer_merge_page(Relation index);
+
+void
+ivfflat_set_buffer_merge_page(Relation index, BlockNumber merge_page);
+
+void
+ivfflat_update_buffer_insert_page(
+    Relation index,
+    BlockNumber insert_page,
+    BlockNumber original_insert_page,
+    bool wait);
+
+void
+ivfflat_load_lists(
     Relation index,
-    Datum *values,
-    BlockNumber *insert_page,
-    ListInfo list_info
+    Array centers,
+    ListInfo list_infos,
+    BlockNumber *start_pages,
+    BlockNumber *insert_pages,
+    float *radii,
+    IvfflatListSummary summaries
 );
 
+float
+ivfflat_covering_radius(HvectorMetric metric, double distance);
+
+bool
+ivfflat_get_summary_proc(Relation index, FmgrInfo *lt_proc, MemoryContext mcxt);
+
+void
+ivfflat_init_summary(IvfflatListSummary summary, bool summarized);
+
+bool
+ivfflat_summary_add(
+    IvfflatListSummary summary,
+    FmgrInfo *lt_proc,
+    Oid collation,
+    Datum value,
+    bool isnull);
+
 void
 ivfflat_start_xlog(
     Relation index,
@@ -88,6 +172,24 @@ ivfflat_commit_xlog(Buffer buf, GenericXLogState *state);
 void
 ivfflat_abort_xlog(Buffer buf, GenericXLogState *state);
 
+Size
+ivfflat_key_size(IndexTuple itup, TupleDesc tupdesc);
+
+bool
+ivfflat_key_equal(IndexTuple a, IndexTuple b, TupleDesc tupdesc);
+
+int
+ivfflat_tuple_tid_count(IndexTuple itup, TupleDesc tupdesc);
+
+ItemPointer
+ivfflat_tuple_tids(IndexTuple itup, TupleDesc tupdesc);
+
+int
+ivfflat_max_posting_tids(IndexTuple itup, TupleDesc tupdesc);
+
+IndexTuple
+ivfflat_form_posting(IndexTuple base, TupleDesc tupdesc, ItemPointer tids, int ntids);
+
 void
 ivfflat_init_register_page(
     Relation index,
@@ -16,7 +16,14 @@
 #include "vector.h"
 #include "catalog/pg_operator_d.h"
 #include "miscadmin.h"
+#include "access/stratnum.h"
+#include "varatt.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/spin.h"
+#include "utils/lsyscache.h"
 #include <float.h>
+#include <math.h>
 extern int ivfflat_probes;
 void
 ivfflat_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
@@ -32,11 +39,30 @@ ivfflat_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
     double		startupPages;
 
     if(path->indexorderbys == NIL){//no order by
-        *indexStartupCost = get_float8_infinity();
-        *indexTotalCost = get_float8_infinity();
-        *indexSelectivity = 0;
-        *indexCorrelation = 0;
-        *indexPages = 0;
+        bool range = false;
+        ListCell *lc;
+
+        //a range qual on the vector column reads the lists near the query
+        foreach(lc, path->indexclauses){
+            if(lfirst_node(IndexClause, lc)->indexcol == 0){
+                range = true;
+            }
+        }
+        if(!range){
+            *indexStartupCost = get_float8_infinity();
+            *indexTotalCost = get_float8_infinity();
+            *indexSelectivity = 0;
+            *indexCorrelation = 0;
+            *indexPages = 0;
+            return;
+        }
+        MemSet(&costs, 0, sizeof(costs));
+        genericcostestimate(root,path,loop_count,&costs);
+        *indexStartupCost = costs.indexStartupCost;
+        *indexTotalCost = costs.indexTotalCost;
+        *indexSelectivity = costs.indexSelectivity;
+        *indexCorrelation = costs.indexCorrelation;
+        *indexPages = costs.numIndexPages;
         return;
     }
     MemSet(&costs, 0, sizeof(costs));
@@ -82,14 +108,16 @@ ivfflat_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 
 Tuplesortstate *
 ivfflat_init_scan_sort_state(TupleDesc tup_desc){
-    AttrNumber	attNums[] = {1};
-	Oid			sortOperators[] = {Float8LessOperator};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
+    //equal distances are ordered by heap tid, so the same entry
+    //read twice is returned back to back
+    AttrNumber	attNums[] = {1, 2};
+	Oid			sortOperators[] = {Float8LessOperator, TIDLessOperator};
+	Oid			sortCollations[] = {InvalidOid, InvalidOid};
+	bool		nullsFirstFlags[] = {false, false};
 
 	return tuplesort_begin_heap(
         tup_desc,
-        1, 
+        2, 
         attNums,
         sortOperators,
         sortCollations,
@@ -99,6 +127,23 @@ ivfflat_init_scan_sort_state(TupleDesc tup_desc){
         false);
 }
 
+static int
+ivfflat_compare_scan_keys(double distance_a, ItemPointer tid_a, double distance_b, ItemPointer tid_b){
+    if(distance_a != distance_b){
+        return distance_a < distance_b ? -1 : 1;
+    }
+    return ItemPointerCompare(tid_a, tid_b);
+}
+
+//the order of the scan sort state
+int
+ivfflat_compare_scan_items(const void *a, const void *b){
+    IvfflatScanItem ia = (IvfflatScanItem) a;
+    IvfflatScanItem ib = (IvfflatScanItem) b;
+
+    return ivfflat_compare_scan_keys(ia->distance, &ia->heap_tid, ib->distance, &ib->heap_tid);
+}
+
 #define GET_SCAN_LIST(ptr) pairingheap_container(IvfflatScanListData, ph_node, ptr)
 #define GET_SCAN_LIST_CONST(ptr) pairingheap_const_container(IvfflatScanListData, ph_node, ptr)
 
@@ -135,12 +180,17 @@ ivfflat_beginscan(Relation index, int nkeys, int norderbys){
     if(max_probes > list_count){
         max_probes = list_count;
     }
+    //a range scan may read every list
+    if(norderbys == 0){
+        max_probes = list_count;
+    }
 
     scan_opaque = (IvfflatScanOpaque) palloc(sizeof(IvfflatScanOpaqueData));
     scan_opaque->vector_type = ivfflat_get_vector_type(index);
     scan_opaque->is_first_scan = true;
     scan_opaque->probes = probes;
     scan_opaque->max_probes = max_probes;
+    scan_opaque->index_list_count = list_count;
     scan_opaque->dimensions = dimensions;
 
     scan_opaque->vector_distance_proc = index_getprocinfo(index, 1,IVFFALT_VECTOR_DISTANCE_PROC);
@@ -153,7 +203,7 @@ ivfflat_beginscan(Relation index, int nkeys, int norderbys){
 
     old_ctx = MemoryContextSwitchTo(scan_opaque->tmp_ctx);
 
-    scan_opaque->tup_desc = CreateTemplateTupleDesc(2);
+    scan_opaque->tup_desc = CreateTemplateTupleDesc(5);
     TupleDescInitEntry(
         scan_opaque->tup_desc,
         (AttrNumber) 1,
@@ -170,30 +220,110 @@ ivfflat_beginscan(Relation index, int nkeys, int norderbys){
         -1,
         0
     );
+    TupleDescInitEntry(
+        scan_opaque->tup_desc,
+        (AttrNumber) 3,
+        "indextid",
+        TIDOID,
+        -1,
+        0
+    );
+    TupleDescInitEntry(
+        scan_opaque->tup_desc,
+        (AttrNumber) 4,
+        "lsn",
+        INT8OID,
+        -1,
+        0
+    );
+    //the entry for index-only scans, null otherwise
+    TupleDescInitEntry(
+        scan_opaque->tup_desc,
+        (AttrNumber) 5,
+        "itup",
+        BYTEAOID,
+        -1,
+        0
+    );
 
-    scan_opaque->sort_state =ivfflat_init_scan_sort_state(scan_opaque->tup_desc);
+    //one run for the buffer, at most one per list. a range scan has one
+    //list run at a time
+    scan_opaque->filling = NULL;
+    scan_opaque->runs = palloc0((norderbys == 0 ? 2 : max_probes + 1) * sizeof(IvfflatScanRunData));
+    scan_opaque->run_count = 0;
+    scan_opaque->run_ctx = AllocSetContextCreate(scan_opaque->tmp_ctx,
+        "Ivfflat scan run context",
+        ALLOCSET_DEFAULT_SIZES);
 
     scan_opaque->v_slot = MakeSingleTupleTableSlot(scan_opaque->tup_desc, &TTSOpsVirtual);
-    scan_opaque->m_slot = MakeSingleTupleTableSlot(scan_opaque->tup_desc, &TTSOpsMinimalTuple);
     scan_opaque->strategy = GetAccessStrategy(BAS_BULKREAD);
 
+    scan_opaque->summary_keys = palloc(Max(nkeys, 1) * sizeof(IvfflatSummaryKeyData));
+    scan_opaque->summary_key_count = 0;
+    scan_opaque->summary_keys_ready = false;
     scan_opaque->list_queue = pairingheap_allocate(ivfflat_compare_lists, scan_desc);
-    scan_opaque->list_pages = palloc(max_probes * sizeof(BlockNumber));
+    scan_opaque->probe_lists = palloc(max_probes * sizeof(IvfflatScanList));
+    scan_opaque->list_count = 0;
     scan_opaque->list_index = 0;
     scan_opaque->lists = palloc(max_probes * sizeof(IvfflatScanListData));
+    scan_opaque->buffer_page = InvalidBlockNumber;
+    scan_opaque->scoring_buffer = false;
+    scan_opaque->buffer_tids = NULL;
+    scan_opaque->buffer_tid_count = 0;
+    scan_opaque->max_buffer_tids = 0;
+    ItemPointerSetInvalid(&scan_opaque->last_tid);
+    ItemPointerSetInvalid(&scan_opaque->last_index_tid);
+    scan_opaque->killed_items = palloc(IVFFLAT_MAX_KILLED_ITEMS * sizeof(IvfflatKilledItemData));
+    scan_opaque->killed_count = 0;
+    scan_opaque->batch_distance = NULL;
+    scan_opaque->metric = HVECTOR_METRIC_NONE;
+    scan_opaque->batch_offsets = palloc(MaxOffsetNumber * sizeof(OffsetNumber));
+    scan_opaque->batch_vectors = palloc(MaxOffsetNumber * sizeof(float *));
+    scan_opaque->batch_distances = palloc(MaxOffsetNumber * sizeof(double));
+    scan_opaque->itup = NULL;
+    scan_opaque->parallel_setup = false;
+    scan_opaque->exact = false;
+    memset(&scan_opaque->exact_scan, 0, sizeof(IvfflatExactScanData));
+    scan_opaque->centers_loaded = false;
+    scan_opaque->center_count = 0;
+    scan_opaque->centers = NULL;
+    scan_opaque->range_key = NULL;
+    scan_opaque->order_range_key = NULL;
+    scan_opaque->range_threshold = DBL_MAX;
+    scan_opaque->range_base = 0;
+    scan_opaque->range_done = false;
+    scan_opaque->recheck = false;
 
     MemoryContextSwitchTo(old_ctx);
+    scan_desc->xs_itupdesc = RelationGetDescr(index);
     scan_desc->opaque = scan_opaque;
     return scan_desc;
 }
 
 
+//how many of the probed lists the scan read, the others were skipped
+static void
+ivfflat_report_lists(IndexScanDesc scan){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan->opaque;
+
+    if(scan->parallel_scan == NULL && scan_opaque->list_count > 0){
+        elog(DEBUG1, "pg_hybrid_ivfflat scan read %d of %d probed lists",
+             scan_opaque->list_index, scan_opaque->list_count);
+    }
+}
+
 void
 ivfflat_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys){
     IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan->opaque;
+    ivfflat_report_lists(scan);
+    ivfflat_kill_items(scan);
+    ivfflat_end_runs(scan);
+    ItemPointerSetInvalid(&scan_opaque->last_index_tid);
     scan_opaque->is_first_scan = true;
     pairingheap_reset(scan_opaque->list_queue);
+    scan_opaque->list_count = 0;
     scan_opaque->list_index = 0;
+    ivfflat_exact_reset(scan);
 
     if (keys && scan->numberOfKeys > 0){
         memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
@@ -209,25 +339,296 @@ ivfflat_zero_distance(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2){
     return Float8GetDatum(0.0);
 }
 
+//the query of the order by or of the range key
 Datum
-ivfflat_get_scan_value(IndexScanDesc scan_desc){
+ivfflat_get_scan_value(IndexScanDesc scan_desc, Datum argument, bool is_null){
     IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
     Datum value;
-    if(scan_desc->orderByData->sk_flags & SK_ISNULL){
+    if(is_null){
         value = PointerGetDatum(NULL);
         scan_opaque->dist_func = ivfflat_zero_distance;
+        scan_opaque->batch_distance = NULL;
+        scan_opaque->metric = HVECTOR_METRIC_NONE;
     }else{
-        value = scan_desc->orderByData->sk_argument;
+        value = argument;
         scan_opaque->dist_func = FunctionCall2Coll;
         if(scan_opaque->vector_normalize_proc != NULL){
-            MemoryContext old_ctx = MemoryContextSwitchTo(scan_opaque->tmp_ctx);
+            MemoryContext old_ctx = MemoryContextSwitchTo(scan_opaque->run_ctx);
             value = ivfflat_normalize_value(scan_opaque->vector_type, scan_opaque->collation, value);
             MemoryContextSwitchTo(old_ctx);
         }
+        scan_opaque->batch_distance = hvector_get_batch_distance(scan_opaque->vector_distance_proc);
+        scan_opaque->metric = hvector_get_metric(scan_opaque->vector_distance_proc);
+        if(scan_opaque->batch_distance != NULL){
+            //detoasted once, not once per entry
+            MemoryContext old_ctx = MemoryContextSwitchTo(scan_opaque->run_ctx);
+            value = PointerGetDatum(DatumGetVectorP(value));
+            MemoryContextSwitchTo(old_ctx);
+        }
     }
     return value;
 }
 
+//the operators of the quals are looked up once, in the context of the
+//scan. a rescan keeps them and only takes the new arguments
+void
+ivfflat_init_summary_keys(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    Relation index = scan_desc->indexRelation;
+    MemoryContext old_ctx;
+
+    if(scan_opaque->summary_keys_ready){
+        for(int i = 0; i < scan_opaque->summary_key_count; i++){
+            IvfflatSummaryKey summary_key = &scan_opaque->summary_keys[i];
+            ScanKey key = &scan_desc->keyData[summary_key->key_index];
+
+            summary_key->argument = key->sk_argument;
+            summary_key->is_null = (key->sk_flags & SK_ISNULL) != 0;
+        }
+        return;
+    }
+    old_ctx = MemoryContextSwitchTo(scan_opaque->tmp_ctx);
+    scan_opaque->summary_key_count = 0;
+    for(int i = 0; i < scan_desc->numberOfKeys; i++){
+        ScanKey key = &scan_desc->keyData[i];
+        IvfflatSummaryKey summary_key = &scan_opaque->summary_keys[scan_opaque->summary_key_count];
+        Oid lefttype,righttype;
+        StrategyNumber min_strategy = InvalidStrategy;
+        StrategyNumber max_strategy = InvalidStrategy;
+        Oid min_opno = InvalidOid,max_opno = InvalidOid;
+
+        if(key->sk_attno != 2){
+            continue;
+        }
+        switch(key->sk_strategy){
+            case BTLessStrategyNumber:
+                min_strategy = BTLessStrategyNumber;
+                break;
+            case BTLessEqualStrategyNumber:
+                min_strategy = BTLessEqualStrategyNumber;
+                break;
+            case BTEqualStrategyNumber:
+                min_strategy = BTLessEqualStrategyNumber;
+                max_strategy = BTGreaterEqualStrategyNumber;
+                break;
+            case BTGreaterEqualStrategyNumber:
+                max_strategy = BTGreaterEqualStrategyNumber;
+                break;
+            case BTGreaterStrategyNumber:
+                max_strategy = BTGreaterStrategyNumber;
+                break;
+            default:
+                continue;
+        }
+        lefttype = index->rd_opcintype[1];
+        righttype = OidIsValid(key->sk_subtype) ? key->sk_subtype : lefttype;
+        if(min_strategy != InvalidStrategy){
+            min_opno = get_opfamily_member(index->rd_opfamily[1], lefttype, righttype, min_strategy);
+            if(!OidIsValid(min_opno)){
+                continue;
+            }
+        }
+        if(max_strategy != InvalidStrategy){
+            max_opno = get_opfamily_member(index->rd_opfamily[1], lefttype, righttype, max_strategy);
+            if(!OidIsValid(max_opno)){
+                continue;
+            }
+        }
+
+        summary_key->key_index = i;
+        summary_key->argument = key->sk_argument;
+        summary_key->collation = key->sk_collation;
+        summary_key->is_null = (key->sk_flags & SK_ISNULL) != 0;
+        summary_key->has_min = OidIsValid(min_opno);
+        summary_key->has_max = OidIsValid(max_opno);
+        if(summary_key->has_min){
+            fmgr_info(get_opcode(min_opno), &summary_key->min_proc);
+        }
+        if(summary_key->has_max){
+            fmgr_info(get_opcode(max_opno), &summary_key->max_proc);
+        }
+        scan_opaque->summary_key_count++;
+    }
+    scan_opaque->summary_keys_ready = true;
+    MemoryContextSwitchTo(old_ctx);
+}
+
+bool
+ivfflat_list_may_match(IndexScanDesc scan_desc, IvfflatListSummary summary){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+
+    if(summary->flags == IVFFLAT_SUMMARY_NONE){
+        return true;
+    }
+    for(int i = 0; i < scan_opaque->summary_key_count; i++){
+        IvfflatSummaryKey key = &scan_opaque->summary_keys[i];
+
+        //only nulls, or a null argument
+        if(summary->flags == IVFFLAT_SUMMARY_EMPTY || key->is_null){
+            return false;
+        }
+        if(key->has_min && !DatumGetBool(FunctionCall2Coll(
+            &key->min_proc,
+            key->collation,
+            summary->min,
+            key->argument))){
+            return false;
+        }
+        if(key->has_max && !DatumGetBool(FunctionCall2Coll(
+            &key->max_proc,
+            key->collation,
+            summary->max,
+            key->argument))){
+            return false;
+        }
+    }
+    return true;
+}
+
+//keep the max_probes nearest lists in the max-heap list_queue
+static void
+ivfflat_offer_scan_list(
+    IvfflatScanOpaque scan_opaque,
+    int *list_count,
+    double *max_distance,
+    BlockNumber start_page,
+    double distance,
+    float radius,
+    int list_no){
+    IvfflatScanList scan_list;
+
+    if(*list_count < scan_opaque->max_probes){
+        scan_list = &scan_opaque->lists[*list_count];
+        (*list_count)++;
+    }else if(distance < *max_distance){
+        scan_list = GET_SCAN_LIST(pairingheap_remove_first(scan_opaque->list_queue));
+    }else{
+        return;
+    }
+    scan_list->start_page = start_page;
+    scan_list->distance = distance;
+    scan_list->radius = radius;
+    scan_list->list_no = list_no;
+    pairingheap_add(scan_opaque->list_queue,&scan_list->ph_node);
+
+    if(*list_count == scan_opaque->max_probes){
+        *max_distance = GET_SCAN_LIST(pairingheap_first(scan_opaque->list_queue))->distance;
+    }
+}
+
+/*
+ * copy the centers of the lists once per scan, so a rescan scores them
+ * in memory instead of reading the center pages. skipped when they do
+ * not fit in work_mem.
+ */
+void
+ivfflat_load_centers(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    int max_count = scan_opaque->index_list_count;
+    Size vector_size = MAXALIGN(VECTOR_SIZE(scan_opaque->dimensions));
+    BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
+    MemoryContext old_ctx;
+    int count = 0;
+    bool complete = true;
+
+    scan_opaque->centers_loaded = true;
+    if((double) max_count * vector_size > work_mem * 1024.0){
+        return;
+    }
+
+    old_ctx = MemoryContextSwitchTo(scan_opaque->tmp_ctx);
+    scan_opaque->centers = palloc(max_count * vector_size);
+    scan_opaque->center_data = palloc(max_count * sizeof(float *));
+    scan_opaque->center_start_pages = palloc(max_count * sizeof(BlockNumber));
+    scan_opaque->center_tids = palloc(max_count * sizeof(ItemPointerData));
+    scan_opaque->center_distances = palloc(max_count * sizeof(double));
+    MemoryContextSwitchTo(old_ctx);
+
+    while(BlockNumberIsValid(blkno) && complete){
+        Buffer buf = ReadBuffer(scan_desc->indexRelation, blkno);
+        Page page;
+        OffsetNumber max_offset;
+
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        for(OffsetNumber offset = FirstOffsetNumber;
+            offset <= max_offset;
+            offset = OffsetNumberNext(offset)){
+            IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offset));
+            Vector center = (Vector) (scan_opaque->centers + count * vector_size);
+
+            if(count == max_count || list->center.dim != scan_opaque->dimensions){
+                complete = false;
+                break;
+            }
+            memcpy(center, &list->center, VECTOR_SIZE(scan_opaque->dimensions));
+            scan_opaque->center_data[count] = center->data;
+            scan_opaque->center_start_pages[count] = list->start_page;
+            ItemPointerSet(&scan_opaque->center_tids[count], blkno, offset);
+            count++;
+        }
+        blkno = IvfflatPageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+
+    //not the layout of the meta page, read the pages
+    if(!complete){
+        pfree(scan_opaque->centers);
+        pfree(scan_opaque->center_data);
+        pfree(scan_opaque->center_start_pages);
+        pfree(scan_opaque->center_tids);
+        pfree(scan_opaque->center_distances);
+        scan_opaque->centers = NULL;
+        return;
+    }
+    scan_opaque->center_count = count;
+}
+
+static int
+ivfflat_compare_list_nos(const void *a, const void *b){
+    IvfflatScanList la = *((const IvfflatScanList *) a);
+    IvfflatScanList lb = *((const IvfflatScanList *) b);
+
+    return la->list_no - lb->list_no;
+}
+
+//the radii of the cached lists, read after the buffer was scored like
+//the page path does. the lists are read in chain order, one pin per page
+void
+ivfflat_read_radii(IndexScanDesc scan_desc, int list_count){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    Buffer buf = InvalidBuffer;
+    BlockNumber blkno = InvalidBlockNumber;
+    Page page = NULL;
+
+    for(int i = 0; i < list_count; i++){
+        scan_opaque->probe_lists[i] = &scan_opaque->lists[i];
+    }
+    qsort(scan_opaque->probe_lists, list_count, sizeof(IvfflatScanList), ivfflat_compare_list_nos);
+
+    for(int i = 0; i < list_count; i++){
+        IvfflatScanList scan_list = scan_opaque->probe_lists[i];
+        ItemPointer tid = &scan_opaque->center_tids[scan_list->list_no];
+        IvfflatList list;
+
+        if(ItemPointerGetBlockNumber(tid) != blkno){
+            if(BufferIsValid(buf)){
+                UnlockReleaseBuffer(buf);
+            }
+            blkno = ItemPointerGetBlockNumber(tid);
+            buf = ReadBuffer(scan_desc->indexRelation, blkno);
+            LockBuffer(buf, BUFFER_LOCK_SHARE);
+            page = BufferGetPage(buf);
+        }
+        list = (IvfflatList) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(tid)));
+        scan_list->radius = list->radius;
+    }
+    if(BufferIsValid(buf)){
+        UnlockReleaseBuffer(buf);
+    }
+}
+
 void
 ivfflat_get_scan_lists(IndexScanDesc scan_desc,Datum value){
     IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
@@ -240,6 +641,52 @@ ivfflat_get_scan_lists(IndexScanDesc scan_desc,Datum value){
     IvfflatList list;
     IvfflatScanList scan_list;
 
+    //the summaries are only on the pages
+    if(scan_opaque->summary_key_count == 0 && !scan_opaque->centers_loaded){
+        ivfflat_load_centers(scan_desc);
+    }
+
+    if(scan_opaque->summary_key_count == 0 && scan_opaque->centers != NULL){
+        int count = scan_opaque->center_count;
+
+        if(scan_opaque->batch_distance != NULL){
+            Vector query = (Vector) DatumGetPointer(value);
+            if(query->dim != scan_opaque->dimensions){
+                ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("different vector dimensions %d and %d", scan_opaque->dimensions, query->dim)));
+            }
+            scan_opaque->batch_distance(
+                query->dim,
+                query->data,
+                scan_opaque->center_data,
+                count,
+                scan_opaque->center_distances);
+        }else{
+            for(int i = 0; i < count; i++){
+                scan_opaque->center_distances[i] = DatumGetFloat8(
+                    scan_opaque->dist_func(
+                    scan_opaque->vector_distance_proc,
+                    scan_opaque->collation,
+                    PointerGetDatum(scan_opaque->centers + i * MAXALIGN(VECTOR_SIZE(scan_opaque->dimensions))),
+                    value
+                ));
+            }
+        }
+        for(int i = 0; i < count; i++){
+            ivfflat_offer_scan_list(
+                scan_opaque,
+                &list_count,
+                &max_distance,
+                scan_opaque->center_start_pages[i],
+                scan_opaque->center_distances[i],
+                0,
+                i);
+        }
+        ivfflat_read_radii(scan_desc, list_count);
+        start_blkno = InvalidBlockNumber;
+    }
+
     //scan list pages
     while(BlockNumberIsValid(start_blkno)){
         center_buf = ReadBuffer(scan_desc->indexRelation,start_blkno);
@@ -253,6 +700,10 @@ ivfflat_get_scan_lists(IndexScanDesc scan_desc,Datum value){
             list = (IvfflatList) PageGetItem(
                 center_page,
                 PageGetItemId(center_page,offset));
+            if(scan_opaque->summary_key_count > 0 &&
+                !ivfflat_list_may_match(scan_desc, &list->summary)){
+                continue;
+            }
             distance = DatumGetFloat8(
                 scan_opaque->dist_func(
                 scan_opaque->vector_distance_proc,
@@ -260,124 +711,1360 @@ ivfflat_get_scan_lists(IndexScanDesc scan_desc,Datum value){
                 PointerGetDatum(&list->center),
                 value
             ));
-            if(list_count < scan_opaque->max_probes){
-                scan_list = &scan_opaque->lists[list_count];
-                scan_list->start_page = list->start_page;
-                scan_list->distance = distance;
-                list_count++;
-                //add to heap
-                pairingheap_add(scan_opaque->list_queue,&scan_list->ph_node);
-
-                if(list_count == scan_opaque->max_probes){
-                    max_distance = GET_SCAN_LIST(pairingheap_first(scan_opaque->list_queue))->distance;
-                }
-            }else if(distance < max_distance){
-                scan_list = GET_SCAN_LIST(pairingheap_remove_first(scan_opaque->list_queue));
-                scan_list->start_page = list->start_page;
-                scan_list->distance = distance;
-                pairingheap_add(scan_opaque->list_queue,&scan_list->ph_node);
-
-                max_distance = GET_SCAN_LIST(pairingheap_first(scan_opaque->list_queue))->distance;
-            }
+            ivfflat_offer_scan_list(
+                scan_opaque,
+                &list_count,
+                &max_distance,
+                list->start_page,
+                distance,
+                list->radius,
+                -1);
         }
         start_blkno = IvfflatPageGetOpaque(center_page)->nextblkno;
         UnlockReleaseBuffer(center_buf);
     }
 
     for(int i = list_count - 1; i >= 0; i--){
-        scan_opaque->list_pages[i] = GET_SCAN_LIST(pairingheap_remove_first(scan_opaque->list_queue))->start_page;
+        scan_list = GET_SCAN_LIST(pairingheap_remove_first(scan_opaque->list_queue));
+        scan_list->lower_bound = ivfflat_list_lower_bound(
+            scan_opaque->metric,
+            scan_list->distance,
+            scan_list->radius);
+        scan_opaque->probe_lists[i] = scan_list;
+    }
+    qsort(
+        scan_opaque->probe_lists,
+        list_count,
+        sizeof(IvfflatScanList),
+        ivfflat_compare_lower_bounds);
+    //a range scan reads only the lists that may hold an entry in range
+    if(scan_opaque->range_key != NULL){
+        while(list_count > 0 &&
+            scan_opaque->probe_lists[list_count - 1]->lower_bound >= scan_opaque->range_threshold){
+            list_count--;
+        }
     }
+    scan_opaque->list_count = list_count;
+    scan_opaque->list_index = 0;
 }
 
-void
-ivfflat_get_scan_items(IndexScanDesc scan_desc, Datum value){
+/*
+ * no entry within radius of the center is closer to the query than
+ * |q - c| - radius. the slack covers the float rounding of the distance
+ * functions. other distances are not metrics, their lists are never skipped.
+ */
+double
+ivfflat_list_lower_bound(HvectorMetric metric, double distance, float radius){
+    double center_distance,bound;
+
+    if(metric == HVECTOR_METRIC_L2_SQUARED){
+        center_distance = sqrt(Max(distance, 0.0));
+    }else if(metric == HVECTOR_METRIC_L2){
+        center_distance = distance;
+    }else{
+        return -DBL_MAX;
+    }
+    bound = center_distance - radius - (center_distance + radius) * 1e-4;
+    if(bound <= 0){
+        return 0;
+    }
+    return metric == HVECTOR_METRIC_L2_SQUARED ? bound * bound : bound;
+}
+
+int
+ivfflat_compare_lower_bounds(const void *a, const void *b){
+    IvfflatScanList la = *((const IvfflatScanList *) a);
+    IvfflatScanList lb = *((const IvfflatScanList *) b);
+
+    if(la->lower_bound != lb->lower_bound){
+        return la->lower_bound < lb->lower_bound ? -1 : 1;
+    }
+    if(la->distance != lb->distance){
+        return la->distance < lb->distance ? -1 : 1;
+    }
+    return 0;
+}
+
+//score the live entries of the locked page that pass the quals. their
+//offsets and distances are left in batch_offsets and batch_distances,
+//returns their number
+int
+ivfflat_score_page(IndexScanDesc scan_desc, Datum value, Page page){
     IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
     TupleDesc tup_desc = RelationGetDescr(scan_desc->indexRelation);
-    TupleTableSlot *slot = scan_opaque->v_slot;
-    int batch_probes = 0;
-    Buffer buf;
-    Page page;
-    OffsetNumber max_offset;
+    OffsetNumber max_offset = PageGetMaxOffsetNumber(page);
     IndexTuple itup;
     Datum datum;
     bool isnull;
     ItemId itemid;
+    int count = 0;
 
-    tuplesort_reset(scan_opaque->sort_state);
+    //collect the live entries of the page
+    for(OffsetNumber offset = FirstOffsetNumber;
+        offset <= max_offset;
+        offset = OffsetNumberNext(offset)){
+        itemid = PageGetItemId(page,offset);
+        //known dead to every transaction, no need to score it
+        if(scan_desc->ignore_killed_tuples && ItemIdIsDead(itemid)){
+            continue;
+        }
+        //filtered out, no need to score it or fetch its heap tuple
+        if(scan_desc->numberOfKeys > 0 &&
+            !ivfflat_match_keys(scan_desc, (IndexTuple) PageGetItem(page, itemid), tup_desc)){
+            continue;
+        }
+        scan_opaque->batch_offsets[count++] = offset;
+    }
 
-    while(scan_opaque->list_index < scan_opaque->max_probes && 
-        (++batch_probes) <= scan_opaque->probes){
-        BlockNumber search_page = scan_opaque->list_pages[scan_opaque->list_index++];
-        while(BlockNumberIsValid(search_page)){
-            buf = ReadBufferExtended(scan_desc->indexRelation,MAIN_FORKNUM,search_page,RBM_NORMAL,scan_opaque->strategy);
-            LockBuffer(buf,BUFFER_LOCK_SHARE);
-            page = BufferGetPage(buf);
-            max_offset = PageGetMaxOffsetNumber(page);
-            for(OffsetNumber offset = FirstOffsetNumber;
-                offset <= max_offset;
-                offset = OffsetNumberNext(offset)){
-                itemid = PageGetItemId(page,offset);
-                itup = (IndexTuple) PageGetItem(page,itemid);
-                datum = index_getattr(itup,1,tup_desc,&isnull);
-                ExecClearTuple(slot);
-                slot->tts_values[0] = scan_opaque->dist_func(
-                    scan_opaque->vector_distance_proc,
-                    scan_opaque->collation,
-                    datum,
-                    value
-                );
-                slot->tts_isnull[0] = false;
-                slot->tts_values[1] = PointerGetDatum(&itup->t_tid);
-                slot->tts_isnull[1] = false;
-                ExecStoreVirtualTuple(slot);
+    if(scan_opaque->batch_distance != NULL){
+        Vector query = (Vector) DatumGetPointer(value);
+        for(int i = 0; i < count; i++){
+            Vector vec;
+            itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, scan_opaque->batch_offsets[i]));
+            datum = index_getattr(itup,1,tup_desc,&isnull);
+            //short varlena headers are copied to an aligned vector
+            vec = DatumGetVectorP(datum);
+            if(vec->dim != query->dim){
+                ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("different vector dimensions %d and %d", vec->dim, query->dim)));
+            }
+            scan_opaque->batch_vectors[i] = vec->data;
+        }
+        scan_opaque->batch_distance(
+            query->dim,
+            query->data,
+            scan_opaque->batch_vectors,
+            count,
+            scan_opaque->batch_distances);
+    }else{
+        for(int i = 0; i < count; i++){
+            itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, scan_opaque->batch_offsets[i]));
+            datum = index_getattr(itup,1,tup_desc,&isnull);
+            scan_opaque->batch_distances[i] = DatumGetFloat8(scan_opaque->dist_func(
+                scan_opaque->vector_distance_proc,
+                scan_opaque->collation,
+                datum,
+                value
+            ));
+        }
+    }
+
+    //out of range, the operator itself is rechecked on the heap row
+    if(scan_opaque->range_key != NULL){
+        int kept = 0;
 
-                tuplesort_puttupleslot(scan_opaque->sort_state,slot);
+        for(int i = 0; i < count; i++){
+            if(scan_opaque->batch_distances[i] < scan_opaque->range_threshold){
+                scan_opaque->batch_offsets[kept] = scan_opaque->batch_offsets[i];
+                scan_opaque->batch_distances[kept] = scan_opaque->batch_distances[i];
+                kept++;
             }
-            search_page = IvfflatPageGetOpaque(page)->nextblkno;
-            UnlockReleaseBuffer(buf);
         }
+        count = kept;
     }
+    return count;
+}
+
+void
+ivfflat_scan_chain(IndexScanDesc scan_desc, Datum value, BlockNumber search_page){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    Buffer buf;
+    Page page;
+    IndexTuple itup;
+    XLogRecPtr lsn;
+    int count;
+
+    while(BlockNumberIsValid(search_page)){
+        buf = ReadBufferExtended(scan_desc->indexRelation,MAIN_FORKNUM,search_page,RBM_NORMAL,scan_opaque->strategy);
+        LockBuffer(buf,BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        lsn = BufferGetLSNAtomic(buf);
 
-    tuplesort_performsort(scan_opaque->sort_state);
+        count = ivfflat_score_page(scan_desc, value, page);
+        for(int i = 0; i < count; i++){
+            itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, scan_opaque->batch_offsets[i]));
+            ivfflat_put_scan_item(
+                scan_desc,
+                itup,
+                search_page,
+                scan_opaque->batch_offsets[i],
+                lsn,
+                scan_opaque->batch_distances[i]);
+        }
+        search_page = IvfflatPageGetOpaque(page)->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
 }
 
+//the quals on the columns after the vector. the operators are the
+//btree style ones of the column opclass, the null test is strict
 bool
-ivfflat_gettuple(IndexScanDesc scan, ScanDirection dir){
-    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan->opaque;
-    ItemPointer heap_tid;
-    bool is_null;
-    Datum value;
+ivfflat_match_keys(IndexScanDesc scan_desc, IndexTuple itup, TupleDesc tup_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
 
-    if(scan_opaque->is_first_scan){
-        if(scan->orderByData == NULL){
-            elog(ERROR, "cannot scan ivfflat index without order");
+    for(int i = 0; i < scan_desc->numberOfKeys; i++){
+        ScanKey key = &scan_desc->keyData[i];
+        Datum datum;
+        bool isnull;
+
+        //tested on the distance by ivfflat_score_page
+        if(key == scan_opaque->range_key){
+            continue;
         }
-        if(!IsMVCCSnapshot(scan->xs_snapshot)){
-            elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
+        //the stored vector may be a rounded normalized copy, a strict
+        //test of the operator on it would drop rows in range on the heap
+        if(key == scan_opaque->order_range_key){
+            datum = index_getattr(itup, 1, tup_desc, &isnull);
+            if(isnull || DatumGetFloat8(FunctionCall2Coll(
+                scan_opaque->vector_distance_proc,
+                scan_opaque->collation,
+                datum,
+                scan_opaque->order_range_value)) >= scan_opaque->range_threshold){
+                return false;
+            }
+            continue;
         }
-        value = ivfflat_get_scan_value(scan);
-        ivfflat_get_scan_lists(scan, value);
-        ivfflat_get_scan_items(scan, value);
-        scan_opaque->is_first_scan = false;
-        scan_opaque->value = value;
-    }
-    while(!tuplesort_gettupleslot(scan_opaque->sort_state,true,false,scan_opaque->m_slot,NULL)){
-        if(scan_opaque->list_index == scan_opaque->max_probes){
+        //other range keys are left to the heap recheck
+        if(key->sk_attno == 1 && key->sk_strategy == IVFFLAT_RANGE_STRATEGY &&
+            !(key->sk_flags & SK_ISNULL)){
+            continue;
+        }
+        if(key->sk_flags & SK_ISNULL){
+            return false;
+        }
+        datum = index_getattr(itup, key->sk_attno, tup_desc, &isnull);
+        if(isnull){
+            return false;
+        }
+        if(!DatumGetBool(FunctionCall2Coll(
+            &key->sk_func,
+            key->sk_collation,
+            datum,
+            key->sk_argument))){
             return false;
         }
-        ivfflat_get_scan_items(scan, scan_opaque->value);
     }
-    heap_tid = (ItemPointer) DatumGetPointer(slot_getattr(scan_opaque->m_slot,2,&is_null));
-    scan->xs_heaptid = *heap_tid;
-    scan->xs_recheck = false;
-    scan->xs_recheckorderby = false;
     return true;
 }
 
+//the columns of the entry, without the heap tids of a posting tuple
+static bytea *
+ivfflat_copy_key(IndexTuple itup, TupleDesc tup_desc){
+    Size key_size = ivfflat_key_size(itup, tup_desc);
+    bytea *key;
+    IndexTuple key_tuple;
+
+    key = (bytea *) palloc(VARHDRSZ + MAXALIGN(key_size));
+    SET_VARSIZE(key, VARHDRSZ + MAXALIGN(key_size));
+    key_tuple = (IndexTuple) VARDATA(key);
+    memset(key_tuple, 0, MAXALIGN(key_size));
+    memcpy(key_tuple, itup, key_size);
+    key_tuple->t_info &= ~(INDEX_SIZE_MASK | INDEX_AM_RESERVED_BIT);
+    key_tuple->t_info |= MAXALIGN(key_size);
+    return key;
+}
+
+static void
+ivfflat_add_buffer_tid(IvfflatScanOpaque scan_opaque, ItemPointer tid){
+    if(scan_opaque->buffer_tid_count == scan_opaque->max_buffer_tids){
+        scan_opaque->max_buffer_tids = Max(scan_opaque->max_buffer_tids * 2, 64);
+        if(scan_opaque->buffer_tids == NULL){
+            scan_opaque->buffer_tids = MemoryContextAlloc(
+                scan_opaque->run_ctx,
+                scan_opaque->max_buffer_tids * sizeof(ItemPointerData));
+        }else{
+            scan_opaque->buffer_tids = repalloc(
+                scan_opaque->buffer_tids,
+                scan_opaque->max_buffer_tids * sizeof(ItemPointerData));
+        }
+    }
+    scan_opaque->buffer_tids[scan_opaque->buffer_tid_count++] = *tid;
+}
+
+static int
+ivfflat_compare_tids(const void *a, const void *b){
+    return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+//whether the heap tid has an entry in the buffer run
+static bool
+ivfflat_in_buffer(IvfflatScanOpaque scan_opaque, ItemPointer tid){
+    return scan_opaque->buffer_tid_count > 0 &&
+        bsearch(tid, scan_opaque->buffer_tids, scan_opaque->buffer_tid_count,
+                sizeof(ItemPointerData), ivfflat_compare_tids) != NULL;
+}
+
+//one run item per heap tid. a posting tuple shares the distance and key
+void
+ivfflat_put_scan_item(
+    IndexScanDesc scan_desc,
+    IndexTuple itup,
+    BlockNumber blkno,
+    OffsetNumber offset,
+    XLogRecPtr lsn,
+    double distance){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun run = scan_opaque->filling;
+    TupleDesc tup_desc = RelationGetDescr(scan_desc->indexRelation);
+    TupleTableSlot *slot = scan_opaque->v_slot;
+    ItemPointerData index_tid;
+    ItemPointer tids = ivfflat_tuple_tids(itup, tup_desc);
+    int ntids = ivfflat_tuple_tid_count(itup, tup_desc);
+    bytea *key = NULL;
+
+    if(scan_desc->xs_want_itup){
+        MemoryContext old_ctx = MemoryContextSwitchTo(scan_opaque->run_ctx);
+        key = ivfflat_copy_key(itup, tup_desc);
+        MemoryContextSwitchTo(old_ctx);
+    }
+
+    ItemPointerSet(&index_tid, blkno, offset);
+    for(int i = 0; i < ntids; i++){
+        if(scan_opaque->scoring_buffer){
+            ivfflat_add_buffer_tid(scan_opaque, &tids[i]);
+        }
+        if(run->sort_state == NULL){
+            ivfflat_add_run_item(scan_desc, run, distance, &tids[i], &index_tid, lsn, key);
+            continue;
+        }
+        ExecClearTuple(slot);
+        slot->tts_values[0] = Float8GetDatum(distance);
+        slot->tts_isnull[0] = false;
+        slot->tts_values[1] = PointerGetDatum(&tids[i]);
+        slot->tts_isnull[1] = false;
+        slot->tts_values[2] = PointerGetDatum(&index_tid);
+        slot->tts_isnull[2] = false;
+        slot->tts_values[3] = Int64GetDatum((int64) lsn);
+        slot->tts_isnull[3] = false;
+        slot->tts_values[4] = PointerGetDatum(key);
+        slot->tts_isnull[4] = key == NULL;
+        ExecStoreVirtualTuple(slot);
+
+        tuplesort_puttupleslot(run->sort_state,slot);
+    }
+    //the tuplesort copied it
+    if(key != NULL && run->sort_state != NULL){
+        pfree(key);
+    }
+}
+
+//the array grows in the scan context and is kept by rescans. the keys
+//are counted too, so the run spills to a tuplesort at work_mem
+void
+ivfflat_add_run_item(
+    IndexScanDesc scan_desc,
+    IvfflatScanRun run,
+    double distance,
+    ItemPointer heap_tid,
+    ItemPointer index_tid,
+    XLogRecPtr lsn,
+    bytea *key){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanItem item;
+
+    if(run->item_count == run->max_items){
+        int max_items = Max(run->max_items * 2, 64);
+
+        if(run->items == NULL){
+            run->items = MemoryContextAlloc(scan_opaque->tmp_ctx, max_items * sizeof(IvfflatScanItemData));
+        }else{
+            run->items = repalloc(run->items, max_items * sizeof(IvfflatScanItemData));
+        }
+        run->max_items = max_items;
+    }
+    item = &run->items[run->item_count++];
+    item->distance = distance;
+    item->heap_tid = *heap_tid;
+    item->index_tid = *index_tid;
+    item->lsn = lsn;
+    item->key = key;
+
+    run->item_bytes += sizeof(IvfflatScanItemData);
+    //the tids of a posting tuple share the key
+    if(key != NULL && (run->item_count == 1 || run->items[run->item_count - 2].key != key)){
+        run->item_bytes += VARSIZE(key);
+    }
+    if(run->item_bytes > work_mem * 1024L){
+        ivfflat_spill_run(scan_desc, run);
+    }
+}
+
+//move the items of the run to a tuplesort, which takes the rest of it
+void
+ivfflat_spill_run(IndexScanDesc scan_desc, IvfflatScanRun run){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    TupleTableSlot *slot = scan_opaque->v_slot;
+    MemoryContext old_ctx = MemoryContextSwitchTo(scan_opaque->tmp_ctx);
+
+    if(run->slot == NULL){
+        run->slot = MakeSingleTupleTableSlot(scan_opaque->tup_desc, &TTSOpsMinimalTuple);
+    }
+    run->sort_state = ivfflat_init_scan_sort_state(scan_opaque->tup_desc);
+    MemoryContextSwitchTo(old_ctx);
+
+    for(int i = 0; i < run->item_count; i++){
+        IvfflatScanItem item = &run->items[i];
+
+        ExecClearTuple(slot);
+        slot->tts_values[0] = Float8GetDatum(item->distance);
+        slot->tts_isnull[0] = false;
+        slot->tts_values[1] = PointerGetDatum(&item->heap_tid);
+        slot->tts_isnull[1] = false;
+        slot->tts_values[2] = PointerGetDatum(&item->index_tid);
+        slot->tts_isnull[2] = false;
+        slot->tts_values[3] = Int64GetDatum((int64) item->lsn);
+        slot->tts_isnull[3] = false;
+        slot->tts_values[4] = PointerGetDatum(item->key);
+        slot->tts_isnull[4] = item->key == NULL;
+        ExecStoreVirtualTuple(slot);
+
+        tuplesort_puttupleslot(run->sort_state,slot);
+    }
+    run->item_count = 0;
+    run->item_bytes = 0;
+}
+
+IvfflatScanRun
+ivfflat_begin_run(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun run = &scan_opaque->runs[scan_opaque->run_count++];
+
+    run->item_count = 0;
+    run->item_index = 0;
+    run->item_bytes = 0;
+    run->sort_state = NULL;
+    run->has_item = false;
+    scan_opaque->filling = run;
+    return run;
+}
+
+void
+ivfflat_finish_run(IndexScanDesc scan_desc, IvfflatScanRun run){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+
+    if(run->sort_state != NULL){
+        tuplesort_performsort(run->sort_state);
+    }else if(scan_desc->numberOfOrderBys > 0){
+        qsort(run->items, run->item_count, sizeof(IvfflatScanItemData), ivfflat_compare_scan_items);
+    }
+    scan_opaque->filling = NULL;
+    ivfflat_advance_run(run);
+}
+
+void
+ivfflat_advance_run(IvfflatScanRun run){
+    bool is_null;
+
+    if(run->sort_state == NULL){
+        run->has_item = run->item_index < run->item_count;
+        if(run->has_item){
+            run->item = run->items[run->item_index++];
+        }
+        return;
+    }
+
+    run->has_item = tuplesort_gettupleslot(run->sort_state, true, false, run->slot, NULL);
+    if(run->has_item){
+        Datum key;
+
+        run->item.distance = DatumGetFloat8(slot_getattr(run->slot, 1, &is_null));
+        run->item.heap_tid = *((ItemPointer) DatumGetPointer(slot_getattr(run->slot, 2, &is_null)));
+        run->item.index_tid = *((ItemPointer) DatumGetPointer(slot_getattr(run->slot, 3, &is_null)));
+        run->item.lsn = (XLogRecPtr) DatumGetInt64(slot_getattr(run->slot, 4, &is_null));
+        key = slot_getattr(run->slot, 5, &is_null);
+        run->item.key = is_null ? NULL : DatumGetByteaPP(key);
+    }
+}
+
+//the run with the nearest entry. equal distances are ordered by heap tid
+IvfflatScanRun
+ivfflat_next_run(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun best = NULL;
+
+    for(int i = 0; i < scan_opaque->run_count; i++){
+        IvfflatScanRun run = &scan_opaque->runs[i];
+        if(!run->has_item){
+            continue;
+        }
+        if(best == NULL || ivfflat_compare_scan_items(&run->item, &best->item) < 0){
+            best = run;
+        }
+    }
+    return best;
+}
+
+//the buffer is scored before the radii are read. the merge raises the
+//radius of a list before it moves an entry there from the buffer, so an
+//entry gone from the buffer is covered by the radius. returns whether
+//the buffer had entries
+bool
+ivfflat_scan_buffer(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun run;
+
+    ivfflat_get_buffer_pages(scan_desc->indexRelation, &scan_opaque->buffer_page, NULL);
+    if(!BlockNumberIsValid(scan_opaque->buffer_page)){
+        return false;
+    }
+    run = ivfflat_begin_run(scan_desc);
+    scan_opaque->scoring_buffer = true;
+    ivfflat_scan_chain(scan_desc, scan_opaque->value, scan_opaque->buffer_page);
+    scan_opaque->scoring_buffer = false;
+    ivfflat_finish_run(scan_desc, run);
+    if(scan_opaque->buffer_tid_count > 1){
+        qsort(scan_opaque->buffer_tids, scan_opaque->buffer_tid_count,
+              sizeof(ItemPointerData), ivfflat_compare_tids);
+    }
+    scan_opaque->buffer_page = InvalidBlockNumber;
+    return run->has_item;
+}
+
+//the lower bound of the next list to score, false when none is left
+bool
+ivfflat_peek_list(IndexScanDesc scan_desc, double *lower_bound){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatParallelScan shared;
+    bool found = false;
+
+    //a parallel range scan is run by one participant, see ivfflat_range_init
+    if(scan_desc->parallel_scan == NULL || scan_opaque->range_key != NULL){
+        if(scan_opaque->list_index >= scan_opaque->list_count){
+            return false;
+        }
+        *lower_bound = scan_opaque->probe_lists[scan_opaque->list_index]->lower_bound;
+        return true;
+    }
+
+    shared = IvfflatGetParallelScan(scan_desc);
+    SpinLockAcquire(&shared->mutex);
+    if(shared->next_list < shared->list_count &&
+        (!shared->single || scan_opaque->parallel_setup)){
+        *lower_bound = shared->lists[shared->next_list].lower_bound;
+        found = true;
+    }
+    SpinLockRelease(&shared->mutex);
+    return found;
+}
+
+//take the next list to score, InvalidBlockNumber when none is left
+BlockNumber
+ivfflat_claim_list(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatParallelScan shared;
+    BlockNumber start_page = InvalidBlockNumber;
+
+    if(scan_desc->parallel_scan == NULL || scan_opaque->range_key != NULL){
+        if(scan_opaque->list_index >= scan_opaque->list_count){
+            return InvalidBlockNumber;
+        }
+        return scan_opaque->probe_lists[scan_opaque->list_index++]->start_page;
+    }
+
+    shared = IvfflatGetParallelScan(scan_desc);
+    SpinLockAcquire(&shared->mutex);
+    if(shared->next_list < shared->list_count &&
+        (!shared->single || scan_opaque->parallel_setup)){
+        start_page = shared->lists[shared->next_list++].start_page;
+    }
+    SpinLockRelease(&shared->mutex);
+    return start_page;
+}
+
+//score the next list, and every other list that may hold an entry
+//nearer than the threshold, into a new run. parallel participants take
+//one list at a time, so that the lists are shared out
+void
+ivfflat_score_lists(IndexScanDesc scan_desc, double threshold){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun run = NULL;
+    BlockNumber start_page;
+    double lower_bound;
+
+    while(BlockNumberIsValid(start_page = ivfflat_claim_list(scan_desc))){
+        if(run == NULL){
+            run = ivfflat_begin_run(scan_desc);
+        }
+        ivfflat_scan_chain(scan_desc, scan_opaque->value, start_page);
+        if(scan_desc->parallel_scan != NULL ||
+            !ivfflat_peek_list(scan_desc, &lower_bound) ||
+            lower_bound > threshold){
+            break;
+        }
+    }
+    if(run != NULL){
+        ivfflat_finish_run(scan_desc, run);
+    }
+}
+
+Size
+ivfflat_estimateparallelscan(void){
+    return add_size(
+        offsetof(IvfflatParallelScanData, lists),
+        mul_size(Max(ivfflat_probes, 1), sizeof(IvfflatParallelListData)));
+}
+
+void
+ivfflat_initparallelscan(void *target){
+    IvfflatParallelScan shared = (IvfflatParallelScan) target;
+
+    SpinLockInit(&shared->mutex);
+    ConditionVariableInit(&shared->cv);
+    shared->state = IVFFLAT_PARALLEL_INIT;
+    shared->single = false;
+    shared->max_lists = Max(ivfflat_probes, 1);
+    shared->list_count = 0;
+    shared->next_list = 0;
+}
+
+void
+ivfflat_parallelrescan(IndexScanDesc scan_desc){
+    IvfflatParallelScan shared = IvfflatGetParallelScan(scan_desc);
+
+    SpinLockAcquire(&shared->mutex);
+    shared->state = IVFFLAT_PARALLEL_INIT;
+    shared->single = false;
+    shared->list_count = 0;
+    shared->next_list = 0;
+    SpinLockRelease(&shared->mutex);
+}
+
+/*
+ * the first participant scores the buffer and picks the lists, the others
+ * wait for the lists. all of them then take lists in lower bound order.
+ * each participant returns its own entries by distance, gather merge
+ * merges them. an entry being merged may be in both the buffer and its
+ * list, and only one participant can skip the second copy, so the first
+ * participant scores all the lists when the buffer had entries.
+ */
+void
+ivfflat_parallel_setup(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatParallelScan shared = IvfflatGetParallelScan(scan_desc);
+    bool setup = false;
+
+    SpinLockAcquire(&shared->mutex);
+    if(shared->state == IVFFLAT_PARALLEL_INIT){
+        shared->state = IVFFLAT_PARALLEL_SETUP;
+        setup = true;
+    }
+    SpinLockRelease(&shared->mutex);
+    scan_opaque->parallel_setup = setup;
+
+    if(setup){
+        bool buffered = ivfflat_scan_buffer(scan_desc);
+        int list_count;
+
+        ivfflat_init_summary_keys(scan_desc);
+        ivfflat_get_scan_lists(scan_desc, scan_opaque->value);
+        list_count = Min(scan_opaque->list_count, shared->max_lists);
+        for(int i = 0; i < list_count; i++){
+            shared->lists[i].start_page = scan_opaque->probe_lists[i]->start_page;
+            shared->lists[i].lower_bound = scan_opaque->probe_lists[i]->lower_bound;
+        }
+
+        SpinLockAcquire(&shared->mutex);
+        shared->list_count = list_count;
+        shared->next_list = 0;
+        shared->single = buffered;
+        shared->state = IVFFLAT_PARALLEL_READY;
+        SpinLockRelease(&shared->mutex);
+        ConditionVariableBroadcast(&shared->cv);
+        return;
+    }
+
+    ConditionVariablePrepareToSleep(&shared->cv);
+    for(;;){
+        bool ready;
+
+        SpinLockAcquire(&shared->mutex);
+        ready = shared->state == IVFFLAT_PARALLEL_READY;
+        SpinLockRelease(&shared->mutex);
+        if(ready){
+            break;
+        }
+        ConditionVariableSleep(&shared->cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+}
+
+void
+ivfflat_end_runs(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+
+    //the item arrays and slots are kept for the next scan
+    for(int i = 0; i < scan_opaque->run_count; i++){
+        IvfflatScanRun run = &scan_opaque->runs[i];
+        if(run->sort_state != NULL){
+            ExecClearTuple(run->slot);
+            tuplesort_end(run->sort_state);
+            run->sort_state = NULL;
+        }
+        run->item_count = 0;
+        run->item_index = 0;
+        run->item_bytes = 0;
+        run->has_item = false;
+    }
+    scan_opaque->run_count = 0;
+    scan_opaque->filling = NULL;
+    MemoryContextReset(scan_opaque->run_ctx);
+    scan_opaque->order_range_key = NULL;
+    scan_opaque->buffer_tids = NULL;
+    scan_opaque->buffer_tid_count = 0;
+    scan_opaque->max_buffer_tids = 0;
+}
+
+//return the entry from gettuple
+void
+ivfflat_set_scan_item(
+    IndexScanDesc scan_desc,
+    ItemPointer heap_tid,
+    ItemPointer index_tid,
+    XLogRecPtr lsn,
+    bytea *key){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+
+    scan_opaque->last_tid = *heap_tid;
+    scan_opaque->last_index_tid = *index_tid;
+    scan_opaque->last_lsn = lsn;
+    if(key != NULL){
+        Size key_size = VARSIZE_ANY_EXHDR(key);
+
+        //valid until the next call
+        if(scan_opaque->itup != NULL){
+            pfree(scan_opaque->itup);
+        }
+        scan_opaque->itup = (IndexTuple) MemoryContextAlloc(scan_opaque->tmp_ctx, key_size);
+        memcpy(scan_opaque->itup, VARDATA_ANY(key), key_size);
+        scan_desc->xs_itup = scan_opaque->itup;
+    }
+    scan_desc->xs_heaptid = *heap_tid;
+    scan_desc->xs_recheck = scan_opaque->recheck;
+    scan_desc->xs_recheckorderby = false;
+}
+
+static int
+ivfflat_compare_blocks(const void *a, const void *b){
+    BlockNumber ba = *((const BlockNumber *) a);
+    BlockNumber bb = *((const BlockNumber *) b);
+
+    if(ba != bb){
+        return ba < bb ? -1 : 1;
+    }
+    return 0;
+}
+
+static void
+ivfflat_exact_sift_down(IvfflatScanItem items, int count, int i){
+    for(;;){
+        int farthest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        IvfflatScanItemData tmp;
+
+        if(left < count && ivfflat_compare_scan_items(&items[left], &items[farthest]) > 0){
+            farthest = left;
+        }
+        if(right < count && ivfflat_compare_scan_items(&items[right], &items[farthest]) > 0){
+            farthest = right;
+        }
+        if(farthest == i){
+            break;
+        }
+        tmp = items[i];
+        items[i] = items[farthest];
+        items[farthest] = tmp;
+        i = farthest;
+    }
+}
+
+static void
+ivfflat_exact_sift_up(IvfflatScanItem items, int i){
+    while(i > 0){
+        int parent = (i - 1) / 2;
+        IvfflatScanItemData tmp;
+
+        if(ivfflat_compare_scan_items(&items[i], &items[parent]) <= 0){
+            break;
+        }
+        tmp = items[i];
+        items[i] = items[parent];
+        items[parent] = tmp;
+        i = parent;
+    }
+}
+
+//keep the entry if it is after the last one returned, and among the
+//batch_size nearest of the pass
+static void
+ivfflat_exact_offer(
+    IndexScanDesc scan_desc,
+    IndexTuple itup,
+    ItemPointer heap_tid,
+    ItemPointer index_tid,
+    XLogRecPtr lsn,
+    double distance){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+    IvfflatScanItem item;
+    bool replaced = false;
+
+    if(exact->has_last &&
+        ivfflat_compare_scan_keys(distance, heap_tid, exact->last_distance, &exact->last_tid) <= 0){
+        return;
+    }
+    if(exact->item_count == exact->batch_size){
+        item = &exact->items[0];
+        if(ivfflat_compare_scan_keys(distance, heap_tid, item->distance, &item->heap_tid) >= 0){
+            return;
+        }
+        if(item->key != NULL){
+            pfree(item->key);
+        }
+        replaced = true;
+    }else{
+        item = &exact->items[exact->item_count++];
+    }
+    item->distance = distance;
+    item->heap_tid = *heap_tid;
+    item->index_tid = *index_tid;
+    item->lsn = lsn;
+    item->key = NULL;
+    if(scan_desc->xs_want_itup){
+        MemoryContext old_ctx = MemoryContextSwitchTo(exact->pass_ctx);
+        item->key = ivfflat_copy_key(itup, RelationGetDescr(scan_desc->indexRelation));
+        MemoryContextSwitchTo(old_ctx);
+    }
+    if(replaced){
+        ivfflat_exact_sift_down(exact->items, exact->item_count, 0);
+    }else{
+        ivfflat_exact_sift_up(exact->items, exact->item_count - 1);
+    }
+}
+
+//score one entry page into the heap of the pass. the sweep skips the
+//insert buffer, which is read through its chain. returns the next page
+//of the chain
+static BlockNumber
+ivfflat_exact_page(IndexScanDesc scan_desc, BlockNumber blkno, bool buffer_chain){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+    TupleDesc tup_desc = RelationGetDescr(scan_desc->indexRelation);
+    BlockNumber next_page = InvalidBlockNumber;
+    IvfflatPageOpaque opaque;
+    MemoryContext old_ctx;
+    Buffer buf;
+    Page page;
+    XLogRecPtr lsn;
+    int count;
+
+    buf = ReadBufferExtended(scan_desc->indexRelation,MAIN_FORKNUM,blkno,RBM_NORMAL,scan_opaque->strategy);
+    LockBuffer(buf,BUFFER_LOCK_SHARE);
+    page = BufferGetPage(buf);
+    opaque = IvfflatPageGetOpaque(page);
+    if(PageIsNew(page) ||
+        opaque->page_id != IVFFLAT_PAGE_ID ||
+        (!buffer_chain && opaque->list_tag == IVFFLAT_LIST_TAG_BUFFER)){
+        UnlockReleaseBuffer(buf);
+        return InvalidBlockNumber;
+    }
+    lsn = BufferGetLSNAtomic(buf);
+
+    //the vectors copied for alignment only live for the page
+    old_ctx = MemoryContextSwitchTo(exact->page_ctx);
+    count = ivfflat_score_page(scan_desc, scan_opaque->value, page);
+    MemoryContextSwitchTo(old_ctx);
+    for(int i = 0; i < count; i++){
+        OffsetNumber offset = scan_opaque->batch_offsets[i];
+        IndexTuple itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offset));
+        ItemPointer tids = ivfflat_tuple_tids(itup, tup_desc);
+        int ntids = ivfflat_tuple_tid_count(itup, tup_desc);
+        ItemPointerData index_tid;
+
+        ItemPointerSet(&index_tid, blkno, offset);
+        for(int j = 0; j < ntids; j++){
+            ivfflat_exact_offer(scan_desc, itup, &tids[j], &index_tid, lsn, scan_opaque->batch_distances[i]);
+        }
+    }
+    MemoryContextReset(exact->page_ctx);
+    next_page = opaque->nextblkno;
+    UnlockReleaseBuffer(buf);
+    return next_page;
+}
+
+void
+ivfflat_exact_reset(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+
+    exact->batch_size = IVFFLAT_EXACT_INITIAL_BATCH;
+    exact->items = NULL;
+    exact->item_count = 0;
+    exact->item_index = 0;
+    exact->has_last = false;
+    exact->done = false;
+    if(exact->pass_ctx != NULL){
+        MemoryContextReset(exact->pass_ctx);
+    }
+}
+
+//the center pages are written by the build only, rescans keep them
+void
+ivfflat_exact_init(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+    BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
+    int max_pages = 8;
+
+    if(exact->pass_ctx == NULL){
+        exact->pass_ctx = AllocSetContextCreate(scan_opaque->tmp_ctx,
+            "Ivfflat exact scan pass context",
+            ALLOCSET_DEFAULT_SIZES);
+        exact->page_ctx = AllocSetContextCreate(scan_opaque->tmp_ctx,
+            "Ivfflat exact scan page context",
+            ALLOCSET_DEFAULT_SIZES);
+    }
+    ivfflat_exact_reset(scan_desc);
+    if(exact->center_pages != NULL){
+        return;
+    }
+
+    exact->center_pages = MemoryContextAlloc(scan_opaque->tmp_ctx, max_pages * sizeof(BlockNumber));
+    exact->center_page_count = 0;
+    while(BlockNumberIsValid(blkno)){
+        Buffer buf;
+
+        if(exact->center_page_count == max_pages){
+            max_pages *= 2;
+            exact->center_pages = repalloc(exact->center_pages, max_pages * sizeof(BlockNumber));
+        }
+        exact->center_pages[exact->center_page_count++] = blkno;
+        buf = ReadBuffer(scan_desc->indexRelation, blkno);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        blkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+        UnlockReleaseBuffer(buf);
+    }
+    qsort(exact->center_pages, exact->center_page_count, sizeof(BlockNumber), ivfflat_compare_blocks);
+}
+
+/*
+ * one pass over the index. the buffer is read before the entry pages, as
+ * in the probed scans, so an entry moved by a concurrent merge is seen at
+ * least once. pages added during the pass only hold entries of later
+ * inserts, which the snapshot does not see.
+ */
+void
+ivfflat_exact_pass(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+    Relation index = scan_desc->indexRelation;
+    BlockNumber buffer_page;
+    BlockNumber nblocks;
+    int center_index = 0;
+
+    MemoryContextReset(exact->pass_ctx);
+    exact->items = MemoryContextAlloc(exact->pass_ctx, exact->batch_size * sizeof(IvfflatScanItemData));
+    exact->item_count = 0;
+    exact->item_index = 0;
+
+    ivfflat_get_buffer_pages(index, &buffer_page, NULL);
+    while(BlockNumberIsValid(buffer_page)){
+        CHECK_FOR_INTERRUPTS();
+        buffer_page = ivfflat_exact_page(scan_desc, buffer_page, true);
+    }
+
+    nblocks = RelationGetNumberOfBlocks(index);
+    for(BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
+        blkno < nblocks && blkno < IVFFLAT_HEAD_BLKNO + IVFFLAT_EXACT_PREFETCH_PAGES;
+        blkno++){
+        PrefetchBuffer(index, MAIN_FORKNUM, blkno);
+    }
+    for(BlockNumber blkno = IVFFLAT_HEAD_BLKNO; blkno < nblocks; blkno++){
+        CHECK_FOR_INTERRUPTS();
+        if(blkno + IVFFLAT_EXACT_PREFETCH_PAGES < nblocks){
+            PrefetchBuffer(index, MAIN_FORKNUM, blkno + IVFFLAT_EXACT_PREFETCH_PAGES);
+        }
+        while(center_index < exact->center_page_count &&
+            exact->center_pages[center_index] < blkno){
+            center_index++;
+        }
+        if(center_index < exact->center_page_count &&
+            exact->center_pages[center_index] == blkno){
+            continue;
+        }
+        ivfflat_exact_page(scan_desc, blkno, false);
+    }
+
+    qsort(exact->items, exact->item_count, sizeof(IvfflatScanItemData), ivfflat_compare_scan_items);
+    exact->done = exact->item_count < exact->batch_size;
+    exact->batch_size = (int) Min((Size) exact->batch_size * 2,
+                                  MaxAllocSize / sizeof(IvfflatScanItemData));
+}
+
+bool
+ivfflat_exact_next(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatExactScan exact = &scan_opaque->exact_scan;
+
+    for(;;){
+        IvfflatScanItem item;
+
+        if(exact->item_index >= exact->item_count){
+            if(exact->done){
+                return false;
+            }
+            ivfflat_exact_pass(scan_desc);
+            continue;
+        }
+        item = &exact->items[exact->item_index++];
+        exact->has_last = true;
+        exact->last_distance = item->distance;
+        exact->last_tid = item->heap_tid;
+        //skip the second copy of an entry being merged
+        if(ItemPointerEquals(&item->heap_tid, &scan_opaque->last_tid)){
+            continue;
+        }
+        ivfflat_set_scan_item(scan_desc, &item->heap_tid, &item->index_tid, item->lsn, item->key);
+        return true;
+    }
+}
+
+//the radius of the range operator in the units of the distance proc.
+//the slack covers the float rounding, the rows are rechecked
+static double
+ivfflat_range_threshold(IvfflatScanOpaque scan_opaque, HvectorMetric metric, double radius){
+    double slack = (fabs(radius) + 1.0) * 1e-4;
+
+    if(metric == HVECTOR_METRIC_L2_SQUARED){
+        //no distance is below zero
+        if(radius <= 0){
+            return 0;
+        }
+        return (radius + slack) * (radius + slack);
+    }
+    //the cosine distance of unit vectors is 1 + the negative inner product
+    if(scan_opaque->vector_normalize_proc != NULL){
+        return radius - 1.0 + slack;
+    }
+    return radius + slack;
+}
+
+//the range key of a scan with order by, see ivfflat_match_keys. keys
+//after the first one on the vector column are left to the heap recheck
+static void
+ivfflat_order_range_init(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    MemoryContext old_ctx;
+    Datum value;
+    double radius;
+
+    scan_opaque->order_range_key = NULL;
+    for(int i = 0; i < scan_desc->numberOfKeys; i++){
+        ScanKey key = &scan_desc->keyData[i];
+        if(key->sk_attno == 1 && key->sk_strategy == IVFFLAT_RANGE_STRATEGY &&
+            !(key->sk_flags & SK_ISNULL)){
+            scan_opaque->order_range_key = key;
+            break;
+        }
+    }
+    if(scan_opaque->order_range_key == NULL){
+        return;
+    }
+
+    old_ctx = MemoryContextSwitchTo(scan_opaque->run_ctx);
+    value = PointerGetDatum(hvector_get_range(scan_opaque->order_range_key->sk_argument, &radius));
+    if(scan_opaque->vector_normalize_proc != NULL){
+        value = ivfflat_normalize_value(scan_opaque->vector_type, scan_opaque->collation, value);
+    }
+    MemoryContextSwitchTo(old_ctx);
+    scan_opaque->order_range_value = value;
+    scan_opaque->range_threshold = ivfflat_range_threshold(
+        scan_opaque,
+        hvector_get_metric(scan_opaque->vector_distance_proc),
+        radius);
+}
+
+/*
+ * a scan without order by. the range key picks every list whose lower
+ * bound is under the radius, all of them for distances that are not
+ * metrics, and ivfflat.probes does not apply. the shared list array of a
+ * parallel scan only holds ivfflat.probes lists, so the first participant
+ * runs the whole range scan.
+ */
+void
+ivfflat_range_init(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    ScanKey range_key = NULL;
+    MemoryContext old_ctx;
+    Vector query;
+    double radius;
+
+    for(int i = 0; i < scan_desc->numberOfKeys; i++){
+        ScanKey key = &scan_desc->keyData[i];
+        if(key->sk_attno == 1 && key->sk_strategy == IVFFLAT_RANGE_STRATEGY){
+            range_key = key;
+            break;
+        }
+    }
+    if(range_key == NULL){
+        elog(ERROR, "cannot scan ivfflat index without order or distance range");
+    }
+    scan_opaque->range_key = range_key;
+    scan_opaque->range_base = 0;
+    scan_opaque->range_done = false;
+    scan_opaque->list_count = 0;
+    scan_opaque->list_index = 0;
+    if(range_key->sk_flags & SK_ISNULL){
+        scan_opaque->range_done = true;
+        return;
+    }
+    if(scan_desc->parallel_scan != NULL){
+        IvfflatParallelScan shared = IvfflatGetParallelScan(scan_desc);
+        bool first = false;
+
+        SpinLockAcquire(&shared->mutex);
+        if(shared->state == IVFFLAT_PARALLEL_INIT){
+            shared->state = IVFFLAT_PARALLEL_READY;
+            first = true;
+        }
+        SpinLockRelease(&shared->mutex);
+        if(!first){
+            scan_opaque->range_done = true;
+            return;
+        }
+    }
+
+    old_ctx = MemoryContextSwitchTo(scan_opaque->run_ctx);
+    query = hvector_get_range(range_key->sk_argument, &radius);
+    MemoryContextSwitchTo(old_ctx);
+    scan_opaque->value = ivfflat_get_scan_value(scan_desc, PointerGetDatum(query), false);
+    scan_opaque->range_threshold = ivfflat_range_threshold(scan_opaque, scan_opaque->metric, radius);
+
+    ivfflat_scan_buffer(scan_desc);
+    scan_opaque->range_base = scan_opaque->run_count;
+    ivfflat_init_summary_keys(scan_desc);
+    ivfflat_get_scan_lists(scan_desc, scan_opaque->value);
+}
+
+//the matches of the buffer, then of the lists by lower bound, each in
+//page order
+bool
+ivfflat_range_next(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatScanRun buffer_run = scan_opaque->range_base > 0 ? &scan_opaque->runs[0] : NULL;
+    IvfflatScanRun run = scan_opaque->run_count > 0 ? &scan_opaque->runs[scan_opaque->run_count - 1] : NULL;
+    BlockNumber start_page;
+
+    if(scan_opaque->range_done){
+        return false;
+    }
+    for(;;){
+        if(run != NULL && run->has_item){
+            //the copy of an entry being merged, returned from the buffer
+            if(run != buffer_run && ivfflat_in_buffer(scan_opaque, &run->item.heap_tid)){
+                ivfflat_advance_run(run);
+                continue;
+            }
+            ivfflat_set_scan_item(
+                scan_desc,
+                &run->item.heap_tid,
+                &run->item.index_tid,
+                run->item.lsn,
+                scan_desc->xs_want_itup ? run->item.key : NULL);
+            ivfflat_advance_run(run);
+            return true;
+        }
+
+        start_page = ivfflat_claim_list(scan_desc);
+        if(!BlockNumberIsValid(start_page)){
+            return false;
+        }
+        //the list run is reused. its items are in insertion order, so the
+        //tids of a posting tuple sharing a key are adjacent
+        if(scan_opaque->run_count > scan_opaque->range_base){
+            IvfflatScanRun last = &scan_opaque->runs[scan_opaque->range_base];
+
+            if(last->sort_state != NULL){
+                ExecClearTuple(last->slot);
+                tuplesort_end(last->sort_state);
+                last->sort_state = NULL;
+            }
+            for(int i = 0; i < last->item_count; i++){
+                bytea *key = last->items[i].key;
+                if(key != NULL && (i == 0 || last->items[i - 1].key != key)){
+                    pfree(key);
+                }
+            }
+        }
+        scan_opaque->run_count = scan_opaque->range_base;
+        run = ivfflat_begin_run(scan_desc);
+        ivfflat_scan_chain(scan_desc, scan_opaque->value, start_page);
+        ivfflat_finish_run(scan_desc, run);
+    }
+}
+
+bool
+ivfflat_gettuple(IndexScanDesc scan, ScanDirection dir){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan->opaque;
+    IvfflatScanRun run;
+
+    //the executor found the entry returned last dead to every transaction
+    if(scan->kill_prior_tuple && ItemPointerIsValid(&scan_opaque->last_index_tid)){
+        IvfflatKilledItem killed;
+        if(scan_opaque->killed_count == IVFFLAT_MAX_KILLED_ITEMS){
+            ivfflat_kill_items(scan);
+        }
+        killed = &scan_opaque->killed_items[scan_opaque->killed_count++];
+        killed->index_tid = scan_opaque->last_index_tid;
+        killed->heap_tid = scan_opaque->last_tid;
+        killed->lsn = scan_opaque->last_lsn;
+    }
+
+    if(scan_opaque->is_first_scan){
+        if(!IsMVCCSnapshot(scan->xs_snapshot)){
+            elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
+        }
+        ItemPointerSetInvalid(&scan_opaque->last_tid);
+        scan_opaque->recheck = false;
+        for(int i = 0; i < scan->numberOfKeys; i++){
+            if(scan->keyData[i].sk_attno == 1){
+                scan_opaque->recheck = true;
+            }
+        }
+        if(scan->numberOfOrderBys == 0){
+            ivfflat_range_init(scan);
+            scan_opaque->is_first_scan = false;
+            return ivfflat_range_next(scan);
+        }
+        scan_opaque->value = ivfflat_get_scan_value(
+            scan,
+            scan->orderByData->sk_argument,
+            (scan->orderByData->sk_flags & SK_ISNULL) != 0);
+        ivfflat_order_range_init(scan);
+
+        scan_opaque->exact = scan->parallel_scan == NULL &&
+            scan_opaque->probes >= scan_opaque->index_list_count;
+        if(scan_opaque->exact){
+            ivfflat_exact_init(scan);
+        }else if(scan->parallel_scan != NULL){
+            ivfflat_parallel_setup(scan);
+        }else{
+            ivfflat_scan_buffer(scan);
+            ivfflat_init_summary_keys(scan);
+            ivfflat_get_scan_lists(scan, scan_opaque->value);
+        }
+        scan_opaque->is_first_scan = false;
+    }
+    if(scan_opaque->exact){
+        return ivfflat_exact_next(scan);
+    }
+    if(scan->numberOfOrderBys == 0){
+        return ivfflat_range_next(scan);
+    }
+    for(;;){
+        double lower_bound;
+
+        run = ivfflat_next_run(scan);
+        //an unscored list may hold an entry as near as the next one. with
+        //no entry yet only the nearest list is scored, its entries bound
+        //the lists after it
+        if(ivfflat_peek_list(scan, &lower_bound) &&
+            (run == NULL || lower_bound <= run->item.distance)){
+            ivfflat_score_lists(scan, run == NULL ? -DBL_MAX : run->item.distance);
+            continue;
+        }
+        if(run == NULL){
+            return false;
+        }
+        //the list copy of an entry being merged, returned from the buffer
+        if(run != &scan_opaque->runs[0] && ivfflat_in_buffer(scan_opaque, &run->item.heap_tid)){
+            ivfflat_advance_run(run);
+            continue;
+        }
+        break;
+    }
+    ivfflat_set_scan_item(
+        scan,
+        &run->item.heap_tid,
+        &run->item.index_tid,
+        run->item.lsn,
+        scan->xs_want_itup ? run->item.key : NULL);
+    ivfflat_advance_run(run);
+    return true;
+}
+
+int
+ivfflat_compare_killed_items(const void *a, const void *b){
+    return ItemPointerCompare(
+        &((IvfflatKilledItem) a)->index_tid,
+        &((IvfflatKilledItem) b)->index_tid);
+}
+
+void
+ivfflat_kill_items(IndexScanDesc scan_desc){
+    IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan_desc->opaque;
+    IvfflatKilledItem items = scan_opaque->killed_items;
+    int count = scan_opaque->killed_count;
+    int i = 0;
+
+    scan_opaque->killed_count = 0;
+    if(count == 0){
+        return;
+    }
+    //a page is visited once for all its entries
+    qsort(items, count, sizeof(IvfflatKilledItemData), ivfflat_compare_killed_items);
+
+    while(i < count){
+        BlockNumber blkno = ItemPointerGetBlockNumber(&items[i].index_tid);
+        Buffer buf;
+        Page page;
+        OffsetNumber max_offset;
+        XLogRecPtr lsn;
+        bool killed = false;
+
+        //the share lock is enough for a hint, like nbtree
+        buf = ReadBuffer(scan_desc->indexRelation, blkno);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        max_offset = PageGetMaxOffsetNumber(page);
+        lsn = BufferGetLSNAtomic(buf);
+
+        for(; i < count && ItemPointerGetBlockNumber(&items[i].index_tid) == blkno; i++){
+            OffsetNumber offset = ItemPointerGetOffsetNumber(&items[i].index_tid);
+            ItemId itemid;
+            IndexTuple itup;
+
+            //vacuum may have moved the entries since the page was read.
+            //unlogged pages have no lsn to tell it
+            if(!RelationNeedsWAL(scan_desc->indexRelation) ||
+                lsn != items[i].lsn ||
+                offset > max_offset){
+                continue;
+            }
+            itemid = PageGetItemId(page, offset);
+            itup = (IndexTuple) PageGetItem(page, itemid);
+            //other heap tids of a posting tuple may still be alive
+            if(ItemIdIsNormal(itemid) &&
+                !IvfflatTupleIsPosting(itup) &&
+                ItemPointerEquals(&itup->t_tid, &items[i].heap_tid)){
+                ItemIdMarkDead(itemid);
+                killed = true;
+            }
+        }
+        if(killed){
+            MarkBufferDirtyHint(buf, true);
+        }
+        UnlockReleaseBuffer(buf);
+    }
+}
+
 void
 ivfflat_endscan(IndexScanDesc scan){
     IvfflatScanOpaque scan_opaque = (IvfflatScanOpaque) scan->opaque;
-    tuplesort_end(scan_opaque->sort_state);
+    ivfflat_report_lists(scan);
+    ivfflat_kill_items(scan);
+    ivfflat_end_runs(scan);
     MemoryContextDelete(scan_opaque->tmp_ctx);
     pfree(scan_opaque);
     scan->opaque = NULL;
@@ -3,39 +3,262 @@
 
 #include "ivffat.h"
 #include "vector.h"
+#include "access/xlogdefs.h"
+#include "storage/itemptr.h"
+#include "ivfflat_page.h"
+#include "access/relscan.h"
+#include "storage/condition_variable.h"
+#include "storage/spin.h"
+
+//the strategy of the range operators of the vector opclasses, see
+//hvector_range in the sql. the order by operators are strategy 1
+#define IVFFLAT_RANGE_STRATEGY 2
 
 typedef struct IvfflatScanListData {
     pairingheap_node ph_node;
 	BlockNumber start_page;
 	double		distance;
+	float		radius;
+	//no entry of the list is closer to the query, see ivfflat_list_lower_bound
+	double		lower_bound;
+	//the cached center of the list, -1 when read from the pages
+	int			list_no;
 } IvfflatScanListData;
 
 typedef IvfflatScanListData * IvfflatScanList;
 
+//a scored entry, ordered by distance, then by heap tid
+typedef struct IvfflatScanItemData {
+    double distance;
+    ItemPointerData heap_tid;
+    ItemPointerData index_tid;
+    XLogRecPtr lsn;
+    //the entry for index-only scans, NULL otherwise
+    bytea *key;
+} IvfflatScanItemData;
+
+typedef IvfflatScanItemData * IvfflatScanItem;
+
+/*
+ * the entries of the lists scored together, sorted by distance. the scan
+ * merges the runs, and scores the next lists only when their lower bound
+ * is not above the nearest entry left, so a LIMIT query stops before the
+ * far lists are read.
+ *
+ * the entries are kept in an array sorted with qsort, and the run moves
+ * to a tuplesort only when they outgrow work_mem. the arrays are kept
+ * across rescans, so a small rescan allocates nothing.
+ */
+typedef struct IvfflatScanRunData {
+    IvfflatScanItem items;
+    int item_count;
+    int max_items;
+    int item_index;
+    Size item_bytes;
+    //NULL unless the run outgrew work_mem
+    Tuplesortstate *sort_state;
+    TupleTableSlot *slot;
+    //the nearest entry left
+    bool has_item;
+    IvfflatScanItemData item;
+} IvfflatScanRunData;
+
+typedef IvfflatScanRunData * IvfflatScanRun;
+
+//parallel scan, shared by the participants in dsm
+#define IVFFLAT_PARALLEL_INIT  0
+#define IVFFLAT_PARALLEL_SETUP 1
+#define IVFFLAT_PARALLEL_READY 2
+
+typedef struct IvfflatParallelListData {
+    BlockNumber start_page;
+    double lower_bound;
+} IvfflatParallelListData;
+
+typedef struct IvfflatParallelScanData {
+    slock_t mutex;
+    //the others wait until the first participant has picked the lists
+    ConditionVariable cv;
+    int state;
+    //the first participant scores all the lists
+    bool single;
+    int max_lists;
+    int list_count;
+    int next_list;
+    IvfflatParallelListData lists[FLEXIBLE_ARRAY_MEMBER];
+} IvfflatParallelScanData;
+
+typedef IvfflatParallelScanData * IvfflatParallelScan;
+
+#define IvfflatGetParallelScan(scan) \
+    ((IvfflatParallelScan) OffsetToPointer((void *) (scan)->parallel_scan, (scan)->parallel_scan->ps_offset))
+
+//a qual on the summarized column, as tests of the list min and max:
+//col = v can only match when min <= v and max >= v
+typedef struct IvfflatSummaryKeyData {
+    //the qual in keyData, its argument changes on rescan
+    int key_index;
+    Datum argument;
+    Oid collation;
+    bool is_null;
+    bool has_min,has_max;
+    //min <op> argument, max <op> argument
+    FmgrInfo min_proc;
+    FmgrInfo max_proc;
+} IvfflatSummaryKeyData;
+
+typedef IvfflatSummaryKeyData * IvfflatSummaryKey;
+
+/*
+ * exact mode, when the probes cover every list. the entry pages are read
+ * in block order rather than list by list, and each pass keeps the
+ * batch_size nearest entries in a bounded heap. the am does not know the
+ * limit, so a scan that needs more entries runs the next pass with twice
+ * the batch size and skips the entries up to the last one returned.
+ */
+#define IVFFLAT_EXACT_INITIAL_BATCH 100
+//pages read ahead, the size of the bulk read ring
+#define IVFFLAT_EXACT_PREFETCH_PAGES 32
+
+typedef struct IvfflatExactScanData {
+    //center pages, sorted, skipped by the sweep
+    BlockNumber *center_pages;
+    int center_page_count;
+    int batch_size;
+    //max-heap of the pass, the farthest entry on top. sorted nearest
+    //first once the pass is done
+    IvfflatScanItem items;
+    int item_count;
+    int item_index;
+    //the last entry returned, the next pass starts after it
+    bool has_last;
+    double last_distance;
+    ItemPointerData last_tid;
+    //the last pass found fewer entries than its batch size
+    bool done;
+    //reset at the start of each pass, and per page
+    MemoryContext pass_ctx;
+    MemoryContext page_ctx;
+} IvfflatExactScanData;
+
+typedef IvfflatExactScanData * IvfflatExactScan;
+
+//entries reported dead by the executor, marked LP_DEAD in batches
+#define IVFFLAT_MAX_KILLED_ITEMS 256
+
+typedef struct IvfflatKilledItemData {
+    ItemPointerData index_tid;
+    ItemPointerData heap_tid;
+    //the page is only trusted if it did not change since it was read
+    XLogRecPtr lsn;
+} IvfflatKilledItemData;
+
+typedef IvfflatKilledItemData * IvfflatKilledItem;
+
 typedef struct IvfflatScanOpaqueData{
     IvfflatVectorType vector_type;
     int probes,max_probes,dimensions;
+    //lists of the index
+    int index_list_count;
     bool is_first_scan;
     Datum value;
     MemoryContext tmp_ctx;
 
-    //
-    Tuplesortstate *sort_state;
+    //the run being filled
+    IvfflatScanRun filling;
+    IvfflatScanRun runs;
+    int run_count;
     TupleDesc tup_desc;
     TupleTableSlot *v_slot;
-    TupleTableSlot *m_slot;
     BufferAccessStrategy strategy;
+    //the query and the keys of the entries in the runs, reset by rescan
+    MemoryContext run_ctx;
 
     //
     FmgrInfo *vector_distance_proc,*vector_normalize_proc;
     Oid collation;
     Datum (*dist_func)(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2);
+    //lists are only skipped for l2 distances
+    HvectorMetric metric;
+    //the vectors of one page are scored in one call when the distance
+    //function has a batch version
+    HvectorBatchDistance batch_distance;
+    OffsetNumber *batch_offsets;
+    const float **batch_vectors;
+    double *batch_distances;
 
     //
+    //lists whose summary rules out the quals are not probed, the next
+    //nearest ones are probed instead
+    IvfflatSummaryKey summary_keys;
+    int summary_key_count;
+    bool summary_keys_ready;
+
+    /*
+     * the centers, copied on the first scan when they fit in work_mem and
+     * scored with the batch kernels by the rescans. the build writes them
+     * once. the radii and summaries grow, so the radii of the probed lists
+     * are read again, and scans with summary quals read the pages.
+     */
+    bool centers_loaded;
+    int center_count;
+    char *centers;
+    const float **center_data;
+    BlockNumber *center_start_pages;
+    //where the list entry is on the center pages
+    ItemPointerData *center_tids;
+    double *center_distances;
+
     pairingheap *list_queue;
-    BlockNumber *list_pages;
+    //the probed lists by lower bound, list_index is the next to score
+    IvfflatScanList *probe_lists;
+    int list_count;
     int list_index;
     IvfflatScanList lists;
+
+    //insert buffer, scored before the lists are read
+    BlockNumber buffer_page;
+    //an entry being merged may be both in the buffer and its list. the
+    //heap tids of the buffer run, sorted, find the list copies
+    bool scoring_buffer;
+    ItemPointer buffer_tids;
+    int buffer_tid_count;
+    int max_buffer_tids;
+    //the entry returned last
+    ItemPointerData last_tid;
+
+    //the entry returned last, for kill_prior_tuple
+    ItemPointerData last_index_tid;
+    XLogRecPtr last_lsn;
+    //the entry returned last, for index-only scans
+    IndexTuple itup;
+    //this participant picked the lists of the parallel scan
+    bool parallel_setup;
+    //serial scans probing every list read the index in block order
+    bool exact;
+    IvfflatExactScanData exact_scan;
+
+    /*
+     * a scan without order by picks the lists by the range key on the
+     * vector column: every list whose lower bound is under the radius.
+     * the matches are returned list by list without sorting, and the
+     * copies of the buffer entries are skipped by their heap tids.
+     */
+    ScanKey range_key;
+    //the radius in the units of the distance proc, with slack. the heap
+    //rows are rechecked
+    double range_threshold;
+    //with order by the range key is a qual of ivfflat_match_keys, tested
+    //on the distance to its own query with the same slack
+    ScanKey order_range_key;
+    Datum order_range_value;
+    //the run of the current list, after the buffer run
+    int range_base;
+    bool range_done;
+    //a range key on the vector column, rechecked on the heap row
+    bool recheck;
+    IvfflatKilledItem killed_items;
+    int killed_count;
 } IvfflatScanOpaqueData;
 
 typedef IvfflatScanOpaqueData * IvfflatScanOpaque;
@@ -54,11 +277,122 @@ Datum
 ivfflat_zero_distance(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2);
 
 Datum
-ivfflat_get_scan_value(IndexScanDesc scan_desc);
+ivfflat_get_scan_value(IndexScanDesc scan_desc, Datum argument, bool is_null);
+
+void
+ivfflat_init_summary_keys(IndexScanDesc scan_desc);
+
+bool
+ivfflat_list_may_match(IndexScanDesc scan_desc, IvfflatListSummary summary);
+
+void
+ivfflat_load_centers(IndexScanDesc scan_desc);
+
+void
+ivfflat_read_radii(IndexScanDesc scan_desc, int list_count);
 
 void
 ivfflat_get_scan_lists(IndexScanDesc scan_desc,Datum value);
 
 void
-ivfflat_get_scan_items(IndexScanDesc scan_desc, Datum value);
+ivfflat_scan_chain(IndexScanDesc scan_desc, Datum value, BlockNumber search_page);
+
+bool
+ivfflat_match_keys(IndexScanDesc scan_desc, IndexTuple itup, TupleDesc tup_desc);
+
+int
+ivfflat_score_page(IndexScanDesc scan_desc, Datum value, Page page);
+
+void
+ivfflat_put_scan_item(
+    IndexScanDesc scan_desc,
+    IndexTuple itup,
+    BlockNumber blkno,
+    OffsetNumber offset,
+    XLogRecPtr lsn,
+    double distance);
+
+double
+ivfflat_list_lower_bound(HvectorMetric metric, double distance, float radius);
+
+int
+ivfflat_compare_lower_bounds(const void *a, const void *b);
+
+int
+ivfflat_compare_scan_items(const void *a, const void *b);
+
+IvfflatScanRun
+ivfflat_begin_run(IndexScanDesc scan_desc);
+
+void
+ivfflat_finish_run(IndexScanDesc scan_desc, IvfflatScanRun run);
+
+void
+ivfflat_add_run_item(
+    IndexScanDesc scan_desc,
+    IvfflatScanRun run,
+    double distance,
+    ItemPointer heap_tid,
+    ItemPointer index_tid,
+    XLogRecPtr lsn,
+    bytea *key);
+
+void
+ivfflat_spill_run(IndexScanDesc scan_desc, IvfflatScanRun run);
+
+void
+ivfflat_advance_run(IvfflatScanRun run);
+
+IvfflatScanRun
+ivfflat_next_run(IndexScanDesc scan_desc);
+
+bool
+ivfflat_scan_buffer(IndexScanDesc scan_desc);
+
+bool
+ivfflat_peek_list(IndexScanDesc scan_desc, double *lower_bound);
+
+BlockNumber
+ivfflat_claim_list(IndexScanDesc scan_desc);
+
+void
+ivfflat_score_lists(IndexScanDesc scan_desc, double threshold);
+
+void
+ivfflat_parallel_setup(IndexScanDesc scan_desc);
+
+void
+ivfflat_end_runs(IndexScanDesc scan_desc);
+
+void
+ivfflat_set_scan_item(
+    IndexScanDesc scan_desc,
+    ItemPointer heap_tid,
+    ItemPointer index_tid,
+    XLogRecPtr lsn,
+    bytea *key);
+
+void
+ivfflat_exact_init(IndexScanDesc scan_desc);
+
+void
+ivfflat_exact_reset(IndexScanDesc scan_desc);
+
+void
+ivfflat_exact_pass(IndexScanDesc scan_desc);
+
+bool
+ivfflat_exact_next(IndexScanDesc scan_desc);
+
+void
+ivfflat_range_init(IndexScanDesc scan_desc);
+
+bool
+ivfflat_range_next(IndexScanDesc scan_desc);
+
+int
+ivfflat_compare_killed_items(const void *a, const void *b);
+
+void
+ivfflat_kill_items(IndexScanDesc scan_desc);
 #endif
\ No newline at end of file
@@ -0,0 +1,444 @@
+#include "ivfflat_xlog.h"
+#include "access/bufmask.h"
+#include "access/generic_xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "access/xlogutils.h"
+#include "ivfflat_page.h"
+#include "miscadmin.h"
+#include "storage/bufpage.h"
+#include "storage/standby.h"
+#include "utils/rel.h"
+
+extern bool ivfflat_custom_wal;
+static bool ivfflat_rmgr_registered = false;
+
+static const RmgrData ivfflat_rmgr = {
+    .rm_name = IVFFLAT_RMGR_NAME,
+    .rm_redo = ivfflat_redo,
+    .rm_desc = ivfflat_desc,
+    .rm_identify = ivfflat_identify,
+    .rm_mask = ivfflat_mask,
+};
+
+void
+ivfflat_init_xlog(void){
+    //the redo routines must exist before the startup process runs,
+    //so the rmgr is only registered from shared_preload_libraries.
+    //it is registered even when custom_wal is off: the wal may still
+    //hold records written before it was turned off
+    //without it custom_wal is never defined, see ivfflat_init_options
+    if(process_shared_preload_libraries_in_progress){
+        RegisterCustomRmgr(IVFFLAT_RMGR_ID, &ivfflat_rmgr);
+        ivfflat_rmgr_registered = true;
+    }
+}
+
+bool
+ivfflat_use_custom_wal(void){
+    return ivfflat_rmgr_registered && ivfflat_custom_wal;
+}
+
+OffsetNumber
+ivfflat_xlog_add_item(Relation index, Buffer buf, IndexTuple itup, Size itemsz){
+    Page page;
+    OffsetNumber offno;
+
+    if(!ivfflat_use_custom_wal()){
+        GenericXLogState *state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        offno = PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
+        if(offno == InvalidOffsetNumber){
+            elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+        }
+        GenericXLogFinish(state);
+        return offno;
+    }
+
+    page = BufferGetPage(buf);
+    //the caller checked the free space
+    START_CRIT_SECTION();
+    offno = PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false);
+    if(offno == InvalidOffsetNumber){
+        elog(PANIC, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+    }
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogAddItemData xlrec;
+        XLogRecPtr recptr;
+
+        xlrec.offnum = offno;
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogAddItemData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        XLogRegisterBufData(0, (char *) itup, itemsz);
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_ADD_ITEM);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+    return offno;
+}
+
+void
+ivfflat_xlog_overwrite_item(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    IndexTuple itup){
+    Page page;
+    Size itemsz = IndexTupleSize(itup);
+
+    if(!ivfflat_use_custom_wal()){
+        GenericXLogState *state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        if(!PageIndexTupleOverwrite(page, offnum, (Item) itup, itemsz)){
+            elog(ERROR, "failed to replace index item in \"%s\"", RelationGetRelationName(index));
+        }
+        GenericXLogFinish(state);
+        return;
+    }
+
+    page = BufferGetPage(buf);
+    //the caller checked the free space
+    START_CRIT_SECTION();
+    if(!PageIndexTupleOverwrite(page, offnum, (Item) itup, itemsz)){
+        elog(PANIC, "failed to replace index item in \"%s\"", RelationGetRelationName(index));
+    }
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogOverwriteItemData xlrec;
+        XLogRecPtr recptr;
+
+        xlrec.offnum = offnum;
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogOverwriteItemData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        XLogRegisterBufData(0, (char *) itup, itemsz);
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_OVERWRITE_ITEM);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+void
+ivfflat_xlog_delete_items(
+    Relation index,
+    Buffer buf,
+    OffsetNumber *deletable,
+    int ndeletable){
+    Page page;
+
+    if(!ivfflat_use_custom_wal()){
+        GenericXLogState *state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        PageIndexMultiDelete(page, deletable, ndeletable);
+        GenericXLogFinish(state);
+        return;
+    }
+
+    page = BufferGetPage(buf);
+    START_CRIT_SECTION();
+    PageIndexMultiDelete(page, deletable, ndeletable);
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogDeleteItemsData xlrec;
+        XLogRecPtr recptr;
+
+        xlrec.ndeleted = ndeletable;
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogDeleteItemsData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        XLogRegisterBufData(0, (char *) deletable, ndeletable * sizeof(OffsetNumber));
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_DELETE_ITEMS);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+void
+ivfflat_xlog_prune_items(
+    Relation index,
+    Relation heap_rel,
+    Buffer buf,
+    OffsetNumber *deletable,
+    int ndeletable,
+    TransactionId snapshot_conflict_horizon){
+    Page page;
+
+    //no standby queries to cancel, a plain delete does
+    if(!ivfflat_use_custom_wal()){
+        ivfflat_xlog_delete_items(index, buf, deletable, ndeletable);
+        return;
+    }
+
+    page = BufferGetPage(buf);
+    START_CRIT_SECTION();
+    PageIndexMultiDelete(page, deletable, ndeletable);
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogPruneItemsData xlrec;
+        XLogRecPtr recptr;
+
+        memset(&xlrec, 0, sizeof(xlrec));
+        xlrec.snapshot_conflict_horizon = snapshot_conflict_horizon;
+        xlrec.ndeleted = ndeletable;
+        xlrec.is_catalog_rel = RelationIsAccessibleInLogicalDecoding(heap_rel);
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogPruneItemsData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        XLogRegisterBufData(0, (char *) deletable, ndeletable * sizeof(OffsetNumber));
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_PRUNE_ITEMS);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+static void
+ivfflat_apply_update_list(
+    Page page,
+    OffsetNumber offnum,
+    BlockNumber insert_page,
+    BlockNumber start_page){
+    IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offnum));
+
+    if(BlockNumberIsValid(insert_page)){
+        list->insert_page = insert_page;
+    }
+    if(BlockNumberIsValid(start_page)){
+        list->start_page = start_page;
+    }
+}
+
+void
+ivfflat_xlog_update_list(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    BlockNumber insert_page,
+    BlockNumber start_page){
+    Page page;
+
+    if(!ivfflat_use_custom_wal()){
+        GenericXLogState *state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        ivfflat_apply_update_list(page, offnum, insert_page, start_page);
+        GenericXLogFinish(state);
+        return;
+    }
+
+    page = BufferGetPage(buf);
+    START_CRIT_SECTION();
+    ivfflat_apply_update_list(page, offnum, insert_page, start_page);
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogUpdateListData xlrec;
+        XLogRecPtr recptr;
+
+        memset(&xlrec, 0, sizeof(xlrec));
+        xlrec.offnum = offnum;
+        xlrec.insert_page = insert_page;
+        xlrec.start_page = start_page;
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogUpdateListData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_UPDATE_LIST);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+static void
+ivfflat_apply_update_bounds(
+    Page page,
+    OffsetNumber offnum,
+    float radius,
+    IvfflatListSummary summary){
+    IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offnum));
+
+    list->radius = radius;
+    list->summary = *summary;
+}
+
+void
+ivfflat_xlog_update_bounds(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    float radius,
+    IvfflatListSummary summary){
+    Page page;
+
+    if(!ivfflat_use_custom_wal()){
+        GenericXLogState *state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        ivfflat_apply_update_bounds(page, offnum, radius, summary);
+        GenericXLogFinish(state);
+        return;
+    }
+
+    page = BufferGetPage(buf);
+    START_CRIT_SECTION();
+    ivfflat_apply_update_bounds(page, offnum, radius, summary);
+    MarkBufferDirty(buf);
+
+    if(RelationNeedsWAL(index)){
+        IvfflatXlogUpdateBoundsData xlrec;
+        XLogRecPtr recptr;
+
+        //the record is copied whole, padding included
+        memset(&xlrec, 0, sizeof(xlrec));
+        xlrec.offnum = offnum;
+        xlrec.radius = radius;
+        xlrec.summary = *summary;
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(IvfflatXlogUpdateBoundsData));
+        XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+        recptr = XLogInsert(IVFFLAT_RMGR_ID, XLOG_IVFFLAT_UPDATE_BOUNDS);
+        PageSetLSN(page, recptr);
+    }
+    END_CRIT_SECTION();
+}
+
+void
+ivfflat_redo(XLogReaderState *record){
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+    Buffer buf;
+    Page page;
+    Size len;
+    char *data;
+
+    //queries on the standby may still see the pruned heap tuples
+    if(info == XLOG_IVFFLAT_PRUNE_ITEMS && InHotStandby){
+        IvfflatXlogPruneItems xlrec = (IvfflatXlogPruneItems) XLogRecGetData(record);
+        RelFileLocator locator;
+
+        XLogRecGetBlockTag(record, 0, &locator, NULL, NULL);
+        ResolveRecoveryConflictWithSnapshot(
+            xlrec->snapshot_conflict_horizon,
+            xlrec->is_catalog_rel,
+            locator);
+    }
+
+    if(XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO){
+        page = BufferGetPage(buf);
+        switch(info){
+            case XLOG_IVFFLAT_ADD_ITEM:{
+                IvfflatXlogAddItem xlrec = (IvfflatXlogAddItem) XLogRecGetData(record);
+                data = XLogRecGetBlockData(record, 0, &len);
+                if(PageAddItem(page, (Item) data, len, xlrec->offnum, false, false) != xlrec->offnum){
+                    elog(PANIC, "ivfflat_redo: failed to add item");
+                }
+                break;
+            }
+            case XLOG_IVFFLAT_OVERWRITE_ITEM:{
+                IvfflatXlogOverwriteItem xlrec = (IvfflatXlogOverwriteItem) XLogRecGetData(record);
+                data = XLogRecGetBlockData(record, 0, &len);
+                if(!PageIndexTupleOverwrite(page, xlrec->offnum, (Item) data, len)){
+                    elog(PANIC, "ivfflat_redo: failed to replace item");
+                }
+                break;
+            }
+            case XLOG_IVFFLAT_DELETE_ITEMS:{
+                IvfflatXlogDeleteItems xlrec = (IvfflatXlogDeleteItems) XLogRecGetData(record);
+                data = XLogRecGetBlockData(record, 0, &len);
+                PageIndexMultiDelete(page, (OffsetNumber *) data, xlrec->ndeleted);
+                break;
+            }
+            case XLOG_IVFFLAT_PRUNE_ITEMS:{
+                IvfflatXlogPruneItems xlrec = (IvfflatXlogPruneItems) XLogRecGetData(record);
+                data = XLogRecGetBlockData(record, 0, &len);
+                PageIndexMultiDelete(page, (OffsetNumber *) data, xlrec->ndeleted);
+                break;
+            }
+            case XLOG_IVFFLAT_UPDATE_LIST:{
+                IvfflatXlogUpdateList xlrec = (IvfflatXlogUpdateList) XLogRecGetData(record);
+                ivfflat_apply_update_list(
+                    page,
+                    xlrec->offnum,
+                    xlrec->insert_page,
+                    xlrec->start_page);
+                break;
+            }
+            case XLOG_IVFFLAT_UPDATE_BOUNDS:{
+                IvfflatXlogUpdateBounds xlrec = (IvfflatXlogUpdateBounds) XLogRecGetData(record);
+                ivfflat_apply_update_bounds(page, xlrec->offnum, xlrec->radius, &xlrec->summary);
+                break;
+            }
+            default:
+                elog(PANIC, "ivfflat_redo: unknown op code %u", info);
+        }
+        PageSetLSN(page, record->EndRecPtr);
+        MarkBufferDirty(buf);
+    }
+    if(BufferIsValid(buf)){
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+void
+ivfflat_desc(StringInfo buf, XLogReaderState *record){
+    char *rec = XLogRecGetData(record);
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+    switch(info){
+        case XLOG_IVFFLAT_ADD_ITEM:
+            appendStringInfo(buf, "off: %u",
+                ((IvfflatXlogAddItem) rec)->offnum);
+            break;
+        case XLOG_IVFFLAT_OVERWRITE_ITEM:
+            appendStringInfo(buf, "off: %u",
+                ((IvfflatXlogOverwriteItem) rec)->offnum);
+            break;
+        case XLOG_IVFFLAT_DELETE_ITEMS:
+            appendStringInfo(buf, "ndeleted: %u",
+                ((IvfflatXlogDeleteItems) rec)->ndeleted);
+            break;
+        case XLOG_IVFFLAT_PRUNE_ITEMS:
+            appendStringInfo(buf, "snapshot_conflict_horizon: %u, ndeleted: %u",
+                ((IvfflatXlogPruneItems) rec)->snapshot_conflict_horizon,
+                ((IvfflatXlogPruneItems) rec)->ndeleted);
+            break;
+        case XLOG_IVFFLAT_UPDATE_LIST:
+            appendStringInfo(buf, "off: %u, insert_page: %u, start_page: %u",
+                ((IvfflatXlogUpdateList) rec)->offnum,
+                ((IvfflatXlogUpdateList) rec)->insert_page,
+                ((IvfflatXlogUpdateList) rec)->start_page);
+            break;
+        case XLOG_IVFFLAT_UPDATE_BOUNDS:
+            appendStringInfo(buf, "off: %u, radius: %g, summary: %u",
+                ((IvfflatXlogUpdateBounds) rec)->offnum,
+                ((IvfflatXlogUpdateBounds) rec)->radius,
+                ((IvfflatXlogUpdateBounds) rec)->summary.flags);
+            break;
+    }
+}
+
+const char *
+ivfflat_identify(uint8 info){
+    switch(info & ~XLR_INFO_MASK){
+        case XLOG_IVFFLAT_ADD_ITEM:
+            return "ADD_ITEM";
+        case XLOG_IVFFLAT_OVERWRITE_ITEM:
+            return "OVERWRITE_ITEM";
+        case XLOG_IVFFLAT_DELETE_ITEMS:
+            return "DELETE_ITEMS";
+        case XLOG_IVFFLAT_UPDATE_LIST:
+            return "UPDATE_LIST";
+        case XLOG_IVFFLAT_PRUNE_ITEMS:
+            return "PRUNE_ITEMS";
+        case XLOG_IVFFLAT_UPDATE_BOUNDS:
+            return "UPDATE_BOUNDS";
+    }
+    return NULL;
+}
+
+void
+ivfflat_mask(char *pagedata, BlockNumber blkno){
+    mask_page_lsn_and_checksum(pagedata);
+    mask_unused_space(pagedata);
+}
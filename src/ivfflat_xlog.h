@@ -0,0 +1,139 @@
+#ifndef IVFFLAT_XLOG_H
+#define IVFFLAT_XLOG_H
+
+#include "ivffat.h"
+#include "ivfflat_page.h"
+#include "access/itup.h"
+#include "access/rmgr.h"
+#include "access/xlogreader.h"
+#include "lib/stringinfo.h"
+#include "storage/bufmgr.h"
+#include "utils/relcache.h"
+
+//custom wal, see pg_hybrid_ivfflat.custom_wal.
+//without it the changes are logged by the generic wal.
+//the id is written into the wal, it must not change between releases
+//and no other extension loaded with this one may use it.
+//RM_EXPERIMENTAL_ID is only for local development
+#ifndef IVFFLAT_RMGR_ID
+#define IVFFLAT_RMGR_ID 152
+#endif
+StaticAssertDecl(RmgrIdIsCustom(IVFFLAT_RMGR_ID) && IVFFLAT_RMGR_ID != RM_EXPERIMENTAL_ID,
+                 "IVFFLAT_RMGR_ID must be a custom rmgr id");
+#define IVFFLAT_RMGR_NAME "pg_hybrid_ivfflat"
+
+#define XLOG_IVFFLAT_ADD_ITEM       0x00
+#define XLOG_IVFFLAT_DELETE_ITEMS   0x10
+#define XLOG_IVFFLAT_UPDATE_LIST    0x20
+#define XLOG_IVFFLAT_PRUNE_ITEMS    0x30
+#define XLOG_IVFFLAT_OVERWRITE_ITEM 0x40
+#define XLOG_IVFFLAT_UPDATE_BOUNDS  0x50
+
+//block 0 data: the index tuple
+typedef struct IvfflatXlogAddItemData {
+    OffsetNumber offnum;
+} IvfflatXlogAddItemData;
+
+typedef IvfflatXlogAddItemData * IvfflatXlogAddItem;
+
+//block 0 data: the new posting tuple
+typedef struct IvfflatXlogOverwriteItemData {
+    OffsetNumber offnum;
+} IvfflatXlogOverwriteItemData;
+
+typedef IvfflatXlogOverwriteItemData * IvfflatXlogOverwriteItem;
+
+//block 0 data: the deleted offsets
+typedef struct IvfflatXlogDeleteItemsData {
+    uint16 ndeleted;
+} IvfflatXlogDeleteItemsData;
+
+typedef IvfflatXlogDeleteItemsData * IvfflatXlogDeleteItems;
+
+typedef struct IvfflatXlogUpdateListData {
+    OffsetNumber offnum;
+    BlockNumber insert_page;
+    BlockNumber start_page;
+} IvfflatXlogUpdateListData;
+
+typedef IvfflatXlogUpdateListData * IvfflatXlogUpdateList;
+
+//the covering radius and the summary of a list
+typedef struct IvfflatXlogUpdateBoundsData {
+    OffsetNumber offnum;
+    float radius;
+    IvfflatListSummaryData summary;
+} IvfflatXlogUpdateBoundsData;
+
+typedef IvfflatXlogUpdateBoundsData * IvfflatXlogUpdateBounds;
+
+//block 0 data: the pruned offsets. standbys resolve the conflicts first
+typedef struct IvfflatXlogPruneItemsData {
+    TransactionId snapshot_conflict_horizon;
+    uint16 ndeleted;
+    bool is_catalog_rel;
+} IvfflatXlogPruneItemsData;
+
+typedef IvfflatXlogPruneItemsData * IvfflatXlogPruneItems;
+
+void
+ivfflat_init_xlog(void);
+
+bool
+ivfflat_use_custom_wal(void);
+
+OffsetNumber
+ivfflat_xlog_add_item(Relation index, Buffer buf, IndexTuple itup, Size itemsz);
+
+void
+ivfflat_xlog_overwrite_item(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    IndexTuple itup);
+
+void
+ivfflat_xlog_delete_items(
+    Relation index,
+    Buffer buf,
+    OffsetNumber *deletable,
+    int ndeletable);
+
+void
+ivfflat_xlog_update_list(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    BlockNumber insert_page,
+    BlockNumber start_page);
+
+void
+ivfflat_xlog_update_bounds(
+    Relation index,
+    Buffer buf,
+    OffsetNumber offnum,
+    float radius,
+    IvfflatListSummary summary);
+
+void
+ivfflat_xlog_prune_items(
+    Relation index,
+    Relation heap_rel,
+    Buffer buf,
+    OffsetNumber *deletable,
+    int ndeletable,
+    TransactionId snapshot_conflict_horizon);
+
+void
+ivfflat_redo(XLogReaderState *record);
+
+void
+ivfflat_desc(StringInfo buf, XLogReaderState *record);
+
+const char *
+ivfflat_identify(uint8 info);
+
+void
+ivfflat_mask(char *pagedata, BlockNumber blkno);
+
+#endif
@@ -8,6 +8,8 @@
 
 #include "pg_hybrid.h"
 #include "ivfflat_options.h"
+#include "ivfflat_xlog.h"
+#include "bm25.h"
 
 
 PG_MODULE_MAGIC;
@@ -17,6 +19,8 @@ void
 _PG_init(void)
 {
     ivfflat_init_options();
+    ivfflat_init_xlog();
+    bm25_init_options();
 }
 
 
@@ -14,6 +14,7 @@
 #include <ctype.h>
 #include <string.h>
 #include "utils/lsyscache.h"
+#include "executor/executor.h"
 
 Vector
 vector_create(int dimensions){
@@ -898,6 +899,173 @@ PGDLLEXPORT Datum hvector_negative_inner_product(PG_FUNCTION_ARGS){
     PG_RETURN_FLOAT8(-sum);
 }
 
+// 批量 L2 平方距离
+// 每次处理 4 个向量：查询向量的每个元素只读取一次，4 个累加器互不依赖。
+// 逐个向量的运算顺序与 hvector_l2_squared_distance 相同
+void
+hvector_l2_squared_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances){
+    int i = 0;
+
+    for(; i + 4 <= count; i += 4){
+        const float *v0 = vectors[i];
+        const float *v1 = vectors[i + 1];
+        const float *v2 = vectors[i + 2];
+        const float *v3 = vectors[i + 3];
+        double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+        double d0, d1, d2, d3;
+
+        for(int j = 0; j < dim; j++){
+            float q = query[j];
+            d0 = v0[j] - q;
+            d1 = v1[j] - q;
+            d2 = v2[j] - q;
+            d3 = v3[j] - q;
+            s0 += d0 * d0;
+            s1 += d1 * d1;
+            s2 += d2 * d2;
+            s3 += d3 * d3;
+        }
+        distances[i] = s0;
+        distances[i + 1] = s1;
+        distances[i + 2] = s2;
+        distances[i + 3] = s3;
+    }
+    for(; i < count; i++){
+        const float *v = vectors[i];
+        double sum = 0.0;
+        double diff;
+
+        for(int j = 0; j < dim; j++){
+            diff = v[j] - query[j];
+            sum += diff * diff;
+        }
+        distances[i] = sum;
+    }
+}
+
+void
+hvector_l2_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances){
+    hvector_l2_squared_distance_batch(dim, query, vectors, count, distances);
+    for(int i = 0; i < count; i++){
+        distances[i] = sqrt(distances[i]);
+    }
+}
+
+// 批量负内积，运算顺序与 hvector_negative_inner_product 相同
+void
+hvector_negative_inner_product_batch(int dim, const float *query, const float **vectors, int count, double *distances){
+    int i = 0;
+
+    for(; i + 4 <= count; i += 4){
+        const float *v0 = vectors[i];
+        const float *v1 = vectors[i + 1];
+        const float *v2 = vectors[i + 2];
+        const float *v3 = vectors[i + 3];
+        float r0 = 0.0, r1 = 0.0, r2 = 0.0, r3 = 0.0;
+
+        for(int j = 0; j < dim; j++){
+            float q = query[j];
+            r0 += v0[j] * q;
+            r1 += v1[j] * q;
+            r2 += v2[j] * q;
+            r3 += v3[j] * q;
+        }
+        distances[i] = -((double) r0);
+        distances[i + 1] = -((double) r1);
+        distances[i + 2] = -((double) r2);
+        distances[i + 3] = -((double) r3);
+    }
+    for(; i < count; i++){
+        distances[i] = -((double) hvector_inner_product_float(dim, (float *) vectors[i], (float *) query));
+    }
+}
+
+// y 的一块在 L2 缓存里放得下，x 的每一行都跟这一块算完再换下一块
+#define HVECTOR_DOT_BLOCK_BYTES (128 * 1024)
+#define HVECTOR_DOT_BLOCK_ROWS 64
+
+void
+hvector_dot_matrix(int dim, const float *x, int x_count, const float *y, int y_count, double *dots, int ld){
+    int y_block = Max(4, HVECTOR_DOT_BLOCK_BYTES / (int) (sizeof(float) * Max(dim, 1)));
+
+    for(int yb = 0; yb < y_count; yb += y_block){
+        int y_end = Min(yb + y_block, y_count);
+
+        for(int xb = 0; xb < x_count; xb += HVECTOR_DOT_BLOCK_ROWS){
+            int x_end = Min(xb + HVECTOR_DOT_BLOCK_ROWS, x_count);
+
+            for(int a = xb; a < x_end; a++){
+                const float *xa = x + (Size) a * dim;
+                double *out = dots + (Size) a * ld;
+                int b = yb;
+
+                // 每次 4 行：x 的每个元素只读取一次，4 个累加器互不依赖
+                for(; b + 4 <= y_end; b += 4){
+                    const float *y0 = y + (Size) b * dim;
+                    const float *y1 = y0 + dim;
+                    const float *y2 = y1 + dim;
+                    const float *y3 = y2 + dim;
+                    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+
+                    for(int j = 0; j < dim; j++){
+                        double v = xa[j];
+                        s0 += v * y0[j];
+                        s1 += v * y1[j];
+                        s2 += v * y2[j];
+                        s3 += v * y3[j];
+                    }
+                    out[b] = s0;
+                    out[b + 1] = s1;
+                    out[b + 2] = s2;
+                    out[b + 3] = s3;
+                }
+                for(; b < y_end; b++){
+                    const float *yv = y + (Size) b * dim;
+                    double sum = 0.0;
+
+                    for(int j = 0; j < dim; j++){
+                        sum += (double) xa[j] * yv[j];
+                    }
+                    out[b] = sum;
+                }
+            }
+        }
+    }
+}
+
+// 按距离函数的地址找到批量版本，没有则返回 NULL
+HvectorBatchDistance
+hvector_get_batch_distance(FmgrInfo *proc){
+    if(proc == NULL){
+        return NULL;
+    }
+    if(proc->fn_addr == hvector_l2_squared_distance){
+        return hvector_l2_squared_distance_batch;
+    }
+    if(proc->fn_addr == hvector_l2_distance){
+        return hvector_l2_distance_batch;
+    }
+    if(proc->fn_addr == hvector_negative_inner_product){
+        return hvector_negative_inner_product_batch;
+    }
+    return NULL;
+}
+
+// 按距离函数的地址判断度量，内积等不满足三角不等式的返回 HVECTOR_METRIC_NONE
+HvectorMetric
+hvector_get_metric(FmgrInfo *proc){
+    if(proc == NULL){
+        return HVECTOR_METRIC_NONE;
+    }
+    if(proc->fn_addr == hvector_l2_squared_distance){
+        return HVECTOR_METRIC_L2_SQUARED;
+    }
+    if(proc->fn_addr == hvector_l2_distance){
+        return HVECTOR_METRIC_L2;
+    }
+    return HVECTOR_METRIC_NONE;
+}
+
 // 向量球面距离
 // 输入：两个Vector类型的值。单位向量。用于Elkan kmeans
 // 输出：一个double类型的值. 角度距离满足三角不等式
@@ -922,6 +1090,70 @@ PGDLLEXPORT Datum hvector_spherical_distance(PG_FUNCTION_ARGS){
     PG_RETURN_FLOAT8(acos(dist) / M_PI);
 }
 
+// 距离范围 hvector_range 是 (query hvector, radius float8)
+// 返回 detoast 后的查询向量，radius 存到 *radius
+Vector
+hvector_get_range(Datum range, double *radius){
+    HeapTupleHeader tuple = DatumGetHeapTupleHeader(range);
+    Datum value;
+    bool isnull;
+
+    value = GetAttributeByNum(tuple, 2, &isnull);
+    if(isnull){
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("hvector_range has no radius")));
+    }
+    *radius = DatumGetFloat8(value);
+    value = GetAttributeByNum(tuple, 1, &isnull);
+    if(isnull){
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("hvector_range has no query")));
+    }
+    return DatumGetVectorP(value);
+}
+
+// 距离范围判断：distance(a, query) < radius
+// 示例：
+// SELECT '[1,1]'::hvector <<->> hvector_range('[0,0]', 1.5);
+// 结果： t
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_l2_within);
+PGDLLEXPORT Datum hvector_l2_within(PG_FUNCTION_ARGS){
+    double radius;
+    Vector query = hvector_get_range(PG_GETARG_DATUM(1), &radius);
+    double distance = DatumGetFloat8(DirectFunctionCall2(
+        hvector_l2_distance,
+        PG_GETARG_DATUM(0),
+        PointerGetDatum(query)));
+
+    PG_RETURN_BOOL(distance < radius);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_negative_inner_product_within);
+PGDLLEXPORT Datum hvector_negative_inner_product_within(PG_FUNCTION_ARGS){
+    double radius;
+    Vector query = hvector_get_range(PG_GETARG_DATUM(1), &radius);
+    double distance = DatumGetFloat8(DirectFunctionCall2(
+        hvector_negative_inner_product,
+        PG_GETARG_DATUM(0),
+        PointerGetDatum(query)));
+
+    PG_RETURN_BOOL(distance < radius);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_cosine_within);
+PGDLLEXPORT Datum hvector_cosine_within(PG_FUNCTION_ARGS){
+    double radius;
+    Vector query = hvector_get_range(PG_GETARG_DATUM(1), &radius);
+    double distance = DatumGetFloat8(DirectFunctionCall2(
+        hvector_cosine_distance,
+        PG_GETARG_DATUM(0),
+        PointerGetDatum(query)));
+
+    PG_RETURN_BOOL(distance < radius);
+}
+
 static float8 *
 CheckStateArray(ArrayType *statearray)
 {
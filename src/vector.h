@@ -117,6 +117,11 @@ PGDLLEXPORT Datum hvector_l2_squared_distance(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum hvector_cosine_distance(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum hvector_l1_distance(PG_FUNCTION_ARGS);
 
+// 距离范围运算符，索引按半径选列表
+PGDLLEXPORT Datum hvector_l2_within(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_negative_inner_product_within(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_cosine_within(PG_FUNCTION_ARGS);
+
 // 向量数值函数
 PGDLLEXPORT Datum hvector_add(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum hvector_sub(PG_FUNCTION_ARGS);
@@ -143,6 +148,43 @@ PGDLLEXPORT Datum hvector_to_float4(PG_FUNCTION_ARGS);
 /* Helper functions - defined in vector.c */
 float
 hvector_inner_product_float(int dim, float *a, float *b);
+
+// 批量距离：一个查询向量对多个向量。结果与对应的 SQL 距离函数逐位一致
+typedef void (*HvectorBatchDistance)(
+    int dim,
+    const float *query,
+    const float **vectors,
+    int count,
+    double *distances);
+
+void
+hvector_l2_squared_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances);
+
+void
+hvector_l2_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances);
+
+void
+hvector_negative_inner_product_batch(int dim, const float *query, const float **vectors, int count, double *distances);
+
+HvectorBatchDistance
+hvector_get_batch_distance(FmgrInfo *proc);
+
+// 分块矩阵内积：x 和 y 是按行连续存放的 float 矩阵，
+// dots[a * ld + b] = x 第 a 行与 y 第 b 行的内积，用 double 累加
+void
+hvector_dot_matrix(int dim, const float *x, int x_count, const float *y, int y_count, double *dots, int ld);
+
+// 距离函数的度量：L2 距离满足三角不等式，L2 平方开方后满足
+typedef enum HvectorMetric {
+    HVECTOR_METRIC_NONE,
+    HVECTOR_METRIC_L2,
+    HVECTOR_METRIC_L2_SQUARED
+} HvectorMetric;
+
+HvectorMetric
+hvector_get_metric(FmgrInfo *proc);
 int
 hvector_cmp0(Vector a, Vector b);
+Vector
+hvector_get_range(Datum range, double *radius);
 #endif
\ No newline at end of file
@@ -0,0 +1,546 @@
+#include "vector_chunk.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#include <ctype.h>
+#include <math.h>
+
+// 聚合的中间状态，向量追加到连续的 float 数组
+typedef struct VectorChunkStateData
+{
+    int dim;
+    int count;
+    int capacity;
+    float *data;
+} VectorChunkStateData;
+
+typedef VectorChunkStateData * VectorChunkState;
+
+// 块内 top-k 的一个结果，ordinal 从 1 开始
+typedef struct VectorChunkNeighborData
+{
+    int ordinal;
+    double distance;
+} VectorChunkNeighborData;
+
+typedef VectorChunkNeighborData * VectorChunkNeighbor;
+
+// 每次计算距离的向量个数，指针数组和距离数组都放在栈上
+#define VECTOR_CHUNK_BATCH 64
+
+static inline void
+vector_chunk_check_size(int dimensions, int count){
+    if((Size) dimensions * count > (MaxAllocSize - offsetof(VectorChunkData, data)) / sizeof(float)){
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("hvector_chunk cannot hold %d vectors of %d dimensions", count, dimensions)));
+    }
+}
+
+VectorChunk
+vector_chunk_create(int dimensions, int count){
+    Size sz;
+    VectorChunk chunk;
+
+    vector_chunk_check_size(dimensions, count);
+    sz = VECTOR_CHUNK_SIZE(dimensions, count);
+    chunk = (VectorChunk) palloc0(sz);
+    SET_VARSIZE(chunk, sz);
+    chunk->dim = dimensions;
+    chunk->unused = 0;
+    chunk->count = count;
+    return chunk;
+}
+
+static inline void
+vector_chunk_check_dims(int expected, int dim){
+    if(expected != dim){
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("different vector dimensions %d and %d", expected, dim)));
+    }
+}
+
+// 向量块输入
+// 输入：花括号包住的向量列表，每个向量的格式与 hvector 相同
+// 示例：
+// SELECT '{[1,2,3],[4,5,6]}'::hvector_chunk;
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_in);
+Datum
+hvector_chunk_in(PG_FUNCTION_ARGS)
+{
+    char *lit = PG_GETARG_CSTRING(0);
+    char *pt = lit;
+    StringInfoData data;
+    int dim = 0;
+    int count = 0;
+    VectorChunk result;
+
+    while(isspace((unsigned char) *pt))
+        pt++;
+    if(*pt != '{')
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type hvector_chunk: \"%s\"", lit),
+                 errdetail("Chunk contents must start with \"{\".")));
+    pt++;
+
+    initStringInfo(&data);
+    while(1)
+    {
+        char *end;
+        char *item;
+        Vector vec;
+
+        while(isspace((unsigned char) *pt))
+            pt++;
+        if(*pt == '}' && count == 0)
+            break;
+        if(*pt != '[')
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                     errmsg("invalid input syntax for type hvector_chunk: \"%s\"", lit)));
+        end = strchr(pt, ']');
+        if(end == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                     errmsg("invalid input syntax for type hvector_chunk: \"%s\"", lit)));
+
+        // 每个向量交给 hvector_in 解析，错误信息和取值检查保持一致
+        item = pnstrdup(pt, end - pt + 1);
+        vec = DatumGetVectorP(DirectFunctionCall3(hvector_in,
+                                                  CStringGetDatum(item),
+                                                  ObjectIdGetDatum(InvalidOid),
+                                                  Int32GetDatum(-1)));
+        if(count == 0)
+            dim = vec->dim;
+        vector_chunk_check_dims(dim, vec->dim);
+        vector_chunk_check_size(dim, count + 1);
+        appendBinaryStringInfo(&data, (char *) vec->data, dim * sizeof(float));
+        count++;
+        pfree(item);
+        pfree(vec);
+
+        pt = end + 1;
+        while(isspace((unsigned char) *pt))
+            pt++;
+        if(*pt == ',')
+            pt++;
+        else if(*pt == '}')
+            break;
+        else
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                     errmsg("invalid input syntax for type hvector_chunk: \"%s\"", lit)));
+    }
+    pt++;
+    while(isspace((unsigned char) *pt))
+        pt++;
+    if(*pt != '\0')
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type hvector_chunk: \"%s\"", lit)));
+
+    result = vector_chunk_create(dim, count);
+    if(count > 0)
+        memcpy(result->data, data.data, (Size) dim * count * sizeof(float));
+    pfree(data.data);
+    PG_RETURN_POINTER(result);
+}
+
+// 向量块输出
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_out);
+Datum
+hvector_chunk_out(PG_FUNCTION_ARGS)
+{
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '{');
+    for(int i = 0; i < chunk->count; i++){
+        float *v = VectorChunkGetVector(chunk, i);
+
+        if(i > 0)
+            appendStringInfoChar(&buf, ',');
+        appendStringInfoChar(&buf, '[');
+        for(int j = 0; j < chunk->dim; j++){
+            if(j > 0)
+                appendStringInfoString(&buf, ", ");
+            appendStringInfo(&buf, "%g", v[j]);
+        }
+        appendStringInfoChar(&buf, ']');
+    }
+    appendStringInfoChar(&buf, '}');
+    PG_RETURN_CSTRING(buf.data);
+}
+
+// 向量块二进制输入，格式与 hvector_chunk_send 相同：
+// int16 维数、int16 unused、int32 向量个数，然后按行存放的 float4
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_recv);
+Datum
+hvector_chunk_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    VectorChunk result;
+    int16 dim;
+    int16 unused;
+    int32 count;
+    Size n;
+
+    dim = pq_getmsgint(buf, sizeof(int16));
+    unused = pq_getmsgint(buf, sizeof(int16));
+    count = pq_getmsgint(buf, sizeof(int32));
+
+    if(unused != 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("expected unused to be 0, not %d", unused)));
+    if(count < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("hvector_chunk cannot hold %d vectors", count)));
+    // 与文本输入一致：空块的维数为 0，非空块的每个向量至少 1 维
+    if(dim < (count > 0 ? 1 : 0) || dim > VECTOR_MAX_DIM)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATA_EXCEPTION),
+                 errmsg("invalid dimensions %d for type hvector_chunk", dim)));
+
+    result = vector_chunk_create(dim, count);
+    n = (Size) dim * count;
+    for(Size i = 0; i < n; i++){
+        result->data[i] = pq_getmsgfloat4(buf);
+        if(isnan(result->data[i]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("NaN not allowed in vector")));
+        if(isinf(result->data[i]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("infinite value not allowed in vector")));
+    }
+
+    PG_RETURN_POINTER(result);
+}
+
+// 向量块二进制输出
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_send);
+Datum
+hvector_chunk_send(PG_FUNCTION_ARGS)
+{
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+    StringInfoData buf;
+    Size n = (Size) chunk->dim * chunk->count;
+
+    pq_begintypsend(&buf);
+    pq_sendint(&buf, chunk->dim, sizeof(int16));
+    pq_sendint(&buf, 0, sizeof(int16)); /* unused */
+    pq_sendint(&buf, chunk->count, sizeof(int32));
+    for(Size i = 0; i < n; i++)
+        pq_sendfloat4(&buf, chunk->data[i]);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+// 聚合：把一组向量按输入顺序装进一个块，NULL 跳过
+// 示例：
+// SELECT hvector_chunk_agg(embedding ORDER BY id), array_agg(id ORDER BY id)
+// FROM items GROUP BY id / 1024;
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_accum);
+Datum
+hvector_chunk_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_ctx;
+    MemoryContext old_ctx;
+    VectorChunkState state;
+    Vector vec;
+
+    if(!AggCheckCallContext(fcinfo, &agg_ctx))
+        elog(ERROR, "hvector_chunk_accum called in non-aggregate context");
+
+    state = PG_ARGISNULL(0) ? NULL : (VectorChunkState) PG_GETARG_POINTER(0);
+    if(PG_ARGISNULL(1)){
+        if(state == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state);
+    }
+    vec = PG_GETARG_VECTOR_P(1);
+
+    old_ctx = MemoryContextSwitchTo(agg_ctx);
+    if(state == NULL){
+        state = palloc(sizeof(VectorChunkStateData));
+        state->dim = vec->dim;
+        state->count = 0;
+        state->capacity = 64;
+        state->data = palloc((Size) state->capacity * state->dim * sizeof(float));
+    }
+    vector_chunk_check_dims(state->dim, vec->dim);
+    if(state->count == state->capacity){
+        vector_chunk_check_size(state->dim, state->capacity * 2);
+        state->capacity *= 2;
+        state->data = repalloc(state->data, (Size) state->capacity * state->dim * sizeof(float));
+    }
+    memcpy(state->data + (Size) state->count * state->dim, vec->data, state->dim * sizeof(float));
+    state->count++;
+    MemoryContextSwitchTo(old_ctx);
+
+    PG_RETURN_POINTER(state);
+}
+
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_final);
+Datum
+hvector_chunk_final(PG_FUNCTION_ARGS)
+{
+    VectorChunkState state;
+    VectorChunk result;
+
+    if(PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    state = (VectorChunkState) PG_GETARG_POINTER(0);
+    result = vector_chunk_create(state->dim, state->count);
+    memcpy(result->data, state->data, (Size) state->dim * state->count * sizeof(float));
+    PG_RETURN_POINTER(result);
+}
+
+// 块中向量的个数
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_count);
+Datum
+hvector_chunk_count(PG_FUNCTION_ARGS)
+{
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+
+    PG_RETURN_INT32(chunk->count);
+}
+
+// 块中向量的维数
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_dims);
+Datum
+hvector_chunk_dims(PG_FUNCTION_ARGS)
+{
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+
+    PG_RETURN_INT32(chunk->dim);
+}
+
+// 取块中第 n 个向量，n 从 1 开始，越界返回 NULL
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_get);
+Datum
+hvector_chunk_get(PG_FUNCTION_ARGS)
+{
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+    int32 n = PG_GETARG_INT32(1);
+    Vector result;
+
+    if(n < 1 || n > chunk->count)
+        PG_RETURN_NULL();
+    result = vector_create(chunk->dim);
+    memcpy(result->data, VectorChunkGetVector(chunk, n - 1), chunk->dim * sizeof(float));
+    PG_RETURN_POINTER(result);
+}
+
+// 按顺序展开块中的向量
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_unnest);
+Datum
+hvector_chunk_unnest(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+    Vector vec;
+
+    InitMaterializedSRF(fcinfo, 0);
+    vec = vector_create(chunk->dim);
+    for(int i = 0; i < chunk->count; i++){
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        memcpy(vec->data, VectorChunkGetVector(chunk, i), chunk->dim * sizeof(float));
+        values[0] = Int32GetDatum(i + 1);
+        values[1] = PointerGetDatum(vec);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    return (Datum) 0;
+}
+
+// 余弦距离，运算顺序与 hvector_cosine_distance 相同
+static void
+vector_chunk_cosine_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances){
+    for(int i = 0; i < count; i++){
+        const float *v = vectors[i];
+        double dist = 0.0, norm_a = 0.0, norm_b = 0.0;
+        double f;
+
+        for(int j = 0; j < dim; j++){
+            dist += v[j] * query[j];
+            norm_a += v[j] * v[j];
+            norm_b += query[j] * query[j];
+        }
+        f = sqrt((double)norm_a * (double)norm_b);
+        if(f == 0.0){
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_EXCEPTION),
+                     errmsg("norm_a and norm_b are 0")));
+        }
+        dist = dist / f;
+        if(dist > 1.0){
+            dist = 1.0;
+        }else if(dist < -1.0){
+            dist = -1.0;
+        }
+        distances[i] = 1.0 - dist;
+    }
+}
+
+// L1 距离，运算顺序与 hvector_l1_distance 相同
+static void
+vector_chunk_l1_distance_batch(int dim, const float *query, const float **vectors, int count, double *distances){
+    for(int i = 0; i < count; i++){
+        const float *v = vectors[i];
+        float sum = 0.0;
+
+        for(int j = 0; j < dim; j++){
+            sum += fabsf(v[j] - query[j]);
+        }
+        distances[i] = (double) sum;
+    }
+}
+
+static HvectorBatchDistance
+vector_chunk_batch_distance(text *distance_op){
+    char *op = text_to_cstring(distance_op);
+
+    if(strcmp(op, "<->") == 0)
+        return hvector_l2_distance_batch;
+    if(strcmp(op, "<#>") == 0)
+        return hvector_negative_inner_product_batch;
+    if(strcmp(op, "<=>") == 0)
+        return vector_chunk_cosine_distance_batch;
+    if(strcmp(op, "<+>") == 0)
+        return vector_chunk_l1_distance_batch;
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unsupported distance operator \"%s\"", op),
+             errhint("Use <->, <#>, <=> or <+>.")));
+    return NULL;
+}
+
+// 距离大的在前，相同距离时序号大的在前，堆顶是当前最差的结果
+static inline bool
+vector_chunk_worse(VectorChunkNeighbor a, VectorChunkNeighbor b){
+    if(a->distance != b->distance)
+        return a->distance > b->distance;
+    return a->ordinal > b->ordinal;
+}
+
+static void
+vector_chunk_sift_down(VectorChunkNeighbor heap, int count, int i){
+    while(1){
+        int worst = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        VectorChunkNeighborData tmp;
+
+        if(left < count && vector_chunk_worse(&heap[left], &heap[worst]))
+            worst = left;
+        if(right < count && vector_chunk_worse(&heap[right], &heap[worst]))
+            worst = right;
+        if(worst == i)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void
+vector_chunk_offer(VectorChunkNeighbor heap, int *count, int k, int ordinal, double distance){
+    VectorChunkNeighborData item = {ordinal, distance};
+
+    if(*count < k){
+        int i = (*count)++;
+
+        heap[i] = item;
+        while(i > 0){
+            int parent = (i - 1) / 2;
+            VectorChunkNeighborData tmp;
+
+            if(!vector_chunk_worse(&heap[i], &heap[parent]))
+                break;
+            tmp = heap[i];
+            heap[i] = heap[parent];
+            heap[parent] = tmp;
+            i = parent;
+        }
+    }else if(vector_chunk_worse(&heap[0], &item)){
+        heap[0] = item;
+        vector_chunk_sift_down(heap, *count, 0);
+    }
+}
+
+// 块内精确 KNN：顺序扫描连续存放的向量，批量计算距离，保留最近的 k 个
+// 输入：向量块，查询向量，k，距离运算符
+// 输出：(ordinal, distance)，按距离从小到大
+// 示例：
+// SELECT c.ids[n.ordinal], n.distance
+// FROM item_chunks c, hvector_chunk_knn(c.vectors, '[1,2,3]', 10) n
+// ORDER BY n.distance LIMIT 10;
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hvector_chunk_knn);
+Datum
+hvector_chunk_knn(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    VectorChunk chunk = PG_GETARG_VECTOR_CHUNK_P(0);
+    Vector query = PG_GETARG_VECTOR_P(1);
+    int32 k = PG_GETARG_INT32(2);
+    HvectorBatchDistance distance = vector_chunk_batch_distance(PG_GETARG_TEXT_PP(3));
+    const float *vectors[VECTOR_CHUNK_BATCH];
+    double distances[VECTOR_CHUNK_BATCH];
+    VectorChunkNeighbor heap;
+    int heap_count = 0;
+
+    if(k < 1){
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("k must be at least 1")));
+    }
+    InitMaterializedSRF(fcinfo, 0);
+    if(chunk->count == 0)
+        return (Datum) 0;
+    vector_chunk_check_dims(chunk->dim, query->dim);
+
+    k = Min(k, chunk->count);
+    heap = palloc(k * sizeof(VectorChunkNeighborData));
+    for(int start = 0; start < chunk->count; start += VECTOR_CHUNK_BATCH){
+        int n = Min(VECTOR_CHUNK_BATCH, chunk->count - start);
+
+        for(int i = 0; i < n; i++){
+            vectors[i] = VectorChunkGetVector(chunk, start + i);
+        }
+        distance(chunk->dim, query->data, vectors, n, distances);
+        for(int i = 0; i < n; i++){
+            vector_chunk_offer(heap, &heap_count, k, start + i + 1, distances[i]);
+        }
+    }
+
+    // 依次弹出堆顶，从后往前排成升序
+    for(int i = heap_count - 1; i > 0; i--){
+        VectorChunkNeighborData tmp = heap[0];
+
+        heap[0] = heap[i];
+        heap[i] = tmp;
+        vector_chunk_sift_down(heap, i, 0);
+    }
+    for(int i = 0; i < heap_count; i++){
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        values[0] = Int32GetDatum(heap[i].ordinal);
+        values[1] = Float8GetDatum(heap[i].distance);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    pfree(heap);
+    return (Datum) 0;
+}
@@ -0,0 +1,43 @@
+#ifndef VECTOR_CHUNK_H
+#define VECTOR_CHUNK_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "vector.h"
+
+// 向量块：多行同维向量按行连续存放的 float 数组，
+// 精确 KNN 和分析查询顺序扫描，避免逐行 detoast
+typedef struct VectorChunkData
+{
+    int32       vl_len_;        /* varlena header (do not touch directly!) */
+    int16       dim;
+    int16       unused;
+    int32       count;
+    float       data[FLEXIBLE_ARRAY_MEMBER];
+}           VectorChunkData;
+
+typedef VectorChunkData * VectorChunk;
+
+#define VECTOR_CHUNK_SIZE(dimensions, count) \
+    (offsetof(VectorChunkData, data) + sizeof(float) * (Size) (dimensions) * (count))
+
+#define VectorChunkGetVector(chunk, i) ((chunk)->data + (Size) (i) * (chunk)->dim)
+
+#define PG_GETARG_VECTOR_CHUNK_P(n) ((VectorChunk) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+VectorChunk
+vector_chunk_create(int dimensions, int count);
+
+PGDLLEXPORT Datum hvector_chunk_in(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_out(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_recv(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_send(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_accum(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_final(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_count(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_dims(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_get(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_unnest(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hvector_chunk_knn(PG_FUNCTION_ARGS);
+
+#endif
@@ -0,0 +1,71 @@
+CREATE TABLE docs (id int, body tsvector);
+INSERT INTO docs
+SELECT i, to_tsvector('simple', 'a' || i % 7 || ' b' || i % 13 || ' c' || i % 3 ||
+                      repeat(' a' || i % 7, i % 4))
+FROM generate_series(1, 2000) i;
+CREATE INDEX docs_bm25 ON docs USING pg_hybrid_bm25 (body);
+-- rows added after the build wait in the pending list
+INSERT INTO docs
+SELECT i, to_tsvector('simple', 'a' || i % 7 || ' b' || i % 13 || ' c' || i % 3 ||
+                      repeat(' a' || i % 7, i % 4))
+FROM generate_series(2001, 2200) i;
+-- scores of the rows matching filter ranked by query, once with the index
+-- and once with a seqscan, and the index the ranked plan scans
+CREATE FUNCTION bm25_ranked(filter tsquery, query text, idx text DEFAULT 'docs_bm25',
+    OUT index_used text, OUT by_index numeric[], OUT by_seqscan numeric[])
+LANGUAGE plpgsql AS $$
+DECLARE
+    ranked text := format(
+        'SELECT array_agg(s) FROM ('
+        '    SELECT round(-(body <&> to_bm25query(%L, %L))::numeric, 6) AS s FROM docs'
+        '    WHERE body @@ %L ORDER BY body <&> to_bm25query(%L, %L)) t',
+        idx, query, filter, idx, query);
+    line text;
+BEGIN
+    SET enable_seqscan = off;
+    FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || ranked LOOP
+        index_used := coalesce(index_used, substring(line from 'Index Scan using (\S+)'));
+    END LOOP;
+    EXECUTE ranked INTO by_index;
+    RESET enable_seqscan;
+    SET enable_indexscan = off;
+    EXECUTE ranked INTO by_seqscan;
+    RESET enable_indexscan;
+END
+$$;
+-- the index ranks the rows a seqscan sorts
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('a1 | b2', 'a1 | b2');
+-- matching rows without a scored lexeme follow with score 0
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('c0', 'a1');
+-- a qual that matches rows without its lexemes is left to the seqscan
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('!a1', 'a1');
+-- with two indexes on the column only the named one is scanned
+CREATE INDEX docs_bm25_k2 ON docs USING pg_hybrid_bm25 (body) WITH (k1 = 2.0);
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('a1 | b2', 'a1 | b2');
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('a1 | b2', 'a1 | b2', 'docs_bm25_k2');
+DROP INDEX docs_bm25_k2;
+-- VACUUM merges the pending list into the postings
+DELETE FROM docs WHERE id % 10 = 0;
+VACUUM docs;
+INSERT INTO docs
+SELECT i, to_tsvector('simple', 'a' || i % 7 || ' b' || i % 13 || ' c' || i % 3 ||
+                      repeat(' a' || i % 7, i % 4))
+FROM generate_series(2201, 2400) i;
+-- merged and pending rows
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('a1 | b2', 'a1 | b2');
+-- merged and pending rows with score 0
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('c0', 'a1');
+-- a second merge
+VACUUM docs;
+-- after the second merge
+SELECT index_used, by_index = by_seqscan AS same, cardinality(by_index) AS rows
+FROM bm25_ranked('c0', 'a1');
+DROP FUNCTION bm25_ranked;
+DROP TABLE docs;
@@ -0,0 +1,61 @@
+SET pg_hybrid_ivfflat.probes = 100;
+CREATE TABLE batch_items (id int, embedding hvector(3));
+INSERT INTO batch_items
+SELECT i, ('[' || i % 37 || ',' || i % 11 || ',' || i % 7 || ']')::hvector(3)
+FROM generate_series(1, 1000) i;
+CREATE INDEX batch_items_idx ON batch_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops);
+-- every query of a batch gets the distances of an exact scan
+WITH queries(n, v) AS (
+    VALUES (1, '[1,2,3]'::hvector(3)), (2, '[30,10,6]'::hvector(3)), (3, '[36,0,0]'::hvector(3))
+)
+SELECT n,
+       (SELECT array_agg(round(b.distance::numeric, 4) ORDER BY b.rank)
+        FROM pg_hybrid_ivfflat_search_batch('batch_items_idx',
+             ARRAY(SELECT v FROM queries ORDER BY n), 5, 100) b
+        WHERE b.query_no = n) =
+       (SELECT array_agg(round(d::numeric, 4) ORDER BY d)
+        FROM (SELECT embedding <-> v AS d FROM batch_items ORDER BY d LIMIT 5) s) AS same
+FROM queries ORDER BY n;
+-- a null query has no results
+SELECT count(*) FROM pg_hybrid_ivfflat_search_batch('batch_items_idx',
+    ARRAY[NULL, '[1,2,3]']::hvector[], 5, 100) WHERE query_no = 1;
+-- filtered through the lists
+SELECT (SELECT array_agg(round(f.distance::numeric, 4) ORDER BY f.rank)
+        FROM pg_hybrid_ivfflat_search_filtered('batch_items_idx', '[1,2,3]',
+             ARRAY(SELECT ctid FROM batch_items WHERE id % 10 = 3), 5, 100) f) =
+       (SELECT array_agg(round(d::numeric, 4) ORDER BY d)
+        FROM (SELECT embedding <-> '[1,2,3]' AS d FROM batch_items
+              WHERE id % 10 = 3 ORDER BY d LIMIT 5) s) AS same;
+-- few allowed rows are scored from the heap
+SELECT (SELECT array_agg(round(f.distance::numeric, 4) ORDER BY f.rank)
+        FROM pg_hybrid_ivfflat_search_filtered('batch_items_idx', '[1,2,3]',
+             ARRAY(SELECT ctid FROM batch_items WHERE id % 200 = 7), 3, 1) f) =
+       (SELECT array_agg(round(d::numeric, 4) ORDER BY d)
+        FROM (SELECT embedding <-> '[1,2,3]' AS d FROM batch_items
+              WHERE id % 200 = 7 ORDER BY d LIMIT 3) s) AS same;
+-- a partial index only returns the rows it holds, even for few allowed rows
+CREATE TABLE part_items (id int, embedding hvector(3));
+INSERT INTO part_items SELECT * FROM batch_items;
+CREATE INDEX part_items_idx ON part_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WHERE id % 2 = 0;
+SELECT count(*) FROM pg_hybrid_ivfflat_search_filtered('part_items_idx', '[1,2,3]',
+    ARRAY(SELECT ctid FROM part_items WHERE id % 200 = 7), 3, 1);
+SELECT count(*), bool_and(p.id % 2 = 0) AS in_index
+FROM pg_hybrid_ivfflat_search_filtered('part_items_idx', '[1,2,3]',
+    ARRAY(SELECT ctid FROM part_items WHERE id % 200 IN (7, 8)), 3, 1) f
+JOIN part_items p ON p.ctid = f.ctid;
+DROP TABLE part_items;
+-- row-level security is not applied by the search functions, so they refuse
+CREATE ROLE regress_ivfflat_rls;
+GRANT SELECT ON batch_items TO regress_ivfflat_rls;
+ALTER TABLE batch_items ENABLE ROW LEVEL SECURITY;
+CREATE POLICY batch_items_odd ON batch_items FOR SELECT USING (id % 2 = 1);
+SET ROLE regress_ivfflat_rls;
+SELECT bool_and(id % 2 = 1) AS only_odd
+FROM (SELECT id FROM batch_items ORDER BY embedding <-> '[2,2,2]' LIMIT 5) s;
+SELECT * FROM pg_hybrid_ivfflat_search_batch('batch_items_idx', ARRAY['[1,2,3]'::hvector], 5, 100);
+SELECT * FROM pg_hybrid_ivfflat_search_filtered('batch_items_idx', '[1,2,3]',
+    ARRAY(SELECT ctid FROM batch_items), 5, 100);
+RESET ROLE;
+DROP TABLE batch_items;
+DROP ROLE regress_ivfflat_rls;
@@ -0,0 +1,36 @@
+SET pg_hybrid_ivfflat.probes = 100;
+-- 100 points 10 apart on the x axis, ten rows each
+CREATE TABLE lateral_items (id int, embedding hvector(3));
+INSERT INTO lateral_items
+SELECT i, ('[' || i % 100 * 10 || ',0,0]')::hvector(3)
+FROM generate_series(1, 1000) i;
+CREATE INDEX lateral_items_idx ON lateral_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops);
+CREATE TABLE lateral_queries (n int, v hvector(3));
+INSERT INTO lateral_queries VALUES
+    (1, '[1,0,0]'), (2, '[503,0,0]'), (3, '[995,0,0]'), (4, '[1,0,0]');
+-- the same rows without an index
+CREATE TABLE lateral_plain AS SELECT * FROM lateral_items;
+SET enable_seqscan = off;
+-- the index is rescanned for every query row, the state of the
+-- previous query must not leak into the next one
+SELECT q.n, s.count, s.max FROM lateral_queries q,
+LATERAL (SELECT count(*), max(d) FROM (
+    SELECT embedding <-> q.v AS d FROM lateral_items
+    ORDER BY embedding <-> q.v LIMIT 15) t) s
+ORDER BY q.n;
+-- more candidates than one list holds
+SELECT q.n, (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> q.v AS d FROM lateral_items
+        ORDER BY embedding <-> q.v LIMIT 200) t) =
+    (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> q.v AS d FROM lateral_plain
+        ORDER BY embedding <-> q.v LIMIT 200) t) AS same
+FROM lateral_queries q ORDER BY q.n;
+-- range scans are rescanned the same way
+SELECT q.n, s.count FROM lateral_queries q,
+LATERAL (SELECT count(*) FROM lateral_items
+    WHERE embedding <<->> hvector_range(q.v, 8)) s
+ORDER BY q.n;
+DROP TABLE lateral_plain;
+DROP TABLE lateral_queries;
+DROP TABLE lateral_items;
@@ -0,0 +1,18 @@
+SET pg_hybrid_ivfflat.probes = 10;
+-- 100 points 10 apart, ten rows each: every list holds one point
+CREATE TABLE prune_items (id int, embedding hvector(3));
+INSERT INTO prune_items
+SELECT i, ('[' || i % 100 * 10 || ',0,0]')::hvector(3)
+FROM generate_series(1, 1000) i;
+CREATE INDEX prune_items_idx ON prune_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops);
+SET enable_seqscan = off;
+SET client_min_messages = debug1;
+-- the nearest list holds the three rows, the other lists are skipped
+SELECT embedding <-> '[1,0,0]' AS distance FROM prune_items
+ORDER BY embedding <-> '[1,0,0]' LIMIT 3;
+-- a list is read when its bound is not above the next row
+SELECT count(*), max(distance) FROM (
+    SELECT embedding <-> '[1,0,0]' AS distance FROM prune_items
+    ORDER BY embedding <-> '[1,0,0]' LIMIT 25) s;
+RESET client_min_messages;
+DROP TABLE prune_items;
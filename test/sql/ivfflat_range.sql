@@ -0,0 +1,37 @@
+SET pg_hybrid_ivfflat.probes = 100;
+-- 100 points 10 apart on the x axis, ten rows each
+CREATE TABLE range_items (id int, embedding hvector(3));
+INSERT INTO range_items
+SELECT i, ('[' || i % 100 * 10 || ',0,0]')::hvector(3)
+FROM generate_series(1, 1000) i;
+CREATE INDEX range_items_idx ON range_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops);
+SET enable_seqscan = off;
+-- every row within the radius, in any order
+SELECT count(*), min(embedding <-> '[1,0,0]'), max(embedding <-> '[1,0,0]')
+FROM range_items WHERE embedding <<->> hvector_range('[1,0,0]', 25);
+-- the radius itself is excluded
+SELECT count(*) FROM range_items WHERE embedding <<->> hvector_range('[1,0,0]', 1);
+SELECT count(*) FROM range_items WHERE embedding <<->> hvector_range('[1,0,0]', 1.5);
+-- no list is near the query
+SELECT count(*) FROM range_items WHERE embedding <<->> hvector_range('[5000,0,0]', 10);
+-- the same rows as the distance predicate
+SELECT (SELECT array_agg(id ORDER BY id) FROM range_items
+        WHERE embedding <<->> hvector_range('[503,0,0]', 30)) =
+       (SELECT array_agg(id ORDER BY id) FROM range_items
+        WHERE embedding <-> '[503,0,0]' < 30) AS same;
+-- with ORDER BY the radius filters the nearest rows
+SELECT embedding <-> '[1,0,0]' AS distance FROM range_items
+WHERE embedding <<->> hvector_range('[1,0,0]', 10)
+ORDER BY embedding <-> '[1,0,0]' LIMIT 12;
+SELECT count(*) FROM (
+    SELECT id FROM range_items
+    WHERE embedding <<->> hvector_range('[1,0,0]', 10)
+    ORDER BY embedding <-> '[1,0,0]' LIMIT 100) s;
+-- rows inserted into the lists and into the insert buffer
+INSERT INTO range_items VALUES (1001, '[4,0,0]');
+ALTER INDEX range_items_idx SET (buffered_insert = on);
+INSERT INTO range_items VALUES (1002, '[2,0,0]');
+SELECT array_agg(id ORDER BY id) FROM range_items
+WHERE embedding <<->> hvector_range('[1,0,0]', 5) AND id > 1000;
+SELECT count(*) FROM range_items WHERE embedding <<->> hvector_range('[1,0,0]', 5);
+DROP TABLE range_items;
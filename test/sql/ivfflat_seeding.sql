@@ -0,0 +1,86 @@
+SET pg_hybrid_ivfflat.probes = 100;
+CREATE TABLE seeding_items (id int, embedding hvector(3));
+INSERT INTO seeding_items
+SELECT i, ('[' || i % 37 || ',' || i % 11 || ',' || i % 7 || ']')::hvector(3)
+FROM generate_series(1, 1000) i;
+-- the same rows without an index
+CREATE TABLE seeding_plain AS SELECT * FROM seeding_items;
+CREATE INDEX seeding_items_idx ON seeding_items USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WITH (seeding = 'kmeans++');
+SET enable_seqscan = off;
+-- probing every list returns the exact neighbors whatever the centers
+SELECT (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> '[1,2,3]' AS d FROM seeding_items
+        ORDER BY embedding <-> '[1,2,3]' LIMIT 50) t) =
+       (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> '[1,2,3]' AS d FROM seeding_plain
+        ORDER BY embedding <-> '[1,2,3]' LIMIT 50) t) AS same;
+ALTER INDEX seeding_items_idx SET (seeding = 'kmeans||');
+REINDEX INDEX seeding_items_idx;
+SELECT (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> '[1,2,3]' AS d FROM seeding_items
+        ORDER BY embedding <-> '[1,2,3]' LIMIT 50) t) =
+       (SELECT array_agg(round(d::numeric, 4) ORDER BY d) FROM (
+        SELECT embedding <-> '[1,2,3]' AS d FROM seeding_plain
+        ORDER BY embedding <-> '[1,2,3]' LIMIT 50) t) AS same;
+-- fewer distinct points than lists: the centers are filled with samples
+CREATE TABLE seeding_few (id int, embedding hvector(3));
+INSERT INTO seeding_few
+SELECT i, ('[' || i % 30 || ',0,0]')::hvector(3)
+FROM generate_series(1, 300) i;
+CREATE INDEX seeding_few_pp ON seeding_few USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WITH (seeding = 'kmeans++');
+SELECT count(*) FROM (
+    SELECT id FROM seeding_few ORDER BY embedding <-> '[0,0,0]' LIMIT 1000) t;
+DROP INDEX seeding_few_pp;
+CREATE INDEX seeding_few_parallel ON seeding_few USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WITH (seeding = 'kmeans||');
+SELECT count(*) FROM (
+    SELECT id FROM seeding_few ORDER BY embedding <-> '[0,0,0]' LIMIT 1000) t;
+-- unknown seeding
+CREATE INDEX ON seeding_few USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WITH (seeding = 'random');
+-- clustered data probed with fewer lists than the index has: both seedings
+-- must put the centers on the clusters to keep the recall
+CREATE TABLE seeding_clusters (id int, embedding hvector(3));
+INSERT INTO seeding_clusters
+SELECT i, ('[' || i % 100 * 100 + i / 100 % 5 || ',' || i / 100 % 4 || ',0]')::hvector(3)
+FROM generate_series(0, 1999) i;
+CREATE TABLE seeding_clusters_plain AS SELECT * FROM seeding_clusters;
+CREATE FUNCTION seeding_recall(OUT index_used text, OUT recall_ok boolean)
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+    q hvector;
+    bound float8;
+    hits int := 0;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) SELECT id FROM seeding_clusters '
+                        'ORDER BY embedding <-> ''[2,1,0]'' LIMIT 10' LOOP
+        index_used := coalesce(index_used, substring(line from 'Index Scan using (\S+)'));
+    END LOOP;
+    FOR c IN 0..99 BY 5 LOOP
+        q := ('[' || c * 100 + 2 || ',1,0]')::hvector;
+        SELECT max(d) INTO bound FROM (
+            SELECT embedding <-> q AS d FROM seeding_clusters_plain
+            ORDER BY embedding <-> q LIMIT 10) t;
+        hits := hits + (SELECT count(*) FROM (
+            SELECT embedding <-> q AS d FROM seeding_clusters
+            ORDER BY embedding <-> q LIMIT 10) t WHERE d <= bound);
+    END LOOP;
+    recall_ok := hits >= 0.9 * 200;
+END
+$$;
+CREATE INDEX seeding_clusters_idx ON seeding_clusters USING pg_hybrid_ivfflat (embedding hvector_l2_ops)
+    WITH (seeding = 'kmeans++');
+SET pg_hybrid_ivfflat.probes = 2;
+SELECT * FROM seeding_recall();
+ALTER INDEX seeding_clusters_idx SET (seeding = 'kmeans||');
+REINDEX INDEX seeding_clusters_idx;
+SELECT * FROM seeding_recall();
+DROP FUNCTION seeding_recall;
+DROP TABLE seeding_clusters_plain;
+DROP TABLE seeding_clusters;
+DROP TABLE seeding_few;
+DROP TABLE seeding_plain;
+DROP TABLE seeding_items;